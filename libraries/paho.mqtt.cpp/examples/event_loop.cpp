@@ -0,0 +1,176 @@
+// event_loop.cpp
+//
+// Paho C++ sample client application that runs a client from its own
+// single-threaded event loop, and measures the round trip latency of
+// messages it publishes to a topic it is subscribed to.
+//
+// With the "loop" mode, the client is created with an event loop, and the
+// application waits on the client's socket with poll(), calling run_once()
+// when it is ready or its timeout has passed. The messages arrive in a
+// callback on the loop's thread. With the "notify" mode, the library's I/O
+// threads run the client, and the application waits with poll() on the
+// client's notification descriptor, then drains the consumer queue without
+// blocking. With the "thread" mode, the application thread blocks in
+// consume_message(), for comparison.
+//
+/*******************************************************************************
+ * Copyright (c) 2013-2023 Frank Pagliughi <fpagliughi@mindspring.com>
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Frank Pagliughi - initial implementation and documentation
+ *******************************************************************************/
+
+#include <poll.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mqtt/async_client.h"
+
+using namespace std;
+using namespace std::chrono;
+
+const std::string DFLT_SERVER_ADDRESS{"mqtt://localhost:1883"};
+const std::string CLIENT_ID{"event_loop"};
+const std::string TOPIC{"test/event_loop"};
+
+const int DFLT_N_MSG = 10000, QOS = 0;
+
+// Get the current time on the steady clock, in nanoseconds
+int64_t now_ns()
+{
+    return (int64_t)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// --------------------------------------------------------------------------
+// Waits on the client's socket for as long as it allows, then runs one turn
+// of its I/O, until the condition is met.
+
+void run_until(mqtt::async_client& cli, const function<bool()>& done)
+{
+    while (!done()) {
+        bool wantWrite = false;
+        int sock = cli.get_loop_socket(&wantWrite);
+        auto timeout = cli.get_loop_timeout();
+
+        int ms = (timeout.count() < 0 || timeout.count() > 100) ? 100 : int(timeout.count());
+        if (sock >= 0) {
+            pollfd pfd{sock, short(POLLIN | (wantWrite ? POLLOUT : 0)), 0};
+            ::poll(&pfd, 1, ms);
+            cli.run_once();
+        }
+        else
+            cli.run_once(ms);
+    }
+}
+
+// --------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    string address = (argc > 1) ? string(argv[1]) : DFLT_SERVER_ADDRESS;
+    string mode = (argc > 2) ? string(argv[2]) : string("loop");
+    int nMsg = (argc > 3) ? atoi(argv[3]) : DFLT_N_MSG;
+
+    bool loop = (mode == "loop"), notify = (mode == "notify");
+
+    auto createOpts =
+        mqtt::create_options_builder().event_loop(loop).notify_fd(notify).finalize();
+    mqtt::async_client cli(address, CLIENT_ID, createOpts);
+
+    vector<int64_t> latencies;
+    latencies.reserve(nMsg);
+
+    // Each payload is the time it was published, to get the latency
+    auto on_message = [&latencies](mqtt::const_message_ptr msg) {
+        int64_t sent = 0;
+        if (msg->get_payload().size() == sizeof(sent)) {
+            memcpy(&sent, msg->get_payload().data(), sizeof(sent));
+            latencies.push_back(now_ns() - sent);
+        }
+    };
+
+    try {
+        cout << "Connecting to " << address << " in " << mode << " mode..." << flush;
+
+        if (loop) {
+            cli.set_message_callback(on_message);
+
+            auto tok = cli.connect();
+            run_until(cli, [&] { return tok->is_complete(); });
+            tok = cli.subscribe(TOPIC, QOS);
+            run_until(cli, [&] { return tok->is_complete(); });
+        }
+        else {
+            cli.start_consuming();
+            cli.connect()->wait();
+            cli.subscribe(TOPIC, QOS)->wait();
+        }
+        cout << "OK" << endl;
+
+        // Publish one message at a time, and wait for it to come back
+
+        for (int i = 0; i < nMsg; ++i) {
+            int64_t sent = now_ns();
+            cli.publish(TOPIC, &sent, sizeof(sent), QOS, false);
+
+            if (loop)
+                run_until(cli, [&] { return latencies.size() > size_t(i); });
+            else if (notify) {
+                while (latencies.size() <= size_t(i)) {
+                    pollfd pfd{cli.get_notify_fd(), POLLIN, 0};
+                    ::poll(&pfd, 1, 100);
+                    cli.clear_notify();
+                    for (auto& evt : cli.try_consume_events()) {
+                        if (const auto* pmsg = evt.get_message_if())
+                            on_message(*pmsg);
+                    }
+                    // The completed tokens are kept until drained
+                    cli.try_consume_tokens();
+                }
+            }
+            else
+                on_message(cli.consume_message());
+        }
+
+        if (loop) {
+            auto tok = cli.disconnect();
+            run_until(cli, [&] { return tok->is_complete(); });
+        }
+        else {
+            cli.disconnect()->wait();
+            cli.stop_consuming();
+        }
+    }
+    catch (const mqtt::exception& exc) {
+        cerr << "\n  " << exc << endl;
+        return 1;
+    }
+
+    if (latencies.empty())
+        return 1;
+
+    sort(latencies.begin(), latencies.end());
+    auto pct = [&latencies](double p) {
+        return latencies[min(latencies.size() - 1, size_t(p * latencies.size()))] / 1000;
+    };
+
+    cout << "Round trip latency of " << latencies.size() << " messages, in usec:" << endl;
+    cout << "  p50: " << pct(0.50) << ", p99: " << pct(0.99) << ", max: " << pct(1.0) << endl;
+    return 0;
+}
@@ -0,0 +1,166 @@
+// lock_contention.cpp
+//
+// Paho C++ sample client application to measure how much application
+// threads publishing to their own clients hold each other up.
+//
+// Each of a number of threads publishes QoS 1 messages through its own
+// client, which is also subscribed to its own topic, so the library is
+// busy with inbound messages for every client while the threads publish.
+// The run reports the total message rate and how long the publish calls
+// took, which is mostly time spent waiting for the library's locks. The
+// number of I/O shards can be given to spread the clients over more I/O
+// threads.
+//
+/*******************************************************************************
+ * Copyright (c) 2013-2023 Frank Pagliughi <fpagliughi@mindspring.com>
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Frank Pagliughi - initial implementation and documentation
+ *******************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mqtt/async_client.h"
+
+using namespace std;
+using namespace std::chrono;
+
+const std::string DFLT_SERVER_ADDRESS{"mqtt://localhost:1883"};
+
+const size_t DFLT_PAYLOAD_SIZE = 64;
+const int DFLT_N_THREAD = 16, DFLT_N_MSG = 10000, DFLT_N_SHARD = 1, QOS = 1;
+
+const string TOPIC_BASE{"test/contention/"};
+
+// Get the current time on the steady clock
+steady_clock::time_point now() { return steady_clock::now(); }
+
+// Convert a duration to a count of microseconds
+template <class Rep, class Period>
+int64_t usec(const std::chrono::duration<Rep, Period>& dur)
+{
+    return (int64_t)duration_cast<microseconds>(dur).count();
+}
+
+// The time one thread spent in its publish calls
+struct publish_times
+{
+    int64_t total = 0, max = 0;
+};
+
+// --------------------------------------------------------------------------
+// Publishes the messages of one thread, timing each publish call, and waits
+// for the last one to be acknowledged.
+
+void publisher(mqtt::async_client& cli, const string& topic, int nMsg, size_t msgSz,
+               publish_times& times)
+{
+    const string payload(msgSz, 'x');
+    mqtt::delivery_token_ptr tok;
+
+    for (int i = 0; i < nMsg; ++i) {
+        auto start = now();
+        tok = cli.publish(topic, payload.data(), payload.size(), QOS, false);
+        int64_t t = usec(now() - start);
+
+        times.total += t;
+        times.max = max(times.max, t);
+    }
+    tok->wait();
+}
+
+// --------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    string address = (argc > 1) ? string(argv[1]) : DFLT_SERVER_ADDRESS;
+    int nThread = (argc > 2) ? atoi(argv[2]) : DFLT_N_THREAD;
+    int nMsg = (argc > 3) ? atoi(argv[3]) : DFLT_N_MSG;
+    int nShard = (argc > 4) ? atoi(argv[4]) : DFLT_N_SHARD;
+    size_t msgSz = (size_t)((argc > 5) ? atol(argv[5]) : DFLT_PAYLOAD_SIZE);
+
+    cout << "Initializing " << nThread << " clients in " << nShard << " shard(s) for server '"
+         << address << "'..." << endl;
+
+    vector<unique_ptr<mqtt::async_client>> clients;
+    atomic<int> nArrived{0};
+
+    try {
+        mqtt::async_client::set_io_shards(nShard);
+
+        // Every thread queues all its messages at once, so the buffer must hold them
+        auto connOpts = mqtt::connect_options_builder().clean_session().finalize();
+
+        for (int i = 0; i < nThread; ++i) {
+            auto createOpts = mqtt::create_options_builder()
+                                  .server_uri(address)
+                                  .client_id("lock_contention_" + to_string(i))
+                                  .max_buffered_messages(nMsg + 1)
+                                  .finalize();
+
+            auto cli = std::make_unique<mqtt::async_client>(createOpts);
+            cli->set_message_callback([&nArrived](mqtt::const_message_ptr) { ++nArrived; });
+            cli->connect(connOpts)->wait();
+            cli->subscribe(TOPIC_BASE + to_string(i), 0)->wait();
+            clients.push_back(std::move(cli));
+        }
+        cout << "OK" << endl;
+
+        vector<publish_times> times(nThread);
+        vector<thread> threads;
+
+        auto start = now();
+        for (int i = 0; i < nThread; ++i)
+            threads.emplace_back(
+                publisher, std::ref(*clients[i]), TOPIC_BASE + to_string(i), nMsg, msgSz,
+                std::ref(times[i])
+            );
+        for (auto& thr : threads) thr.join();
+        auto end = now();
+
+        int64_t nTotal = int64_t(nThread) * nMsg, total = 0, longest = 0;
+        for (const auto& t : times) {
+            total += t.total;
+            longest = max(longest, t.max);
+        }
+
+        int64_t us = max<int64_t>(1, usec(end - start));
+        cout << nTotal << " msgs in " << us / 1000 << "ms, " << nTotal * 1000000 / us
+             << " msg/s" << endl;
+        cout << "  publish call avg " << total * 1000 / nTotal << "ns, max " << longest
+             << "us" << endl;
+
+        // Give the last messages a moment to come back from the server
+        this_thread::sleep_for(milliseconds(500));
+        cout << "  " << nArrived << " msgs received back" << endl;
+
+        for (auto& cli : clients) cli->disconnect()->wait();
+    }
+    catch (const mqtt::exception& exc) {
+        cerr << exc.what() << endl;
+        return 1;
+    }
+    catch (const std::exception& exc) {
+        cerr << exc.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+// priority_latency.cpp
+//
+// Paho C++ sample client application to measure how long urgent messages
+// wait behind a bulk transfer, with and without message priorities.
+//
+// The publisher queues a large backlog of bulk messages, with a small,
+// timestamped probe message every so often. A second client subscribes to
+// the probes and measures the time from publish to arrival. The run is
+// done once with every message at normal priority, then again with the
+// bulk messages at low priority and the probes at high priority.
+//
+/*******************************************************************************
+ * Copyright (c) 2013-2023 Frank Pagliughi <fpagliughi@mindspring.com>
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Frank Pagliughi - initial implementation and documentation
+ *******************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mqtt/async_client.h"
+
+using namespace std;
+using namespace std::chrono;
+
+const std::string DFLT_SERVER_ADDRESS{"mqtt://localhost:1883"};
+
+const size_t DFLT_PAYLOAD_SIZE = 1024;
+const int DFLT_N_MSG = 20000, DFLT_N_PROBE = 50, QOS = 1;
+
+const string BULK_TOPIC{"test/priority/bulk"}, PROBE_TOPIC{"test/priority/probe"};
+
+// Get the current time on the steady clock
+steady_clock::time_point now() { return steady_clock::now(); }
+
+// Convert a duration to a count of microseconds
+template <class Rep, class Period>
+int64_t usec(const std::chrono::duration<Rep, Period>& dur)
+{
+    return (int64_t)duration_cast<microseconds>(dur).count();
+}
+
+// The probe latencies seen by the subscriber
+mutex latMtx;
+vector<int64_t> latencies;
+
+// --------------------------------------------------------------------------
+// Publishes the bulk messages with the probes mixed in, and waits for them
+// all to arrive. Prints the probe latencies.
+
+void run(mqtt::async_client& cli, bool usePriority, int nMsg, int nProbe, size_t msgSz)
+{
+    {
+        lock_guard<mutex> g(latMtx);
+        latencies.clear();
+    }
+
+    int bulkPrio = usePriority ? mqtt::message::PRIORITY_LOW : mqtt::message::PRIORITY_NORMAL,
+        probePrio = usePriority ? mqtt::message::PRIORITY_HIGH : mqtt::message::PRIORITY_NORMAL;
+
+    const string payload(msgSz, 'x');
+    int every = max(1, nMsg / nProbe);
+
+    mqtt::delivery_token_ptr tok;
+    auto start = now();
+
+    for (int i = 0; i < nMsg; ++i) {
+        auto msg = mqtt::message_ptr_builder()
+                       .topic(BULK_TOPIC)
+                       .payload(payload)
+                       .qos(QOS)
+                       .priority(bulkPrio)
+                       .finalize();
+        tok = cli.publish(msg);
+
+        if (i % every == every / 2) {
+            auto ts = to_string(now().time_since_epoch().count());
+            cli.publish(mqtt::message_ptr_builder()
+                            .topic(PROBE_TOPIC)
+                            .payload(ts)
+                            .qos(QOS)
+                            .priority(probePrio)
+                            .finalize());
+        }
+    }
+
+    tok->wait();
+    auto end = now();
+
+    // Give the last probes a moment to come back from the server
+    this_thread::sleep_for(milliseconds(500));
+
+    lock_guard<mutex> g(latMtx);
+    auto lat = latencies;
+    sort(lat.begin(), lat.end());
+
+    cout << (usePriority ? "With priority:    " : "Without priority: ") << nMsg
+         << " bulk msgs in " << usec(end - start) / 1000 << "ms" << endl;
+
+    if (lat.empty()) {
+        cout << "  No probes received" << endl;
+        return;
+    }
+
+    int64_t sum = 0;
+    for (auto l : lat) sum += l;
+
+    cout << "  " << lat.size() << " probes, latency avg " << sum / int64_t(lat.size()) / 1000
+         << "ms, median " << lat[lat.size() / 2] / 1000 << "ms, max " << lat.back() / 1000
+         << "ms" << endl;
+}
+
+// --------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    string address = (argc > 1) ? string(argv[1]) : DFLT_SERVER_ADDRESS;
+    int nMsg = (argc > 2) ? atoi(argv[2]) : DFLT_N_MSG;
+    int nProbe = (argc > 3) ? atoi(argv[3]) : DFLT_N_PROBE;
+    size_t msgSz = (size_t)((argc > 4) ? atol(argv[4]) : DFLT_PAYLOAD_SIZE);
+
+    cout << "Initializing for server '" << address << "'..." << endl;
+
+    // The whole backlog is queued at once, so the buffer must hold it
+    auto createOpts = mqtt::create_options_builder()
+                          .server_uri(address)
+                          .client_id("priority_latency_pub")
+                          .max_buffered_messages(nMsg + nProbe + 1)
+                          .finalize();
+
+    mqtt::async_client pub(createOpts), sub(address, "priority_latency_sub");
+
+    sub.set_message_callback([](mqtt::const_message_ptr msg) {
+        auto t = now().time_since_epoch().count();
+        auto ts = stoll(msg->get_payload_str());
+        lock_guard<mutex> g(latMtx);
+        latencies.push_back(usec(steady_clock::duration(t - ts)));
+    });
+
+    try {
+        auto connOpts = mqtt::connect_options_builder().clean_session().finalize();
+
+        sub.connect(connOpts)->wait();
+        sub.subscribe(PROBE_TOPIC, QOS)->wait();
+
+        auto pubConnOpts =
+            mqtt::connect_options_builder().clean_session().max_inflight(10).finalize();
+        pub.connect(pubConnOpts)->wait();
+        cout << "OK" << endl;
+
+        run(pub, false, nMsg, nProbe, msgSz);
+        run(pub, true, nMsg, nProbe, msgSz);
+
+        pub.disconnect()->wait();
+        sub.disconnect()->wait();
+    }
+    catch (const mqtt::exception& exc) {
+        cerr << exc.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
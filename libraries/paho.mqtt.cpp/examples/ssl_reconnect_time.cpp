@@ -0,0 +1,142 @@
+// ssl_reconnect_time.cpp
+//
+// This is a Paho MQTT C++ client, sample application.
+//
+// It measures how long it takes to make a secure connection to a broker
+// over and over again, as an application does when it reconnects after
+// losing its connection. The library shares the TLS context between
+// connections with the same options and resumes the previous TLS session
+// with the server, so after the first connection the handshakes should
+// be abbreviated, and much cheaper for both sides.
+//
+// The sample demonstrates:
+//  - Connecting to an MQTT server/broker securely
+//  - Reading the TLS context and session cache counters
+//
+// Like the ssl_publish example, we can test this using mosquitto
+// configured with the certificates in the Paho C library:
+//     $ cd paho.mqtt.c
+//     $ mosquitto -c test/tls-testing/mosquitto.conf
+//
+// Then use the file "test-root-ca.crt" from the test/ssl directory
+// (paho.mqtt.c/test/ssl) for the trust store, and optionally "client.pem"
+// for the key store.
+//
+// USAGE:
+//     ssl_reconnect_time [uri] [n_conn] [trust_store] [key_store]
+//
+
+/*******************************************************************************
+ * Copyright (c) 2024 Frank Pagliughi <fpagliughi@mindspring.com>
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Frank Pagliughi - initial implementation and documentation
+ *******************************************************************************/
+
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "mqtt/async_client.h"
+
+using namespace std;
+using namespace std::chrono;
+
+const string DFLT_SERVER_URI{"mqtts://localhost:18885"};
+const string CLIENT_ID{"ssl_reconnect_time_cpp"};
+
+const int DFLT_N_CONN = 100;
+
+const string DFLT_TRUST_STORE{"test-root-ca.crt"};
+
+/////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    string serverURI = (argc > 1) ? string{argv[1]} : DFLT_SERVER_URI;
+    int nConn = (argc > 2) ? atoi(argv[2]) : DFLT_N_CONN;
+    string trustStore = (argc > 3) ? string{argv[3]} : DFLT_TRUST_STORE;
+    string keyStore = (argc > 4) ? string{argv[4]} : string{};
+
+    if (!ifstream(trustStore)) {
+        cerr << "The trust store file does not exist: " << trustStore << endl;
+        cerr << "  Get a copy from \"paho.mqtt.c/test/ssl/test-root-ca.crt\"" << endl;
+        return 1;
+    }
+
+    mqtt::async_client cli(serverURI, CLIENT_ID);
+
+    auto sslopts = mqtt::ssl_options_builder()
+                       .trust_store(trustStore)
+                       .key_store(keyStore)
+                       .error_handler([](const string& msg) {
+                           cerr << "SSL Error: " << msg << endl;
+                       })
+                       .finalize();
+
+    auto connOpts = mqtt::connect_options_builder()
+                        .clean_session()
+                        .ssl(std::move(sslopts))
+                        .finalize();
+
+    try {
+        cout << "Connecting to '" << serverURI << "' " << nConn << " times..." << flush;
+
+        // The first connection has to do a full handshake, so time it
+        // separately from the reconnects.
+        auto start = steady_clock::now();
+        cli.connect(connOpts)->wait();
+        cli.disconnect()->wait();
+        auto first = steady_clock::now() - start;
+
+        auto cpuStart = clock();
+        start = steady_clock::now();
+
+        for (int i = 1; i < nConn; ++i) {
+            cli.connect(connOpts)->wait();
+            cli.disconnect()->wait();
+        }
+
+        auto elapsed = steady_clock::now() - start;
+        auto cpu = double(clock() - cpuStart) / CLOCKS_PER_SEC;
+        cout << "OK" << endl;
+
+        cout << "\nFirst connection: " << duration_cast<microseconds>(first).count()
+             << " us" << endl;
+
+        if (nConn > 1) {
+            auto n = nConn - 1;
+            cout << "Reconnects: " << n << " in " << duration_cast<milliseconds>(elapsed).count()
+                 << " ms, " << duration_cast<microseconds>(elapsed).count() / n
+                 << " us each, " << (cpu * 1.0e6 / n) << " us of client CPU each" << endl;
+        }
+    }
+    catch (const mqtt::exception& exc) {
+        cerr << "\n" << exc.what() << endl;
+        return 1;
+    }
+
+    auto stats = mqtt::ssl_options::get_cache_stats();
+
+    cout << "\nTLS cache:"
+         << "\n  contexts reused:    " << stats.contextHits << " of "
+         << (stats.contextHits + stats.contextMisses)
+         << "\n  sessions offered:   " << stats.sessionHits << " of "
+         << (stats.sessionHits + stats.sessionMisses)
+         << "\n  resumed handshakes: " << stats.resumedHandshakes
+         << "\n  full handshakes:    " << stats.fullHandshakes << endl;
+
+    return 0;
+}
@@ -34,6 +34,7 @@
 #include "LinkedList.h"
 #include "MQTTClientPersistence.h"
 #include "Socket.h"
+#include "TopicAliases.h"
 
 /**
  * Stored publication data to minimize copying
@@ -45,7 +46,6 @@ typedef struct
 	char* payload;
 	int payloadlen;
 	int refcount;
-	uint8_t mask[4];
 } Publications;
 
 /**
@@ -61,7 +61,9 @@ typedef struct
 	Publications *publish;
 	START_TIME_TYPE lastTouch;		    /**> used for retry and expiry */
 	char nextMessageType;	/**> PUBREC, PUBREL, PUBCOMP */
+	char retried;			/**> whether the packet now awaiting a response has been sent more than once */
 	int len;				/**> length of the whole structure+data */
+	ListElement link;		/**> the message's place in inboundMsgs or outboundMsgs */
 } Messages;
 
 /**
@@ -93,6 +95,8 @@ typedef struct
 	int websocket; /**< socket has been upgraded to use web sockets */
 	char *websocket_key;
 	const MQTTClient_nameValue* httpHeaders;
+	Socket_readBuffer readbuf; /**< receive buffer for TCP and TLS connections */
+	Socket_writeBuffer writebuf; /**< output buffer for coalescing packets on TCP and TLS connections */
 } networkHandles;
 
 
@@ -136,6 +140,12 @@ typedef struct Clients
 	int savedKeepAliveInterval;     /**< saved keep alive interval, in case reset by server keep alive */
 	int retryInterval;              /**< the MQTT retry interval for QoS > 0 */
 	int maxInflightMessages;        /**< the max number of inflight outbound messages we allow */
+	int inflightTargetRTT;          /**< the ack round trip in milliseconds the adaptive inflight window aims for, 0 for none */
+	int inflightWindow;             /**< the adaptive inflight window, within maxInflightMessages */
+	int inflightThreshold;          /**< the window above which it grows by one each round trip rather than each ack */
+	int inflightAcks;               /**< acks counted towards the next one message increase of the window */
+	int inflightHold;               /**< acks still due for messages sent before the window was last halved */
+	DIFF_TIME_TYPE inflightRTT;     /**< smoothed ack round trip in microseconds, 0 if not measured yet */
 	willMessages* will;             /**< the MQTT will message, if any */
 	List* inboundMsgs;              /**< inbound in flight messages */
 	List* outboundMsgs;				/**< outbound in flight messages */
@@ -153,11 +163,13 @@ typedef struct Clients
 	void* context;                  /**< calling context - used when calling disconnect_internal */
 	int MQTTVersion;                /**< the version of MQTT being used, 3, 4 or 5 */
 	unsigned int sessionExpiry;     /**< MQTT 5 session expiry */
+	int outboundTopicAliasMaximum;  /**< MQTT 5 limit on the outbound topic aliases we assign, 0 for none */
+	TopicAliases* outboundAliases;  /**< MQTT 5 outbound topic aliases for the current connection, if any */
+	TopicAliases* inboundAliases;   /**< MQTT 5 topic aliases set by the server on the current connection, if any */
 	char* httpProxy;                /**< HTTP proxy */
 	char* httpsProxy;               /**< HTTPS proxy */
 #if defined(OPENSSL)
 	MQTTClient_SSLOptions *sslopts; /**< the SSL/TLS connect options */
-	SSL_SESSION* session;           /**< SSL session pointer for fast handhake */
 #endif
 } Clients;
 
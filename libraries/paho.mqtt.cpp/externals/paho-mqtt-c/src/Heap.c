@@ -42,6 +42,7 @@ char* Broker_recordFFDC(char* symptoms);
 #include <inttypes.h>
 
 #include "Heap.h"
+#include "Slab.h"
 
 #if !defined(NO_HEAP_TRACKING)
 
@@ -280,6 +281,10 @@ void myfree(char* file, int line, void* p)
 {
 	if (p) /* it is legal und usual to call free(NULL) */
 	{
+#if defined(SLAB_ALLOCATOR)
+		if (Slab_release(p))
+			return;
+#endif
 		Paho_thread_lock_mutex(heap_mutex);
 		if (Internal_heap_unlink(file, line, p))
 			free(((eyecatcherType*)p)-1);
@@ -85,6 +85,16 @@ void Heap_unlink(char* file, int line, void* p);
      }
 #endif
 
+#elif defined(SLAB_ALLOCATOR) && !defined(TREE_C) && !defined(SLAB_C)
+
+#include "Slab.h"
+
+/**
+ * redefines free to use "Slab_free" so that slab blocks are returned to their slab
+ * @param x the pointer to the item to be freed
+ */
+#define free(x) Slab_free(x)
+
 #endif
 
 #endif
@@ -13,6 +13,7 @@
  * Contributors:
  *    Ian Craggs - initial API and implementation and/or initial documentation
  *    Ian Craggs - updates for the async client
+ *    intrusive lists, with the element embedded in the content
  *******************************************************************************/
 
 /**
@@ -22,6 +23,12 @@
  * These linked lists can hold data of any sort, pointed to by the content pointer of the
  * ListElement structure.  ListElements hold the points to the next and previous items in the
  * list.
+ *
+ * An intrusive list instead uses a ListElement embedded in each item of content, at an offset
+ * fixed when the list is initialized.  Adding an item to such a list allocates nothing, and
+ * finding or removing an item by its content pointer does not need to search the list.
+ * An item can be on only one of the lists which use the same embedded element at a time, and
+ * the element records which one, so that looking for the item in another list finds nothing.
  * */
 
 #include "LinkedList.h"
@@ -30,9 +37,19 @@
 #include <string.h>
 
 #include "Heap.h"
+#include "Slab.h"
 
 
 static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*), int freeContent);
+static void ListUnlinkElement(List* aList, ListElement* element);
+
+/**
+ * Gets the list element embedded in an item of content of an intrusive list
+ * @param aList the intrusive list
+ * @param content the list item content
+ * @return pointer to the element embedded in the content
+ */
+#define ListLink(aList, content) ((ListElement*)((char*)(content) + (aList)->link_offset))
 
 
 /**
@@ -58,6 +75,55 @@ List* ListInitialize(void)
 }
 
 
+/**
+ * Allocates and initializes a new intrusive list structure, where each item of content
+ * holds its own ListElement.
+ * @param link_offset the offset of the ListElement in the content, from offsetof()
+ * @return a pointer to the new list structure
+ */
+List* ListInitializeIntrusive(size_t link_offset)
+{
+	List* newl = ListInitialize();
+	if (newl)
+	{
+		newl->intrusive = 1;
+		newl->link_offset = link_offset;
+	}
+	return newl;
+}
+
+
+/**
+ * Gets a list element for a new item: the embedded element for an intrusive list,
+ * otherwise a newly allocated one.
+ * @param aList the list to which the item is to be added
+ * @param content the list item content
+ * @return the list element, or NULL if it could not be allocated
+ */
+static ListElement* ListNewElement(List* aList, void* content)
+{
+	return aList->intrusive ? ListLink(aList, content) : Slab_malloc(sizeof(ListElement));
+}
+
+
+/**
+ * Releases a list element which has been unlinked from a list.  Embedded elements are
+ * marked as not being on a list, so must be released before their content is freed.
+ * @param aList the list from which the element was removed
+ * @param element the list element
+ */
+static void ListFreeElement(List* aList, ListElement* element)
+{
+	if (aList->intrusive)
+	{
+		element->content = element->prev = element->next = NULL;
+		element->list = NULL;
+	}
+	else
+		free(element);
+}
+
+
 /**
  * Append an already allocated ListElement and content to a list.  Can be used to move
  * an item from one list to another.
@@ -69,6 +135,7 @@ List* ListInitialize(void)
 void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t size)
 { /* for heap use */
 	newel->content = content;
+	newel->list = aList;
 	newel->next = NULL;
 	newel->prev = aList->last;
 	if (aList->first == NULL)
@@ -86,10 +153,11 @@ void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t s
  * @param aList the list to which the item is to be added
  * @param content the list item content itself
  * @param size the size of the element
+ * @return the list element, which can be used to remove the item without searching
  */
 ListElement* ListAppend(List* aList, void* content, size_t size)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = ListNewElement(aList, content);
 	if (newel)
 		ListAppendNoMalloc(aList, content, newel, size);
 	return newel;
@@ -103,10 +171,11 @@ ListElement* ListAppend(List* aList, void* content, size_t size)
  * @param size the size of the element
  * @param index the position in the list. If NULL, this function is equivalent
  * to ListAppend.
+ * @return the list element, which can be used to remove the item without searching
  */
 ListElement* ListInsert(List* aList, void* content, size_t size, ListElement* index)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = ListNewElement(aList, content);
 
 	if (newel == NULL)
 		return newel;
@@ -115,6 +184,7 @@ ListElement* ListInsert(List* aList, void* content, size_t size, ListElement* in
 	else
 	{
 		newel->content = content;
+		newel->list = aList;
 		newel->next = index;
 		newel->prev = index->prev;
 
@@ -155,7 +225,14 @@ ListElement* ListFindItem(List* aList, void* content, int(*callback)(void*, void
 {
 	ListElement* rc = NULL;
 
-	if (aList->current != NULL && ((callback == NULL && aList->current->content == content) ||
+	if (aList->intrusive && callback == NULL)
+	{
+		ListElement* link = (content != NULL) ? ListLink(aList, content) : NULL;
+
+		if (link != NULL && link->list == aList && link->content == content)
+			rc = aList->current = link;
+	}
+	else if (aList->current != NULL && ((callback == NULL && aList->current->content == content) ||
 		   (callback != NULL && callback(aList->current->content, content))))
 		rc = aList->current;
 	else
@@ -200,39 +277,44 @@ ListElement* ListFindItem(List* aList, void* content, int(*callback)(void*, void
  */
 static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*), int freeContent)
 {
-	ListElement* next = NULL;
 	ListElement* saved = aList->current;
-	int saveddeleted = 0;
+	ListElement* element = NULL;
 
-	if (!ListFindItem(aList, content, callback))
+	if ((element = ListFindItem(aList, content, callback)) == NULL)
 		return 0; /* false, did not remove item */
 
-	if (aList->current->prev == NULL)
+	aList->current = saved;
+	content = element->content;
+	ListUnlinkElement(aList, element);
+	if (freeContent)
+		free(content);
+	return 1; /* successfully removed item */
+}
+
+
+/**
+ * Removes an element from a list, and releases the element but not its content.
+ * If the element was the current element, the next element becomes current.
+ * @param aList the list from which the element is to be removed
+ * @param element the element to remove
+ */
+static void ListUnlinkElement(List* aList, ListElement* element)
+{
+	if (element->prev == NULL)
 		/* so this is the first element, and we have to update the "first" pointer */
-		aList->first = aList->current->next;
+		aList->first = element->next;
 	else
-		aList->current->prev->next = aList->current->next;
+		element->prev->next = element->next;
 
-	if (aList->current->next == NULL)
-		aList->last = aList->current->prev;
+	if (element->next == NULL)
+		aList->last = element->prev;
 	else
-		aList->current->next->prev = aList->current->prev;
+		element->next->prev = element->prev;
 
-	next = aList->current->next;
-	if (freeContent)
-    {
-		free(aList->current->content);
-                aList->current->content = NULL;
-    }
-	if (saved == aList->current)
-		saveddeleted = 1;
-	free(aList->current);
-	if (saveddeleted)
-		aList->current = next;
-	else
-		aList->current = saved;
+	if (aList->current == element)
+		aList->current = element->next;
 	--(aList->count);
-	return 1; /* successfully removed item */
+	ListFreeElement(aList, element);
 }
 
 
@@ -260,6 +342,33 @@ int ListRemove(List* aList, void* content)
 }
 
 
+/**
+ * Removes but does not free an item in a list, given its list element.  This does not
+ * search the list.
+ * @param aList the list from which the item is to be removed
+ * @param element the element returned when the item was added to the list
+ */
+void ListDetachElement(List* aList, ListElement* element)
+{
+	ListUnlinkElement(aList, element);
+}
+
+
+/**
+ * Removes and frees an item in a list, given its list element.  This does not
+ * search the list.
+ * @param aList the list from which the item is to be removed
+ * @param element the element returned when the item was added to the list
+ */
+void ListRemoveElement(List* aList, ListElement* element)
+{
+	void* content = element->content;
+
+	ListUnlinkElement(aList, element);
+	free(content);
+}
+
+
 /**
  * Removes and frees an the first item in a list.
  * @param aList the list from which the item is to be removed
@@ -279,7 +388,7 @@ void* ListDetachHead(List* aList)
 		aList->first = aList->first->next;
 		if (aList->first)
 			aList->first->prev = NULL;
-		free(first);
+		ListFreeElement(aList, first);
 		--(aList->count);
 	}
 	return content;
@@ -317,7 +426,7 @@ void* ListPopTail(List* aList)
 		aList->last = aList->last->prev;
 		if (aList->last)
 			aList->last->next = NULL;
-		free(last);
+		ListFreeElement(aList, last);
 		--(aList->count);
 	}
 	return content;
@@ -361,13 +470,12 @@ void ListEmpty(List* aList)
 	while (aList->first != NULL)
 	{
 		ListElement* first = aList->first;
-		if (first->content != NULL)
-                {
-			free(first->content);
-                        first->content = NULL;
-                }
+		void* content = first->content;
+
 		aList->first = first->next;
-		free(first);
+		ListFreeElement(aList, first);
+		if (content != NULL)
+			free(content);
 	}
 	aList->count = 0;
 	aList->size = 0;
@@ -395,7 +503,7 @@ void ListFreeNoContent(List* aList)
 	{
 		ListElement* first = aList->first;
 		aList->first = first->next;
-		free(first);
+		ListFreeElement(aList, first);
 	}
 	free(aList);
 }
@@ -453,9 +561,21 @@ int stringcompare(void* a, void* b)
 
 #if defined(UNIT_TESTS)
 
+#include <stdio.h>
+#include <stddef.h>
+
+#define TEST_EXPECT(i,x) if (!(x)) {fprintf( stderr, "failed test: %s (for i == %d)\n", #x, i ); ++fails;}
+
+typedef struct
+{
+	int value;
+	ListElement link;
+} linkedItem;
+
 
 int main(int argc, char *argv[])
 {
+	unsigned int fails = 0u;
 	int i, *ip, *todelete;
 	ListElement* current = NULL;
 	List* l = ListInitialize();
@@ -498,6 +618,68 @@ int main(int argc, char *argv[])
 
 	ListFree(l);
 	printf("List freed\n");
+
+	/* intrusive lists, whose elements are embedded in their content */
+	{
+		linkedItem* items[10];
+		linkedItem other;
+		List* l2 = ListInitializeIntrusive(offsetof(linkedItem, link));
+
+		l = ListInitializeIntrusive(offsetof(linkedItem, link));
+		for (i = 0; i < 10; i++)
+		{
+			items[i] = calloc(1, sizeof(linkedItem));
+			items[i]->value = i;
+			TEST_EXPECT(i, ListAppend(l, items[i], sizeof(linkedItem)) == &items[i]->link);
+			TEST_EXPECT(i, items[i]->link.list == l);
+		}
+		TEST_EXPECT(0, l->count == 10);
+		i = 0;
+		current = NULL;
+		while (ListNextElement(l, &current) != NULL)
+		{
+			TEST_EXPECT(i, ((linkedItem*)(current->content))->value == i);
+			++i;
+		}
+		TEST_EXPECT(i, i == 10);
+		i = 9;
+		current = NULL;
+		while (ListPrevElement(l, &current) != NULL)
+		{
+			TEST_EXPECT(i, ((linkedItem*)(current->content))->value == i);
+			--i;
+		}
+
+		ListDetachElement(l, &items[5]->link);
+		TEST_EXPECT(5, l->count == 9);
+		TEST_EXPECT(5, items[5]->link.list == NULL);
+		TEST_EXPECT(5, ListFind(l, items[5]) == NULL);
+		TEST_EXPECT(5, ListDetach(l, items[5]) == 0);
+		free(items[5]);
+		ListRemoveElement(l, l->first); /* frees item 0 */
+		TEST_EXPECT(0, l->count == 8);
+		TEST_EXPECT(0, ((linkedItem*)(l->first->content))->value == 1);
+		TEST_EXPECT(4, ListFind(l, items[4])->next->content == items[6]);
+		TEST_EXPECT(9, ListPopTail(l) == items[9]);
+		TEST_EXPECT(9, l->count == 7 && l->last == &items[8]->link);
+		free(items[9]);
+
+		/* an element on another list is not found, nor detached, through this one */
+		memset(&other, '\0', sizeof(linkedItem));
+		ListAppend(l2, &other, sizeof(linkedItem));
+		TEST_EXPECT(0, ListFindItem(l, &other, NULL) == NULL);
+		TEST_EXPECT(0, ListFindItem(l2, &other, NULL) == &other.link);
+		TEST_EXPECT(0, ListDetach(l, &other) == 0);
+		TEST_EXPECT(0, l2->count == 1 && other.link.list == l2);
+		TEST_EXPECT(0, ListDetach(l2, &other) == 1);
+		TEST_EXPECT(0, l2->count == 0 && other.link.list == NULL);
+
+		ListFree(l);
+		ListFreeNoContent(l2);
+	}
+
+	printf("List test %s\n", (fails == 0) ? "passed" : "failed");
+	return (int)fails;
 }
 
 #endif
@@ -14,6 +14,7 @@
  *    Ian Craggs - initial API and implementation and/or initial documentation
  *    Ian Craggs - updates for the async client
  *    Ian Craggs - change size types from int to size_t
+ *    intrusive lists, with the element embedded in the content
  *******************************************************************************/
 
 #if !defined(LINKEDLIST_H)
@@ -58,23 +59,27 @@ typedef struct ListElementStruct
 	struct ListElementStruct *prev, /**< pointer to previous list element */
 							*next;	/**< pointer to next list element */
 	void* content;					/**< pointer to element content */
+	struct ListStruct* list;		/**< the list the element is on */
 } ListElement;
 
 
 /**
  * Structure to hold all data for one list
  */
-typedef struct
+typedef struct ListStruct
 {
 	ListElement *first,	/**< first element in the list */
 				*last,	/**< last element in the list */
 				*current;	/**< current element in the list, for iteration */
 	int count;  /**< no of items */
 	size_t size;  /**< heap storage used */
+	int intrusive;  /**< the elements are embedded in their content, and not allocated by the list */
+	size_t link_offset;  /**< for an intrusive list, the offset of the ListElement in the content */
 } List;
 
 void ListZero(List*);
 List* ListInitialize(void);
+List* ListInitializeIntrusive(size_t link_offset);
 
 ListElement* ListAppend(List* aList, void* content, size_t size);
 void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t size);
@@ -89,6 +94,9 @@ void* ListPopTail(List* aList);
 int ListDetach(List* aList, void* content);
 int ListDetachItem(List* aList, void* content, int(*callback)(void*, void*));
 
+void ListDetachElement(List* aList, ListElement* element);
+void ListRemoveElement(List* aList, ListElement* element);
+
 void ListFree(List* aList);
 void ListEmpty(List* aList);
 void ListFreeNoContent(List* aList);
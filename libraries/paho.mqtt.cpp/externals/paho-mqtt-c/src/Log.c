@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <time.h>
 #include <string.h>
 
@@ -111,10 +112,7 @@ static char* Log_formatTraceEntry(traceEntry* cur_entry);
 static void Log_output(enum LOG_LEVELS log_level, const char *msg);
 static void Log_posttrace(enum LOG_LEVELS log_level, traceEntry* cur_entry);
 static void Log_trace(enum LOG_LEVELS log_level, const char *buf);
-#if 0
 static FILE* Log_destToFile(const char *dest);
-static int Log_compareEntries(const char *entry1, const char *entry2);
-#endif
 
 #if defined(GETTIMEOFDAY)
 struct timeval now_ts;
@@ -130,6 +128,70 @@ static pthread_mutex_t log_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static mutex_type log_mutex = &log_mutex_store;
 #endif
 
+/*
+ * Binary trace rings.
+ *
+ * When trace rings are on, trace entries below LOG_ERROR are not formatted when they are
+ * made.  Each thread writes fixed size binary entries - a timestamp, the message number
+ * and the message arguments - into a ring of its own, without taking any lock, and the
+ * formatting is left until the trace is dumped by Log_dumpTrace.
+ *
+ * A ring has only one writer, the thread which owns it.  Each entry carries the position
+ * it was written at, which is zeroed while the entry is being written, so that a dump
+ * running at the same time can tell, and skip, entries which changed while it read them.
+ */
+
+#define RING_MAX_ARGS 8
+#define RING_STRINGS_LENGTH 80
+
+typedef struct
+{
+	uint64_t seq;          /**< position in the ring + 1, or 0 while the entry is being written */
+	uint64_t ticks;        /**< when the entry was made, in Log_ticks units */
+	const char* text;      /**< function name, or format string of a message */
+	thread_id_type thread_id;
+	int number;            /**< message number */
+	int depth;             /**< stack depth, or number of message arguments */
+	int line;
+	int rc;
+	short level;
+	short has_rc;          /**< as for traceEntry: 0 no rc, 1 rc, 2 a message */
+	uint64_t args[RING_MAX_ARGS]; /**< message arguments, strings as offsets + 1 into strings */
+	char strings[RING_STRINGS_LENGTH]; /**< copies of string arguments */
+} ringEntry;
+
+typedef struct traceRing
+{
+	struct traceRing* next_ring; /**< the next ring in trace_rings */
+	thread_id_type thread_id; /**< the thread writing to the ring */
+	int owned;             /**< whether a running thread owns the ring */
+	uint64_t next;         /**< number of entries written */
+	uint64_t mask;         /**< number of entries - 1, a power of 2 */
+	ringEntry* entries;
+} traceRing;
+
+static int ring_entries = 0; /**< entries in each thread's ring, 0 when the rings are off */
+/** all the rings, including those of threads which have ended.  Not a List, because Heap.c,
+ * which List uses, can itself trace */
+static traceRing* trace_rings = NULL;
+static int ring_key_created = 0;
+static uint64_t ring_base_ticks = 0; /**< Log_ticks() at ring_base_us */
+static int64_t ring_base_us = 0; /**< the time at which the ring clock was calibrated */
+
+#if defined(_WIN32) || defined(_WIN64)
+static DWORD ring_key = FLS_OUT_OF_INDEXES;
+static void WINAPI Log_releaseRing(void* ring);
+#else
+static pthread_key_t ring_key;
+static void Log_releaseRing(void* ring);
+#endif
+static traceRing* Log_getRing(void);
+static void Log_ringStackTrace(traceRing* ring, enum LOG_LEVELS log_level, int msgno, thread_id_type thread_id,
+		int current_depth, const char* name, int line, int* rc);
+static void Log_ringMessage(traceRing* ring, enum LOG_LEVELS log_level, int msgno, const char* format, va_list args);
+static void Log_ringText(traceRing* ring, enum LOG_LEVELS log_level, int msgno, const char* text);
+static void Log_freeRings(void);
+
 
 int Log_initialize(Log_nameValue* info)
 {
@@ -187,6 +249,8 @@ int Log_initialize(Log_nameValue* info)
 		else if (strcmp(envval, "ERROR") == 0  || strcmp(envval, "TRACE_ERROR") == 0)
 			trace_output_level = LOG_ERROR;
 	}
+	if ((envval = getenv("MQTT_C_CLIENT_TRACE_RING")) != NULL && strlen(envval) > 0)
+		Log_setTraceRing(atoi(envval));
 	Log_output(TRACE_MINIMUM, "=========================================================");
 	Log_output(TRACE_MINIMUM, "                   Trace Output");
 	if (info)
@@ -235,8 +299,23 @@ void Log_setTraceLevel(enum LOG_LEVELS level)
 }
 
 
+/**
+ * Turns the binary trace rings on or off.
+ * @param entries the number of entries in each thread's ring, rounded up to a power of 2,
+ * or 0 to go back to formatting each entry as it is made.  Rings which already exist keep
+ * their size, and their entries until the trace is terminated.
+ */
+void Log_setTraceRing(int entries)
+{
+	ring_entries = (entries > 0) ? entries : 0;
+}
+
+
 void Log_terminate(void)
 {
+	if (trace_rings && (trace_destination || trace_callback))
+		Log_dumpTrace(NULL); /* the entries in the rings have not been output yet */
+	Log_freeRings();
 	free(trace_queue);
 	trace_queue = NULL;
 	trace_queue_size = 0;
@@ -412,17 +491,26 @@ void Log(enum LOG_LEVELS log_level, int msgno, const char *format, ...)
 		const char *temp = NULL;
 		va_list args;
 
-		/* we're using a static character buffer, so we need to make sure only one thread uses it at a time */
-		Paho_thread_lock_mutex(log_mutex);
+		traceRing* ring = NULL;
+
 		if (format == NULL && (temp = Messages_get(msgno, log_level)) != NULL)
 			format = temp;
 
 		va_start(args, format);
-		vsnprintf(msg_buf, sizeof(msg_buf), format, args);
-
-		Log_trace(log_level, msg_buf);
+		if (ring_entries > 0 && (ring = Log_getRing()) != NULL && log_level < LOG_ERROR)
+			Log_ringMessage(ring, log_level, msgno, format, args);
+		else
+		{
+			/* we're using a static character buffer, so we need to make sure only one thread uses it at a time */
+			Paho_thread_lock_mutex(log_mutex);
+			vsnprintf(msg_buf, sizeof(msg_buf), format, args);
+
+			Log_trace(log_level, msg_buf);
+			if (ring) /* errors are output straight away, and kept in the ring as text */
+				Log_ringText(ring, log_level, msgno, msg_buf);
+			Paho_thread_unlock_mutex(log_mutex);
+		}
 		va_end(args);
-		Paho_thread_unlock_mutex(log_mutex);
 	}
 }
 
@@ -439,6 +527,7 @@ void Log(enum LOG_LEVELS log_level, int msgno, const char *format, ...)
 void Log_stackTrace(enum LOG_LEVELS log_level, int msgno, thread_id_type thread_id, int current_depth, const char* name, int line, int* rc)
 {
 	traceEntry *cur_entry = NULL;
+	traceRing* ring = NULL;
 
 	if (trace_queue == NULL)
 		return;
@@ -446,6 +535,12 @@ void Log_stackTrace(enum LOG_LEVELS log_level, int msgno, thread_id_type thread_
 	if (log_level < trace_settings.trace_level)
 		return;
 
+	if (ring_entries > 0 && (ring = Log_getRing()) != NULL)
+	{
+		Log_ringStackTrace(ring, log_level, msgno, thread_id, current_depth, name, line, rc);
+		return;
+	}
+
 	Paho_thread_lock_mutex(log_mutex);
 	cur_entry = Log_pretrace();
 
@@ -469,99 +564,767 @@ void Log_stackTrace(enum LOG_LEVELS log_level, int msgno, thread_id_type thread_
 }
 
 
-#if 0
-static FILE* Log_destToFile(const char *dest)
+
+
+#if defined(_MSC_VER) && !defined(__clang__)
+static uint64_t Log_loadAcquire(volatile uint64_t* p)
 {
-	FILE* file = NULL;
+	uint64_t value = *p;
+	MemoryBarrier();
+	return value;
+}
+static void Log_storeRelease(volatile uint64_t* p, uint64_t value)
+{
+	MemoryBarrier();
+	*p = value;
+}
+#define Log_acquireFence() MemoryBarrier()
+#define Log_releaseFence() MemoryBarrier()
+#else
+#define Log_loadAcquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define Log_storeRelease(p, value) __atomic_store_n(p, value, __ATOMIC_RELEASE)
+#define Log_acquireFence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define Log_releaseFence() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
 
-	if (strcmp(dest, "stdout") == 0)
-		file = stdout;
-	else if (strcmp(dest, "stderr") == 0)
-		file = stderr;
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+/** The timestamp counter: no system call, and a few nanoseconds to read */
+#define Log_ticks() __rdtsc()
+#else
+/**
+ * A monotonic clock in nanoseconds, for processors without a timestamp counter we can read
+ * directly.
+ * @return the current time in nanoseconds
+ */
+static uint64_t Log_ticks(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	LARGE_INTEGER count;
+
+	QueryPerformanceCounter(&count);
+	return (uint64_t)count.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+#endif
+
+
+/**
+ * The time of day.
+ * @return the number of microseconds since the epoch
+ */
+static int64_t Log_now_us(void)
+{
+#if defined(GETTIMEOFDAY)
+	struct timeval ts;
+
+	gettimeofday(&ts, NULL);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_usec;
+#else
+	struct timeb ts;
+
+	ftime(&ts);
+	return (int64_t)ts.time * 1000000 + (int64_t)ts.millitm * 1000;
+#endif
+}
+
+
+/**
+ * Called when a thread which owns a trace ring ends, so that the ring, and the entries
+ * in it, can be taken over by a new thread.
+ * @param ring the ring of the thread
+ */
+#if defined(_WIN32) || defined(_WIN64)
+static void WINAPI Log_releaseRing(void* ring)
+#else
+static void Log_releaseRing(void* ring)
+#endif
+{
+	if (ring == NULL)
+		return;
+	Paho_thread_lock_mutex(log_mutex);
+	((traceRing*)ring)->owned = 0;
+	Paho_thread_unlock_mutex(log_mutex);
+}
+
+
+/**
+ * Finds the current thread a trace ring.  A ring left by a thread which has ended is
+ * reused if there is one, otherwise a new ring is allocated.
+ * @return the ring, or NULL if there is not enough memory
+ */
+static traceRing* Log_newRing(void)
+{
+	traceRing* ring = NULL;
+	uint64_t size = 1;
+
+	while (size < (uint64_t)ring_entries)
+		size <<= 1;
+
+	Paho_thread_lock_mutex(log_mutex);
+	if (!ring_key_created)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		if ((ring_key = FlsAlloc(Log_releaseRing)) == FLS_OUT_OF_INDEXES)
+#else
+		if (pthread_key_create(&ring_key, Log_releaseRing) != 0)
+#endif
+			goto exit;
+		ring_base_ticks = Log_ticks();
+		ring_base_us = Log_now_us();
+		ring_key_created = 1;
+	}
+
+	for (ring = trace_rings; ring; ring = ring->next_ring)
+	{
+		if (!ring->owned && ring->mask + 1 == size)
+			break;
+	}
+	if (ring == NULL)
+	{
+		if ((ring = malloc(sizeof(traceRing))) == NULL)
+			goto exit;
+		if ((ring->entries = malloc(size * sizeof(ringEntry))) == NULL)
+		{
+			free(ring);
+			ring = NULL;
+			goto exit;
+		}
+		memset(ring->entries, '\0', size * sizeof(ringEntry));
+		ring->next = 0;
+		ring->mask = size - 1;
+		ring->next_ring = trace_rings;
+		trace_rings = ring;
+	}
+	ring->thread_id = Paho_thread_getid();
+	ring->owned = 1;
+#if defined(_WIN32) || defined(_WIN64)
+	FlsSetValue(ring_key, ring);
+#else
+	pthread_setspecific(ring_key, ring);
+#endif
+exit:
+	Paho_thread_unlock_mutex(log_mutex);
+	return ring;
+}
+
+
+/**
+ * Gets the trace ring of the current thread, creating it the first time.
+ * @return the ring, or NULL if there is not enough memory
+ */
+static traceRing* Log_getRing(void)
+{
+	traceRing* ring = NULL;
+
+	if (ring_key_created)
+#if defined(_WIN32) || defined(_WIN64)
+		ring = (traceRing*)FlsGetValue(ring_key);
+#else
+		ring = (traceRing*)pthread_getspecific(ring_key);
+#endif
+	if (ring == NULL)
+		ring = Log_newRing();
+	return ring;
+}
+
+
+/**
+ * Frees all the trace rings.  Threads find they have no ring the next time they trace.
+ */
+static void Log_freeRings(void)
+{
+
+	if (ring_key_created)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		FlsFree(ring_key);
+#else
+		pthread_key_delete(ring_key);
+#endif
+		ring_key_created = 0;
+	}
+	while (trace_rings)
+	{
+		traceRing* ring = trace_rings;
+
+		trace_rings = ring->next_ring;
+		free(ring->entries);
+		free(ring);
+	}
+}
+
+
+/**
+ * Claims the next entry of a trace ring, and marks it as being written.
+ * @param ring the ring of the current thread
+ * @param log_level the level of the entry
+ * @param msgno the message number of the entry
+ * @return the entry
+ */
+static ringEntry* Log_ringStart(traceRing* ring, enum LOG_LEVELS log_level, int msgno)
+{
+	ringEntry* entry = &ring->entries[ring->next & ring->mask];
+
+	entry->seq = 0;
+	Log_releaseFence(); /* a dump must not see new contents with the old position */
+	entry->ticks = Log_ticks();
+	entry->thread_id = ring->thread_id;
+	entry->level = (short)log_level;
+	entry->number = msgno;
+	return entry;
+}
+
+
+/**
+ * Completes the entry being written, so that it can be seen by a dump.
+ * @param ring the ring of the current thread
+ * @param entry the entry returned by Log_ringStart
+ */
+static void Log_ringEnd(traceRing* ring, ringEntry* entry)
+{
+	uint64_t next = ring->next + 1;
+
+	Log_storeRelease(&entry->seq, next);
+	Log_storeRelease(&ring->next, next);
+}
+
+
+static void Log_ringStackTrace(traceRing* ring, enum LOG_LEVELS log_level, int msgno, thread_id_type thread_id,
+		int current_depth, const char* name, int line, int* rc)
+{
+	ringEntry* entry = Log_ringStart(ring, log_level, msgno);
+
+	entry->thread_id = thread_id;
+	entry->text = name; /* function names are string constants */
+	entry->depth = current_depth;
+	entry->line = line;
+	entry->has_rc = (rc == NULL) ? 0 : 1;
+	entry->rc = (rc == NULL) ? 0 : *rc;
+	Log_ringEnd(ring, entry);
+}
+
+
+/** length modifiers of printf conversions */
+enum LOG_ARG_LENGTHS { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T, LEN_LONG_DOUBLE };
+
+/**
+ * A printf conversion specification, as far as is needed to save and restore its argument.
+ */
+typedef struct
+{
+	const char* start;     /**< the first character after the % */
+	const char* end;       /**< the character after the conversion character */
+	int stars;             /**< the number of * widths and precisions */
+	int precision;         /**< the precision if it is given as a number, otherwise -1 */
+	int length;            /**< LOG_ARG_LENGTHS */
+	char conversion;
+} printfSpec;
+
+
+/**
+ * Parses a printf conversion specification.
+ * @param format the character after the %
+ * @param spec returns the parsed specification
+ * @return 1 if the specification is one which can be saved in a trace ring, otherwise 0
+ */
+static int Log_parseSpec(const char* format, printfSpec* spec)
+{
+	const char* p = format;
+
+	memset(spec, '\0', sizeof(printfSpec));
+	spec->start = format;
+	spec->precision = -1;
+	p += strspn(p, "-+ #0");
+	if (*p == '*')
+	{
+		++spec->stars;
+		++p;
+	}
 	else
+		p += strspn(p, "0123456789");
+	if (*p == '.')
 	{
-		if (strstr(dest, "FFDC"))
-			file = fopen(dest, "ab");
+		++p;
+		if (*p == '*')
+		{
+			++spec->stars;
+			++p;
+		}
 		else
-			file = fopen(dest, "wb");
+		{
+			spec->precision = 0;
+			while (*p >= '0' && *p <= '9')
+				spec->precision = spec->precision * 10 + (*p++ - '0');
+		}
 	}
-	return file;
+	switch (*p)
+	{
+	case 'h': spec->length = (p[1] == 'h') ? LEN_HH : LEN_H; break;
+	case 'l': spec->length = (p[1] == 'l') ? LEN_LL : LEN_L; break;
+	case 'z': spec->length = LEN_Z; break;
+	case 'j': spec->length = LEN_J; break;
+	case 't': spec->length = LEN_T; break;
+	case 'L': spec->length = LEN_LONG_DOUBLE; break;
+	}
+	p += (spec->length == LEN_HH || spec->length == LEN_LL) ? 2 : (spec->length != LEN_NONE);
+	spec->conversion = *p;
+	spec->end = (*p) ? p + 1 : p;
+	return *p != '\0' && strchr("diouxXcpseEfFgGaA", *p) != NULL;
 }
 
 
-static int Log_compareEntries(const char *entry1, const char *entry2)
+static void Log_ringMessage(traceRing* ring, enum LOG_LEVELS log_level, int msgno, const char* format, va_list args)
 {
-	int comp = strncmp(&entry1[7], &entry2[7], 19);
+	ringEntry* entry = Log_ringStart(ring, log_level, msgno);
+	const char* p = format;
+	size_t used = 0;
+	int nargs = 0;
+
+	entry->text = format;
+	entry->has_rc = 2;
+	entry->strings[RING_STRINGS_LENGTH - 1] = '\0';
+	while (p && (p = strchr(p, '%')) != NULL)
+	{
+		printfSpec spec;
+		int precision = -1;
+		uint64_t value = 0;
+
+		if (*++p == '%')
+		{
+			++p;
+			continue;
+		}
+		/* arguments which don't all fit, or that we can't save, end the message */
+		if (!Log_parseSpec(p, &spec) || nargs + spec.stars + 1 > RING_MAX_ARGS)
+			break;
+		p = spec.end;
+		precision = spec.precision;
+		if (spec.stars > 0)
+		{
+			int width = va_arg(args, int);
+
+			entry->args[nargs++] = (uint64_t)(int64_t)width;
+			/* a single * is the precision if the width is a number */
+			if (spec.stars == 1 && spec.start[strspn(spec.start, "-+ #0123456789")] == '.')
+				precision = width;
+		}
+		if (spec.stars > 1)
+			entry->args[nargs++] = (uint64_t)(int64_t)(precision = va_arg(args, int));
 
-	/* if timestamps are equal, use the sequence numbers */
-	if (comp == 0)
-		comp = strncmp(&entry1[1], &entry2[1], 4);
+		switch (spec.conversion)
+		{
+		case 'd': case 'i': case 'c':
+			switch (spec.length)
+			{
+			case LEN_HH: value = (uint64_t)(int64_t)(signed char)va_arg(args, int); break;
+			case LEN_H: value = (uint64_t)(int64_t)(short)va_arg(args, int); break;
+			case LEN_L: value = (uint64_t)(int64_t)va_arg(args, long); break;
+			case LEN_LL: value = (uint64_t)(int64_t)va_arg(args, long long); break;
+			case LEN_Z: value = (uint64_t)va_arg(args, size_t); break;
+			case LEN_J: value = (uint64_t)va_arg(args, intmax_t); break;
+			case LEN_T: value = (uint64_t)va_arg(args, ptrdiff_t); break;
+			default: value = (uint64_t)(int64_t)va_arg(args, int); break;
+			}
+			break;
+		case 'o': case 'u': case 'x': case 'X':
+			switch (spec.length)
+			{
+			case LEN_HH: value = (unsigned char)va_arg(args, unsigned int); break;
+			case LEN_H: value = (unsigned short)va_arg(args, unsigned int); break;
+			case LEN_L: value = va_arg(args, unsigned long); break;
+			case LEN_LL: value = va_arg(args, unsigned long long); break;
+			case LEN_Z: value = va_arg(args, size_t); break;
+			case LEN_J: value = va_arg(args, uintmax_t); break;
+			case LEN_T: value = (uint64_t)va_arg(args, ptrdiff_t); break;
+			default: value = va_arg(args, unsigned int); break;
+			}
+			break;
+		case 'p':
+			value = (uint64_t)(uintptr_t)va_arg(args, void*);
+			break;
+		case 's':
+			{
+				const char* str = va_arg(args, const char*);
+
+				if (str == NULL)
+					value = 0;
+				else if (used >= RING_STRINGS_LENGTH - 1)
+					value = RING_STRINGS_LENGTH; /* the terminating null */
+				else
+				{
+					size_t len = RING_STRINGS_LENGTH - 1 - used;
+					const char* end = NULL;
+
+					if (precision >= 0 && (size_t)precision < len)
+						len = (size_t)precision;
+					if ((end = memchr(str, '\0', len)) != NULL)
+						len = end - str;
+					memcpy(&entry->strings[used], str, len);
+					entry->strings[used + len] = '\0';
+					value = used + 1;
+					used += len + 1;
+				}
+			}
+			break;
+		default: /* floating point */
+			{
+				double d = (spec.length == LEN_LONG_DOUBLE) ? (double)va_arg(args, long double) : va_arg(args, double);
 
-	return comp;
+				memcpy(&value, &d, sizeof(value));
+			}
+			break;
+		}
+		entry->args[nargs++] = value;
+	}
+	entry->depth = nargs;
+	Log_ringEnd(ring, entry);
 }
 
 
 /**
- * Write the contents of the stored trace to a stream
- * @param dest string which contains a file name or the special strings stdout or stderr
+ * Adds an already formatted message to a trace ring.
+ * @param ring the ring of the current thread
+ * @param log_level the level of the message
+ * @param msgno the message number
+ * @param text the message, which is truncated to fit the entry
  */
-int Log_dumpTrace(char* dest)
+static void Log_ringText(traceRing* ring, enum LOG_LEVELS log_level, int msgno, const char* text)
 {
-	FILE* file = NULL;
-	ListElement* cur_trace_entry = NULL;
-	const int msgstart = 7;
-	int rc = -1;
-	int trace_queue_index = 0;
+	ringEntry* entry = Log_ringStart(ring, log_level, msgno);
+	size_t len = strlen(text);
+
+	if (len > RING_STRINGS_LENGTH - 1)
+		len = RING_STRINGS_LENGTH - 1;
+	memcpy(entry->strings, text, len);
+	entry->strings[len] = '\0';
+	entry->text = "%s";
+	entry->has_rc = 2;
+	entry->depth = 1;
+	entry->args[0] = 1;
+	Log_ringEnd(ring, entry);
+}
+
 
-	if ((file = Log_destToFile(dest)) == NULL)
+/**
+ * Formats the message in a trace ring entry, as printf would have done when the entry was made.
+ * @param entry the entry
+ * @param buf where to write the message
+ * @param buflen the size of buf
+ */
+static void Log_formatRingMessage(ringEntry* entry, char* buf, size_t buflen)
+{
+	const char* p = entry->text;
+	size_t pos = 0;
+	int arg = 0;
+
+	if (p == NULL)
 	{
-		Log(LOG_ERROR, 9, NULL, "trace", dest, "trace entries");
-		goto exit;
+		snprintf(buf, buflen, "message %d", entry->number);
+		return;
+	}
+	buf[0] = '\0';
+	while (*p && pos < buflen - 1)
+	{
+		printfSpec spec;
+		char specbuf[48];
+		size_t speclen = 0;
+		const char* s = NULL;
+		int n = 0;
+
+		if (*p != '%' || p[1] == '%')
+		{
+			buf[pos++] = *p;
+			p += (*p == '%') ? 2 : 1;
+			continue;
+		}
+		if (!Log_parseSpec(p + 1, &spec) || arg + spec.stars + 1 > entry->depth)
+		{
+			snprintf(&buf[pos], buflen - pos, "...");
+			break;
+		}
+
+		/* rebuild the specification with the widths filled in and a length we know the type of */
+		specbuf[speclen++] = '%';
+		for (s = spec.start; s < spec.end - 1 && speclen < sizeof(specbuf) - 24; ++s)
+		{
+			if (*s == '*')
+			{
+				int value = (int)(int64_t)entry->args[arg++];
+
+				if (s > spec.start && s[-1] == '.' && value < 0)
+					--speclen; /* a negative precision is taken as if it had been left out */
+				else
+					speclen += snprintf(&specbuf[speclen], sizeof(specbuf) - speclen, "%d", value);
+			}
+			else if (strchr("hlLzjt", *s) == NULL)
+				specbuf[speclen++] = *s;
+		}
+		if (strchr("diouxX", spec.conversion))
+		{
+			specbuf[speclen++] = 'l';
+			specbuf[speclen++] = 'l';
+		}
+		specbuf[speclen++] = spec.conversion;
+		specbuf[speclen] = '\0';
+
+		switch (spec.conversion)
+		{
+		case 'd': case 'i':
+			n = snprintf(&buf[pos], buflen - pos, specbuf, (long long)entry->args[arg]);
+			break;
+		case 'o': case 'u': case 'x': case 'X':
+			n = snprintf(&buf[pos], buflen - pos, specbuf, (unsigned long long)entry->args[arg]);
+			break;
+		case 'c':
+			n = snprintf(&buf[pos], buflen - pos, specbuf, (int)entry->args[arg]);
+			break;
+		case 'p':
+			n = snprintf(&buf[pos], buflen - pos, specbuf, (void*)(uintptr_t)entry->args[arg]);
+			break;
+		case 's':
+			if (entry->args[arg] == 0)
+				n = snprintf(&buf[pos], buflen - pos, specbuf, "(null)");
+			else
+				n = snprintf(&buf[pos], buflen - pos, specbuf, &entry->strings[entry->args[arg] - 1]);
+			break;
+		default:
+			{
+				double d;
+
+				memcpy(&d, &entry->args[arg], sizeof(d));
+				n = snprintf(&buf[pos], buflen - pos, specbuf, d);
+			}
+			break;
+		}
+		++arg;
+		if (n < 0)
+			break;
+		pos = min(pos + (size_t)n, buflen - 1);
+		p = spec.end;
 	}
+	buf[min(pos, buflen - 1)] = '\0';
+}
+
+
+static int Log_compareRingEntries(const void* a, const void* b)
+{
+	const ringEntry* entry1 = (const ringEntry*)a;
+	const ringEntry* entry2 = (const ringEntry*)b;
+
+	if (entry1->ticks != entry2->ticks)
+		return (entry1->ticks < entry2->ticks) ? -1 : 1;
+	return (entry1->seq < entry2->seq) ? -1 : (entry1->seq > entry2->seq);
+}
+
 
-	fprintf(file, "=========== Start of trace dump ==========\n");
-	/* Interleave the log and trace entries together appropriately */
-	ListNextElement(trace_buffer, &cur_trace_entry);
-	trace_queue_index = start_index;
-	if (trace_queue_index == -1)
-		trace_queue_index = next_index;
+static FILE* Log_destToFile(const char *dest)
+{
+	FILE* file = NULL;
+
+	if (strcmp(dest, "stdout") == 0)
+		file = stdout;
+	else if (strcmp(dest, "stderr") == 0)
+		file = stderr;
 	else
+		file = fopen(dest, "w");
+	return file;
+}
+
+
+/**
+ * Formats and writes out the entries in the trace rings, oldest first, merging the entries
+ * of all the threads.  Entries are kept in the rings, so they can be dumped again.
+ * @param dest a file name, or "stdout" or "stderr", or NULL to write the entries to the trace
+ * destination and trace callback, at the trace output level
+ * @return the number of entries written, or -1 if dest couldn't be opened or there was not
+ * enough memory
+ */
+int Log_dumpTrace(const char* dest)
+{
+	FILE* file = NULL;
+	traceRing* ring = NULL;
+	ringEntry* entries = NULL;
+	size_t count = 0,
+		size = 0,
+		i = 0;
+	double ticks_per_us = 1.0;
+	uint64_t now_ticks = 0;
+	int64_t now_us = 0;
+	int64_t base_us = 0;
+	int rc = -1;
+
+	/* the tick rate is worked out against the time of day since the rings were started,
+	   which needs a few milliseconds to be accurate.  Wait for them before taking log_mutex,
+	   so that threads which are tracing are not held up */
+	Paho_thread_lock_mutex(log_mutex);
+	base_us = (trace_rings) ? ring_base_us : 0;
+	Paho_thread_unlock_mutex(log_mutex);
+	while (base_us != 0 && Log_now_us() - base_us < 10000)
+		;
+
+	Paho_thread_lock_mutex(log_mutex);
+	if (dest && (file = Log_destToFile(dest)) == NULL)
+		goto exit;
+	if (trace_rings == NULL)
 	{
-		Log_formatTraceEntry(&trace_queue[trace_queue_index++]);
-		if (trace_queue_index == trace_settings.max_trace_entries)
-			trace_queue_index = 0;
+		rc = 0;
+		goto exit;
 	}
-	while (cur_trace_entry || trace_queue_index != next_index)
+
+	for (ring = trace_rings; ring; ring = ring->next_ring)
+		size += ring->mask + 1;
+	if (size > 0 && (entries = malloc(size * sizeof(ringEntry))) == NULL)
+		goto exit;
+
+	/* copy out the entries that were complete and did not change while we read them */
+	for (ring = trace_rings; ring; ring = ring->next_ring)
 	{
-		if (cur_trace_entry && trace_queue_index != -1)
-		{	/* compare these timestamps */
-			if (Log_compareEntries((char*)cur_trace_entry->content, msg_buf) > 0)
-				cur_trace_entry = NULL;
-		}
+		uint64_t next = Log_loadAcquire(&ring->next);
+		uint64_t pos = (next > ring->mask + 1) ? next - ring->mask - 1 : 0;
 
-		if (cur_trace_entry)
+		for (; pos < next; ++pos)
 		{
-			fprintf(file, "%s\n", &((char*)(cur_trace_entry->content))[msgstart]);
-			ListNextElement(trace_buffer, &cur_trace_entry);
+			ringEntry* entry = &ring->entries[pos & ring->mask];
+
+			if (Log_loadAcquire(&entry->seq) != pos + 1)
+				continue;
+			memcpy(&entries[count], entry, sizeof(ringEntry));
+			Log_acquireFence();
+			if (Log_loadAcquire(&entry->seq) == pos + 1)
+				++count;
 		}
+	}
+	qsort(entries, count, sizeof(ringEntry), Log_compareRingEntries);
+
+	now_ticks = Log_ticks();
+	now_us = Log_now_us();
+	if (now_us > ring_base_us && now_ticks > ring_base_ticks)
+		ticks_per_us = (double)(now_ticks - ring_base_ticks) / (double)(now_us - ring_base_us);
+
+	if (file)
+		fprintf(file, "=========== Start of trace dump ==========\n");
+	for (i = 0; i < count; ++i)
+	{
+		ringEntry* entry = &entries[i];
+		traceEntry cur_entry;
+		int64_t us = ring_base_us + (int64_t)(((double)entry->ticks - (double)ring_base_ticks) / ticks_per_us);
+
+		if (file == NULL && entry->level < ((trace_output_level == -1) ? trace_settings.trace_level : trace_output_level))
+			continue;
+#if defined(GETTIMEOFDAY)
+		cur_entry.ts.tv_sec = (time_t)(us / 1000000);
+		cur_entry.ts.tv_usec = (suseconds_t)(us % 1000000);
+#else
+		cur_entry.ts.time = (time_t)(us / 1000000);
+		cur_entry.ts.millitm = (unsigned short)((us % 1000000) / 1000);
+#endif
+		cur_entry.number = entry->number;
+		cur_entry.thread_id = entry->thread_id;
+		cur_entry.depth = entry->depth;
+		cur_entry.line = entry->line;
+		cur_entry.has_rc = entry->has_rc;
+		cur_entry.rc = entry->rc;
+		cur_entry.level = (enum LOG_LEVELS)entry->level;
+		if (entry->has_rc == 2)
+			Log_formatRingMessage(entry, cur_entry.name, sizeof(cur_entry.name));
 		else
 		{
-			fprintf(file, "%s\n", &msg_buf[7]);
-			if (trace_queue_index != next_index)
-			{
-				Log_formatTraceEntry(&trace_queue[trace_queue_index++]);
-				if (trace_queue_index == trace_settings.max_trace_entries)
-					trace_queue_index = 0;
-			}
+			strncpy(cur_entry.name, entry->text, MAX_FUNCTION_NAME_LENGTH);
+			cur_entry.name[MAX_FUNCTION_NAME_LENGTH] = '\0';
 		}
+
+		Log_formatTraceEntry(&cur_entry);
+		if (file)
+			fprintf(file, "%s\n", &msg_buf[7]);
+		else
+			Log_output(cur_entry.level, &msg_buf[7]);
 	}
-	fprintf(file, "========== End of trace dump ==========\n\n");
-	if (file != stdout && file != stderr && file != NULL)
-		fclose(file);
-	rc = 0;
+	if (file)
+		fprintf(file, "========== End of trace dump ==========\n\n");
+	rc = (int)count;
 exit:
+	if (entries)
+		free(entries);
+	if (file && file != stdout && file != stderr)
+		fclose(file);
+	else if (file)
+		fflush(file);
+	Paho_thread_unlock_mutex(log_mutex);
 	return rc;
 }
-#endif
 
 
+#if defined(LOG_TEST)
+
+#define TEST_EXPECT(i,x) if (!(x)) {fprintf( stderr, "failed test: %s (for i == %d)\n", #x, i ); ++fails;}
+
+static unsigned int fails = 0u;
+
+/* saves a message in a ring entry, and checks that it is formatted as snprintf does */
+static void test_format(int i, const char* format, ...)
+{
+	ringEntry entries[1];
+	traceRing ring;
+	char expected[256];
+	char formatted[256];
+	va_list args;
+
+	memset(&ring, '\0', sizeof(ring));
+	memset(entries, '\0', sizeof(entries));
+	ring.entries = entries;
+	va_start(args, format);
+	vsnprintf(expected, sizeof(expected), format, args);
+	va_end(args);
+	va_start(args, format);
+	Log_ringMessage(&ring, LOG_ERROR, 0, format, args);
+	va_end(args);
+	Log_formatRingMessage(&entries[0], formatted, sizeof(formatted));
+	TEST_EXPECT(i, strcmp(expected, formatted) == 0);
+	if (strcmp(expected, formatted) != 0)
+		fprintf(stderr, "\"%s\" gave \"%s\" not \"%s\"\n", format, formatted, expected);
+}
+
+int main(void)
+{
+	printfSpec spec;
+
+	TEST_EXPECT(0, Log_parseSpec("-08.3lld", &spec) == 1);
+	TEST_EXPECT(0, spec.length == LEN_LL && spec.precision == 3 && spec.stars == 0 && spec.conversion == 'd');
+	TEST_EXPECT(1, Log_parseSpec("*.*f", &spec) == 1);
+	TEST_EXPECT(1, spec.stars == 2 && spec.precision == -1 && spec.conversion == 'f');
+	TEST_EXPECT(2, Log_parseSpec("zu", &spec) == 1 && spec.length == LEN_Z && *spec.end == '\0');
+	TEST_EXPECT(3, Log_parseSpec("n", &spec) == 0);
+	TEST_EXPECT(4, Log_parseSpec("", &spec) == 0);
+
+	test_format(10, "no arguments");
+	test_format(11, "100%% of %d%%", 42);
+	test_format(12, "%d %i %u %x %X %o %c", -7, 7, 3000000000u, 255, 255, 8, 'q');
+	test_format(13, "%hhd %hd %hu", -3, -300, 65000);
+	test_format(14, "%ld %lu %lx", -123456789L, 123456789UL, 0xdeadUL);
+	test_format(15, "%lld %llu %llx", -1234567890123LL, 18446744073709551615ULL, 0x123456789abcULL);
+	test_format(16, "%zu %zd", (size_t)4096, (size_t)12);
+	test_format(17, "client %s, topic %s, rc %d", "client-1", "a/b/c", -1);
+	test_format(18, "[%10s] [%-10s] [%.3s] [%8.2s]", "right", "left", "truncated", "ab");
+	test_format(19, "[%*d] [%-*d] [%.*s]", 6, 42, 6, 42, 4, "precision");
+	test_format(20, "[%*.*s] [%.*s]", 8, 3, "abcdef", -1, "negative precision");
+	test_format(21, "[%*s] [%*d]", -6, "neg", -5, 1);
+	test_format(22, "[%05d] [%+d] [% d] [%#x] [%#o]", 42, 42, 42, 42, 8);
+	test_format(23, "%f %.2f %e %g %10.3f", 3.14159, 2.5, 12345.678, 0.0001, -1.5);
+	test_format(24, "%*.*f", 10, 4, 2.718281828);
+	test_format(25, "%s%s%s", "", "x", "");
+
+	printf("Log test %s\n", (fails == 0) ? "passed" : "failed");
+	return (int)fails;
+}
+#endif /* LOG_TEST */
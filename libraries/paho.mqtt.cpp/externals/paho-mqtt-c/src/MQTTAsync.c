@@ -39,6 +39,7 @@
  *    Ian Craggs - refactor to reduce module size
  *******************************************************************************/
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #if !defined(_WIN32) && !defined(_WIN64)
@@ -61,10 +62,12 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Slab.h"
 #include "OsWrapper.h"
 #include "WebSocket.h"
 
 static void MQTTAsync_freeServerURIs(MQTTAsyncs* m);
+static void MQTTAsync_freeShard(MQTTAsync_shard* shard);
 
 #include "VersionInfo.h"
 
@@ -72,9 +75,6 @@ const char *client_timestamp_eye = "MQTTAsyncV3_Timestamp " BUILD_TIMESTAMP;
 const char *client_version_eye = "MQTTAsyncV3_Version " CLIENT_VERSION;
 
 volatile int global_initialized = 0;
-List* MQTTAsync_handles = NULL;
-List* MQTTAsync_commands = NULL;
-int MQTTAsync_tostop = 0;
 
 static ClientStates ClientState =
 {
@@ -85,22 +85,17 @@ static ClientStates ClientState =
 MQTTProtocol state;
 ClientStates* bstate = &ClientState;
 
-enum MQTTAsync_threadStates sendThread_state = STOPPED;
-enum MQTTAsync_threadStates receiveThread_state = STOPPED;
-thread_id_type sendThread_id = 0,
-               receiveThread_id = 0;
+/* Shard i, for i > 0, created when first used, and the number of shards in use.  These,
+   the client count and global_initialized are protected by mqttregistry_mutex, which is
+   locked after any shard's mutex. */
+static MQTTAsync_shard* MQTTAsync_shards[MQTTASYNC_MAX_SHARDS];
+static int MQTTAsync_shardCount = 1;
+static unsigned int MQTTAsync_nextShard = 0; /* for assigning the shards in turn */
+static int MQTTAsync_clientCount = 0; /* clients in all the shards, or being created */
 
 // global objects init declaration
 int MQTTAsync_init(void);
 
-void MQTTAsync_global_init(MQTTAsync_init_options* inits)
-{
-	MQTTAsync_init();
-#if defined(OPENSSL)
-	SSLSocket_handleOpensslInit(inits->do_openssl_init);
-#endif
-}
-
 #if !defined(min)
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #endif
@@ -126,35 +121,43 @@ void MQTTAsync_init_rand(void)
 #endif
 
 #if defined(_WIN32) || defined(_WIN64)
-mutex_type mqttasync_mutex = NULL;
 mutex_type socket_mutex = NULL;
-mutex_type mqttcommand_mutex = NULL;
-sem_type send_sem = NULL;
+static mutex_type mqttregistry_mutex = NULL;
+MQTTAsync_shard MQTTAsync_defaultShard; /* its handles are created by MQTTAsync_init */
 #if !defined(NO_HEAP_TRACKING)
 extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 #endif
 extern mutex_type log_mutex;
+#if defined(SLAB_ALLOCATOR)
+extern mutex_type slab_mutex;
+#endif
 
 int MQTTAsync_init(void)
 {
 	DWORD rc = 0;
 
-	if (mqttasync_mutex == NULL)
+	if (MQTTAsync_defaultShard.mutex == NULL)
 	{
-		if ((mqttasync_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
+		if ((MQTTAsync_defaultShard.mutex = CreateMutex(NULL, 0, NULL)) == NULL)
 		{
 			rc = GetLastError();
 			printf("mqttasync_mutex error %d\n", rc);
 			goto exit;
 		}
-		if ((mqttcommand_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
+		if ((MQTTAsync_defaultShard.command_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
 		{
 			rc = GetLastError();
 			printf("mqttcommand_mutex error %d\n", rc);
 			goto exit;
 		}
-		if ((send_sem = CreateEvent(
+		if ((mqttregistry_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
+		{
+			rc = GetLastError();
+			printf("mqttregistry_mutex error %d\n", rc);
+			goto exit;
+		}
+		if ((MQTTAsync_defaultShard.sendSem = CreateEvent(
 				NULL,               /* default security attributes */
 				FALSE,              /* manual-reset event? */
 				FALSE,              /* initial state is nonsignaled */
@@ -185,12 +188,21 @@ int MQTTAsync_init(void)
 			printf("log_mutex error %d\n", rc);
 			goto exit;
 		}
+#if defined(SLAB_ALLOCATOR)
+		if ((slab_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
+		{
+			rc = GetLastError();
+			printf("slab_mutex error %d\n", rc);
+			goto exit;
+		}
+#endif
 		if ((socket_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
 		{
 			rc = GetLastError();
 			printf("socket_mutex error %d\n", rc);
 			goto exit;
 		}
+		MQTTAsync_defaultShard.socket_mutex = socket_mutex;
 	}
 	else
 	{
@@ -202,8 +214,8 @@ exit:
 
 void MQTTAsync_cleanup(void)
 {
-	if (send_sem)
-		CloseHandle(send_sem);
+	if (MQTTAsync_defaultShard.sendSem)
+		CloseHandle(MQTTAsync_defaultShard.sendSem);
 #if !defined(NO_HEAP_TRACKING)
 	if (stack_mutex)
 		CloseHandle(stack_mutex);
@@ -212,10 +224,18 @@ void MQTTAsync_cleanup(void)
 #endif
 	if (log_mutex)
 		CloseHandle(log_mutex);
+#if defined(SLAB_ALLOCATOR)
+	if (slab_mutex)
+		CloseHandle(slab_mutex);
+#endif
 	if (socket_mutex)
 		CloseHandle(socket_mutex);
-	if (mqttasync_mutex)
-		CloseHandle(mqttasync_mutex);
+	if (MQTTAsync_defaultShard.command_mutex)
+		CloseHandle(MQTTAsync_defaultShard.command_mutex);
+	if (mqttregistry_mutex)
+		CloseHandle(mqttregistry_mutex);
+	if (MQTTAsync_defaultShard.mutex)
+		CloseHandle(MQTTAsync_defaultShard.mutex);
 }
 
 #if defined(PAHO_MQTT_STATIC)
@@ -256,16 +276,24 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 
 #else
 static pthread_mutex_t mqttasync_mutex_store = PTHREAD_MUTEX_INITIALIZER;
-mutex_type mqttasync_mutex = &mqttasync_mutex_store;
 
 static pthread_mutex_t socket_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 mutex_type socket_mutex = &socket_mutex_store;
 
 static pthread_mutex_t mqttcommand_mutex_store = PTHREAD_MUTEX_INITIALIZER;
-mutex_type mqttcommand_mutex = &mqttcommand_mutex_store;
 
 static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
-cond_type send_cond = &send_cond_store;
+
+static pthread_mutex_t mqttregistry_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type mqttregistry_mutex = &mqttregistry_mutex_store;
+
+MQTTAsync_shard MQTTAsync_defaultShard =
+{
+	.mutex = &mqttasync_mutex_store,
+	.command_mutex = &mqttcommand_mutex_store,
+	.socket_mutex = &socket_mutex_store,
+	.sendCond = &send_cond_store
+};
 
 int MQTTAsync_init(void)
 {
@@ -278,15 +306,17 @@ int MQTTAsync_init(void)
 #else
 	/* #warning "no pthread_mutexattr_settype" */
 #endif
-	if ((rc = pthread_mutex_init(mqttasync_mutex, &attr)) != 0)
+	if ((rc = pthread_mutex_init(&mqttasync_mutex_store, &attr)) != 0)
 		printf("MQTTAsync: error %d initializing async_mutex\n", rc);
-	else if ((rc = pthread_mutex_init(mqttcommand_mutex, &attr)) != 0)
+	else if ((rc = pthread_mutex_init(&mqttcommand_mutex_store, &attr)) != 0)
 		printf("MQTTAsync: error %d initializing command_mutex\n", rc);
-	else if ((rc = pthread_mutex_init(socket_mutex, &attr)) != 0)
+	else if ((rc = pthread_mutex_init(&socket_mutex_store, &attr)) != 0)
 		printf("MQTTClient: error %d initializing socket_mutex\n", rc);
-	else if ((rc = pthread_cond_init(&send_cond->cond, NULL)) != 0)
+	else if ((rc = pthread_mutex_init(&mqttregistry_mutex_store, &attr)) != 0)
+		printf("MQTTAsync: error %d initializing registry_mutex\n", rc);
+	else if ((rc = pthread_cond_init(&send_cond_store.cond, NULL)) != 0)
 		printf("MQTTAsync: error %d initializing send_cond cond\n", rc);
-	else if ((rc = pthread_mutex_init(&send_cond->mutex, &attr)) != 0)
+	else if ((rc = pthread_mutex_init(&send_cond_store.mutex, &attr)) != 0)
 		printf("MQTTAsync: error %d initializing send_cond mutex\n", rc);
 
 	return rc;
@@ -294,18 +324,227 @@ int MQTTAsync_init(void)
 #endif
 
 
+void MQTTAsync_global_init(MQTTAsync_init_options* inits)
+{
+	MQTTAsync_init();
+#if defined(OPENSSL)
+	SSLSocket_handleOpensslInit(inits->do_openssl_init);
+#endif
+	if (inits->struct_version >= 1)
+	{
+		MQTTAsync_lock_mutex(mqttregistry_mutex);
+		if (inits->ioShards < 1 || inits->ioShards > MQTTASYNC_MAX_SHARDS)
+			Log(LOG_ERROR, -1, "ioShards must be from 1 to %d", MQTTASYNC_MAX_SHARDS);
+		else if (MQTTAsync_clientCount > 0 && inits->ioShards != MQTTAsync_shardCount)
+			Log(LOG_ERROR, -1, "ioShards can't be changed while there are clients");
+		else
+			MQTTAsync_shardCount = inits->ioShards;
+		MQTTAsync_unlock_mutex(mqttregistry_mutex);
+	}
+}
+
+
+/**
+ * Create one of the shards after the default one, with its own socket set and protocol state.
+ * @param index the index of the shard
+ * @return the shard, or NULL if it couldn't be created
+ */
+static MQTTAsync_shard* MQTTAsync_createShard(int index)
+{
+	MQTTAsync_shard* shard = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((shard = malloc(sizeof(MQTTAsync_shard))) == NULL)
+		goto exit;
+	memset(shard, '\0', sizeof(MQTTAsync_shard));
+	shard->index = index;
+	if ((shard->mutex = Paho_thread_create_mutex(&rc)) == NULL || rc != 0 ||
+		(shard->command_mutex = Paho_thread_create_mutex(&rc)) == NULL || rc != 0 ||
+		(shard->socket_mutex = Paho_thread_create_mutex(&rc)) == NULL || rc != 0 ||
+#if defined(_WIN32) || defined(_WIN64)
+		(shard->sendSem = Thread_create_sem(&rc)) == NULL || rc != 0 ||
+#else
+		(shard->sendCond = Thread_create_cond(&rc)) == NULL || rc != 0 ||
+#endif
+		(shard->sockets = malloc(sizeof(Sockets))) == NULL ||
+		(shard->buffers = malloc(sizeof(SocketBuffers))) == NULL ||
+		(shard->frames = malloc(sizeof(WebSocket_frames))) == NULL ||
+		(shard->protocol = malloc(sizeof(MQTTProtocol))) == NULL ||
+		(shard->clientstates = malloc(sizeof(ClientStates))) == NULL)
+	{
+		Log(LOG_ERROR, -1, "Error creating I/O shard %d", index);
+		MQTTAsync_freeShard(shard);
+		shard = NULL;
+		goto exit;
+	}
+	memset(shard->sockets, '\0', sizeof(Sockets));
+	memset(shard->buffers, '\0', sizeof(SocketBuffers));
+	memset(shard->frames, '\0', sizeof(WebSocket_frames));
+	memset(shard->protocol, '\0', sizeof(MQTTProtocol));
+	memset(shard->clientstates, '\0', sizeof(ClientStates));
+	shard->clientstates->version = bstate->version;
+exit:
+	FUNC_EXIT;
+	return shard;
+}
+
+
+/**
+ * Free a shard made by MQTTAsync_createShard, which has no clients and no threads running
+ * @param shard the shard
+ */
+static void MQTTAsync_freeShard(MQTTAsync_shard* shard)
+{
+	FUNC_ENTRY;
+	if (shard->mutex)
+		Paho_thread_destroy_mutex(shard->mutex);
+	if (shard->command_mutex)
+		Paho_thread_destroy_mutex(shard->command_mutex);
+	if (shard->socket_mutex)
+		Paho_thread_destroy_mutex(shard->socket_mutex);
+#if defined(_WIN32) || defined(_WIN64)
+	if (shard->sendSem)
+		Thread_destroy_sem(shard->sendSem);
+#else
+	if (shard->sendCond)
+		Thread_destroy_cond(shard->sendCond);
+#endif
+	if (shard->sockets)
+		free(shard->sockets);
+	if (shard->buffers)
+		free(shard->buffers);
+	if (shard->frames)
+		free(shard->frames);
+	if (shard->protocol)
+		free(shard->protocol);
+	if (shard->clientstates)
+		free(shard->clientstates);
+	free(shard);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Choose the shard for a new client, initializing the library first if need be, and count
+ * the client so that the library is not terminated while it is being created.
+ * @param options the create options, or NULL
+ * @return the shard, or NULL if it couldn't be created
+ */
+static MQTTAsync_shard* MQTTAsync_assignShard(MQTTAsync_createOptions* options)
+{
+	MQTTAsync_shard* shard = NULL;
+	int index = 0;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttregistry_mutex);
+	if (!global_initialized)
+	{
+		#if !defined(NO_HEAP_TRACKING)
+			Heap_initialize();
+		#endif
+		Log_initialize((Log_nameValue*)MQTTAsync_getVersionInfo());
+		Socket_setWriteContinueCallback(MQTTAsync_writeContinue);
+		Socket_setWriteCompleteCallback(MQTTAsync_writeComplete);
+		Socket_setWriteAvailableCallback(MQTTProtocol_writeAvailable);
+#if defined(OPENSSL)
+		SSLSocket_initialize();
+#endif
+		global_initialized = 1;
+	}
+
+	if (options && options->struct_version >= 7 && options->eventLoop)
+		index = -1;
+	else if (options && options->struct_version >= 6 && options->shard >= 0)
+		index = options->shard % MQTTAsync_shardCount;
+	else if (MQTTAsync_inCallback())
+		index = MQTTAsync_currentShard()->index;
+	else
+		index = (int)(MQTTAsync_nextShard++ % (unsigned int)MQTTAsync_shardCount);
+
+	if (index == -1)
+	{
+		/* a shard of its own, outside the pool, freed when the client is destroyed */
+		if ((shard = MQTTAsync_createShard(index)) != NULL)
+			shard->eventLoop = 1;
+	}
+	else if (index == 0)
+		shard = &MQTTAsync_defaultShard;
+	else
+	{
+		if (MQTTAsync_shards[index] == NULL)
+			MQTTAsync_shards[index] = MQTTAsync_createShard(index);
+		shard = MQTTAsync_shards[index];
+	}
+	if (shard)
+		++MQTTAsync_clientCount;
+	MQTTAsync_unlock_mutex(mqttregistry_mutex);
+	FUNC_EXIT;
+	return shard;
+}
+
+
+/**
+ * Uncount a client which has been destroyed, or failed to be created.  When there are no
+ * clients left, free the process wide state, and the shards whose threads have stopped.
+ * @param destroyed whether a client has been destroyed, rather than failed to be created
+ */
+static void MQTTAsync_releaseShard(int destroyed)
+{
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttregistry_mutex);
+	if (--MQTTAsync_clientCount == 0 && destroyed && global_initialized)
+	{
+		int i;
+
+		for (i = 1; i < MQTTASYNC_MAX_SHARDS; ++i)
+		{
+			MQTTAsync_shard* shard = MQTTAsync_shards[i];
+
+			if (shard && !shard->initialized &&
+					shard->sendThreadState == STOPPED && shard->receiveThreadState == STOPPED)
+			{
+				MQTTAsync_freeShard(shard);
+				MQTTAsync_shards[i] = NULL;
+			}
+		}
+#if defined(OPENSSL)
+		SSLSocket_terminate();
+#endif
+		/* the slab chunks are kept for the next client, as the shard threads are not joined,
+		   and one which has just stopped could still free a block into them */
+		#if !defined(NO_HEAP_TRACKING)
+			Heap_terminate();
+		#endif
+		Log_terminate();
+		global_initialized = 0;
+	}
+	MQTTAsync_unlock_mutex(mqttregistry_mutex);
+	FUNC_EXIT;
+}
+
+
 int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const char* clientId,
 		int persistence_type, void* persistence_context,  MQTTAsync_createOptions* options)
 {
 	int rc = 0;
 	MQTTAsyncs *m = NULL;
+	MQTTAsync_shard* shard = NULL;
+	int listed = 0;
+	int i;
 
 #if (defined(_WIN32) || defined(_WIN64)) && defined(PAHO_MQTT_STATIC)
 	 /* intializes mutexes once.  Must come before FUNC_ENTRY */
 	BOOL bStatus = InitOnceExecuteOnce(&g_InitOnce, InitMutexesOnce, NULL, NULL);
 #endif
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((shard = MQTTAsync_assignShard(options)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit_unlocked;
+	}
+	if ((rc = MQTTAsync_lockShard(shard)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (serverURI == NULL || clientId == NULL)
 	{
@@ -319,7 +558,8 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		goto exit;
 	}
 
-	if (strlen(clientId) == 0 && persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT)
+	if (strlen(clientId) == 0 && (persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT ||
+		persistence_type == MQTTCLIENT_PERSISTENCE_LOG))
 	{
 		rc = MQTTASYNC_PERSISTENCE_ERROR;
 		goto exit;
@@ -352,29 +592,21 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 	}
 
 	if (options && (strncmp(options->struct_id, "MQCO", 4) != 0 ||
-					options->struct_version < 0 || options->struct_version > 3))
+					options->struct_version < 0 || options->struct_version > 7))
 	{
 		rc = MQTTASYNC_BAD_STRUCTURE;
 		goto exit;
 	}
 
-	if (!global_initialized)
+	if (!shard->initialized)
 	{
-		#if !defined(NO_HEAP_TRACKING)
-			Heap_initialize();
-		#endif
-		Log_initialize((Log_nameValue*)MQTTAsync_getVersionInfo());
-		bstate->clients = ListInitialize();
+		MQTTProtocol_getClients()->clients = ListInitialize();
 		Socket_outInitialize();
-		Socket_setWriteContinueCallback(MQTTAsync_writeContinue);
-		Socket_setWriteCompleteCallback(MQTTAsync_writeComplete);
-		Socket_setWriteAvailableCallback(MQTTProtocol_writeAvailable);
 		MQTTAsync_handles = ListInitialize();
-		MQTTAsync_commands = ListInitialize();
-#if defined(OPENSSL)
-		SSLSocket_initialize();
-#endif
-		global_initialized = 1;
+		MQTTAsync_commands = ListInitializeIntrusive(offsetof(MQTTAsync_queuedCommand, link));
+		MQTTAsync_discarded = ListInitializeIntrusive(offsetof(MQTTAsync_queuedCommand, link));
+		TimerWheel_initialize(&MQTTAsync_timers);
+		shard->initialized = 1;
 	}
 	if ((m = malloc(sizeof(MQTTAsyncs))) == NULL)
 	{
@@ -383,6 +615,13 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 	}
 	*handle = m;
 	memset(m, '\0', sizeof(MQTTAsyncs));
+	m->shard = shard;
+	if ((m->client_mutex = Paho_thread_create_mutex(&rc)) == NULL || rc != 0)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	MQTTAsync_initTimers(m);
 	if (strncmp(URI_TCP, serverURI, strlen(URI_TCP)) == 0)
 		serverURI += strlen(URI_TCP);
 	else if (strncmp(URI_MQTT, serverURI, strlen(URI_MQTT)) == 0)
@@ -422,8 +661,13 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
 	}
-	m->responses = ListInitialize();
+	m->responses = ListInitializeIntrusive(offsetof(MQTTAsync_queuedCommand, link));
+	for (i = 0; i < MQTTASYNC_LANES; ++i)
+		m->lanes[i] = ListInitializeIntrusive(offsetof(MQTTAsync_queuedCommand, buffer_link));
+	m->controls = ListInitializeIntrusive(offsetof(MQTTAsync_queuedCommand, buffer_link));
+	m->coalesced = TreeInitialize(MQTTAsync_coalesceCompare);
 	ListAppend(MQTTAsync_handles, m, sizeof(MQTTAsyncs));
+	listed = 1; /* now uncounted when it is destroyed */
 
 	if ((m->c = malloc(sizeof(Clients))) == NULL)
 	{
@@ -432,8 +676,8 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 	}
 	memset(m->c, '\0', sizeof(Clients));
 	m->c->context = m;
-	m->c->outboundMsgs = ListInitialize();
-	m->c->inboundMsgs = ListInitialize();
+	m->c->outboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
+	m->c->inboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
 	m->c->messageQueue = ListInitialize();
 	m->c->outboundQueue = ListInitialize();
 	m->c->clientID = MQTTStrdup(clientId);
@@ -456,6 +700,11 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		memcpy(m->createOptions, options, sizeof(MQTTAsync_createOptions));
 		if (options->struct_version > 0)
 			m->c->MQTTVersion = options->MQTTVersion;
+		if (options->struct_version >= 4 && options->coalesceBytes > 0)
+		{
+			m->c->net.writebuf.limit = (size_t)options->coalesceBytes;
+			m->c->net.writebuf.delay_us = (options->coalesceDelayUs > 0) ? options->coalesceDelayUs : 0;
+		}
 	}
 
 #if !defined(NO_PERSISTENCE)
@@ -474,11 +723,21 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 			}
 		}
 	}
+	m->commandIndexTime = MQTTTime_start_clock();
 #endif
-	ListAppend(bstate->clients, m->c, sizeof(Clients) + 3*sizeof(List));
+	ListAppend(MQTTProtocol_getClients()->clients, m->c, sizeof(Clients) + 3*sizeof(List));
 
 exit:
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	if (rc != MQTTASYNC_SUCCESS && !listed && shard->eventLoop && shard->initialized)
+		MQTTAsync_terminate();
+	MQTTAsync_unlockClient();
+	if (rc != MQTTASYNC_SUCCESS && !listed)
+	{
+		if (shard->eventLoop)
+			MQTTAsync_freeShard(shard);
+		MQTTAsync_releaseShard(0);
+	}
+exit_unlocked:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -497,19 +756,50 @@ int MQTTAsync_create(MQTTAsync* handle, const char* serverURI, const char* clien
 void MQTTAsync_destroy(MQTTAsync* handle)
 {
 	MQTTAsyncs* m = *handle;
+	MQTTAsync_shard* eventLoop = NULL;
+	int destroyed = 0;
+	int i;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if (MQTTAsync_lockClient(m) != MQTTASYNC_SUCCESS)
+	{
+		Log(LOG_ERROR, -1, "A client can't be destroyed in a callback of another shard");
+		goto exit;
+	}
 
 	if (m == NULL)
 		goto exit;
 
+	if (m->shard->eventLoop)
+	{
+		if (MQTTAsync_inCallback())
+		{
+			Log(LOG_ERROR, -1, "A client with an event loop can't be destroyed in its own callbacks");
+			goto exit;
+		}
+		eventLoop = m->shard;
+	}
+
 	MQTTAsync_closeSession(m->c, MQTTREASONCODE_SUCCESS, NULL);
+	MQTTAsync_cancelTimers(m);
 
 	MQTTAsync_NULLPublishResponses(m);
 	MQTTAsync_freeResponses(m);
+#if !defined(NO_PERSISTENCE)
+	if (m->c && m->c->persistence)
+	{
+		/* so that the next create can restore the queued commands without reading them all */
+		MQTTAsync_lock_mutex(mqttcommand_mutex);
+		MQTTAsync_persistCommandIndex(m);
+		MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	}
+#endif
 	MQTTAsync_freeCommands(m);
 	ListFree(m->responses);
+	for (i = 0; i < MQTTASYNC_LANES; ++i)
+		ListFreeNoContent(m->lanes[i]);
+	ListFreeNoContent(m->controls);
+	TreeFree(m->coalesced);
 
 	if (m->c)
 	{
@@ -520,7 +810,7 @@ void MQTTAsync_destroy(MQTTAsync* handle)
 #endif
 		MQTTAsync_emptyMessageQueue(m->c);
 		MQTTProtocol_freeClient(m->c);
-		if (!ListRemove(bstate->clients, m->c))
+		if (!ListRemove(MQTTProtocol_getClients()->clients, m->c))
 			Log(LOG_ERROR, 0, NULL);
 		else
 			Log(TRACE_MIN, 1, NULL, saved_clientid, saved_socket);
@@ -544,14 +834,24 @@ void MQTTAsync_destroy(MQTTAsync* handle)
 		free(m->willProps);
 		m->willProps = NULL;
 	}
+	if (m->client_mutex)
+		Paho_thread_destroy_mutex(m->client_mutex);
 	if (!ListRemove(MQTTAsync_handles, m))
 		Log(LOG_ERROR, -1, "free error");
+	else
+		destroyed = 1;
 	*handle = NULL;
-	if (bstate->clients->count == 0)
+	if (MQTTProtocol_getClients()->clients->count == 0)
 		MQTTAsync_terminate();
 
 exit:
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_unlockClient();
+	if (destroyed)
+	{
+		if (eventLoop)
+			MQTTAsync_freeShard(eventLoop);
+		MQTTAsync_releaseShard(1);
+	}
 	FUNC_EXIT;
 }
 
@@ -561,17 +861,17 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	MQTTAsyncs* m = handle;
 	int rc = MQTTASYNC_SUCCESS;
 	MQTTAsync_queuedCommand* conn;
-	thread_id_type thread_id = 0;
-	int locked = 0;
 
 	FUNC_ENTRY;
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 	if (options == NULL)
 	{
 		rc = MQTTASYNC_NULL_PARAMETER;
 		goto exit;
 	}
 
-	if (strncmp(options->struct_id, "MQTC", 4) != 0 || options->struct_version < 0 || options->struct_version > 8)
+	if (strncmp(options->struct_id, "MQTC", 4) != 0 || options->struct_version < 0 || options->struct_version > 10)
 	{
 		rc = MQTTASYNC_BAD_STRUCTURE;
 		goto exit;
@@ -656,35 +956,31 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	m->connect.context = options->context;
 	m->connectTimeout = options->connectTimeout;
 
-	/* don't lock async mutex if we are being called from a callback */
-	thread_id = Paho_thread_getid();
-	if (thread_id != sendThread_id && thread_id != receiveThread_id)
-	{
-		MQTTAsync_lock_mutex(mqttasync_mutex);
-		locked = 1;
-	}
 	MQTTAsync_tostop = 0;
-	if (sendThread_state != STARTING && sendThread_state != RUNNING)
+	if (!m->shard->eventLoop) /* otherwise the I/O is run by the application, with MQTTAsync_runOnce */
 	{
-		sendThread_state = STARTING;
-		Paho_thread_start(MQTTAsync_sendThread, NULL);
-	}
-	if (receiveThread_state != STARTING && receiveThread_state != RUNNING)
-	{
-		receiveThread_state = STARTING;
-		Paho_thread_start(MQTTAsync_receiveThread, handle);
+		if (sendThread_state != STARTING && sendThread_state != RUNNING)
+		{
+			sendThread_state = STARTING;
+			Paho_thread_start(MQTTAsync_sendThread, m->shard);
+		}
+		if (receiveThread_state != STARTING && receiveThread_state != RUNNING)
+		{
+			receiveThread_state = STARTING;
+			Paho_thread_start(MQTTAsync_receiveThread, m->shard);
+		}
 	}
-	if (locked)
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
 
 	m->c->keepAliveInterval = m->c->savedKeepAliveInterval = options->keepAliveInterval;
 	setRetryLoopInterval(options->keepAliveInterval);
 	m->c->cleansession = options->cleansession;
 	m->c->maxInflightMessages = options->maxInflight;
+	MQTTAsync_lock_mutex(m->client_mutex);
 	if (options->struct_version >= 3)
 		m->c->MQTTVersion = options->MQTTVersion;
 	else
 		m->c->MQTTVersion = MQTTVERSION_DEFAULT;
+	MQTTAsync_unlock_mutex(m->client_mutex);
 	if (options->struct_version >= 4)
 	{
 		m->automaticReconnect = options->automaticReconnect;
@@ -702,6 +998,8 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 		if (options->httpsProxy)
 			m->c->httpsProxy = MQTTStrdup(options->httpsProxy);
 	}
+	m->c->outboundTopicAliasMaximum = (options->struct_version >= 9) ? options->outboundTopicAliasMaximum : 0;
+	m->c->inflightTargetRTT = (options->struct_version >= 10) ? options->inflightTargetRTT : 0;
 
 	if (m->c->will)
 	{
@@ -854,7 +1152,9 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	}
 
 	m->c->retryInterval = options->retryInterval;
+	MQTTAsync_lock_mutex(m->client_mutex);
 	m->shouldBeConnected = 1;
+	MQTTAsync_unlock_mutex(m->client_mutex);
 
 	m->connectTimeout = options->connectTimeout;
 
@@ -920,7 +1220,7 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	}
 
 	/* Add connect request to operation queue */
-	if ((conn = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((conn = Slab_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -940,6 +1240,7 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	rc = MQTTAsync_addCommand(conn, sizeof(conn));
 
 exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -951,7 +1252,9 @@ int MQTTAsync_reconnect(MQTTAsync handle)
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
+	rc = MQTTASYNC_FAILURE;
 
 	if (m->automaticReconnect)
 	{
@@ -961,13 +1264,14 @@ int MQTTAsync_reconnect(MQTTAsync handle)
 			m->currentIntervalBase = m->minRetryInterval;
 			m->currentInterval = m->minRetryInterval;
 			m->retrying = 1;
+			MQTTAsync_armTimers(m);
 			rc = MQTTASYNC_SUCCESS;
 		}
 	}
 	else
 	{
 		/* to reconnect, put the connect command to the head of the command queue */
-		MQTTAsync_queuedCommand* conn = malloc(sizeof(MQTTAsync_queuedCommand));
+		MQTTAsync_queuedCommand* conn = Slab_malloc(sizeof(MQTTAsync_queuedCommand));
 		if (!conn)
 		{
 			rc = PAHO_MEMORY_ERROR;
@@ -983,7 +1287,7 @@ int MQTTAsync_reconnect(MQTTAsync handle)
 	}
 
 exit:
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1005,8 +1309,8 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, con
 	int msgid = 0;
 
 	FUNC_ENTRY;
-	if (!MQTTAsync_inCallback())
-		MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 	if (m == NULL || m->c == NULL)
 		rc = MQTTASYNC_FAILURE;
 	else if (m->c->connected == 0)
@@ -1048,7 +1352,7 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, con
 		goto exit;
 
 	/* Add subscribe request to operation queue */
-	if ((sub = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((sub = Slab_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -1110,8 +1414,7 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, con
 		rc = PAHO_MEMORY_ERROR;
 
 exit:
-	if (!MQTTAsync_inCallback())
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1136,8 +1439,8 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
 	int msgid = 0;
 
 	FUNC_ENTRY;
-	if (!MQTTAsync_inCallback())
-		MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 	if (m == NULL || m->c == NULL)
 		rc = MQTTASYNC_FAILURE;
 	else if (m->c->connected == 0)
@@ -1171,7 +1474,7 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
 		goto exit;
 
 	/* Add unsubscribe request to operation queue */
-	if ((unsub = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((unsub = Slab_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -1202,8 +1505,7 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
 	rc = MQTTAsync_addCommand(unsub, sizeof(unsub));
 
 exit:
-	if (!MQTTAsync_inCallback())
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1226,19 +1528,43 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 	MQTTAsyncs* m = handle;
 	MQTTAsync_queuedCommand* pub;
 	int msgid = 0;
+	int shard_locked = 0;
+	int connected = 0;
+	int shouldBeConnected = 0;
+	int MQTTVersion = 0;
 
 	FUNC_ENTRY;
-	if (!MQTTAsync_inCallback())
-		MQTTAsync_lock_mutex(mqttasync_mutex);
 	if (m == NULL || m->c == NULL)
+	{
 		rc = MQTTASYNC_FAILURE;
-	else if (m->c->connected == 0)
+		goto exit_unlocked;
+	}
+	/* Only the client's own mutex and the command queue are needed to publish, so publishing
+	   threads don't wait on the shard's I/O threads handling other clients.  In a callback the
+	   shard is held anyway, and a persistence store isn't taken to be thread safe, so then
+	   the shard is locked as for other calls. */
+	if (MQTTAsync_inCallback() || m->c->persistence)
+	{
+		shard_locked = 1;
+		if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+			goto exit;
+	}
+	else
+		MQTTAsync_bindShard(m->shard);
+
+	MQTTAsync_lock_mutex(m->client_mutex);
+	connected = m->c->connected;
+	shouldBeConnected = m->shouldBeConnected;
+	MQTTVersion = m->c->MQTTVersion;
+	MQTTAsync_unlock_mutex(m->client_mutex);
+
+	if (connected == 0)
 	{
 		if (m->createOptions == NULL)
 			rc = MQTTASYNC_DISCONNECTED;
 		else if (m->createOptions->sendWhileDisconnected == 0)
 			rc = MQTTASYNC_DISCONNECTED;
-		else if (m->shouldBeConnected == 0 && (m->createOptions->struct_version < 2 || m->createOptions->allowDisconnectedSendAtAnyTime == 0))
+		else if (shouldBeConnected == 0 && (m->createOptions->struct_version < 2 || m->createOptions->allowDisconnectedSendAtAnyTime == 0))
 			rc = MQTTASYNC_DISCONNECTED;
 	}
 
@@ -1251,18 +1577,14 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 		rc = MQTTASYNC_BAD_QOS;
 	else if (qos > 0 && (msgid = MQTTAsync_assignMsgId(m)) == 0)
 		rc = MQTTASYNC_NO_MORE_MSGIDS;
-	else if (m->createOptions &&
-			(m->createOptions->struct_version < 2 || m->createOptions->deleteOldestMessages == 0) &&
-			(MQTTAsync_getNoBufferedMessages(m) >= m->createOptions->maxBufferedMessages))
-		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
 	else if (response)
 	{
-		if (m->c->MQTTVersion >= MQTTVERSION_5)
+		if (MQTTVersion >= MQTTVERSION_5)
 		{
 			if (response->struct_version == 0 || response->onFailure || response->onSuccess)
 				rc = MQTTASYNC_BAD_MQTT_OPTION;
 		}
-		else if (m->c->MQTTVersion < MQTTVERSION_5)
+		else if (MQTTVersion < MQTTVERSION_5)
 		{
 			if (response->struct_version >= 1 && (response->onFailure5 || response->onSuccess5))
 				rc = MQTTASYNC_BAD_MQTT_OPTION;
@@ -1273,7 +1595,7 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 		goto exit;
 
 	/* Add publish request to operation queue */
-	if ((pub = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((pub = Slab_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -1282,19 +1604,32 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 	pub->client = m;
 	pub->command.type = PUBLISH;
 	pub->command.token = msgid;
+	pub->lane = MQTTASYNC_LANE_NORMAL;
 	if (response)
 	{
+		if (response->struct_version >= 2)
+			pub->lane = (response->priority > MQTTASYNC_PRIORITY_NORMAL) ? 0 :
+				(response->priority < MQTTASYNC_PRIORITY_NORMAL) ? MQTTASYNC_LANES - 1 : MQTTASYNC_LANE_NORMAL;
 		pub->command.onSuccess = response->onSuccess;
 		pub->command.onFailure = response->onFailure;
 		pub->command.onSuccess5 = response->onSuccess5;
 		pub->command.onFailure5 = response->onFailure5;
 		pub->command.context = response->context;
 		response->token = pub->command.token;
-		if (m->c->MQTTVersion >= MQTTVERSION_5)
+		if (MQTTVersion >= MQTTVERSION_5)
 			pub->command.properties = MQTTProperties_copy(&response->properties);
+		if (response->struct_version >= 3 && response->coalesceKey &&
+				(pub->coalesce_key = MQTTStrdup(response->coalesceKey)) == NULL)
+		{
+			MQTTProperties_free(&pub->command.properties);
+			free(pub);
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
 	}
 	if ((pub->command.details.pub.destinationName = MQTTStrdup(destinationName)) == NULL)
 	{
+		free(pub->coalesce_key);
 		free(pub);
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -1303,6 +1638,7 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 	if ((pub->command.details.pub.payload = malloc(payloadlen)) == NULL)
 	{
 		free(pub->command.details.pub.destinationName);
+		free(pub->coalesce_key);
 		free(pub);
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -1313,8 +1649,11 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 	rc = MQTTAsync_addCommand(pub, sizeof(pub));
 
 exit:
-	if (!MQTTAsync_inCallback())
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
+	if (shard_locked)
+		MQTTAsync_unlockClient();
+	else
+		MQTTAsync_bindShard(NULL);
+exit_unlocked:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1350,19 +1689,66 @@ exit:
 }
 
 
+int MQTTAsync_sendMany(MQTTAsync handle, int count, char* const* destinationNames,
+		const MQTTAsync_message* msgs, MQTTAsync_responseOptions* responses, int* accepted)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	int batch = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if (accepted)
+		*accepted = 0;
+	if (m == NULL || m->c == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	if (count < 0 || (count > 0 && (destinationNames == NULL || msgs == NULL)))
+	{
+		rc = MQTTASYNC_NULL_PARAMETER;
+		goto exit;
+	}
+
+	/* the commands persisted for the messages are synced together, once they are all written */
+	if ((rc = MQTTAsync_lockClient(m)) == MQTTASYNC_SUCCESS)
+		batch = (MQTTPersistence_beginBatch(m->c) == 0);
+	MQTTAsync_unlockClient();
+
+	for (i = 0; rc == MQTTASYNC_SUCCESS && i < count; ++i)
+	{
+		rc = MQTTAsync_sendMessage(handle, destinationNames[i], &msgs[i], responses ? &responses[i] : NULL);
+		if (rc == MQTTASYNC_SUCCESS && accepted)
+			++(*accepted);
+	}
+
+	if (batch)
+	{
+		MQTTAsync_lockClient(m); /* which succeeded for the same client before */
+		if (MQTTPersistence_endBatch(m->c) != 0 && rc == MQTTASYNC_SUCCESS)
+			rc = MQTTASYNC_PERSISTENCE_ERROR;
+		MQTTAsync_unlockClient();
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 int MQTTAsync_disconnect(MQTTAsync handle, const MQTTAsync_disconnectOptions* options)
 {
 	int rc = 0;
 
 	FUNC_ENTRY;
-	if (!MQTTAsync_inCallback())
-		MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(handle)) != MQTTASYNC_SUCCESS)
+		goto exit;
 	if (options != NULL && (strncmp(options->struct_id, "MQTD", 4) != 0 || options->struct_version < 0 || options->struct_version > 1))
 		rc = MQTTASYNC_BAD_STRUCTURE;
 	else
 		rc = MQTTAsync_disconnect1(handle, options, 0);
-	if (!MQTTAsync_inCallback())
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1374,10 +1760,140 @@ int MQTTAsync_isConnected(MQTTAsync handle)
 	int rc = 0;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
-	if (m && m->c)
+	if (MQTTAsync_lockClient(m) == MQTTASYNC_SUCCESS && m && m->c)
 		rc = m->c->connected;
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_unlockClient();
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_getInflightWindow(MQTTAsync handle, int* window, int* rtt)
+{
+	MQTTAsyncs* m = handle;
+	int rc = MQTTASYNC_SUCCESS;
+
+	FUNC_ENTRY;
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
+	if (m == NULL || m->c == NULL || window == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	*window = (m->c->connected) ? MQTTProtocol_inflightLimit(m->c) : m->c->maxInflightMessages;
+	if (rtt)
+		*rtt = (m->c->inflightTargetRTT > 0) ? (int)m->c->inflightRTT : 0;
+exit:
+	MQTTAsync_unlockClient();
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_getShard(MQTTAsync handle)
+{
+	MQTTAsyncs* m = handle;
+	int rc = MQTTASYNC_FAILURE;
+
+	FUNC_ENTRY;
+	if (m && m->shard)
+		rc = m->shard->index; /* which never changes */
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_getLoopSocket(MQTTAsync handle, int* wantWrite)
+{
+	MQTTAsyncs* m = handle;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	if (wantWrite)
+		*wantWrite = 0;
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
+	rc = -1;
+	if (m == NULL || m->c == NULL)
+		goto exit;
+	if (!m->shard->eventLoop)
+		rc = MQTTASYNC_NOT_EVENT_LOOP;
+	else if (m->c->net.socket > 0)
+	{
+		rc = (int)m->c->net.socket;
+		if (wantWrite)
+		{
+			MQTTAsync_lock_mutex(m->shard->socket_mutex);
+			*wantWrite = Socket_wantsWrite(m->c->net.socket);
+			MQTTAsync_unlock_mutex(m->shard->socket_mutex);
+		}
+	}
+exit:
+	MQTTAsync_unlockClient();
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_getLoopTimeout(MQTTAsync handle)
+{
+	MQTTAsyncs* m = handle;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
+	if (m == NULL)
+		rc = MQTTASYNC_FAILURE;
+	else if (!m->shard->eventLoop)
+		rc = MQTTASYNC_NOT_EVENT_LOOP;
+	else
+		rc = MQTTAsync_loopTimeout();
+exit:
+	MQTTAsync_unlockClient();
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_runOnce(MQTTAsync handle, int timeout)
+{
+	MQTTAsyncs* m = handle;
+	MQTTAsync_shard* shard = NULL;
+	int rc = MQTTASYNC_SUCCESS;
+
+	FUNC_ENTRY;
+	if (m == NULL || m->shard == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	shard = m->shard;
+	if (!shard->eventLoop)
+	{
+		rc = MQTTASYNC_NOT_EVENT_LOOP;
+		goto exit;
+	}
+	if (MQTTAsync_inCallback())
+	{
+		rc = MQTTASYNC_WRONG_SHARD; /* the loop can't be run from inside a callback */
+		goto exit;
+	}
+
+	MQTTAsync_bindShard(shard);
+	MQTTAsync_lock_mutex(shard->mutex);
+	/* this thread stands in for the I/O threads, so the API knows when it is in a callback */
+	shard->sendThreadId = shard->receiveThreadId = Paho_thread_getid();
+	MQTTAsync_unlock_mutex(shard->mutex);
+
+	MQTTAsync_runLoop((timeout > 0) ? timeout : 0);
+
+	MQTTAsync_lock_mutex(shard->mutex);
+	shard->sendThreadId = shard->receiveThreadId = 0;
+	MQTTAsync_unlock_mutex(shard->mutex);
+	MQTTAsync_bindShard(NULL);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1390,7 +1906,8 @@ int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
 	ListElement* current = NULL;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL)
 	{
@@ -1398,15 +1915,19 @@ int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
 		goto exit;
 	}
 
-	/* First check unprocessed commands */
+	/* First check unprocessed commands, which publishing threads change under mqttcommand_mutex only */
 	current = NULL;
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
 	while (ListNextElement(MQTTAsync_commands, &current))
 	{
 		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
 
 		if (cmd->client == m && cmd->command.token == dt)
-			goto exit;
+			break;
 	}
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	if (current)
+		goto exit;
 
 	/* Now check the inflight messages */
 	if (m->c && m->c->outboundMsgs->count > 0)
@@ -1422,7 +1943,7 @@ int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
 	rc = MQTTASYNC_TRUE; /* Can't find it, so it must be complete */
 
 exit:
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1436,21 +1957,26 @@ int MQTTAsync_waitForCompletion(MQTTAsync handle, MQTTAsync_token dt, unsigned l
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_unlockClient();
+		goto exit;
+	}
+	rc = MQTTASYNC_FAILURE;
 
 	if (m == NULL || m->c == NULL)
 	{
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
+		MQTTAsync_unlockClient();
 		rc = MQTTASYNC_FAILURE;
 		goto exit;
 	}
 	if (m->c->connected == 0)
 	{
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
+		MQTTAsync_unlockClient();
 		rc = MQTTASYNC_DISCONNECTED;
 		goto exit;
 	}
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_unlockClient();
 
 	if (MQTTAsync_isComplete(handle, dt) == 1)
 	{
@@ -1464,10 +1990,10 @@ int MQTTAsync_waitForCompletion(MQTTAsync handle, MQTTAsync_token dt, unsigned l
 		MQTTTime_sleep(100);
 		if (MQTTAsync_isComplete(handle, dt) == 1)
 			rc = MQTTASYNC_SUCCESS; /* well we couldn't find it */
-		MQTTAsync_lock_mutex(mqttasync_mutex);
+		MQTTAsync_lockClient(m); /* which succeeded for the same client before */
 		if (m->c->connected == 0)
 			rc = MQTTASYNC_DISCONNECTED;
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
+		MQTTAsync_unlockClient();
 		elapsed = MQTTTime_elapsed(start);
 	}
 exit:
@@ -1482,11 +2008,16 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 	MQTTAsyncs* m = handle;
 	ListElement* current = NULL;
 	int count = 0;
+	int i;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
-	MQTTAsync_lock_mutex(mqttcommand_mutex);
 	*tokens = NULL;
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_unlockClient();
+		goto exit_unlocked;
+	}
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
 
 	if (m == NULL)
 	{
@@ -1494,14 +2025,8 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 		goto exit;
 	}
 
-	/* calculate the number of pending tokens - commands plus inflight */
-	while (ListNextElement(MQTTAsync_commands, &current))
-	{
-		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
-
-		if (cmd->client == m && cmd->command.type == PUBLISH)
-			count++;
-	}
+	/* calculate the number of pending tokens - buffered publish commands plus inflight */
+	count = m->noBufferedMessages;
 	if (m->c)
 		count += m->c->outboundMsgs->count;
 	if (count == 0)
@@ -1516,12 +2041,15 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 	/* First add the unprocessed commands to the pending tokens */
 	current = NULL;
 	count = 0;
-	while (ListNextElement(MQTTAsync_commands, &current))
+	for (i = 0; i < MQTTASYNC_LANES; ++i)
 	{
-		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+		current = NULL;
+		while (ListNextElement(m->lanes[i], &current))
+		{
+			MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
 
-		if (cmd->client == m  && cmd->command.type == PUBLISH)
 			(*tokens)[count++] = cmd->command.token;
+		}
 	}
 
 	/* Now add the inflight messages */
@@ -1538,7 +2066,32 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 
 exit:
 	MQTTAsync_unlock_mutex(mqttcommand_mutex);
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_unlockClient();
+exit_unlocked:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_getBufferStats(MQTTAsync handle, MQTTAsync_bufferStats* stats)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+
+	FUNC_ENTRY;
+	if (m == NULL || stats == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	MQTTAsync_lock_mutex(m->shard->command_mutex);
+	stats->bufferedMessages = m->noBufferedMessages;
+	stats->bufferedBytes = (unsigned long)m->bufferedBytes;
+	stats->droppedMessages = m->droppedMessages;
+	stats->droppedBytes = m->droppedBytes;
+	stats->spilledMessages = m->spilledMessages;
+	MQTTAsync_unlock_mutex(m->shard->command_mutex);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1553,7 +2106,8 @@ int MQTTAsync_setCallbacks(MQTTAsync handle, void* context,
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL || ma == NULL || m->c == NULL || m->c->connect_state != NOT_IN_PROGRESS)
 		rc = MQTTASYNC_FAILURE;
@@ -1565,7 +2119,8 @@ int MQTTAsync_setCallbacks(MQTTAsync handle, void* context,
 		m->dc = dc;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1577,7 +2132,8 @@ int MQTTAsync_setConnectionLostCallback(MQTTAsync handle, void* context,
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL || m->c->connect_state != 0)
 		rc = MQTTASYNC_FAILURE;
@@ -1587,7 +2143,8 @@ int MQTTAsync_setConnectionLostCallback(MQTTAsync handle, void* context,
 		m->cl = cl;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1600,7 +2157,8 @@ int MQTTAsync_setMessageArrivedCallback(MQTTAsync handle, void* context,
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL || ma == NULL || m->c->connect_state != 0)
 		rc = MQTTASYNC_FAILURE;
@@ -1610,7 +2168,8 @@ int MQTTAsync_setMessageArrivedCallback(MQTTAsync handle, void* context,
 		m->ma = ma;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1622,7 +2181,8 @@ int MQTTAsync_setDeliveryCompleteCallback(MQTTAsync handle, void* context,
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL || m->c->connect_state != 0)
 		rc = MQTTASYNC_FAILURE;
@@ -1632,7 +2192,8 @@ int MQTTAsync_setDeliveryCompleteCallback(MQTTAsync handle, void* context,
 		m->dc = dc;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1644,7 +2205,8 @@ int MQTTAsync_setDisconnected(MQTTAsync handle, void* context, MQTTAsync_disconn
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL || m->c->connect_state != NOT_IN_PROGRESS)
 		rc = MQTTASYNC_FAILURE;
@@ -1654,7 +2216,8 @@ int MQTTAsync_setDisconnected(MQTTAsync handle, void* context, MQTTAsync_disconn
 		m->disconnected = disconnected;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1666,7 +2229,8 @@ int MQTTAsync_setConnected(MQTTAsync handle, void* context, MQTTAsync_connected*
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL || m->c->connect_state != NOT_IN_PROGRESS)
 		rc = MQTTASYNC_FAILURE;
@@ -1676,7 +2240,8 @@ int MQTTAsync_setConnected(MQTTAsync handle, void* context, MQTTAsync_connected*
 		m->connected = connected;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1688,7 +2253,8 @@ int MQTTAsync_setUpdateConnectOptions(MQTTAsync handle, void* context, MQTTAsync
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL)
 		rc = MQTTASYNC_FAILURE;
@@ -1698,7 +2264,8 @@ int MQTTAsync_setUpdateConnectOptions(MQTTAsync handle, void* context, MQTTAsync
 		m->updateConnectOptions = updateOptions;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1711,7 +2278,8 @@ int MQTTAsync_setBeforePersistenceWrite(MQTTAsync handle, void* context, MQTTPer
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL)
 		rc = MQTTASYNC_FAILURE;
@@ -1721,7 +2289,8 @@ int MQTTAsync_setBeforePersistenceWrite(MQTTAsync handle, void* context, MQTTPer
 		m->c->beforeWrite_context = context;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1733,7 +2302,8 @@ int MQTTAsync_setAfterPersistenceRead(MQTTAsync handle, void* context, MQTTPersi
 	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if ((rc = MQTTAsync_lockClient(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
 
 	if (m == NULL)
 		rc = MQTTASYNC_FAILURE;
@@ -1743,7 +2313,8 @@ int MQTTAsync_setAfterPersistenceRead(MQTTAsync handle, void* context, MQTTPersi
 		m->c->afterRead_context = context;
 	}
 
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	MQTTAsync_unlockClient();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1762,6 +2333,75 @@ void MQTTAsync_setTraceCallback(MQTTAsync_traceCallback* callback)
 }
 
 
+void MQTTAsync_setTraceRing(int entries)
+{
+	Log_setTraceRing(entries);
+}
+
+
+int MQTTAsync_dumpTrace(const char* dest)
+{
+	return Log_dumpTrace(dest);
+}
+
+
+void MQTTAsync_getSSLCacheStats(MQTTAsync_SSLCacheStats* stats)
+{
+	FUNC_ENTRY;
+	memset(stats, '\0', sizeof(*stats));
+#if defined(OPENSSL)
+	{
+		SSLSocket_cacheStats sslstats;
+
+		SSLSocket_getCacheStats(&sslstats);
+		stats->contextHits = sslstats.contextHits;
+		stats->contextMisses = sslstats.contextMisses;
+		stats->sessionHits = sslstats.sessionHits;
+		stats->sessionMisses = sslstats.sessionMisses;
+		stats->resumedHandshakes = sslstats.resumedHandshakes;
+		stats->fullHandshakes = sslstats.fullHandshakes;
+	}
+#endif
+	FUNC_EXIT;
+}
+
+
+int MQTTAsync_getSlabInfo(MQTTAsync_slabInfo* info)
+{
+	slab_info slabinfo;
+	int rc = MQTTASYNC_FAILURE;
+	int c;
+
+	FUNC_ENTRY;
+	if (info == NULL)
+		goto exit;
+	if (strncmp(info->struct_id, "MQSI", 4) != 0 || info->struct_version != 0)
+	{
+		rc = MQTTASYNC_BAD_STRUCTURE;
+		goto exit;
+	}
+	info->classes = 0;
+	memset(info->classInfo, '\0', sizeof(info->classInfo));
+	info->fallbacks = 0;
+	if (Slab_get_info(&slabinfo) != 0)
+		goto exit;
+	for (c = 0; c < slabinfo.classes && c < MQTTASYNC_SLAB_CLASSES; ++c)
+	{
+		info->classInfo[c].blockSize = slabinfo.class_info[c].block_size;
+		info->classInfo[c].chunks = slabinfo.class_info[c].chunks;
+		info->classInfo[c].blocks = slabinfo.class_info[c].blocks;
+		info->classInfo[c].inUse = slabinfo.class_info[c].in_use;
+		info->classInfo[c].cached = slabinfo.class_info[c].cached;
+	}
+	info->classes = c;
+	info->fallbacks = slabinfo.fallbacks;
+	rc = MQTTASYNC_SUCCESS;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 MQTTAsync_nameValue* MQTTAsync_getVersionInfo(void)
 {
 	#define MAX_INFO_STRINGS 8
@@ -1843,6 +2483,12 @@ const char* MQTTAsync_strerror(int code)
       return "Connect or disconnect command ignored";
     case MQTTASYNC_MAX_BUFFERED:
       return "maxBufferedMessages in the connect options must be >= 0";
+    case MQTTASYNC_SUPERSEDED:
+      return "Message replaced by a newer one with the same coalescing key";
+    case MQTTASYNC_WRONG_SHARD:
+      return "Client called from a callback of a client in another I/O shard";
+    case MQTTASYNC_NOT_EVENT_LOOP:
+      return "Client not created with an event loop";
   }
 
   chars = snprintf(buf, sizeof(buf), "Unknown error code %d", code);
@@ -207,6 +207,21 @@
   * Return code: maxBufferedMessages in the connect options must be >= 0
   */
  #define MQTTASYNC_MAX_BUFFERED -19
+/**
+ * Return code: a buffered message was not sent, because a newer one with the same
+ * coalescing key replaced it.  See ::MQTTAsync_responseOptions.
+ */
+#define MQTTASYNC_SUPERSEDED -20
+/**
+ * Return code: a client was called from a callback of a client in another I/O shard.
+ * See ::MQTTAsync_init_options.
+ */
+#define MQTTASYNC_WRONG_SHARD -21
+/**
+ * Return code: an event loop function was called for a client which was not created
+ * with the eventLoop create option.  See ::MQTTAsync_runOnce.
+ */
+#define MQTTASYNC_NOT_EVENT_LOOP -22
 
 /**
  * Default MQTT version to connect with.  Use 3.1.1 then fall back to 3.1
@@ -237,17 +252,32 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  Must be MQTG. */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0 */
+	/** The version number of this structure.  Must be 0 or 1.
+	 * 0 means no ioShards
+	 */
 	int struct_version;
 	/** 1 = we do openssl init, 0 = leave it to the application */
 	int do_openssl_init;
+	/**
+	 * The number of I/O shards, up to ::MQTTASYNC_MAX_SHARDS.  Each shard has its own send
+	 * and receive threads, sockets and locks, and serves its own group of clients, so that
+	 * many busy clients are not all served by one pair of threads.  The callbacks of a
+	 * client run on its shard's threads, and in a callback only the clients of the same
+	 * shard can be called.  1, the default, serves all clients with one pair of threads.
+	 * Can only be changed when there are no clients.
+	 */
+	int ioShards;
 } MQTTAsync_init_options;
 
-#define MQTTAsync_init_options_initializer { {'M', 'Q', 'T', 'G'}, 0, 0 }
+#define MQTTAsync_init_options_initializer { {'M', 'Q', 'T', 'G'}, 1, 0, 1 }
+
+/** The largest number of I/O shards, see ::MQTTAsync_init_options */
+#define MQTTASYNC_MAX_SHARDS 64
 
 /**
  * Global init of mqtt library. Call once on program start to set global behaviour.
  * handle_openssl_init - if mqtt library should handle openssl init (1) or rely on the caller to init it before using mqtt (0)
+ * ioShards - the number of I/O shards
  */
 LIBMQTT_API void MQTTAsync_global_init(MQTTAsync_init_options* inits);
 
@@ -714,8 +744,10 @@ typedef struct MQTTAsync_responseOptions
 {
 	/** The eyecatcher for this structure.  Must be MQTR */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0 or 1
-	 *   if 0, no MQTTV5 options */
+	/** The version number of this structure.  Must be 0, 1, 2 or 3
+	 *   if 0, no MQTTV5 options
+	 *   if 1, no priority
+	 *   if 2, no coalescing key */
 	int struct_version;
 	/**
     * A pointer to a callback function to be called if the API call successfully
@@ -771,9 +803,38 @@ typedef struct MQTTAsync_responseOptions
 	 * MQTT V5 subscribe option array, when used with subscribeMany only.
 	 */
 	MQTTSubscribe_options* subscribeOptionsList;
+	/**
+	 * When used with send or sendMessage, the priority of the message, from
+	 * ::MQTTASYNC_PRIORITY_LOW to ::MQTTASYNC_PRIORITY_HIGH.  Each priority has its own
+	 * lane of messages waiting to be sent.  While more than one lane has messages waiting,
+	 * the client sends 16 high and 4 normal priority messages for each low priority one, so
+	 * that a bulk transfer at low priority neither delays urgent messages much nor stops.
+	 * The messages in a lane are sent in order, and no message is sent before a subscribe,
+	 * unsubscribe or disconnect called earlier.  When the buffer is full and the
+	 * deleteOldestMessages create option is set, the oldest message of the lowest priority
+	 * is the one deleted.  The priority is not persisted, so messages restored on create
+	 * have normal priority.
+	 */
+	int priority;
+	/**
+	 * When used with send or sendMessage, a key for messages of which only the latest
+	 * value matters, such as a presence state, or NULL.  If a message with the same key is
+	 * still buffered waiting to be sent, this one replaces it, taking its place in the queue,
+	 * and the replaced message fails with ::MQTTASYNC_SUPERSEDED.  Its failure callback is
+	 * called on the send thread, so not before the client first connects.  The key is
+	 * copied, and is not persisted.
+	 */
+	const char* coalesceKey;
 } MQTTAsync_responseOptions;
 
-#define MQTTAsync_responseOptions_initializer { {'M', 'Q', 'T', 'R'}, 1, NULL, NULL, 0, 0, NULL, NULL, MQTTProperties_initializer, MQTTSubscribe_options_initializer, 0, NULL}
+#define MQTTAsync_responseOptions_initializer { {'M', 'Q', 'T', 'R'}, 3, NULL, NULL, 0, 0, NULL, NULL, MQTTProperties_initializer, MQTTSubscribe_options_initializer, 0, NULL, MQTTASYNC_PRIORITY_NORMAL, NULL}
+
+/** Priority for messages sent ahead of normal ones, see ::MQTTAsync_responseOptions */
+#define MQTTASYNC_PRIORITY_HIGH 1
+/** The default priority of messages */
+#define MQTTASYNC_PRIORITY_NORMAL 0
+/** Priority for bulk messages, sent after the others but not held up indefinitely */
+#define MQTTASYNC_PRIORITY_LOW -1
 
 /** A synonym for responseOptions to better reflect its usage since MQTT 5.0 */
 typedef struct MQTTAsync_responseOptions MQTTAsync_callOptions;
@@ -947,6 +1008,10 @@ LIBMQTT_API int MQTTAsync_reconnect(MQTTAsync handle);
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Use the built-in log-structured file
+ * persistence, which appends to a few segment files rather than writing a
+ * file for each message.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
  * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
@@ -954,6 +1019,8 @@ LIBMQTT_API int MQTTAsync_reconnect(MQTTAsync handle);
  * to NULL, the persistence directory used is the working directory).
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
+ * For ::MQTTCLIENT_PERSISTENCE_LOG persistence, it points to an
+ * ::MQTTClient_logPersistenceOptions structure, or is NULL for the defaults.
  * @return ::MQTTASYNC_SUCCESS if the client is successfully created, otherwise
  * an error code is returned.
  */
@@ -965,10 +1032,14 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  must be MQCO. */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0, 1, 2 or 3
+	/** The version number of this structure.  Must be 0, 1, 2, 3, 4, 5, 6 or 7
 	 * 0 means no MQTTVersion
 	 * 1 means no allowDisconnectedSendAtAnyTime, deleteOldestMessages, restoreMessages
 	 * 2 means no persistQoS0
+	 * 3 means no coalesceBytes, coalesceDelayUs
+	 * 4 means no maxBufferedBytes, spillBufferedMessages
+	 * 5 means no shard
+	 * 6 means no eventLoop
 	 */
 	int struct_version;
 	/** Whether to allow messages to be sent when the client library is not connected. */
@@ -999,11 +1070,56 @@ typedef struct
 	 * Persist QoS0 publish commands - an option to not persist them.
 	 */
 	int persistQoS0;
+	/**
+	 * Gather consecutive publish packets into one network write of up to this many bytes.
+	 * The gathered packets are written when this size is reached, when there are no more
+	 * commands ready to send, or when any other packet is sent.  0, the default, writes
+	 * each packet as it is sent.  Applies to TCP and TLS connections, but not WebSockets.
+	 * Over TLS at most one full TLS record (16KB) is gathered, so that small packets share
+	 * records.  A QoS 0 publish completes once it has been gathered.
+	 */
+	int coalesceBytes;
+	/**
+	 * The longest time, in microseconds, that a gathered publish packet waits while more
+	 * commands keep arriving.  0 means only the size and idle conditions apply.
+	 */
+	int coalesceDelayUs;
+	/**
+	 * The most bytes of payload, topic and properties that the buffered messages of this
+	 * client may hold in memory, as well as there being at most maxBufferedMessages of them.
+	 * A buffered message which has been persisted holds none.  When a new message would go
+	 * over, it is refused, or with deleteOldestMessages the oldest messages are discarded
+	 * until it fits.  A message larger than this on its own is always refused.  0, the
+	 * default, sets no limit.
+	 */
+	int maxBufferedBytes;
+	/**
+	 * When a new message would go over maxBufferedBytes, write it to persistence and keep
+	 * only its place in the buffer in memory, rather than refusing it or discarding older
+	 * ones.  Only QoS 0 messages when persistQoS0 is 0 can spill, as with a persistence
+	 * store all the other buffered messages are persisted anyway.
+	 */
+	int spillBufferedMessages;
+	/**
+	 * The I/O shard whose send and receive threads serve this client, modulo the number of
+	 * shards set by ::MQTTAsync_global_init.  -1, the default, assigns the shards in turn,
+	 * except that a client created in a callback goes in the shard of the callback.
+	 */
+	int shard;
+	/**
+	 * Start no threads for this client, which instead is driven by the application calling
+	 * ::MQTTAsync_runOnce from its own event loop, when the socket from
+	 * ::MQTTAsync_getLoopSocket is ready or the time from ::MQTTAsync_getLoopTimeout has
+	 * passed.  All the callbacks are called from ::MQTTAsync_runOnce, on the calling thread.
+	 * The client has an I/O shard of its own, and shard is ignored.  Nothing must wait for
+	 * the client's operations to complete on the thread that runs its loop.
+	 */
+	int eventLoop;
 } MQTTAsync_createOptions;
 
-#define MQTTAsync_createOptions_initializer  { {'M', 'Q', 'C', 'O'}, 2, 0, 100, MQTTVERSION_DEFAULT, 0, 0, 1, 1}
+#define MQTTAsync_createOptions_initializer  { {'M', 'Q', 'C', 'O'}, 7, 0, 100, MQTTVERSION_DEFAULT, 0, 0, 1, 1, 0, 0, 0, 0, -1, 0}
 
-#define MQTTAsync_createOptions_initializer5 { {'M', 'Q', 'C', 'O'}, 2, 0, 100, MQTTVERSION_5, 0, 0, 1, 1}
+#define MQTTAsync_createOptions_initializer5 { {'M', 'Q', 'C', 'O'}, 7, 0, 100, MQTTVERSION_5, 0, 0, 1, 1, 0, 0, 0, 0, -1, 0}
 
 
 LIBMQTT_API int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const char* clientId,
@@ -1203,7 +1319,7 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  must be MQTC. */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0, 1, 2, 3 4 5 6, 7 or 8.
+	/** The version number of this structure.  Must be 0, 1, 2, 3 4 5 6, 7, 8, 9 or 10.
 	  * 0 signifies no SSL options and no serverURIs
 	  * 1 signifies no serverURIs
       * 2 signifies no MQTTVersion
@@ -1212,6 +1328,8 @@ typedef struct
       * 5 signifies no MQTTV5 properties
       * 6 signifies no HTTP headers option
       * 7 signifies no HTTP proxy and HTTPS proxy options
+      * 8 signifies no outbound topic alias maximum
+      * 9 signifies no adaptive inflight window
 	  */
 	int struct_version;
 	/** The "keep alive" interval, measured in seconds, defines the maximum time
@@ -1351,7 +1469,9 @@ typedef struct
 	 */
 	int cleanstart;
 	/**
-	 * MQTT V5 properties for connect
+	 * MQTT V5 properties for connect.  If they include a topic alias maximum greater than 0,
+	 * the client keeps the topics the server sets for its aliases, and gives each message
+	 * which arrives with only an alias the full topic.
 	 */
 	MQTTProperties *connectProperties;
 	/**
@@ -1384,27 +1504,45 @@ typedef struct
 	 * HTTPS proxy setting. See ::MQTTAsync_connectOptions.httpProxy and the section @ref HTTP_proxies.
 	 */
 	const char* httpsProxy;
+	/**
+	 * MQTT V5 only.  The most topic aliases the client is to assign to the topics it publishes
+	 * to, or 0 (the default) for none.  When it is greater than 0 and the server accepts topic
+	 * aliases, the client assigns aliases up to the smaller of this and the server's topic alias
+	 * maximum.  A topic is sent in full with its alias the first time, and after that only the
+	 * alias is sent.  Once all the aliases are in use, the one used least recently is reassigned.
+	 * A PUBLISH which already has a topic alias property is sent unchanged.
+	 */
+	int outboundTopicAliasMaximum;
+	/**
+	 * The round trip time in milliseconds, from sending a QoS 1 or 2 message to receiving its
+	 * PUBACK or PUBREC, that an adaptive inflight window aims for, or 0 (the default) for a fixed
+	 * window of ::maxInflight messages.  The adaptive window starts small and grows while
+	 * round trips stay within the target, and halves when one goes over it or a message has to
+	 * be resent.  It never exceeds ::maxInflight, or the server's receive maximum.  See
+	 * MQTTAsync_getInflightWindow().
+	 */
+	int inflightTargetRTT;
 } MQTTAsync_connectOptions;
 
 /** Initializer for connect options for MQTT 3.1.1 non-WebSocket connections */
-#define MQTTAsync_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 8, 60, 1, 65535, NULL, NULL, NULL, 30, 0,\
-NULL, NULL, NULL, NULL, 0, NULL, MQTTVERSION_DEFAULT, 0, 1, 60, {0, NULL}, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+#define MQTTAsync_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 10, 60, 1, 65535, NULL, NULL, NULL, 30, 0,\
+NULL, NULL, NULL, NULL, 0, NULL, MQTTVERSION_DEFAULT, 0, 1, 60, {0, NULL}, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0}
 
 /** Initializer for connect options for MQTT 5.0 non-WebSocket connections */
-#define MQTTAsync_connectOptions_initializer5 { {'M', 'Q', 'T', 'C'}, 8, 60, 0, 65535, NULL, NULL, NULL, 30, 0,\
-NULL, NULL, NULL, NULL, 0, NULL, MQTTVERSION_5, 0, 1, 60, {0, NULL}, 1, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+#define MQTTAsync_connectOptions_initializer5 { {'M', 'Q', 'T', 'C'}, 10, 60, 0, 65535, NULL, NULL, NULL, 30, 0,\
+NULL, NULL, NULL, NULL, 0, NULL, MQTTVERSION_5, 0, 1, 60, {0, NULL}, 1, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0}
 
 /** Initializer for connect options for MQTT 3.1.1 WebSockets connections.
   * The keepalive interval is set to 45 seconds to avoid webserver 60 second inactivity timeouts.
   */
-#define MQTTAsync_connectOptions_initializer_ws { {'M', 'Q', 'T', 'C'}, 8, 45, 1, 65535, NULL, NULL, NULL, 30, 0,\
-NULL, NULL, NULL, NULL, 0, NULL, MQTTVERSION_DEFAULT, 0, 1, 60, {0, NULL}, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+#define MQTTAsync_connectOptions_initializer_ws { {'M', 'Q', 'T', 'C'}, 10, 45, 1, 65535, NULL, NULL, NULL, 30, 0,\
+NULL, NULL, NULL, NULL, 0, NULL, MQTTVERSION_DEFAULT, 0, 1, 60, {0, NULL}, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0}
 
 /** Initializer for connect options for MQTT 5.0 WebSockets connections.
   * The keepalive interval is set to 45 seconds to avoid webserver 60 second inactivity timeouts.
   */
-#define MQTTAsync_connectOptions_initializer5_ws { {'M', 'Q', 'T', 'C'}, 8, 45, 0, 65535, NULL, NULL, NULL, 30, 0,\
-NULL, NULL, NULL, NULL, 0, NULL, MQTTVERSION_5, 0, 1, 60, {0, NULL}, 1, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+#define MQTTAsync_connectOptions_initializer5_ws { {'M', 'Q', 'T', 'C'}, 10, 45, 0, 65535, NULL, NULL, NULL, 30, 0,\
+NULL, NULL, NULL, NULL, 0, NULL, MQTTVERSION_5, 0, 1, 60, {0, NULL}, 1, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0}
 
 
 /**
@@ -1517,6 +1655,73 @@ LIBMQTT_API int MQTTAsync_disconnect(MQTTAsync handle, const MQTTAsync_disconnec
   */
 LIBMQTT_API int MQTTAsync_isConnected(MQTTAsync handle);
 
+/**
+  * This function gets the current inflight window of a client, and the round trip
+  * time the adaptive window is based on.  See MQTTAsync_connectOptions.inflightTargetRTT.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param window Set to the most QoS 1 and 2 messages, subscribes and unsubscribes
+  * that the client can now have in flight at once.
+  * @param rtt Set to the smoothed round trip time in microseconds from sending a QoS 1 or 2
+  * message to its first response, or 0 if the adaptive window is off or there has been no
+  * response yet.  May be NULL.
+  * @return ::MQTTASYNC_SUCCESS, or ::MQTTASYNC_FAILURE if the handle is not valid.
+  */
+LIBMQTT_API int MQTTAsync_getInflightWindow(MQTTAsync handle, int* window, int* rtt);
+
+/**
+  * This function gets the I/O shard whose threads serve a client, and run its callbacks.
+  * See ::MQTTAsync_init_options.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @return The index of the shard, from 0, or ::MQTTASYNC_FAILURE if the handle is not valid
+  * or the client was created with the eventLoop create option, so has no threads.
+  */
+LIBMQTT_API int MQTTAsync_getShard(MQTTAsync handle);
+
+/**
+  * This function gets the socket which the event loop of a client created with the
+  * eventLoop create option should wait on, to call ::MQTTAsync_runOnce when it is ready.
+  * The socket changes as the client connects and reconnects, so it should be got again
+  * after each call to ::MQTTAsync_runOnce.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_createWithOptions().
+  * @param wantWrite Set to 1 if the loop should wait for the socket to be writable too,
+  * because a connect or a write is in progress, or to 0 if readable only.  May be NULL.
+  * @return The socket, -1 if the client has none at the moment, or
+  * ::MQTTASYNC_NOT_EVENT_LOOP.
+  */
+LIBMQTT_API int MQTTAsync_getLoopSocket(MQTTAsync handle, int* wantWrite);
+
+/**
+  * This function gets the longest time the event loop of a client created with the
+  * eventLoop create option may wait before calling ::MQTTAsync_runOnce, when its socket
+  * isn't ready: until the next keepalive, retry or timeout deadline, or no time at all if
+  * there are operations to send or data already read.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_createWithOptions().
+  * @return The time in milliseconds, -1 if there is no deadline, or
+  * ::MQTTASYNC_NOT_EVENT_LOOP.
+  */
+LIBMQTT_API int MQTTAsync_getLoopTimeout(MQTTAsync handle);
+
+/**
+  * This function runs one turn of the I/O of a client created with the eventLoop create
+  * option, on the calling thread: it sends the queued operations it can, waits up to
+  * timeout for the socket to be ready, handles the packets which have arrived, and acts
+  * on the deadlines which have passed.  The client's callbacks are called from here.
+  * Only one thread may run a client's loop at a time.  Operations started on other threads
+  * are sent by the next call, so such a loop should not wait longer than it can afford to
+  * delay them.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_createWithOptions().
+  * @param timeout The most milliseconds to wait for the socket to be ready.  0 doesn't
+  * wait, which suits a loop that has waited on the socket itself.
+  * @return ::MQTTASYNC_SUCCESS, ::MQTTASYNC_NOT_EVENT_LOOP, or ::MQTTASYNC_WRONG_SHARD if
+  * called from a callback of another client.
+  */
+LIBMQTT_API int MQTTAsync_runOnce(MQTTAsync handle, int timeout);
+
 
 /**
   * This function attempts to subscribe a client to a single topic, which may
@@ -1623,6 +1828,39 @@ LIBMQTT_API int MQTTAsync_send(MQTTAsync handle, const char* destinationName, in
   */
 LIBMQTT_API int MQTTAsync_sendMessage(MQTTAsync handle, const char* destinationName, const MQTTAsync_message* msg, MQTTAsync_responseOptions* response);
 
+/**
+  * This function attempts to publish a number of messages, each to its own
+  * topic, in order (see also MQTTAsync_sendMessage()). It is equivalent to
+  * calling MQTTAsync_sendMessage() for each message, except that with the
+  * ::MQTTCLIENT_PERSISTENCE_LOG persistence or the ring persistence (see
+  * MQTTClient_createRingPersistence()) synced with ::MQTTCLIENT_LOG_SYNC_ALWAYS,
+  * the records persisted for the messages are synced to disk once, before
+  * this function returns, rather than once each.
+  *
+  * If a message is not accepted for publication, the messages after it are
+  * not attempted, and the error code is returned. The messages before it have
+  * been accepted, and are delivered as usual.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param count The number of messages.
+  * @param destinationNames An array (of length <i>count</i>) of the topics of
+  * the messages.
+  * @param msgs An array (of length <i>count</i>) of valid MQTTAsync_message
+  * structures containing the payloads and attributes of the messages.
+  * @param responses An array (of length <i>count</i>) of ::MQTTAsync_responseOptions
+  * structures, one for each message, in which the tokens of the accepted
+  * messages are returned. This is optional and can be set to NULL.
+  * @param accepted Returns the number of messages accepted for publication,
+  * which are the first <i>accepted</i> of the array. This is optional and can
+  * be set to NULL.
+  * @return ::MQTTASYNC_SUCCESS if all the messages are accepted for publication.
+  * ::MQTTASYNC_PERSISTENCE_ERROR if the messages were accepted, but could not
+  * be synced to disk. Another error code is returned if there was a problem
+  * accepting a message.
+  */
+LIBMQTT_API int MQTTAsync_sendMany(MQTTAsync handle, int count, char* const* destinationNames,
+		const MQTTAsync_message* msgs, MQTTAsync_responseOptions* responses, int* accepted);
+
 
 /**
   * This function sets a pointer to an array of tokens for
@@ -1644,6 +1882,36 @@ LIBMQTT_API int MQTTAsync_sendMessage(MQTTAsync handle, const char* destinationN
   */
 LIBMQTT_API int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens);
 
+/**
+ * The state of a client's buffer of messages waiting to be sent, and counts of the
+ * messages the buffer could not hold.
+ */
+typedef struct
+{
+	/** Messages in the buffer */
+	int bufferedMessages;
+	/** Bytes of payload, topic and properties the buffered messages hold in memory */
+	unsigned long bufferedBytes;
+	/** Messages refused, or discarded to make room, because the buffer was full */
+	unsigned long droppedMessages;
+	/** Bytes of payload, topic and properties of the dropped messages, or of the payload
+	 * only for those which had been persisted */
+	unsigned long droppedBytes;
+	/** Messages persisted rather than held in memory because maxBufferedBytes was reached */
+	unsigned long spilledMessages;
+} MQTTAsync_bufferStats;
+
+/**
+  * This function returns the state of the buffer of messages waiting to be sent for
+  * a client, limited by the maxBufferedMessages and maxBufferedBytes create options,
+  * with counts of the messages dropped since the client was created.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param stats the buffer state, returned
+  * @return ::MQTTASYNC_SUCCESS, or ::MQTTASYNC_FAILURE if either pointer is NULL.
+  */
+LIBMQTT_API int MQTTAsync_getBufferStats(MQTTAsync handle, MQTTAsync_bufferStats* stats);
+
 /**
  * Tests whether a request corresponding to a token is complete.
  *
@@ -1752,6 +2020,27 @@ typedef void MQTTAsync_traceCallback(enum MQTTASYNC_TRACE_LEVELS level, char* me
   */
 LIBMQTT_API void MQTTAsync_setTraceCallback(MQTTAsync_traceCallback* callback);
 
+/**
+  * This function switches trace to binary per-thread rings.  Instead of being formatted and
+  * written out as they are made, trace entries below ::MQTTASYNC_TRACE_ERROR are stored in a
+  * ring of fixed size belonging to the thread, without taking any lock.  The oldest entries
+  * are overwritten when a ring is full.  Use MQTTAsync_dumpTrace() to format and write out the
+  * entries.  Trace entries are still filtered by the trace level.
+  * @param entries the number of entries in each ring, which is rounded up to a power of 2.
+  * 0 switches the rings off.  This setting takes effect for threads which do not yet have
+  * a ring, so should be made before any client is created.
+  */
+LIBMQTT_API void MQTTAsync_setTraceRing(int entries);
+
+/**
+  * This function formats and writes out the entries in the trace rings, oldest first,
+  * merging the entries of all threads.  The entries are kept, so they can be dumped again.
+  * @param dest a file name, or "stdout" or "stderr".  If NULL, the entries are written to the
+  * trace destination set by the environment variables, and to the trace callback.
+  * @return the number of entries written, or -1 if the file could not be opened.
+  */
+LIBMQTT_API int MQTTAsync_dumpTrace(const char* dest);
+
 /**
   * This function returns version information about the library.
   * no trace information will be returned.  The default trace level is
@@ -1760,6 +2049,93 @@ LIBMQTT_API void MQTTAsync_setTraceCallback(MQTTAsync_traceCallback* callback);
   */
 LIBMQTT_API MQTTAsync_nameValue* MQTTAsync_getVersionInfo(void);
 
+/**
+ * Counts of how often TLS connections have been able to reuse the SSL context
+ * and TLS session of an earlier connection.
+ *
+ * Connections whose SSL options have the same contents (including the
+ * modification times of the files they name) share an SSL context, so the
+ * certificates and keys are loaded only once.  Options which set a PSK callback
+ * are never shared.  The last TLS session received from each server is offered
+ * when reconnecting to it, which lets the server skip the full handshake.
+ */
+typedef struct
+{
+	/** Connections which used a cached SSL context */
+	unsigned long contextHits;
+	/** Connections which created and loaded a new SSL context */
+	unsigned long contextMisses;
+	/** Connections which offered a cached TLS session to the server */
+	unsigned long sessionHits;
+	/** Connections with no cached TLS session to offer */
+	unsigned long sessionMisses;
+	/** Handshakes in which the server resumed the offered session */
+	unsigned long resumedHandshakes;
+	/** Handshakes in which the server did not resume a session */
+	unsigned long fullHandshakes;
+} MQTTAsync_SSLCacheStats;
+
+/**
+  * This function returns the SSL context and TLS session cache statistics for
+  * the process, since the library was initialized.  All the counts are zero
+  * if the library was built without TLS support.
+  * @param stats the statistics, returned
+  */
+LIBMQTT_API void MQTTAsync_getSSLCacheStats(MQTTAsync_SSLCacheStats* stats);
+
+/** The number of size classes of the slab allocator */
+#define MQTTASYNC_SLAB_CLASSES 7
+
+/**
+ * Occupancy of one size class of the slab allocator, which the library uses for the
+ * small fixed size structures it allocates for every message.
+ */
+typedef struct
+{
+	/** The size of the blocks in this class */
+	size_t blockSize;
+	/** The number of chunks the blocks have been carved from */
+	size_t chunks;
+	/** The total number of blocks in the chunks */
+	size_t blocks;
+	/** Blocks currently allocated */
+	size_t inUse;
+	/** Free blocks held in the caches of the library's threads */
+	size_t cached;
+} MQTTAsync_slabClassInfo;
+
+/**
+ * The state of the slab allocator.  The counts are a snapshot, taken without stopping
+ * the threads which are allocating.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQSI. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0. */
+	int struct_version;
+	/** The number of entries of classInfo in use */
+	int classes;
+	/** The occupancy of each size class */
+	MQTTAsync_slabClassInfo classInfo[MQTTASYNC_SLAB_CLASSES];
+	/** Allocations which were passed on to malloc, because no slab block was available */
+	size_t fallbacks;
+} MQTTAsync_slabInfo;
+
+#define MQTTAsync_slabInfo_initializer { {'M', 'Q', 'S', 'I'}, 0, 0, {{0, 0, 0, 0, 0}}, 0 }
+
+/**
+  * This function returns the occupancy of each size class of the slab allocator, shared
+  * by all the clients in the process.
+  * @param info the slab allocator state, returned, initialized with
+  * ::MQTTAsync_slabInfo_initializer.  All the counts are zero if the library was built
+  * without the slab allocator.
+  * @return ::MQTTASYNC_SUCCESS, ::MQTTASYNC_BAD_STRUCTURE if info was not initialized,
+  * or ::MQTTASYNC_FAILURE if the library was built without the slab allocator or info
+  * is NULL.
+  */
+LIBMQTT_API int MQTTAsync_getSlabInfo(MQTTAsync_slabInfo* info);
+
 /**
  * Returns a pointer to a string representation of the error code, or NULL.
  * Do not free after use. Returns NULL if the error code is unknown.
@@ -1830,6 +2206,14 @@ LIBMQTT_API const char* MQTTAsync_strerror(int code);
   * must be set to non-zero, and the maxBufferedMessages field set as required -
   * the default being 100.
   *
+  * The maxBufferedBytes field also limits the memory the buffered messages take, so that
+  * a long outage can't use an unpredictable amount of it.  When the buffer is full, new
+  * messages are refused with ::MQTTASYNC_MAX_BUFFERED_MESSAGES, or the oldest ones are
+  * discarded if deleteOldestMessages is set, or, with spillBufferedMessages and a
+  * persistence store, new messages are kept in persistence only.  Discarding the oldest
+  * message takes the same time however many are buffered.  ::MQTTAsync_getBufferStats
+  * returns how full the buffer is and how many messages have been dropped.
+  *
   * ::MQTTAsync_getPendingTokens can be called to return the ids of the messages
   * waiting to be sent, or for which the sending process has not completed.
   *
@@ -2285,6 +2669,11 @@ exit:
   * to a file.  Two files are used at most, when they are full, the last one is overwritten with the
   * new trace entries.  The default size is 1000 lines.
   *
+  * Setting MQTT_C_CLIENT_TRACE_RING to a number of entries stores trace in binary per-thread
+  * rings of that size rather than formatting it as it is made, see MQTTAsync_setTraceRing().
+  * The rings are written to the trace destination when the library is terminated, or
+  * on demand with MQTTAsync_dumpTrace().  ERROR and higher entries are always written immediately.
+  *
   * #### Trace API calls
   *
   * MQTTAsync_traceCallback() is used to set a callback function which is called whenever trace
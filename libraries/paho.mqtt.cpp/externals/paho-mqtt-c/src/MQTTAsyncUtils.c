@@ -15,6 +15,7 @@
  *    Sven Gambel - add generic proxy support
  *******************************************************************************/
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #if !defined(_WIN32) && !defined(_WIN64)
@@ -33,6 +34,7 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Slab.h"
 #include "OsWrapper.h"
 #include "WebSocket.h"
 #include "Proxy.h"
@@ -54,8 +56,17 @@ static void MQTTAsync_checkDisconnect(MQTTAsync handle, MQTTAsync_command* comma
 static void MQTTProtocol_checkPendingWrites(void);
 static void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command);
 static void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command);
+static int MQTTAsync_publishBytes(MQTTAsync_queuedCommand* command);
+static int MQTTAsync_bufferFits(MQTTAsyncs* m, int bytes);
+static void MQTTAsync_linkCommand(MQTTAsync_queuedCommand* command);
+static void MQTTAsync_unlinkCommand(MQTTAsync_queuedCommand* command);
+static int MQTTAsync_chooseLane(MQTTAsyncs* m, int charge);
+static void MQTTAsync_discardPublish(MQTTAsync_queuedCommand* command, int code);
+static void MQTTAsync_dropOldestPublish(MQTTAsyncs* m);
+static void MQTTAsync_replaceCommand(MQTTAsync_queuedCommand* replaced, MQTTAsync_queuedCommand* command);
 static int MQTTAsync_processCommand(void);
 static void MQTTAsync_checkTimeouts(void);
+static void MQTTAsync_checkClientTimeouts(MQTTAsyncs* m);
 static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack);
 static void MQTTAsync_stop(void);
 static void MQTTAsync_closeOnly(Clients* client, enum MQTTReasonCodes reasonCode, MQTTProperties* props);
@@ -64,41 +75,20 @@ static int MQTTAsync_cleanSession(Clients* client);
 static int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topicLen, MQTTAsync_message* mm);
 static int MQTTAsync_disconnect_internal(MQTTAsync handle, int timeout);
 static int cmdMessageIDCompare(void* a, void* b);
-static void MQTTAsync_retry(void);
 static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc);
+static void MQTTAsync_handleCycle(SOCKET sock, MQTTPacket* pack, int rc);
+static void MQTTAsync_processCommands(void);
 static int MQTTAsync_connecting(MQTTAsyncs* m);
 
-extern MQTTProtocol state; /* defined in MQTTAsync.c */
-extern ClientStates* bstate; /* defined in MQTTAsync.c */
+extern MQTTAsync_shard MQTTAsync_defaultShard; /* defined in MQTTAsync.c */
 
-extern enum MQTTAsync_threadStates sendThread_state;
-extern enum MQTTAsync_threadStates receiveThread_state;
-extern thread_id_type sendThread_id,
-               receiveThread_id;
-
-extern volatile int global_initialized;
-extern List* MQTTAsync_handles;
-extern List* MQTTAsync_commands;
-extern int MQTTAsync_tostop;
+/* the shard whose clients this thread is working on, or NULL for the default shard */
+static THREAD_LOCAL MQTTAsync_shard* current_shard = NULL;
 
 #if defined(_WIN32) || defined(_WIN64)
 	#if defined(_MSC_VER) && _MSC_VER < 1900
 		#define snprintf _snprintf
 	#endif
-extern mutex_type mqttasync_mutex;
-extern mutex_type socket_mutex;
-extern mutex_type mqttcommand_mutex;
-extern sem_type send_sem;
-#if !defined(NO_HEAP_TRACKING)
-extern mutex_type stack_mutex;
-extern mutex_type heap_mutex;
-#endif
-extern mutex_type log_mutex;
-#else
-extern mutex_type mqttasync_mutex;
-extern mutex_type socket_mutex;
-extern mutex_type mqttcommand_mutex;
-extern cond_type send_cond;
 #endif
 
 #if !defined(min)
@@ -184,6 +174,96 @@ void MQTTAsync_unlock_mutex(mutex_type amutex)
 }
 
 
+/**
+ * Get the shard whose clients the calling thread is working on.  That is the shard of the
+ * calling I/O thread, or of the client passed to the API function being called.
+ * @return the shard
+ */
+MQTTAsync_shard* MQTTAsync_currentShard(void)
+{
+	return (current_shard) ? current_shard : &MQTTAsync_defaultShard;
+}
+
+
+/**
+ * Make the calling thread work on a shard's clients, with the shard's socket set and
+ * protocol state.
+ * @param shard the shard, or NULL for the default shard
+ */
+void MQTTAsync_bindShard(MQTTAsync_shard* shard)
+{
+	current_shard = shard;
+	if (shard)
+	{
+		Socket_setCurrent(shard->sockets, shard->sockets ? shard->socket_mutex : NULL);
+		SocketBuffer_setCurrent(shard->buffers);
+		WebSocket_setCurrent(shard->frames);
+		MQTTProtocol_setCurrent(shard->protocol, shard->clientstates);
+	}
+	else
+	{
+		Socket_setCurrent(NULL, NULL);
+		SocketBuffer_setCurrent(NULL);
+		WebSocket_setCurrent(NULL);
+		MQTTProtocol_setCurrent(NULL, NULL);
+	}
+}
+
+
+/**
+ * Lock a shard, for an API call, and work on its clients until MQTTAsync_unlockClient.
+ * In a callback, the shard of the I/O thread is already locked, and no other shard can
+ * be locked without the risk of deadlock with the other shard's callbacks.
+ * @param shard the shard
+ * @return MQTTASYNC_SUCCESS, or MQTTASYNC_WRONG_SHARD if called from a callback of
+ * another shard
+ */
+int MQTTAsync_lockShard(MQTTAsync_shard* shard)
+{
+	int rc = MQTTASYNC_SUCCESS;
+
+	if (MQTTAsync_inCallback())
+	{
+		if (shard != MQTTAsync_currentShard())
+			rc = MQTTASYNC_WRONG_SHARD;
+	}
+	else
+	{
+		MQTTAsync_bindShard(shard);
+		MQTTAsync_lock_mutex(shard->mutex);
+	}
+	return rc;
+}
+
+
+/**
+ * Lock the shard of a client, for an API call.  MQTTAsync_unlockClient must be called
+ * afterwards, whether this succeeds or not.
+ * @param handle the client, or NULL for the default shard
+ * @return MQTTASYNC_SUCCESS, or MQTTASYNC_WRONG_SHARD if called from a callback of
+ * another shard
+ */
+int MQTTAsync_lockClient(MQTTAsync handle)
+{
+	MQTTAsyncs* m = handle;
+
+	return MQTTAsync_lockShard((m && m->shard) ? m->shard : &MQTTAsync_defaultShard);
+}
+
+
+/**
+ * Unlock the shard locked by MQTTAsync_lockClient or MQTTAsync_lockShard
+ */
+void MQTTAsync_unlockClient(void)
+{
+	if (!MQTTAsync_inCallback())
+	{
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+		MQTTAsync_bindShard(NULL);
+	}
+}
+
+
 /*
   Check whether there are any more connect options.  If not then we are finished
   with connect attempts.
@@ -201,27 +281,37 @@ static int MQTTAsync_checkConn(MQTTAsync_command* command, MQTTAsyncs* client, i
 }
 
 
+/**
+ * Stop the threads of the current shard, and free its lists if it has no clients left.
+ * The process wide state is freed by the caller, when there are no clients in any shard.
+ */
 void MQTTAsync_terminate(void)
 {
+	MQTTAsync_shard* shard = MQTTAsync_currentShard();
+
 	FUNC_ENTRY;
 	MQTTAsync_stop();
 
-	/* don't destroy global data if a new client was created while waiting for background threads to terminate */
-	if (global_initialized && bstate->clients->count == 0)
+	/* don't destroy the shard's data if a new client was created while waiting for background threads to terminate */
+	if (shard->initialized && MQTTProtocol_getClients()->clients->count == 0)
 	{
 		ListElement* elem = NULL;
-		ListFree(bstate->clients);
+		ListFree(MQTTProtocol_getClients()->clients);
+		MQTTProtocol_getClients()->clients = NULL;
 		ListFree(MQTTAsync_handles);
 		while (ListNextElement(MQTTAsync_commands, &elem))
 			MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*)(elem->content));
 		ListFree(MQTTAsync_commands);
+		elem = NULL;
+		while (ListNextElement(MQTTAsync_discarded, &elem))
+			MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*)(elem->content));
+		ListFree(MQTTAsync_discarded);
 		MQTTAsync_handles = NULL;
-		WebSocket_terminate();
-		#if !defined(NO_HEAP_TRACKING)
-			Heap_terminate();
-		#endif
-		Log_terminate();
-		global_initialized = 0;
+		MQTTAsync_commands = NULL;
+		MQTTAsync_discarded = NULL;
+		WebSocket_freeFrames();
+		Socket_outTerminate();
+		shard->initialized = 0;
 	}
 	FUNC_EXIT;
 }
@@ -380,7 +470,12 @@ static int MQTTAsync_persistCommand(MQTTAsync_queuedCommand* qcmd)
 	 * by the value PERSISTENCE_MAX_KEY_LENGTH minus the max prefix string length
 	 */
 	if (++aclient->command_seqno == PERSISTENCE_SEQNO_LIMIT)
+	{
 		aclient->command_seqno = 0;
+		/* the index snapshot would match reused sequence numbers to old entries */
+		if (aclient->c->persistence->pcontainskey(aclient->c->phandle, PERSISTENCE_COMMAND_INDEX_KEY) == 0)
+			aclient->c->persistence->premove(aclient->c->phandle, PERSISTENCE_COMMAND_INDEX_KEY);
+	}
 
 	if (aclient->c->MQTTVersion >= MQTTVERSION_5 && process) 	/* persist properties */
 	{
@@ -413,6 +508,8 @@ static int MQTTAsync_persistCommand(MQTTAsync_queuedCommand* qcmd)
 
 		if ((rc = aclient->c->persistence->pput(aclient->c->phandle, key, nbufs, (char**)bufs, lens)) != 0)
 			Log(LOG_ERROR, 0, "Error persisting command, rc %d", rc);
+		else
+			qcmd->persisted = (aclient->c->MQTTVersion >= MQTTVERSION_5) ? MQTTVERSION_5 : MQTTVERSION_3_1_1;
 		qcmd->seqno = aclient->command_seqno;
 	}
 exit:
@@ -444,7 +541,7 @@ static MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int bufle
 
 	if (qcommand == NULL)
 	{
-		if ((qcommand = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+		if ((qcommand = Slab_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 			goto exit;
 		memset(qcommand, '\0', sizeof(MQTTAsync_queuedCommand));
 		qcommand->not_restored = 1; /* don't restore all the command on the first call */
@@ -611,79 +708,316 @@ exit:
 }
 
 
+/** Version of the layout of the command index snapshot */
+#define COMMAND_INDEX_VERSION 1
+/** Shortest time between periodic writes of the command index snapshot, in milliseconds */
+#define COMMAND_INDEX_INTERVAL 10000
+
+/**
+ * The command index snapshot is this header followed by one entry per
+ * persisted command.  An entry holds the fields of a command that are
+ * restored before it's sent, so restore needn't read every command record.
+ */
+typedef struct
+{
+	int version;
+	unsigned int command_seqno; /* the highest sequence number used */
+	int count; /* the number of entries which follow */
+} MQTTAsync_commandIndexHeader;
+
+typedef struct
+{
+	unsigned int seqno;
+	int MQTTVersion;
+	int type;
+	MQTTAsync_token token;
+	int qos;
+	int retained;
+	int payloadlen;
+} MQTTAsync_commandIndexEntry;
+
+/** A persisted command key, with its sequence number parsed out */
+typedef struct
+{
+	unsigned int seqno;
+	int MQTTVersion;
+	char* key;
+} MQTTAsync_commandKey;
+
+
+
 static int cmpkeys(const void *p1, const void *p2)
 {
-   int key1 = atoi(strchr(*(char * const *)p1, '-') + 1);
-   int key2 = atoi(strchr(*(char * const *)p2, '-') + 1);
+	unsigned int key1 = ((const MQTTAsync_commandKey*)p1)->seqno;
+	unsigned int key2 = ((const MQTTAsync_commandKey*)p2)->seqno;
 
-   return (key1 == key2) ? 0 : ((key1 < key2) ? -1 : 1);
+	return (key1 == key2) ? 0 : ((key1 < key2) ? -1 : 1);
+}
+
+
+static int cmpentries(const void *p1, const void *p2)
+{
+	unsigned int key1 = ((const MQTTAsync_commandIndexEntry*)p1)->seqno;
+	unsigned int key2 = ((const MQTTAsync_commandIndexEntry*)p2)->seqno;
+
+	return (key1 == key2) ? 0 : ((key1 < key2) ? -1 : 1);
+}
+
+
+/**
+ * Writes the index snapshot of the persisted commands queued for a client.
+ * The caller must hold mqttcommand_mutex.
+ * @param client the client
+ * @return 0 on success, or an error code
+ */
+int MQTTAsync_persistCommandIndex(MQTTAsyncs* client)
+{
+	Clients* c = client->c;
+	MQTTAsync_commandIndexHeader* header = NULL;
+	MQTTAsync_commandIndexEntry* entry = NULL;
+	ListElement* current = NULL;
+	char* buffer = NULL;
+	char* bufs[1];
+	int lens[1];
+	int count = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (c->persistence == NULL)
+		goto exit;
+	client->commandIndexTime = MQTTTime_start_clock();
+
+	while (ListNextElement(MQTTAsync_commands, &current))
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+		if (cmd->client == client && cmd->persisted)
+			count++;
+	}
+	if (count == 0)
+	{
+		if (c->persistence->pcontainskey(c->phandle, PERSISTENCE_COMMAND_INDEX_KEY) == 0)
+			rc = c->persistence->premove(c->phandle, PERSISTENCE_COMMAND_INDEX_KEY);
+		goto exit;
+	}
+
+	lens[0] = (int)(sizeof(MQTTAsync_commandIndexHeader) + count * sizeof(MQTTAsync_commandIndexEntry));
+	if ((buffer = malloc(lens[0])) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	header = (MQTTAsync_commandIndexHeader*)buffer;
+	header->version = COMMAND_INDEX_VERSION;
+	header->command_seqno = client->command_seqno;
+	header->count = count;
+	entry = (MQTTAsync_commandIndexEntry*)(buffer + sizeof(MQTTAsync_commandIndexHeader));
+	current = NULL;
+	while (ListNextElement(MQTTAsync_commands, &current))
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+		if (cmd->client != client || cmd->persisted == 0)
+			continue;
+		memset(entry, '\0', sizeof(MQTTAsync_commandIndexEntry));
+		entry->seqno = cmd->seqno;
+		entry->MQTTVersion = cmd->persisted;
+		entry->type = cmd->command.type;
+		entry->token = cmd->command.token;
+		if (cmd->command.type == PUBLISH)
+		{
+			entry->qos = cmd->command.details.pub.qos;
+			entry->retained = cmd->command.details.pub.retained;
+			entry->payloadlen = cmd->command.details.pub.payloadlen;
+		}
+		entry++;
+	}
+
+	bufs[0] = buffer;
+	if (c->beforeWrite)
+		rc = c->beforeWrite(c->beforeWrite_context, 1, bufs, lens);
+	if ((rc = c->persistence->pput(c->phandle, PERSISTENCE_COMMAND_INDEX_KEY, 1, bufs, lens)) != 0)
+		Log(LOG_ERROR, 0, "Error %d persisting the command index", rc);
+exit:
+	if (buffer)
+		free(buffer);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Reads the command index snapshot of a client.
+ * @param c the client
+ * @param header set to the snapshot header, followed by the entries sorted by
+ * sequence number.  NULL if there is no usable snapshot.
+ * @return 0 on success, including when there is no snapshot, or an error code
+ */
+static int MQTTAsync_readCommandIndex(Clients* c, MQTTAsync_commandIndexHeader** header)
+{
+	char* buffer = NULL;
+	int buflen = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	*header = NULL;
+	if (c->persistence->pcontainskey(c->phandle, PERSISTENCE_COMMAND_INDEX_KEY) != 0)
+		goto exit;
+	if ((rc = c->persistence->pget(c->phandle, PERSISTENCE_COMMAND_INDEX_KEY, &buffer, &buflen)) != 0 ||
+		(c->afterRead && (rc = c->afterRead(c->afterRead_context, &buffer, &buflen)) != 0))
+	{
+		Log(LOG_ERROR, 0, "Error %d reading the command index", rc);
+		rc = 0; /* restore the commands from their records */
+		goto exit;
+	}
+	if (buflen >= (int)sizeof(MQTTAsync_commandIndexHeader))
+	{
+		MQTTAsync_commandIndexHeader* h = (MQTTAsync_commandIndexHeader*)buffer;
+
+		if (h->version == COMMAND_INDEX_VERSION && h->count >= 0 &&
+			(size_t)buflen == sizeof(MQTTAsync_commandIndexHeader) + h->count * sizeof(MQTTAsync_commandIndexEntry))
+		{
+			/* the snapshot is written in queue order, which is sequence number order unless the numbers wrapped */
+			qsort(buffer + sizeof(MQTTAsync_commandIndexHeader), (size_t)h->count,
+					sizeof(MQTTAsync_commandIndexEntry), cmpentries);
+			*header = h;
+			buffer = NULL;
+		}
+	}
+	if (*header == NULL)
+		Log(LOG_ERROR, 0, "Ignoring an invalid command index");
+exit:
+	if (buffer)
+		free(buffer);
+	FUNC_EXIT_RC(rc);
+	return rc;
 }
 
 
 int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 {
 	int rc = 0;
-	char **msgkeys;
-	int nkeys;
+	char **msgkeys = NULL;
+	int nkeys = 0;
 	int i = 0;
 	Clients* c = client->c;
 	int commands_restored = 0;
+	int commands_indexed = 0;
+	MQTTAsync_commandKey* cmdkeys = NULL;
+	int ncmdkeys = 0;
+	MQTTAsync_commandIndexHeader* index = NULL;
+	MQTTAsync_commandIndexEntry* entries = NULL;
+	int e = 0;
 
 	FUNC_ENTRY;
-	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0 && nkeys > 0)
+	if (c->persistence == NULL || (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) != 0 || nkeys == 0)
+		goto exit;
+
+	if ((cmdkeys = malloc(nkeys * sizeof(MQTTAsync_commandKey))) == NULL)
 	{
-		/* let's have the sequence number array sorted */
-		qsort(msgkeys, (size_t)nkeys, sizeof(char*), cmpkeys);
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	for (i = 0; i < nkeys; ++i)
+	{
+		int MQTTVersion = 0;
 
-		while (rc == 0 && i < nkeys)
+		if (strncmp(msgkeys[i], PERSISTENCE_V5_COMMAND_KEY, strlen(PERSISTENCE_V5_COMMAND_KEY)) == 0)
+			MQTTVersion = MQTTVERSION_5;
+		else if (strncmp(msgkeys[i], PERSISTENCE_COMMAND_KEY, strlen(PERSISTENCE_COMMAND_KEY)) == 0)
+			MQTTVersion = MQTTVERSION_3_1_1;
+		if (MQTTVersion)
 		{
-			char *buffer = NULL;
-			int buflen;
+			cmdkeys[ncmdkeys].seqno = (unsigned int)atoi(strchr(msgkeys[i], '-') + 1); /* key format is tag'-'seqno */
+			cmdkeys[ncmdkeys].MQTTVersion = MQTTVersion;
+			cmdkeys[ncmdkeys++].key = msgkeys[i];
+		}
+		else
+			free(msgkeys[i]);
+		msgkeys[i] = NULL;
+	}
+	/* let's have the sequence numbers sorted */
+	qsort(cmdkeys, (size_t)ncmdkeys, sizeof(MQTTAsync_commandKey), cmpkeys);
 
-			if (strncmp(msgkeys[i], PERSISTENCE_COMMAND_KEY, strlen(PERSISTENCE_COMMAND_KEY)) != 0 &&
-				strncmp(msgkeys[i], PERSISTENCE_V5_COMMAND_KEY, strlen(PERSISTENCE_V5_COMMAND_KEY)) != 0)
-			{
-				;
-			}
-			else
-			{
-				MQTTAsync_queuedCommand* cmd = NULL;
-				if ((rc = c->persistence->pget(c->phandle, msgkeys[i], &buffer, &buflen)) == 0 &&
-					(c->afterRead == NULL || (rc = c->afterRead(c->afterRead_context, &buffer, &buflen)) == 0))
-				{
-					int MQTTVersion = (strncmp(msgkeys[i], PERSISTENCE_V5_COMMAND_KEY, strlen(PERSISTENCE_V5_COMMAND_KEY)) == 0)
-										? MQTTVERSION_5 : MQTTVERSION_3_1_1;
-					cmd = MQTTAsync_restoreCommand(buffer, buflen, MQTTVersion, NULL);
-				}
+	if (ncmdkeys > 0 && (rc = MQTTAsync_readCommandIndex(c, &index)) == 0 && index)
+	{
+		entries = (MQTTAsync_commandIndexEntry*)((char*)index + sizeof(MQTTAsync_commandIndexHeader));
+		client->command_seqno = max(client->command_seqno, index->command_seqno);
+	}
 
-				if (cmd)
+	for (i = 0; rc == 0 && i < ncmdkeys; ++i)
+	{
+		MQTTAsync_queuedCommand* cmd = NULL;
+		char *buffer = NULL;
+		int buflen;
+
+		/* both lists are sorted, so step through the index alongside the keys */
+		while (index && e < index->count && entries[e].seqno < cmdkeys[i].seqno)
+			e++;
+		if (index && e < index->count && entries[e].seqno == cmdkeys[i].seqno &&
+			entries[e].MQTTVersion == cmdkeys[i].MQTTVersion)
+		{
+			if ((cmd = Slab_malloc(sizeof(MQTTAsync_queuedCommand))) != NULL)
+			{
+				memset(cmd, '\0', sizeof(MQTTAsync_queuedCommand));
+				cmd->not_restored = 1;
+				cmd->command.type = entries[e].type;
+				cmd->command.token = entries[e].token;
+				if (cmd->command.type == PUBLISH)
 				{
-					/* As the entire command is not restored on the first read to save memory, we temporarily store
-					 * the filename of the persisted command to be used when restoreCommand is called the second time.
-					 */
-					cmd->key = malloc(strlen(msgkeys[i])+1);
-					strcpy(cmd->key, msgkeys[i]);
-
-					cmd->client = client;
-					cmd->seqno = atoi(strchr(msgkeys[i], '-')+1); /* key format is tag'-'seqno */
-					/* we can just append the commands to the list as they've already been sorted */
-					ListAppend(MQTTAsync_commands, cmd, sizeof(MQTTAsync_queuedCommand));
-					client->command_seqno = max(client->command_seqno, cmd->seqno);
-					commands_restored++;
-					if (cmd->command.type == PUBLISH)
-						client->noBufferedMessages++;
+					cmd->command.details.pub.qos = entries[e].qos;
+					cmd->command.details.pub.retained = entries[e].retained;
+					cmd->command.details.pub.payloadlen = entries[e].payloadlen;
 				}
+				commands_indexed++;
 			}
-			if (buffer)
-				free(buffer);
+		}
+		else if ((rc = c->persistence->pget(c->phandle, cmdkeys[i].key, &buffer, &buflen)) == 0 &&
+			(c->afterRead == NULL || (rc = c->afterRead(c->afterRead_context, &buffer, &buflen)) == 0))
+			cmd = MQTTAsync_restoreCommand(buffer, buflen, cmdkeys[i].MQTTVersion, NULL);
+
+		if (cmd)
+		{
+			/* As the entire command is not restored on the first read to save memory, we temporarily store
+			 * the key of the persisted command to be used when restoreCommand is called the second time.
+			 */
+			cmd->key = cmdkeys[i].key;
+			cmdkeys[i].key = NULL;
+
+			cmd->client = client;
+			cmd->seqno = cmdkeys[i].seqno;
+			cmd->persisted = cmdkeys[i].MQTTVersion;
+			/* we can just append the commands to the list as they've already been sorted */
+			ListAppend(MQTTAsync_commands, cmd, sizeof(MQTTAsync_queuedCommand));
+			client->command_seqno = max(client->command_seqno, cmd->seqno);
+			commands_restored++;
+			cmd->lane = MQTTASYNC_LANE_NORMAL;
+			MQTTAsync_linkCommand(cmd);
+		}
+		if (buffer)
+			free(buffer);
+	}
+exit:
+	for (i = 0; i < ncmdkeys; ++i)
+	{
+		if (cmdkeys[i].key)
+			free(cmdkeys[i].key);
+	}
+	if (cmdkeys)
+		free(cmdkeys);
+	if (msgkeys)
+	{
+		for (i = 0; i < nkeys; ++i)
+		{
 			if (msgkeys[i])
 				free(msgkeys[i]);
-			i++;
 		}
-		if (msgkeys != NULL)
-			free(msgkeys);
+		free(msgkeys);
 	}
-	Log(TRACE_MINIMUM, -1, "%d commands restored for client %s", commands_restored, c->clientID);
+	if (index)
+		free(index);
+	Log(TRACE_MINIMUM, -1, "%d commands restored for client %s, %d from the index",
+			commands_restored, c->clientID, commands_indexed);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -705,7 +1039,8 @@ int MQTTAsync_unpersistCommandsAndMessages(Clients* c)
 			if (strncmp(msgkeys[i], PERSISTENCE_COMMAND_KEY, strlen(PERSISTENCE_COMMAND_KEY)) == 0 ||
 				strncmp(msgkeys[i], PERSISTENCE_V5_COMMAND_KEY, strlen(PERSISTENCE_V5_COMMAND_KEY)) == 0 ||
 				strncmp(msgkeys[i], PERSISTENCE_QUEUE_KEY, strlen(PERSISTENCE_QUEUE_KEY)) == 0 ||
-				strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) == 0)
+				strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) == 0 ||
+				strcmp(msgkeys[i], PERSISTENCE_COMMAND_INDEX_KEY) == 0)
 			{
 				if ((rc = c->persistence->premove(c->phandle, msgkeys[i])) == 0)
 					messages_deleted++;
@@ -789,6 +1124,282 @@ static int clientCompareConnectCommand(void* a, void* b)
 #endif
 
 
+/**
+ * The bytes of payload, topic and properties that a publish command holds in memory, which
+ * count against the maxBufferedBytes create option.  Once persisted, a command holds none.
+ * @param command the publish command
+ * @return the number of bytes
+ */
+static int MQTTAsync_publishBytes(MQTTAsync_queuedCommand* command)
+{
+	int bytes = command->command.properties.length;
+
+	if (command->command.details.pub.payload)
+		bytes += command->command.details.pub.payloadlen;
+	if (command->command.details.pub.destinationName)
+		bytes += (int)strlen(command->command.details.pub.destinationName) + 1;
+	return bytes;
+}
+
+
+/**
+ * Whether another publish command holding this many bytes in memory fits within the
+ * maxBufferedBytes create option.  Called with mqttcommand_mutex held.
+ * @param m the client
+ * @param bytes the bytes the command holds
+ * @return boolean
+ */
+static int MQTTAsync_bufferFits(MQTTAsyncs* m, int bytes)
+{
+	return m->createOptions == NULL || m->createOptions->struct_version < 5 || m->createOptions->maxBufferedBytes <= 0 ||
+		m->bufferedBytes + bytes <= (size_t)m->createOptions->maxBufferedBytes;
+}
+
+
+/**
+ * Link a command, which has been added to the end of the command queue, into its client's
+ * lanes if it is a publish, or into its controls if not.  Called with mqttcommand_mutex held.
+ * @param command the command
+ */
+static void MQTTAsync_linkCommand(MQTTAsync_queuedCommand* command)
+{
+	MQTTAsyncs* m = command->client;
+
+	command->order = m->command_order++;
+	if (command->command.type == PUBLISH)
+	{
+		command->bytes = MQTTAsync_publishBytes(command);
+		ListAppend(m->lanes[command->lane], command, sizeof(MQTTAsync_queuedCommand));
+		m->bufferedBytes += command->bytes;
+		m->noBufferedMessages++;
+		if (command->coalesce_key)
+			TreeAdd(m->coalesced, command, sizeof(MQTTAsync_queuedCommand));
+	}
+	else
+		ListAppend(m->controls, command, sizeof(MQTTAsync_queuedCommand));
+}
+
+
+/**
+ * Put a publish command, which has been added to the command queue just ahead of a
+ * buffered publish with the same coalescing key, in that one's place in its lane, and
+ * discard that one.  Called with mqttcommand_mutex held.
+ * @param replaced the buffered publish command
+ * @param command the new publish command
+ */
+static void MQTTAsync_replaceCommand(MQTTAsync_queuedCommand* replaced, MQTTAsync_queuedCommand* command)
+{
+	MQTTAsyncs* m = command->client;
+
+	command->lane = replaced->lane;
+	command->order = replaced->order;
+	command->bytes = MQTTAsync_publishBytes(command);
+	ListInsert(m->lanes[command->lane], command, sizeof(MQTTAsync_queuedCommand), &replaced->buffer_link);
+	m->bufferedBytes += command->bytes;
+	m->noBufferedMessages++;
+	MQTTAsync_discardPublish(replaced, MQTTASYNC_SUPERSEDED);
+	TreeAdd(m->coalesced, command, sizeof(MQTTAsync_queuedCommand));
+}
+
+
+/**
+ * Unlink a command from its client's lanes or controls, as it leaves the command queue.
+ * Called with mqttcommand_mutex held.
+ * @param command the command
+ */
+static void MQTTAsync_unlinkCommand(MQTTAsync_queuedCommand* command)
+{
+	MQTTAsyncs* m = command->client;
+
+	if (command->command.type != PUBLISH)
+		ListDetach(m->controls, command);
+	else if (ListDetach(m->lanes[command->lane], command))
+	{
+		m->bufferedBytes -= command->bytes;
+		m->noBufferedMessages--;
+		if (m->lanes[command->lane]->count == 0)
+			m->laneCredit[command->lane] = 0; /* an idle lane saves up no turns */
+		if (command->coalesce_key)
+		{
+			TreeRemove(m->coalesced, command);
+			free(command->coalesce_key); /* once it is sent, no newer message can replace it */
+			command->coalesce_key = NULL;
+		}
+	}
+}
+
+
+/**
+ * Tree comparison of a buffered publish command's coalescing key, with that of another
+ * command or with a key.
+ * @param a the command in the tree
+ * @param b the other command, or the key
+ * @param content whether b is a command
+ * @return as strcmp
+ */
+int MQTTAsync_coalesceCompare(void* a, void* b, int content)
+{
+	const char* key = (content) ? ((MQTTAsync_queuedCommand*)b)->coalesce_key : (const char*)b;
+
+	return strcmp(((MQTTAsync_queuedCommand*)a)->coalesce_key, key);
+}
+
+
+/* the share of the turns each lane gets while they all have messages waiting */
+static const int lane_weights[MQTTASYNC_LANES] = {16, 4, 1};
+
+/**
+ * Choose the lane the next publish of a client is sent from, by smooth weighted round robin
+ * over the lanes which have a publish waiting, ahead of the client's first subscribe,
+ * unsubscribe or disconnect.  Each such lane gains its weight in credit, and the one with
+ * the most is chosen and gives up the total, so the turns are interleaved in proportion to
+ * the weights.  Called with mqttcommand_mutex held.
+ * @param m the client
+ * @param charge whether to take the turn, rather than only look at whose turn it is
+ * @return the lane, or -1 if no publish may be sent next
+ */
+static int MQTTAsync_chooseLane(MQTTAsyncs* m, int charge)
+{
+	MQTTAsync_queuedCommand* barrier = (m->controls->first) ? (MQTTAsync_queuedCommand*)(m->controls->first->content) : NULL;
+	int lane = -1;
+	int best = 0;
+	int total = 0;
+	int i;
+
+	for (i = 0; i < MQTTASYNC_LANES; ++i)
+	{
+		MQTTAsync_queuedCommand* head = NULL;
+
+		if (m->lanes[i]->first == NULL)
+			continue;
+		head = (MQTTAsync_queuedCommand*)(m->lanes[i]->first->content);
+		if (barrier && (int)(head->order - barrier->order) > 0)
+			continue; /* queued after a command that it may not overtake */
+		total += lane_weights[i];
+		if (lane == -1 || m->laneCredit[i] + lane_weights[i] > best)
+		{
+			lane = i;
+			best = m->laneCredit[i] + lane_weights[i];
+		}
+		if (charge)
+			m->laneCredit[i] += lane_weights[i];
+	}
+	if (charge && lane != -1)
+		m->laneCredit[lane] -= total;
+	return lane;
+}
+
+
+/**
+ * Remove a buffered publish command from the command queue and from persistence.  If it
+ * has a failure callback, it is passed to the send thread to call that and free it, as
+ * the application's thread may be publishing, and the callback may publish in turn;
+ * otherwise it is freed.  Called with mqttcommand_mutex held.
+ * @param command the command
+ * @param code the return code given to the failure callback
+ */
+static void MQTTAsync_discardPublish(MQTTAsync_queuedCommand* command, int code)
+{
+	MQTTAsyncs* m = command->client;
+
+	MQTTAsync_unlinkCommand(command);
+	ListDetach(MQTTAsync_commands, command);
+#if !defined(NO_PERSISTENCE)
+	if (m->c->persistence && command->persisted)
+		MQTTAsync_unpersistCommand(command);
+#endif
+	if (command->command.onFailure || command->command.onFailure5)
+	{
+		command->discard_rc = code;
+		ListAppend(MQTTAsync_discarded, command, sizeof(MQTTAsync_queuedCommand));
+	}
+	else
+		MQTTAsync_freeCommand(command);
+}
+
+
+/**
+ * Call the failure callback of a command taken out of the command queue without being
+ * sent, with its discard_rc, and free it.  Called with mqttasync_mutex held, and not
+ * mqttcommand_mutex, so that the callback can call the API.
+ * @param command the command, which is in no list
+ */
+static void MQTTAsync_failDiscarded(MQTTAsync_queuedCommand* command)
+{
+	MQTTAsyncs* m = command->client;
+
+	if (command->command.onFailure)
+	{
+		MQTTAsync_failureData data;
+
+		data.token = command->command.token;
+		data.code = command->discard_rc;
+		data.message = NULL;
+		Log(TRACE_MIN, -1, "Calling %s failure for client %s, rc %d",
+				MQTTPacket_name(command->command.type), m->c->clientID, data.code);
+		(*(command->command.onFailure))(command->command.context, &data);
+	}
+	else if (command->command.onFailure5)
+	{
+		MQTTAsync_failureData5 data = MQTTAsync_failureData5_initializer;
+
+		data.token = command->command.token;
+		data.code = command->discard_rc;
+		if (command->command.type == PUBLISH)
+			data.packet_type = PUBLISH;
+		Log(TRACE_MIN, -1, "Calling %s failure for client %s, rc %d",
+				MQTTPacket_name(command->command.type), m->c->clientID, data.code);
+		(*(command->command.onFailure5))(command->command.context, &data);
+	}
+	MQTTAsync_freeCommand(command);
+}
+
+
+/**
+ * Call the failure callbacks of the publish commands of the current shard which have been
+ * discarded from the buffer, on the send thread.  Called without mqttasync_mutex.
+ */
+static void MQTTAsync_completeDiscarded(void)
+{
+	MQTTAsync_queuedCommand* command = NULL;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	while ((command = ListDetachHead(MQTTAsync_discarded)) != NULL)
+	{
+		MQTTAsync_unlock_mutex(mqttcommand_mutex);
+		MQTTAsync_failDiscarded(command);
+		MQTTAsync_lock_mutex(mqttcommand_mutex);
+	}
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Discard the oldest buffered publish command of a client from its lowest priority lane
+ * which has any, to make room for a new one, and call its failure callback.  Called with
+ * mqttcommand_mutex held, and at least one publish buffered.
+ * @param m the client
+ */
+static void MQTTAsync_dropOldestPublish(MQTTAsyncs* m)
+{
+	MQTTAsync_queuedCommand* first_publish = NULL;
+	int lane = MQTTASYNC_LANES - 1;
+
+	while (m->lanes[lane]->count == 0)
+		--lane;
+	first_publish = (MQTTAsync_queuedCommand*)(m->lanes[lane]->first->content);
+
+	Log(TRACE_MIN, -1, "Buffer full for client %s, discarding oldest message of %d bytes", m->c->clientID, first_publish->bytes);
+	m->droppedMessages++;
+	m->droppedBytes += (first_publish->bytes > 0) ? first_publish->bytes : first_publish->command.details.pub.payloadlen;
+	MQTTAsync_discardPublish(first_publish, MQTTASYNC_MAX_BUFFERED_MESSAGES);
+}
+
+
 int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
 {
 	int rc = MQTTASYNC_SUCCESS;
@@ -837,101 +1448,121 @@ int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
 	}
 	else
 	{
-		if (ListAppend(MQTTAsync_commands, command, command_size) == NULL)
-		{
-			rc = PAHO_MEMORY_ERROR;
-			goto exit;
-		}
+		MQTTAsyncs* m = command->client;
+		MQTTAsync_queuedCommand* replaced = NULL;
+		int persist = 0;
+
 #if !defined(NO_PERSISTENCE)
-		if (command->client->c->persistence)
+		persist = (m->c->persistence != NULL);
+		if (persist && command->command.type == PUBLISH &&
+			m->createOptions && m->createOptions->struct_version >= 2 &&
+			m->createOptions->persistQoS0 == 0 && command->command.details.pub.qos == 0)
+			persist = 0; /* don't persist QoS0 if that create option is set to 0 */
+#endif
+		if (command->command.type == PUBLISH && command->coalesce_key)
 		{
-			if (command->command.type == PUBLISH &&
-				command->client->createOptions && command->client->createOptions->struct_version >= 2 &&
-				command->client->createOptions->persistQoS0 == 0 && command->command.details.pub.qos == 0)
-				; /* don't persist QoS0 if that create option is set to 0 */
-			else
+			Node* found = TreeFind(m->coalesced, command->coalesce_key);
+
+			if (found)
 			{
-				rc = MQTTAsync_persistCommand(command);
-				if (command->command.type == PUBLISH && rc == 0)
+				replaced = (MQTTAsync_queuedCommand*)(found->content);
+				/* if it needs more room than the one it replaces, it is queued like any other */
+				if (!persist && !MQTTAsync_bufferFits(m, MQTTAsync_publishBytes(command) - replaced->bytes))
 				{
-					char key[PERSISTENCE_MAX_KEY_LENGTH + 1];
-					int chars = 0;
-
-					command->not_restored = 1;
-					if (command->client->c->MQTTVersion >= MQTTVERSION_5)
-						chars = snprintf(key, sizeof(key), "%s%u", PERSISTENCE_V5_COMMAND_KEY, command->seqno);
-					else
-						chars = snprintf(key, sizeof(key), "%s%u", PERSISTENCE_COMMAND_KEY, command->seqno);
-					if (chars >= sizeof(key))
-					{
-						rc = MQTTASYNC_PERSISTENCE_ERROR;
-						Log(LOG_ERROR, 0, "Error writing %d chars with snprintf", chars);
-						goto exit;
-					}
-					command->key = malloc(strlen(key)+1);
-					strcpy(command->key, key);
-
-					free(command->command.details.pub.payload);
-					command->command.details.pub.payload = NULL;
-					free(command->command.details.pub.destinationName);
-					command->command.details.pub.destinationName = NULL;
-					MQTTProperties_free(&command->command.properties);
+					MQTTAsync_discardPublish(replaced, MQTTASYNC_SUPERSEDED);
+					replaced = NULL;
 				}
 			}
 		}
+		if (command->command.type == PUBLISH && m->createOptions && replaced == NULL)
+		{
+			int bytes = MQTTAsync_publishBytes(command);
+			int delete_oldest = (m->createOptions->struct_version >= 2 && m->createOptions->deleteOldestMessages);
+
+			/* a persisted command holds no bytes in memory, so only the count can make it not fit */
+			if (m->noBufferedMessages >= m->createOptions->maxBufferedMessages && !delete_oldest)
+				rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
+			else if (!persist && !MQTTAsync_bufferFits(m, bytes))
+			{
+#if !defined(NO_PERSISTENCE)
+				if (m->c->persistence && m->createOptions->spillBufferedMessages)
+				{
+					persist = 1;
+					m->spilledMessages++;
+				}
+				else
 #endif
-		if (command->command.type == PUBLISH)
+				if (!delete_oldest || bytes > m->createOptions->maxBufferedBytes)
+					rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
+			}
+			if (rc == MQTTASYNC_MAX_BUFFERED_MESSAGES)
+			{
+				Log(TRACE_MIN, -1, "Buffer full for client %s, refusing message of %d bytes", m->c->clientID, bytes);
+				m->droppedMessages++;
+				m->droppedBytes += bytes;
+				MQTTAsync_freeCommand(command);
+				goto exit;
+			}
+		}
+
+		if (ListInsert(MQTTAsync_commands, command, command_size, (replaced) ? &replaced->link : NULL) == NULL)
 		{
-			/* delete oldest message if buffer is full.  We wouldn't be here if delete newest was in operation */
-			if (command->client->createOptions && (command->client->noBufferedMessages >= command->client->createOptions->maxBufferedMessages))
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+#if !defined(NO_PERSISTENCE)
+		if (persist)
+		{
+			if ((rc = MQTTAsync_persistCommand(command)) != 0)
 			{
-				MQTTAsync_queuedCommand* first_publish = NULL;
-				ListElement* current = NULL;
+				/* not queued, so that a retry by the application can't send it twice */
+				ListDetach(MQTTAsync_commands, command);
+				MQTTAsync_freeCommand(command);
+				goto exit;
+			}
+			if (command->command.type == PUBLISH)
+			{
+				char key[PERSISTENCE_MAX_KEY_LENGTH + 1];
+				int chars = 0;
 
-				/* Find first publish command for this client and detach it */
-				while (ListNextElement(MQTTAsync_commands, &current))
+				command->not_restored = 1;
+				if (command->client->c->MQTTVersion >= MQTTVERSION_5)
+					chars = snprintf(key, sizeof(key), "%s%u", PERSISTENCE_V5_COMMAND_KEY, command->seqno);
+				else
+					chars = snprintf(key, sizeof(key), "%s%u", PERSISTENCE_COMMAND_KEY, command->seqno);
+				if (chars >= sizeof(key))
 				{
-					MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
-
-					if (cmd->client == command->client && cmd->command.type == PUBLISH)
-					{
-						first_publish = cmd;
-						break;
-					}
+					rc = MQTTASYNC_PERSISTENCE_ERROR;
+					Log(LOG_ERROR, 0, "Error writing %d chars with snprintf", chars);
+					goto exit;
 				}
-				if (first_publish)
-				{
-					ListDetach(MQTTAsync_commands, first_publish);
+				command->key = malloc(strlen(key)+1);
+				strcpy(command->key, key);
 
-	#if !defined(NO_PERSISTENCE)
-					if (command->client->c->persistence)
-						MQTTAsync_unpersistCommand(first_publish);
+				free(command->command.details.pub.payload);
+				command->command.details.pub.payload = NULL;
+				free(command->command.details.pub.destinationName);
+				command->command.details.pub.destinationName = NULL;
+				MQTTProperties_free(&command->command.properties);
+			}
+			if (MQTTTime_elapsed(command->client->commandIndexTime) >= COMMAND_INDEX_INTERVAL)
+				MQTTAsync_persistCommandIndex(command->client);
+		}
 #endif
-					if (first_publish->command.onFailure)
-					{
-						MQTTAsync_failureData data;
-
-						data.token = first_publish->command.token;
-						data.code = MQTTASYNC_MAX_BUFFERED_MESSAGES;
-						data.message = NULL;
-						Log(TRACE_MIN, -1, "Calling connect failure for client %s, rc %d", command->client->c->clientID, data.code);
-						(*(first_publish->command.onFailure))(first_publish->command.context, &data);
-					} else if (first_publish->command.onFailure5)
-					{
-						MQTTAsync_failureData5 data;
-
-						data.token = first_publish->command.token;
-						data.code = MQTTASYNC_MAX_BUFFERED_MESSAGES;
-						data.message = NULL;
-						data.packet_type = PUBLISH;
-						Log(TRACE_MIN, -1, "Calling connect failure for client %s, rc %d", command->client->c->clientID, data.code);
-						(*(first_publish->command.onFailure5))(first_publish->command.context, &data);
-					}
-					MQTTAsync_freeCommand(first_publish);
-				}
+		if (replaced)
+			MQTTAsync_replaceCommand(replaced, command);
+		else
+		{
+			if (command->command.type == PUBLISH)
+			{
+				int bytes = MQTTAsync_publishBytes(command);
+
+				/* drop the oldest messages until this one fits.  We wouldn't be here if delete newest was in operation */
+				while (m->createOptions && m->noBufferedMessages > 0 &&
+						(m->noBufferedMessages >= m->createOptions->maxBufferedMessages || !MQTTAsync_bufferFits(m, bytes)))
+					MQTTAsync_dropOldestPublish(m);
 			}
-			else
-				command->client->noBufferedMessages++;
+			MQTTAsync_linkCommand(command);
 		}
 	}
 exit:
@@ -963,6 +1594,7 @@ void MQTTAsync_startConnectRetry(MQTTAsyncs* m)
 			m->retrying = 1;
 		}
 		m->currentInterval = MQTTAsync_randomJitter(m->currentIntervalBase, m->minRetryInterval, m->maxRetryInterval);
+		MQTTAsync_armTimers(m);
 	}
 }
 
@@ -1013,9 +1645,9 @@ void MQTTAsync_checkDisconnect(MQTTAsync handle, MQTTAsync_command* command)
 static int MQTTAsync_Socket_noPendingWrites(SOCKET socket)
 {
     int rc;
-    MQTTAsync_lock_mutex(socket_mutex);
+    MQTTAsync_lock_mutex(MQTTAsync_currentShard()->socket_mutex);
     rc = Socket_noPendingWrites(socket);
-    MQTTAsync_unlock_mutex(socket_mutex);
+    MQTTAsync_unlock_mutex(MQTTAsync_currentShard()->socket_mutex);
     return rc;
 }
 
@@ -1026,21 +1658,23 @@ static int MQTTAsync_Socket_noPendingWrites(SOCKET socket)
  */
 static void MQTTProtocol_checkPendingWrites(void)
 {
+	List* pending_writes = &(MQTTProtocol_getState()->pending_writes);
+
 	FUNC_ENTRY;
-	if (state.pending_writes.count > 0)
+	if (pending_writes->count > 0)
 	{
-		ListElement* le = state.pending_writes.first;
+		ListElement* le = pending_writes->first;
 		while (le)
 		{
 			if (Socket_noPendingWrites(((pending_write*)(le->content))->socket))
 			{
 				MQTTProtocol_removePublication(((pending_write*)(le->content))->p);
-				state.pending_writes.current = le;
-				ListRemove(&(state.pending_writes), le->content); /* does NextElement itself */
-				le = state.pending_writes.current;
+				pending_writes->current = le;
+				ListRemove(pending_writes, le->content); /* does NextElement itself */
+				le = pending_writes->current;
 			}
 			else
-				ListNextElement(&(state.pending_writes), &le);
+				ListNextElement(pending_writes, &le);
 		}
 	}
 	FUNC_EXIT;
@@ -1084,6 +1718,9 @@ static void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 	MQTTProperties_free(&command->command.properties);
 	if (command->not_restored && command->key)
 		free(command->key);
+	if (command->coalesce_key)
+		free(command->coalesce_key);
+	command->coalesce_key = NULL;
 }
 
 
@@ -1208,12 +1845,22 @@ void MQTTAsync_writeComplete(SOCKET socket, int rc)
 				if (com)
 				{
 					Log(TRACE_PROTOCOL, -1, "writeComplete: Removing response for msgid %d", com->command.token);
+					MQTTAsync_lock_mutex(m->client_mutex);
 					ListDetach(m->responses, com);
+					MQTTAsync_unlock_mutex(m->client_mutex);
 					MQTTAsync_freeCommand(com);
 				}
 			} /* if cur_response */
 			m->pending_write = NULL;
 		} /* if pending_write */
+
+		/* packets gathered while the write was pending can now go */
+		if (m->c->net.writebuf.len > 0 && sendThread_state != STOPPED)
+#if !defined(_WIN32) && !defined(_WIN64)
+			Thread_signal_cond(send_cond);
+#else
+			Thread_post_sem(send_sem);
+#endif
 	}
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
 	FUNC_EXIT;
@@ -1224,6 +1871,7 @@ static int MQTTAsync_processCommand(void)
 {
 	int rc = 0;
 	MQTTAsync_queuedCommand* command = NULL;
+	MQTTAsyncs* client = NULL;
 	ListElement* cur_command = NULL;
 	List* ignored_clients = NULL;
 
@@ -1245,6 +1893,15 @@ static int MQTTAsync_processCommand(void)
 		if (ListFind(ignored_clients, cmd->client))
 			continue;
 
+		if (cmd->command.type == PUBLISH)
+		{
+			/* the client's first command is a publish, but its lanes decide which one goes next */
+			int lane = MQTTAsync_chooseLane(cmd->client, 0);
+
+			if (lane != -1)
+				cmd = (MQTTAsync_queuedCommand*)(cmd->client->lanes[lane]->first->content);
+		}
+
 		if (cmd->command.type == CONNECT || cmd->command.type == DISCONNECT || (cmd->client->c->connected &&
 			cmd->client->c->connect_state == NOT_IN_PROGRESS && MQTTAsync_Socket_noPendingWrites(cmd->client->c->net.socket)))
 		{
@@ -1255,9 +1912,9 @@ static int MQTTAsync_processCommand(void)
 			}
 			else if (((cmd->command.type == PUBLISH && cmd->command.details.pub.qos > 0) ||
 						cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE) &&
-				(cmd->client->c->outboundMsgs->count >= cmd->client->c->maxInflightMessages))
+				(cmd->client->c->outboundMsgs->count >= MQTTProtocol_inflightLimit(cmd->client->c)))
 			{
-				Log(TRACE_MIN, -1, "Blocking on server receive maximum for client %s",
+				Log(TRACE_MIN, -1, "Blocking on inflight limit for client %s",
 						cmd->client->c->clientID); /* flow control */
 			}
 			else
@@ -1272,7 +1929,8 @@ static int MQTTAsync_processCommand(void)
 	if (command)
 	{
 		if (command->command.type == PUBLISH)
-			command->client->noBufferedMessages--;
+			MQTTAsync_chooseLane(command->client, 1);
+		MQTTAsync_unlinkCommand(command);
 		ListDetach(MQTTAsync_commands, command);
 #if !defined(NO_PERSISTENCE)
 		/*printf("outboundmsgs count %d max inflight %d qos %d %d %d\n", command->client->c->outboundMsgs->count, command->client->c->maxInflightMessages,
@@ -1306,11 +1964,15 @@ static int MQTTAsync_processCommand(void)
 				MQTTAsync_unpersistCommand(command);
 		}
 #endif
+		/* its message id stays in use until it is in the outbound messages or responses */
+		if (command)
+			command->client->sendingMsgId = command->command.token;
 	}
 	MQTTAsync_unlock_mutex(mqttcommand_mutex);
 
 	if (!command)
 		goto exit; /* nothing to do */
+	client = command->client; /* the command may be freed before its client's timers are armed */
 
 	if (command->command.type == CONNECT)
 	{
@@ -1451,15 +2113,12 @@ static int MQTTAsync_processCommand(void)
 		Publish* p = NULL;
 		MQTTProperties initialized = MQTTProperties_initializer;
 
-		if ((p = malloc(sizeof(Publish))) == NULL)
+		if ((p = Slab_malloc(sizeof(Publish))) == NULL)
 		{
 			rc = PAHO_MEMORY_ERROR;
 			goto exit;
 		}
 
-		/* Initialize the mask */
-		memset(p->mask, 0, sizeof(p->mask));
-
 		p->payload = command->command.details.pub.payload;
 		p->payloadlen = command->command.details.pub.payloadlen;
 		p->topic = command->command.details.pub.destinationName;
@@ -1469,7 +2128,9 @@ static int MQTTAsync_processCommand(void)
 		if (p->MQTTVersion >= MQTTVERSION_5)
 			p->properties = command->command.properties;
 
+		MQTTAsync_lock_mutex(command->client->client_mutex);
 		rc = MQTTProtocol_startPublish(command->client->c, p, command->command.details.pub.qos, command->command.details.pub.retained, &msg);
+		MQTTAsync_unlock_mutex(command->client->client_mutex);
 
 		if (command->command.details.pub.qos == 0)
 		{
@@ -1567,7 +2228,11 @@ static int MQTTAsync_processCommand(void)
 			rc != SOCKET_ERROR && rc != MQTTASYNC_PERSISTENCE_ERROR)
 	{
 		if (rc == TCPSOCKET_INTERRUPTED)
+		{
+			MQTTAsync_lock_mutex(command->client->client_mutex);
 			ListAppend(command->client->responses, command, sizeof(command));
+			MQTTAsync_unlock_mutex(command->client->client_mutex);
+		}
 		else
 			MQTTAsync_freeCommand(command);
 	}
@@ -1577,7 +2242,9 @@ static int MQTTAsync_processCommand(void)
 		{
 			MQTTAsync_disconnectOptions opts = MQTTAsync_disconnectOptions_initializer;
 			MQTTAsync_disconnect(command->client, &opts); /* not "internal" because we don't want to call connection lost */
+			MQTTAsync_lock_mutex(command->client->client_mutex);
 			command->client->shouldBeConnected = 1; /* as above call is not "internal" we need to reset this */
+			MQTTAsync_unlock_mutex(command->client->client_mutex);
 		}
 		else
 			MQTTAsync_disconnect_internal(command->client, 0);
@@ -1629,9 +2296,20 @@ static int MQTTAsync_processCommand(void)
 		}
 	}
 	else /* put the command into a waiting for response queue for each client, indexed by msgid */
+	{
+		MQTTAsync_lock_mutex(command->client->client_mutex);
 		ListAppend(command->client->responses, command, sizeof(command));
+		MQTTAsync_unlock_mutex(command->client->client_mutex);
+	}
+	MQTTAsync_armTimers(client);
 
 exit:
+	if (client)
+	{
+		MQTTAsync_lock_mutex(client->client_mutex);
+		client->sendingMsgId = 0;
+		MQTTAsync_unlock_mutex(client->client_mutex);
+	}
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
 	rc = (command != NULL);
 	FUNC_EXIT_RC(rc);
@@ -1659,7 +2337,7 @@ static void nextOrClose(MQTTAsyncs* m, int rc, char* message)
 			connectionLost_called = 1;
 		}
 		/* put the connect command back to the head of the command queue, using the next serverURI */
-		if ((conn = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+		if ((conn = Slab_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 			goto exit;
 		memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 		conn->client = m;
@@ -1723,110 +2401,160 @@ exit:
 }
 
 
+/**
+ * Run the timer callbacks for the deadlines which have been reached.  Called from
+ * the send thread, which sleeps until the next deadline in between.
+ */
 static void MQTTAsync_checkTimeouts(void)
 {
-	ListElement* current = NULL;
-	static START_TIME_TYPE last = START_TIME_ZERO;
-	START_TIME_TYPE now;
-
 	FUNC_ENTRY;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
-	now = MQTTTime_now();
-	if (MQTTTime_difftime(now, last) < (DIFF_TIME_TYPE)3000)
-		goto exit;
-	last = now;
-	while (ListNextElement(MQTTAsync_handles, &current))		/* for each client */
-	{
-		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+	if (MQTTAsync_currentShard()->initialized)
+		TimerWheel_expire(&MQTTAsync_timers, TimerWheel_now(&MQTTAsync_timers));
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	FUNC_EXIT;
+}
 
-		/* check disconnect timeout */
-		if (m->c->connect_state == DISCONNECTING)
-			MQTTAsync_checkDisconnect(m, &m->disconnect);
 
-		/* check connect timeout */
-		if (m->c->connect_state != NOT_IN_PROGRESS && MQTTTime_elapsed(m->connect.start_time) > (ELAPSED_TIME_TYPE)(m->connectTimeout * 1000))
-		{
-			nextOrClose(m, MQTTASYNC_FAILURE, "TCP connect timeout");
-			continue;
-		}
+/**
+ * Check the disconnect, connect and reconnect timeouts for one client
+ * @param m the client
+ */
+static void MQTTAsync_checkClientTimeouts(MQTTAsyncs* m)
+{
+	FUNC_ENTRY;
+	/* check disconnect timeout */
+	if (m->c->connect_state == DISCONNECTING)
+		MQTTAsync_checkDisconnect(m, &m->disconnect);
 
-		/* There was a section here that removed timed-out responses.  But if the command had completed and
-		 * there was a response, then we may as well report it, no?
-		 *
-		 * In any case, that section was disabled when automatic reconnect was implemented.
-		 */
+	/* check connect timeout */
+	if (m->c->connect_state != NOT_IN_PROGRESS && MQTTTime_elapsed(m->connect.start_time) > (ELAPSED_TIME_TYPE)(m->connectTimeout * 1000))
+	{
+		nextOrClose(m, MQTTASYNC_FAILURE, "TCP connect timeout");
+		goto exit;
+	}
+
+	/* There was a section here that removed timed-out responses.  But if the command had completed and
+	 * there was a response, then we may as well report it, no?
+	 *
+	 * In any case, that section was disabled when automatic reconnect was implemented.
+	 */
 
-		if (m->automaticReconnect && m->retrying)
+	if (m->automaticReconnect && m->retrying)
+	{
+		if (m->reconnectNow || MQTTTime_elapsed(m->lastConnectionFailedTime) > (ELAPSED_TIME_TYPE)(m->currentInterval * 1000))
 		{
-			if (m->reconnectNow || MQTTTime_elapsed(m->lastConnectionFailedTime) > (ELAPSED_TIME_TYPE)(m->currentInterval * 1000))
+			/* to reconnect put the connect command to the head of the command queue */
+			MQTTAsync_queuedCommand* conn = Slab_malloc(sizeof(MQTTAsync_queuedCommand));
+			if (!conn)
+				goto exit;
+			memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+			conn->client = m;
+			conn->command = m->connect;
+  			/* make sure that the version attempts are restarted */
+			if (m->c->MQTTVersion == MQTTVERSION_DEFAULT)
+				conn->command.details.conn.MQTTVersion = 0;
+			if (m->updateConnectOptions)
 			{
-				/* to reconnect put the connect command to the head of the command queue */
-				MQTTAsync_queuedCommand* conn = malloc(sizeof(MQTTAsync_queuedCommand));
-				if (!conn)
-					goto exit;
-				memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
-				conn->client = m;
-				conn->command = m->connect;
-	  			/* make sure that the version attempts are restarted */
-				if (m->c->MQTTVersion == MQTTVERSION_DEFAULT)
-					conn->command.details.conn.MQTTVersion = 0;
-				if (m->updateConnectOptions)
-				{
-					MQTTAsync_connectData connectData = MQTTAsync_connectData_initializer;
-					int callback_rc = MQTTASYNC_SUCCESS;
+				MQTTAsync_connectData connectData = MQTTAsync_connectData_initializer;
+				int callback_rc = MQTTASYNC_SUCCESS;
 
-					connectData.username = m->c->username;
-					connectData.binarypwd.data = m->c->password;
-					connectData.binarypwd.len = m->c->passwordlen;
-					Log(TRACE_MIN, -1, "Calling updateConnectOptions for client %s", m->c->clientID);
-					callback_rc = (*(m->updateConnectOptions))(m->updateConnectOptions_context, &connectData);
+				connectData.username = m->c->username;
+				connectData.binarypwd.data = m->c->password;
+				connectData.binarypwd.len = m->c->passwordlen;
+				Log(TRACE_MIN, -1, "Calling updateConnectOptions for client %s", m->c->clientID);
+				callback_rc = (*(m->updateConnectOptions))(m->updateConnectOptions_context, &connectData);
 
-					if (callback_rc)
+				if (callback_rc)
+				{
+					if (connectData.username != m->c->username)
 					{
-						if (connectData.username != m->c->username)
+						if (m->c->username)
+							free((void*)m->c->username);
+						if (connectData.username)
+							m->c->username = connectData.username; /* must be allocated by MQTTAsync_malloc in the callback */
+						else
+							m->c->username = NULL;
+					}
+					if (connectData.binarypwd.data != m->c->password)
+					{
+						if (m->c->password)
+							free((void*)m->c->password);
+						if (connectData.binarypwd.data)
 						{
-							if (m->c->username)
-								free((void*)m->c->username);
-							if (connectData.username)
-								m->c->username = connectData.username; /* must be allocated by MQTTAsync_malloc in the callback */
-							else
-								m->c->username = NULL;
+							m->c->passwordlen = connectData.binarypwd.len;
+							m->c->password = connectData.binarypwd.data; /* must be allocated by MQTTAsync_malloc in the callback */
 						}
-						if (connectData.binarypwd.data != m->c->password)
+						else
 						{
-							if (m->c->password)
-								free((void*)m->c->password);
-							if (connectData.binarypwd.data)
-							{
-								m->c->passwordlen = connectData.binarypwd.len;
-								m->c->password = connectData.binarypwd.data; /* must be allocated by MQTTAsync_malloc in the callback */
-							}
-							else
-							{
-								m->c->password = NULL;
-								m->c->passwordlen = 0;
-							}
+							m->c->password = NULL;
+							m->c->passwordlen = 0;
 						}
 					}
 				}
-				Log(TRACE_MIN, -1, "Automatically attempting to reconnect");
-				MQTTAsync_addCommand(conn, sizeof(m->connect));
-				m->reconnectNow = 0;
 			}
+			Log(TRACE_MIN, -1, "Automatically attempting to reconnect");
+			MQTTAsync_addCommand(conn, sizeof(m->connect));
+			m->reconnectNow = 0;
 		}
 	}
 exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Write out the publish packets gathered for clients using outbound coalescing, as the
+ * send thread has run out of commands it can process for now.
+ */
+static void MQTTAsync_flushCoalesced(void)
+{
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	while (ListNextElement(MQTTAsync_handles, &current))
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+
+		if (m->c->net.writebuf.len > 0 && m->c->connected && MQTTPacket_flush(&m->c->net) == SOCKET_ERROR)
+		{
+			Log(TRACE_MIN, -1, "Error writing gathered packets for client %s", m->c->clientID);
+			MQTTAsync_disconnect_internal(m, 0);
+		}
+	}
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
 	FUNC_EXIT;
 }
 
 
+/**
+ * Name an I/O thread, with the index of its shard after the first
+ * @param name the name of the thread in the default shard
+ */
+static void MQTTAsync_setThreadName(const char* name)
+{
+	int index = MQTTAsync_currentShard()->index;
+
+	if (index == 0)
+		Thread_set_name(name);
+	else
+	{
+		char buf[16]; /* the longest thread name on Linux, with the terminating null */
+
+		snprintf(buf, sizeof(buf), "%s%d", name, index);
+		Thread_set_name(buf);
+	}
+}
+
+
 thread_return_type WINAPI MQTTAsync_sendThread(void* n)
 {
 	int timeout = 10; /* first time in we have a small timeout.  Gets things started more quickly */
 
 	FUNC_ENTRY;
-	Thread_set_name("MQTTAsync_send");
+	MQTTAsync_bindShard((MQTTAsync_shard*)n);
+	MQTTAsync_setThreadName("MQTTAsync_send");
 	MQTTAsync_lock_mutex(mqttasync_mutex);
 	sendThread_state = RUNNING;
 	sendThread_id = Paho_thread_getid();
@@ -1834,27 +2562,30 @@ thread_return_type WINAPI MQTTAsync_sendThread(void* n)
 	while (!MQTTAsync_tostop)
 	{
 		int rc;
-		int command_count = 0;
 
-		MQTTAsync_lock_mutex(mqttcommand_mutex);
-		command_count = MQTTAsync_commands->count;
-		MQTTAsync_unlock_mutex(mqttcommand_mutex);
-		while (command_count > 0)
+		MQTTAsync_processCommands();
+		MQTTAsync_lock_mutex(mqttasync_mutex);
 		{
-			if (MQTTAsync_processCommand() == 0)
-				break;  /* no commands were processed, so go into a wait */
-			MQTTAsync_lock_mutex(mqttcommand_mutex);
-			command_count = MQTTAsync_commands->count;
-			MQTTAsync_unlock_mutex(mqttcommand_mutex);
+			/* sleep until the next client deadline, if that is sooner */
+			uint64_t now = TimerWheel_now(&MQTTAsync_timers);
+			uint64_t next = 0;
+
+			if (TimerWheel_nextDeadline(&MQTTAsync_timers, &next) && next < now + (uint64_t)timeout)
+				timeout = (next > now) ? (int)(next - now) : 0;
+			sendThread_wakeTime = now + (uint64_t)timeout;
 		}
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+		if (timeout > 0)
+		{
 #if !defined(_WIN32) && !defined(_WIN64)
-		if ((rc = Thread_wait_cond(send_cond, timeout)) != 0 && rc != ETIMEDOUT)
-			Log(LOG_ERROR, -1, "Error %d waiting for condition variable", rc);
+			if ((rc = Thread_wait_cond(send_cond, timeout)) != 0 && rc != ETIMEDOUT)
+				Log(LOG_ERROR, -1, "Error %d waiting for condition variable", rc);
 #else
-		if ((rc = Thread_wait_sem(send_sem, timeout)) != 0 && rc != ETIMEDOUT)
-			Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
+			if ((rc = Thread_wait_sem(send_sem, timeout)) != 0 && rc != ETIMEDOUT)
+				Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
 #endif
-		timeout = 1000; /* 1 second for follow on waits */
+		}
+		timeout = 1000; /* 1 second for follow on waits, unless a deadline is sooner */
 		MQTTAsync_checkTimeouts();
 	}
 	sendThread_state = STOPPING;
@@ -1906,11 +2637,20 @@ void MQTTAsync_freeResponses(MQTTAsyncs* m)
 	FUNC_ENTRY;
 	if (m->responses)
 	{
-		ListElement* cur_response = NULL;
-
-		while (ListNextElement(m->responses, &cur_response))
+		for (;;)
 		{
-			MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(cur_response->content);
+			MQTTAsync_queuedCommand* command = NULL;
+
+			/* each is taken off the list before it is freed, as a publish may be looking through it */
+			MQTTAsync_lock_mutex(m->client_mutex);
+			if (m->responses->first)
+			{
+				command = (MQTTAsync_queuedCommand*)(m->responses->first->content);
+				ListDetach(m->responses, command);
+			}
+			MQTTAsync_unlock_mutex(m->client_mutex);
+			if (command == NULL)
+				break;
 
 			if (command->command.onFailure)
 			{
@@ -1940,7 +2680,6 @@ void MQTTAsync_freeResponses(MQTTAsyncs* m)
 			MQTTAsync_freeCommand1(command);
 			count++;
 		}
-		ListEmpty(m->responses);
 	}
 	Log(TRACE_MINIMUM, -1, "%d responses removed for client %s", count, m->c->clientID);
 	FUNC_EXIT;
@@ -1950,52 +2689,57 @@ void MQTTAsync_freeResponses(MQTTAsyncs* m)
 void MQTTAsync_freeCommands(MQTTAsyncs* m)
 {
 	int count = 0;
+	List failed;
 	ListElement* current = NULL;
 	ListElement *next = NULL;
+	MQTTAsync_queuedCommand* command = NULL;
 
 	FUNC_ENTRY;
-	/* remove commands in the command queue relating to this client */
+	ListZero(&failed);
+	failed.intrusive = 1;
+	failed.link_offset = offsetof(MQTTAsync_queuedCommand, link);
+
+	/* publishing threads change the lists holding only mqttcommand_mutex, so the client's
+	   commands are taken out under it, and their callbacks called once it is released */
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+
+	/* the publishes discarded from this client's buffer, which the send thread hasn't completed yet */
+	current = ListNextElement(MQTTAsync_discarded, &next);
+	ListNextElement(MQTTAsync_discarded, &next);
+	while (current)
+	{
+		command = (MQTTAsync_queuedCommand*)(current->content);
+		if (command->client == m)
+		{
+			ListDetach(MQTTAsync_discarded, command);
+			ListAppend(&failed, command, sizeof(MQTTAsync_queuedCommand));
+		}
+		current = next;
+		ListNextElement(MQTTAsync_discarded, &next);
+	}
+
+	/* and the commands in the command queue relating to this client */
+	next = NULL;
 	current = ListNextElement(MQTTAsync_commands, &next);
 	ListNextElement(MQTTAsync_commands, &next);
 	while (current)
 	{
-		MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
-
+		command = (MQTTAsync_queuedCommand*)(current->content);
 		if (command->client == m)
 		{
+			MQTTAsync_unlinkCommand(command);
 			ListDetach(MQTTAsync_commands, command);
-
-			if (command->command.onFailure)
-			{
-				MQTTAsync_failureData data;
-
-				data.token = command->command.token;
-				data.code = MQTTASYNC_OPERATION_INCOMPLETE; /* interrupted return code */
-				data.message = NULL;
-
-				Log(TRACE_MIN, -1, "Calling %s failure for client %s",
-							MQTTPacket_name(command->command.type), m->c->clientID);
-					(*(command->command.onFailure))(command->command.context, &data);
-			}
-			else if (command->command.onFailure5)
-			{
-				MQTTAsync_failureData5 data = MQTTAsync_failureData5_initializer;
-
-				data.token = command->command.token;
-				data.code = MQTTASYNC_OPERATION_INCOMPLETE; /* interrupted return code */
-				data.message = NULL;
-
-				Log(TRACE_MIN, -1, "Calling %s failure for client %s",
-							MQTTPacket_name(command->command.type), m->c->clientID);
-					(*(command->command.onFailure5))(command->command.context, &data);
-			}
-
-			MQTTAsync_freeCommand(command);
+			command->discard_rc = MQTTASYNC_OPERATION_INCOMPLETE; /* interrupted return code */
+			ListAppend(&failed, command, sizeof(MQTTAsync_queuedCommand));
 			count++;
 		}
 		current = next;
 		ListNextElement(MQTTAsync_commands, &next);
 	}
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+
+	while ((command = ListDetachHead(&failed)) != NULL)
+		MQTTAsync_failDiscarded(command);
 	Log(TRACE_MINIMUM, -1, "%d commands removed for client %s", count, m->c->clientID);
 	FUNC_EXIT;
 }
@@ -2012,9 +2756,39 @@ static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack)
 		if ((rc = connack->rc) == MQTTASYNC_SUCCESS)
 		{
 			m->retrying = 0;
+			MQTTAsync_lock_mutex(m->client_mutex);
 			m->c->connected = 1;
+			MQTTAsync_unlock_mutex(m->client_mutex);
 			m->c->good = 1;
 			m->c->connect_state = NOT_IN_PROGRESS;
+			TopicAliases_free(m->c->outboundAliases);
+			m->c->outboundAliases = NULL;
+			TopicAliases_free(m->c->inboundAliases);
+			m->c->inboundAliases = NULL;
+			MQTTProtocol_inflightReset(m->c);
+			if (m->c->MQTTVersion >= MQTTVERSION_5 && m->connectProps &&
+					MQTTProperties_hasProperty(m->connectProps, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM))
+			{
+				/* the server may use as many aliases as we allowed in the CONNECT */
+				int maximum = (int)MQTTProperties_getNumericValue(m->connectProps, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+
+				if (maximum > 0)
+					m->c->inboundAliases = TopicAliases_create(maximum);
+			}
+			if (m->c->MQTTVersion >= MQTTVERSION_5 && m->c->outboundTopicAliasMaximum > 0 &&
+					MQTTProperties_hasProperty(&connack->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM))
+			{
+				/* assign no more aliases than either the server or the application allows */
+				int maximum = (int)MQTTProperties_getNumericValue(&connack->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+
+				if (maximum > m->c->outboundTopicAliasMaximum)
+					maximum = m->c->outboundTopicAliasMaximum;
+				if (maximum > 0)
+				{
+					Log(LOG_PROTOCOL, -1, "Assigning up to %d outbound topic aliases", maximum);
+					m->c->outboundAliases = TopicAliases_create(maximum);
+				}
+			}
 			if (m->c->cleansession || m->c->cleanstart)
 				rc = MQTTAsync_cleanSession(m->c);
 			else if (m->c->MQTTVersion >= MQTTVERSION_3_1_1 && connack->flags.bits.sessionPresent == 0)
@@ -2032,7 +2806,7 @@ static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack)
 					Messages* messages = (Messages*)(outcurrent->content);
 					memset(&messages->lastTouch, '\0', sizeof(messages->lastTouch));
 				}
-				MQTTProtocol_retry(zero, 1, 1);
+				MQTTProtocol_retryClient(zero, m->c, 1);
 				if (m->c->connected != 1)
 					rc = MQTTASYNC_DISCONNECTED;
 			}
@@ -2058,6 +2832,7 @@ static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack)
 			}
 		}
 		m->pack = NULL;
+		MQTTAsync_armTimers(m);
 #if !defined(_WIN32) && !defined(_WIN64)
 		Thread_signal_cond(send_cond);
 #else
@@ -2069,325 +2844,357 @@ static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack)
 }
 
 
-/* This is the thread function that handles the calling of callback functions if set */
-thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
+/**
+ * Handle what MQTTAsync_cycle has read from a socket, calling the client's callbacks.
+ * Called with mqttasync_mutex held, from the receive thread or MQTTAsync_runLoop.
+ * @param sock the socket which was ready
+ * @param pack the packet read, which is freed here, or NULL
+ * @param rc the return code from MQTTAsync_cycle
+ */
+static void MQTTAsync_handleCycle(SOCKET sock, MQTTPacket* pack, int rc)
 {
-	long timeout = 10L; /* first time in we have a small timeout.  Gets things started more quickly */
+	MQTTAsyncs* m = NULL;
 
 	FUNC_ENTRY;
-	Thread_set_name("MQTTAsync_rcv");
-	MQTTAsync_lock_mutex(mqttasync_mutex);
-	receiveThread_state = RUNNING;
-	receiveThread_id = Paho_thread_getid();
-	while (!MQTTAsync_tostop)
+	/* find client corresponding to socket */
+	if (ListFindItem(MQTTAsync_handles, &sock, clientSockCompare) == NULL)
 	{
-		int rc = SOCKET_ERROR;
-		SOCKET sock = -1;
-		MQTTAsyncs* m = NULL;
-		MQTTPacket* pack = NULL;
-
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
-		pack = MQTTAsync_cycle(&sock, timeout, &rc);
-		MQTTAsync_lock_mutex(mqttasync_mutex);
-		if (MQTTAsync_tostop)
-			break;
-
-		if (sock == 0)
-			continue;
-		timeout = 1000L;
-
-		/* find client corresponding to socket */
-		if (ListFindItem(MQTTAsync_handles, &sock, clientSockCompare) == NULL)
-		{
-			Log(TRACE_MINIMUM, -1, "Could not find client corresponding to socket %d", sock);
-			/* Socket_close(sock); - removing socket in this case is not necessary (Bug 442400) */
-			continue;
-		}
-		m = (MQTTAsyncs*)(MQTTAsync_handles->current->content);
-		if (m == NULL)
-		{
-			Log(LOG_ERROR, -1, "Client structure was NULL for socket %d - removing socket", sock);
-			Socket_close(sock);
-			continue;
-		}
-		if (rc == SOCKET_ERROR)
-		{
-			Log(TRACE_MINIMUM, -1, "Error from MQTTAsync_cycle() - removing socket %d", sock);
-			nextOrClose(m, rc, "socket error");
-		}
-		else
+		Log(TRACE_MINIMUM, -1, "Could not find client corresponding to socket %d", sock);
+		/* Socket_close(sock); - removing socket in this case is not necessary (Bug 442400) */
+		goto exit;
+	}
+	m = (MQTTAsyncs*)(MQTTAsync_handles->current->content);
+	if (m == NULL)
+	{
+		Log(LOG_ERROR, -1, "Client structure was NULL for socket %d - removing socket", sock);
+		Socket_close(sock);
+		goto exit;
+	}
+	if (rc == SOCKET_ERROR)
+	{
+		Log(TRACE_MINIMUM, -1, "Error from MQTTAsync_cycle() - removing socket %d", sock);
+		nextOrClose(m, rc, "socket error");
+	}
+	else
+	{
+		if (m->c->messageQueue->count > 0 && m->ma)
 		{
-			if (m->c->messageQueue->count > 0 && m->ma)
-			{
-				qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
-				int topicLen = qe->topicLen;
+			qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
+			int topicLen = qe->topicLen;
 
-				if (strlen(qe->topicName) == topicLen)
-					topicLen = 0;
+			if (strlen(qe->topicName) == topicLen)
+				topicLen = 0;
 
-				if (MQTTAsync_deliverMessage(m, qe->topicName, topicLen, qe->msg))
-				{
+			if (MQTTAsync_deliverMessage(m, qe->topicName, topicLen, qe->msg))
+			{
 #if !defined(NO_PERSISTENCE)
-					if (m->c->persistence)
-						MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
+				if (m->c->persistence)
+					MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
 #endif
-					ListRemove(m->c->messageQueue, qe); /* qe is freed here */
-				}
-				else
-					Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
-						m->c->clientID);
+				ListRemove(m->c->messageQueue, qe); /* qe is freed here */
 			}
-			if (pack)
+			else
+				Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
+					m->c->clientID);
+		}
+		if (pack)
+		{
+			if (pack->header.bits.type == CONNACK)
 			{
-				if (pack->header.bits.type == CONNACK)
-				{
-					Connack* connack = (Connack*)pack;
-					int sessionPresent = connack->flags.bits.sessionPresent;
+				Connack* connack = (Connack*)pack;
+				int sessionPresent = connack->flags.bits.sessionPresent;
 
-					rc = MQTTAsync_completeConnection(m, connack);
-					if (rc == MQTTASYNC_SUCCESS)
+				rc = MQTTAsync_completeConnection(m, connack);
+				if (rc == MQTTASYNC_SUCCESS)
+				{
+					int onSuccess = 0;
+					if ((m->serverURIcount > 0)
+					    && (m->connect.details.conn.currentURI < m->serverURIcount))
+					{
+						Log(TRACE_MIN, -1, "Connect succeeded to %s",
+							m->serverURIs[m->connect.details.conn.currentURI]);
+					}
+					onSuccess = (m->connect.onSuccess != NULL ||
+							m->connect.onSuccess5 != NULL); /* save setting of onSuccess callback */
+					if (m->connect.onSuccess)
 					{
-						int onSuccess = 0;
+						MQTTAsync_successData data;
+						memset(&data, '\0', sizeof(data));
+						Log(TRACE_MIN, -1, "Calling connect success for client %s", m->c->clientID);
 						if ((m->serverURIcount > 0)
 						    && (m->connect.details.conn.currentURI < m->serverURIcount))
-						{
-							Log(TRACE_MIN, -1, "Connect succeeded to %s",
-								m->serverURIs[m->connect.details.conn.currentURI]);
-						}
-						onSuccess = (m->connect.onSuccess != NULL ||
-								m->connect.onSuccess5 != NULL); /* save setting of onSuccess callback */
-						if (m->connect.onSuccess)
-						{
-							MQTTAsync_successData data;
-							memset(&data, '\0', sizeof(data));
-							Log(TRACE_MIN, -1, "Calling connect success for client %s", m->c->clientID);
-							if ((m->serverURIcount > 0)
-							    && (m->connect.details.conn.currentURI < m->serverURIcount))
-								data.alt.connect.serverURI = m->serverURIs[m->connect.details.conn.currentURI];
-							else
-								data.alt.connect.serverURI = m->serverURI;
-							data.alt.connect.MQTTVersion = m->connect.details.conn.MQTTVersion;
-							data.alt.connect.sessionPresent = sessionPresent;
-							(*(m->connect.onSuccess))(m->connect.context, &data);
-							/* Null out callback pointers so they aren't accidentally called again */
-							m->connect.onSuccess = NULL;
-							m->connect.onFailure = NULL;
-						}
-						else if (m->connect.onSuccess5)
-						{
-							MQTTAsync_successData5 data = MQTTAsync_successData5_initializer;
-							Log(TRACE_MIN, -1, "Calling connect success for client %s", m->c->clientID);
-							if (m->serverURIcount > 0)
-								data.alt.connect.serverURI = m->serverURIs[m->connect.details.conn.currentURI];
-							else
-								data.alt.connect.serverURI = m->serverURI;
-							data.alt.connect.MQTTVersion = m->connect.details.conn.MQTTVersion;
-							data.alt.connect.sessionPresent = sessionPresent;
-							data.properties = connack->properties;
-							data.reasonCode = connack->rc;
-							(*(m->connect.onSuccess5))(m->connect.context, &data);
-							/* Null out callback pointers so they aren't accidentally called again */
-							m->connect.onSuccess5 = NULL;
-							m->connect.onFailure5 = NULL;
-						}
-						if (m->connected)
-						{
-							char* reason = (onSuccess) ? "connect onSuccess called" : "automatic reconnect";
-							Log(TRACE_MIN, -1, "Calling connected for client %s", m->c->clientID);
-							(*(m->connected))(m->connected_context, reason);
-						}
-						if (m->c->MQTTVersion >= MQTTVERSION_5)
-						{
-							if (MQTTProperties_hasProperty(&connack->properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM))
-							{
-								int recv_max = (int)MQTTProperties_getNumericValue(&connack->properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM);
-								if (m->c->maxInflightMessages > recv_max)
-									m->c->maxInflightMessages = recv_max;
-							}
-						}
+							data.alt.connect.serverURI = m->serverURIs[m->connect.details.conn.currentURI];
+						else
+							data.alt.connect.serverURI = m->serverURI;
+						data.alt.connect.MQTTVersion = m->connect.details.conn.MQTTVersion;
+						data.alt.connect.sessionPresent = sessionPresent;
+						(*(m->connect.onSuccess))(m->connect.context, &data);
+						/* Null out callback pointers so they aren't accidentally called again */
+						m->connect.onSuccess = NULL;
+						m->connect.onFailure = NULL;
 					}
-					else
+					else if (m->connect.onSuccess5)
+					{
+						MQTTAsync_successData5 data = MQTTAsync_successData5_initializer;
+						Log(TRACE_MIN, -1, "Calling connect success for client %s", m->c->clientID);
+						if (m->serverURIcount > 0)
+							data.alt.connect.serverURI = m->serverURIs[m->connect.details.conn.currentURI];
+						else
+							data.alt.connect.serverURI = m->serverURI;
+						data.alt.connect.MQTTVersion = m->connect.details.conn.MQTTVersion;
+						data.alt.connect.sessionPresent = sessionPresent;
+						data.properties = connack->properties;
+						data.reasonCode = connack->rc;
+						(*(m->connect.onSuccess5))(m->connect.context, &data);
+						/* Null out callback pointers so they aren't accidentally called again */
+						m->connect.onSuccess5 = NULL;
+						m->connect.onFailure5 = NULL;
+					}
+					if (m->connected)
+					{
+						char* reason = (onSuccess) ? "connect onSuccess called" : "automatic reconnect";
+						Log(TRACE_MIN, -1, "Calling connected for client %s", m->c->clientID);
+						(*(m->connected))(m->connected_context, reason);
+					}
+					if (m->c->MQTTVersion >= MQTTVERSION_5)
 					{
-					    nextOrClose(m, rc, "CONNACK return code");
+						if (MQTTProperties_hasProperty(&connack->properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM))
+						{
+							int recv_max = (int)MQTTProperties_getNumericValue(&connack->properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM);
+							if (m->c->maxInflightMessages > recv_max)
+								m->c->maxInflightMessages = recv_max;
+						}
 					}
-					MQTTPacket_freeConnack(connack);
 				}
-				else if (pack->header.bits.type == SUBACK)
+				else
 				{
-					ListElement* current = NULL;
+				    nextOrClose(m, rc, "CONNACK return code");
+				}
+				MQTTPacket_freeConnack(connack);
+			}
+			else if (pack->header.bits.type == SUBACK)
+			{
+				ListElement* current = NULL;
 
-					/* use the msgid to find the callback to be called */
-					while (ListNextElement(m->responses, &current))
+				/* use the msgid to find the callback to be called */
+				while (ListNextElement(m->responses, &current))
+				{
+					MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
+					if (command->command.token == ((Suback*)pack)->msgId)
 					{
-						MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
-						if (command->command.token == ((Suback*)pack)->msgId)
+						Suback* sub = (Suback*)pack;
+						MQTTAsync_lock_mutex(m->client_mutex);
+						if (!ListDetach(m->responses, command)) /* remove the response from the list */
+							Log(LOG_ERROR, -1, "Subscribe command not removed from command list");
+						MQTTAsync_unlock_mutex(m->client_mutex);
+
+						/* Call the failure callback if there is one subscribe in the MQTT packet and
+						 * the return code is 0x80 (failure).  If the MQTT packet contains >1 subscription
+						 * request, then we call onSuccess with the list of returned QoSs, which inelegantly,
+						 * could include some failures, or worse, the whole list could have failed.
+						 */
+						if (m->c->MQTTVersion >= MQTTVERSION_5)
 						{
-							Suback* sub = (Suback*)pack;
-							if (!ListDetach(m->responses, command)) /* remove the response from the list */
-								Log(LOG_ERROR, -1, "Subscribe command not removed from command list");
-
-							/* Call the failure callback if there is one subscribe in the MQTT packet and
-							 * the return code is 0x80 (failure).  If the MQTT packet contains >1 subscription
-							 * request, then we call onSuccess with the list of returned QoSs, which inelegantly,
-							 * could include some failures, or worse, the whole list could have failed.
-							 */
-							if (m->c->MQTTVersion >= MQTTVERSION_5)
-							{
-								if (sub->qoss->count == 1 && *(int*)(sub->qoss->first->content) >= MQTTREASONCODE_UNSPECIFIED_ERROR)
-								{
-									if (command->command.onFailure5)
-									{
-										MQTTAsync_failureData5 data = MQTTAsync_failureData5_initializer;
-
-										data.token = command->command.token;
-										data.reasonCode = *(int*)(sub->qoss->first->content);
-										data.message = NULL;
-										data.properties = sub->properties;
-										Log(TRACE_MIN, -1, "Calling subscribe failure for client %s", m->c->clientID);
-										(*(command->command.onFailure5))(command->command.context, &data);
-									}
-								}
-								else if (command->command.onSuccess5)
-								{
-									MQTTAsync_successData5 data;
-									enum MQTTReasonCodes* array = NULL;
-
-									data.reasonCode = *(int*)(sub->qoss->first->content);
-									data.alt.sub.reasonCodeCount = sub->qoss->count;
-									if (sub->qoss->count > 1)
-									{
-										ListElement* cur_qos = NULL;
-										enum MQTTReasonCodes* element = array = data.alt.sub.reasonCodes = malloc(sub->qoss->count * sizeof(enum MQTTReasonCodes));
-										if (array)
-											while (ListNextElement(sub->qoss, &cur_qos))
-												*element++ = *(int*)(cur_qos->content);
-									}
-									data.token = command->command.token;
-									data.properties = sub->properties;
-									Log(TRACE_MIN, -1, "Calling subscribe success for client %s", m->c->clientID);
-									(*(command->command.onSuccess5))(command->command.context, &data);
-									if (array)
-										free(array);
-								}
-							}
-							else if (sub->qoss->count == 1 && *(int*)(sub->qoss->first->content) == MQTT_BAD_SUBSCRIBE)
+							if (sub->qoss->count == 1 && *(int*)(sub->qoss->first->content) >= MQTTREASONCODE_UNSPECIFIED_ERROR)
 							{
-								if (command->command.onFailure)
+								if (command->command.onFailure5)
 								{
-									MQTTAsync_failureData data;
+									MQTTAsync_failureData5 data = MQTTAsync_failureData5_initializer;
 
 									data.token = command->command.token;
-									data.code = *(int*)(sub->qoss->first->content);
+									data.reasonCode = *(int*)(sub->qoss->first->content);
 									data.message = NULL;
+									data.properties = sub->properties;
 									Log(TRACE_MIN, -1, "Calling subscribe failure for client %s", m->c->clientID);
-									(*(command->command.onFailure))(command->command.context, &data);
+									(*(command->command.onFailure5))(command->command.context, &data);
 								}
 							}
-							else if (command->command.onSuccess)
+							else if (command->command.onSuccess5)
 							{
-								MQTTAsync_successData data;
-								int* array = NULL;
+								MQTTAsync_successData5 data;
+								enum MQTTReasonCodes* array = NULL;
 
-								if (sub->qoss->count == 1)
-									data.alt.qos = *(int*)(sub->qoss->first->content);
-								else if (sub->qoss->count > 1)
+								data.reasonCode = *(int*)(sub->qoss->first->content);
+								data.alt.sub.reasonCodeCount = sub->qoss->count;
+								if (sub->qoss->count > 1)
 								{
 									ListElement* cur_qos = NULL;
-									int* element = array = data.alt.qosList = malloc(sub->qoss->count * sizeof(int));
+									enum MQTTReasonCodes* element = array = data.alt.sub.reasonCodes = malloc(sub->qoss->count * sizeof(enum MQTTReasonCodes));
 									if (array)
 										while (ListNextElement(sub->qoss, &cur_qos))
 											*element++ = *(int*)(cur_qos->content);
 								}
 								data.token = command->command.token;
-								Log(TRACE_MIN, -1, "Calling subscribe success for client %s", m->c->clientID);
-								(*(command->command.onSuccess))(command->command.context, &data);
+								data.properties = sub->properties;
+								Log(TRACE_MIN, -1, "Calling subscribe success for client %s", m->c->clientID);
+								(*(command->command.onSuccess5))(command->command.context, &data);
+								if (array)
+									free(array);
+							}
+						}
+						else if (sub->qoss->count == 1 && *(int*)(sub->qoss->first->content) == MQTT_BAD_SUBSCRIBE)
+						{
+							if (command->command.onFailure)
+							{
+								MQTTAsync_failureData data;
+
+								data.token = command->command.token;
+								data.code = *(int*)(sub->qoss->first->content);
+								data.message = NULL;
+								Log(TRACE_MIN, -1, "Calling subscribe failure for client %s", m->c->clientID);
+								(*(command->command.onFailure))(command->command.context, &data);
+							}
+						}
+						else if (command->command.onSuccess)
+						{
+							MQTTAsync_successData data;
+							int* array = NULL;
+
+							if (sub->qoss->count == 1)
+								data.alt.qos = *(int*)(sub->qoss->first->content);
+							else if (sub->qoss->count > 1)
+							{
+								ListElement* cur_qos = NULL;
+								int* element = array = data.alt.qosList = malloc(sub->qoss->count * sizeof(int));
 								if (array)
-									free(array);
+									while (ListNextElement(sub->qoss, &cur_qos))
+										*element++ = *(int*)(cur_qos->content);
 							}
-							MQTTAsync_freeCommand(command);
-							break;
+							data.token = command->command.token;
+							Log(TRACE_MIN, -1, "Calling subscribe success for client %s", m->c->clientID);
+							(*(command->command.onSuccess))(command->command.context, &data);
+							if (array)
+								free(array);
 						}
+						MQTTAsync_freeCommand(command);
+						break;
 					}
-					rc = MQTTProtocol_handleSubacks(pack, m->c->net.socket);
 				}
-				else if (pack->header.bits.type == UNSUBACK)
-				{
-					ListElement* current = NULL;
-					Unsuback* unsub = (Unsuback*)pack;
+				rc = MQTTProtocol_handleSubacks(pack, m->c->net.socket);
+			}
+			else if (pack->header.bits.type == UNSUBACK)
+			{
+				ListElement* current = NULL;
+				Unsuback* unsub = (Unsuback*)pack;
 
-					/* use the msgid to find the callback to be called */
-					while (ListNextElement(m->responses, &current))
+				/* use the msgid to find the callback to be called */
+				while (ListNextElement(m->responses, &current))
+				{
+					MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
+					if (command->command.token == ((Unsuback*)pack)->msgId)
 					{
-						MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
-						if (command->command.token == ((Unsuback*)pack)->msgId)
+						MQTTAsync_lock_mutex(m->client_mutex);
+						if (!ListDetach(m->responses, command)) /* remove the response from the list */
+							Log(LOG_ERROR, -1, "Unsubscribe command not removed from command list");
+						MQTTAsync_unlock_mutex(m->client_mutex);
+						if (command->command.onSuccess || command->command.onSuccess5)
 						{
-							if (!ListDetach(m->responses, command)) /* remove the response from the list */
-								Log(LOG_ERROR, -1, "Unsubscribe command not removed from command list");
-							if (command->command.onSuccess || command->command.onSuccess5)
+							Log(TRACE_MIN, -1, "Calling unsubscribe success for client %s", m->c->clientID);
+							if (command->command.onSuccess)
 							{
-								Log(TRACE_MIN, -1, "Calling unsubscribe success for client %s", m->c->clientID);
-								if (command->command.onSuccess)
-								{
-									MQTTAsync_successData data;
+								MQTTAsync_successData data;
 
-									memset(&data, '\0', sizeof(data));
-									data.token = command->command.token;
-									(*(command->command.onSuccess))(command->command.context, &data);
-								}
-								else
+								memset(&data, '\0', sizeof(data));
+								data.token = command->command.token;
+								(*(command->command.onSuccess))(command->command.context, &data);
+							}
+							else
+							{
+								MQTTAsync_successData5 data = MQTTAsync_successData5_initializer;
+								enum MQTTReasonCodes* array = NULL;
+
+								data.reasonCode = *(enum MQTTReasonCodes*)(unsub->reasonCodes->first->content);
+								data.alt.unsub.reasonCodeCount = unsub->reasonCodes->count;
+								if (unsub->reasonCodes->count > 1)
 								{
-									MQTTAsync_successData5 data = MQTTAsync_successData5_initializer;
-									enum MQTTReasonCodes* array = NULL;
-
-									data.reasonCode = *(enum MQTTReasonCodes*)(unsub->reasonCodes->first->content);
-									data.alt.unsub.reasonCodeCount = unsub->reasonCodes->count;
-									if (unsub->reasonCodes->count > 1)
-									{
-										ListElement* cur_rc = NULL;
-										enum MQTTReasonCodes* element = array = data.alt.unsub.reasonCodes = malloc(unsub->reasonCodes->count * sizeof(enum MQTTReasonCodes));
-										if (array)
-											while (ListNextElement(unsub->reasonCodes, &cur_rc))
-												*element++ = *(enum MQTTReasonCodes*)(cur_rc->content);
-									}
-									data.token = command->command.token;
-									data.properties = unsub->properties;
-									Log(TRACE_MIN, -1, "Calling unsubscribe success for client %s", m->c->clientID);
-									(*(command->command.onSuccess5))(command->command.context, &data);
+									ListElement* cur_rc = NULL;
+									enum MQTTReasonCodes* element = array = data.alt.unsub.reasonCodes = malloc(unsub->reasonCodes->count * sizeof(enum MQTTReasonCodes));
 									if (array)
-										free(array);
+										while (ListNextElement(unsub->reasonCodes, &cur_rc))
+											*element++ = *(enum MQTTReasonCodes*)(cur_rc->content);
 								}
+								data.token = command->command.token;
+								data.properties = unsub->properties;
+								Log(TRACE_MIN, -1, "Calling unsubscribe success for client %s", m->c->clientID);
+								(*(command->command.onSuccess5))(command->command.context, &data);
+								if (array)
+									free(array);
 							}
-							MQTTAsync_freeCommand(command);
-							break;
 						}
+						MQTTAsync_freeCommand(command);
+						break;
 					}
-					rc = MQTTProtocol_handleUnsubacks(pack, m->c->net.socket);
 				}
-				else if (pack->header.bits.type == DISCONNECT)
-				{
-					Ack* disc = (Ack*)pack;
-					int discrc = 0;
+				rc = MQTTProtocol_handleUnsubacks(pack, m->c->net.socket);
+			}
+			else if (pack->header.bits.type == DISCONNECT)
+			{
+				Ack* disc = (Ack*)pack;
+				int discrc = 0;
 
-					discrc = disc->rc;
-					if (m->disconnected)
-					{
-						Log(TRACE_MIN, -1, "Calling disconnected for client %s", m->c->clientID);
-						(*(m->disconnected))(m->disconnected_context, &disc->properties, disc->rc);
-					}
-					rc = MQTTProtocol_handleDisconnects(pack, m->c->net.socket);
-					m->c->connected = 0; /* don't send disconnect packet back */
-					nextOrClose(m, discrc, "Received disconnect");
-				}
-				else
+				discrc = disc->rc;
+				if (m->disconnected)
 				{
-					Log(LOG_ERROR, -1, "An unexpected packet type %u has been received", pack->header.bits.type);
+					Log(TRACE_MIN, -1, "Calling disconnected for client %s", m->c->clientID);
+					(*(m->disconnected))(m->disconnected_context, &disc->properties, disc->rc);
 				}
+				rc = MQTTProtocol_handleDisconnects(pack, m->c->net.socket);
+				MQTTAsync_lock_mutex(m->client_mutex);
+				m->c->connected = 0; /* don't send disconnect packet back */
+				MQTTAsync_unlock_mutex(m->client_mutex);
+				nextOrClose(m, discrc, "Received disconnect");
+			}
+			else
+			{
+				Log(LOG_ERROR, -1, "An unexpected packet type %u has been received", pack->header.bits.type);
+			}
+		}
+	}
+exit:
+	FUNC_EXIT;
+}
+
+
+/* This is the thread function that handles the calling of callback functions if set */
+thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
+{
+	long timeout = 10L; /* first time in we have a small timeout.  Gets things started more quickly */
+
+	FUNC_ENTRY;
+	MQTTAsync_bindShard((MQTTAsync_shard*)n);
+	MQTTAsync_setThreadName("MQTTAsync_rcv");
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	receiveThread_state = RUNNING;
+	receiveThread_id = Paho_thread_getid();
+	while (!MQTTAsync_tostop)
+	{
+		int rc = SOCKET_ERROR;
+		SOCKET sock = -1;
+		MQTTPacket* pack = NULL;
+
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+		pack = MQTTAsync_cycle(&sock, timeout, &rc);
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		if (MQTTAsync_tostop)
+			break;
+
+		if (sock == 0)
+		{
+			/* nothing was ready, and there may be no sockets to wait on, so don't spin */
+			if (timeout > 0L)
+			{
+				MQTTAsync_unlock_mutex(mqttasync_mutex);
+				MQTTAsync_sleep(100L);
+				MQTTAsync_lock_mutex(mqttasync_mutex);
 			}
+			continue;
 		}
+		timeout = 1000L;
+		MQTTAsync_handleCycle(sock, pack, rc);
 	}
 	receiveThread_state = STOPPED;
 	receiveThread_id = 0;
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	/* before unlocking, after which the shard may be freed */
 #if !defined(_WIN32) && !defined(_WIN64)
 	if (sendThread_state != STOPPED)
 		Thread_signal_cond(send_cond);
@@ -2395,6 +3202,7 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 	if (sendThread_state != STOPPED)
 		Thread_post_sem(send_sem);
 #endif
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
 
 #if defined(OPENSSL)
 #if ((OPENSSL_VERSION_NUMBER < 0x1010000fL) || defined(LIBRESSL_VERSION_NUMBER))
@@ -2412,6 +3220,112 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 }
 
 
+/**
+ * Process the commands queued for the current shard, until none can be processed for now,
+ * then write out any gathered publish packets.
+ */
+static void MQTTAsync_processCommands(void)
+{
+	int command_count = 0;
+	int discarded_count = 0;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	command_count = MQTTAsync_commands->count;
+	discarded_count = MQTTAsync_discarded->count;
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	if (discarded_count > 0)
+		MQTTAsync_completeDiscarded();
+	while (command_count > 0)
+	{
+		if (MQTTAsync_processCommand() == 0)
+			break;  /* no commands were processed, so go into a wait */
+		MQTTAsync_lock_mutex(mqttcommand_mutex);
+		command_count = MQTTAsync_commands->count;
+		MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	}
+	MQTTAsync_flushCoalesced();
+	FUNC_EXIT;
+}
+
+
+/**
+ * Work out how long the event loop of the current shard may wait for its socket.
+ * Called with mqttasync_mutex held.
+ * @return the time in milliseconds, or -1 if there is no deadline
+ */
+int MQTTAsync_loopTimeout(void)
+{
+	int timeout = -1;
+	uint64_t next = 0;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	if (MQTTAsync_commands->count > 0 || MQTTAsync_discarded->count > 0)
+		timeout = 0;
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	if (timeout == 0 || Socket_hasPendingRead()
+#if defined(OPENSSL)
+			|| SSLSocket_hasPendingRead()
+#endif
+			)
+		timeout = 0;
+	else if (TimerWheel_nextDeadline(&MQTTAsync_timers, &next))
+	{
+		uint64_t now = TimerWheel_now(&MQTTAsync_timers);
+
+		timeout = (next > now) ? (int)(next - now) : 0;
+	}
+	FUNC_EXIT_RC(timeout);
+	return timeout;
+}
+
+
+/**
+ * Run one turn of the I/O of the current shard on the calling thread, in place of its
+ * send and receive threads: send the queued commands, wait for the socket, handle what
+ * has been read, and expire the timers which are due.  Called without mqttasync_mutex.
+ * @param timeout the most milliseconds to wait for a socket to be ready
+ */
+void MQTTAsync_runLoop(int timeout)
+{
+	int reads = 0;
+
+	FUNC_ENTRY;
+	MQTTAsync_processCommands();
+	MQTTAsync_checkTimeouts();
+
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if (timeout > 0)
+	{
+		int due = MQTTAsync_loopTimeout();
+
+		if (due >= 0 && due < timeout)
+			timeout = due;
+	}
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+
+	/* wait once, then handle the packets already arrived without waiting again */
+	while (reads++ < MQTTASYNC_LOOP_READS)
+	{
+		int rc = SOCKET_ERROR;
+		SOCKET sock = -1;
+		MQTTPacket* pack = MQTTAsync_cycle(&sock, (reads == 1) ? (unsigned long)timeout : 0L, &rc);
+
+		if (sock == 0)
+			break;
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		MQTTAsync_handleCycle(sock, pack, rc);
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+	}
+
+	/* send what the callbacks have queued, and the acknowledgements */
+	MQTTAsync_processCommands();
+	MQTTAsync_checkTimeouts();
+	FUNC_EXIT;
+}
+
+
 static void MQTTAsync_stop(void)
 {
 #if !defined(NOSTACKTRACE)
@@ -2468,21 +3382,28 @@ static void MQTTAsync_closeOnly(Clients* client, enum MQTTReasonCodes reasonCode
 		MQTTProtocol_checkPendingWrites();
 		if (client->connected && Socket_noPendingWrites(client->net.socket))
 			MQTTPacket_send_disconnect(client, reasonCode, props);
-		MQTTAsync_lock_mutex(socket_mutex);
+		MQTTAsync_lock_mutex(MQTTAsync_currentShard()->socket_mutex);
 		WebSocket_close(&client->net, WebSocket_CLOSE_NORMAL, NULL);
 #if defined(OPENSSL)
-		SSL_SESSION_free(client->session); /* is a no-op if session is NULL */
-		client->session = NULL; /* show the session has been freed */
 		SSLSocket_close(&client->net);
 #endif
-		MQTTAsync_unlock_mutex(socket_mutex);
+		MQTTAsync_unlock_mutex(MQTTAsync_currentShard()->socket_mutex);
 		Socket_close(client->net.socket); /* Socket_close locks socket mutex itself */
+		Socket_freeReadBuffer(&client->net.readbuf);
+		Socket_freeWriteBuffer(&client->net.writebuf);
 		client->net.socket = 0;
 #if defined(OPENSSL)
 		client->net.ssl = NULL;
 #endif
 	}
+	/* topic aliases only last as long as the network connection */
+	TopicAliases_free(client->outboundAliases);
+	client->outboundAliases = NULL;
+	TopicAliases_free(client->inboundAliases);
+	client->inboundAliases = NULL;
+	MQTTAsync_lock_mutex(((MQTTAsyncs*)client->context)->client_mutex);
 	client->connected = 0;
+	MQTTAsync_unlock_mutex(((MQTTAsyncs*)client->context)->client_mutex);
 	client->connect_state = NOT_IN_PROGRESS;
 	FUNC_EXIT;
 }
@@ -2591,8 +3512,10 @@ static int MQTTAsync_cleanSession(Clients* client)
 	rc = MQTTAsync_unpersistInflightMessages(client);
 #endif
 	MQTTProtocol_emptyMessageList(client->inboundMsgs);
+	MQTTAsync_lock_mutex(((MQTTAsyncs*)client->context)->client_mutex);
 	MQTTProtocol_emptyMessageList(client->outboundMsgs);
 	client->msgID = 0;
+	MQTTAsync_unlock_mutex(((MQTTAsyncs*)client->context)->client_mutex);
 	if ((found = ListFindItem(MQTTAsync_handles, client, clientStructCompare)) != NULL)
 	{
 		MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
@@ -2714,6 +3637,146 @@ void setRetryLoopInterval(int keepalive)
 }
 
 
+/**
+ * Schedule a client timer, unless it is already armed to fire earlier.  Timer callbacks
+ * work out the next deadline again when they fire, so an early firing is harmless.
+ * @param timer the timer
+ * @param delay the number of milliseconds from now
+ */
+static void MQTTAsync_scheduleTimer(TimerWheel_entry* timer, DIFF_TIME_TYPE delay)
+{
+	uint64_t deadline = TimerWheel_now(&MQTTAsync_timers) + (uint64_t)delay;
+
+	if (timer->armed && timer->deadline <= deadline)
+		return;
+	TimerWheel_schedule(&MQTTAsync_timers, timer, deadline);
+	if (deadline < sendThread_wakeTime && sendThread_state == RUNNING)
+	{
+		/* the send thread is sleeping past the new deadline */
+#if !defined(_WIN32) && !defined(_WIN64)
+		Thread_signal_cond(send_cond);
+#else
+		Thread_post_sem(send_sem);
+#endif
+	}
+}
+
+
+/**
+ * How long until MQTTAsync_checkClientTimeouts next has something to do for a client.
+ * @param m the client
+ * @return the number of milliseconds, 0 if due now, or -1 if no timeout is running
+ */
+static DIFF_TIME_TYPE MQTTAsync_timeoutDue(MQTTAsyncs* m)
+{
+	DIFF_TIME_TYPE due = -1;
+
+	if (m->c->connect_state == DISCONNECTING)
+	{
+		if (m->c->outboundMsgs->count == 0)
+			due = 0;
+		else
+			due = (DIFF_TIME_TYPE)m->disconnect.details.dis.timeout - (DIFF_TIME_TYPE)MQTTTime_elapsed(m->disconnect.start_time);
+	}
+	if (m->c->connect_state != NOT_IN_PROGRESS)
+	{
+		DIFF_TIME_TYPE connect_due = (DIFF_TIME_TYPE)(m->connectTimeout * 1000) + 1 - (DIFF_TIME_TYPE)MQTTTime_elapsed(m->connect.start_time);
+
+		if (due == -1 || connect_due < due)
+			due = connect_due;
+	}
+	else if (m->automaticReconnect && m->retrying && m->c->connected == 0)
+	{
+		DIFF_TIME_TYPE reconnect_due = 0;
+
+		if (!m->reconnectNow)
+			reconnect_due = (DIFF_TIME_TYPE)(m->currentInterval * 1000) + 1 - (DIFF_TIME_TYPE)MQTTTime_elapsed(m->lastConnectionFailedTime);
+		if (due == -1 || reconnect_due < due)
+			due = reconnect_due;
+	}
+	if (due < -1)
+		due = 0;
+	return due;
+}
+
+
+static void MQTTAsync_timeoutTimer(void* context)
+{
+	MQTTAsyncs* m = (MQTTAsyncs*)context;
+	DIFF_TIME_TYPE due = -1;
+
+	MQTTAsync_checkClientTimeouts(m);
+	if ((due = MQTTAsync_timeoutDue(m)) >= 0)
+		MQTTAsync_scheduleTimer(&m->timeout_timer, (due == 0) ? retryLoopIntervalms : due);
+}
+
+
+static void MQTTAsync_keepaliveTimer(void* context)
+{
+	MQTTAsyncs* m = (MQTTAsyncs*)context;
+	DIFF_TIME_TYPE due = -1;
+
+	MQTTProtocol_keepaliveClient(MQTTTime_now(), m->c);
+	/* nothing could be done if it is still due, for instance a write is pending, so poll */
+	if ((due = MQTTProtocol_keepaliveDue(MQTTTime_now(), m->c)) >= 0)
+		MQTTAsync_scheduleTimer(&m->keepalive_timer, (due == 0) ? retryLoopIntervalms : due);
+}
+
+
+static void MQTTAsync_retryTimer(void* context)
+{
+	MQTTAsyncs* m = (MQTTAsyncs*)context;
+	DIFF_TIME_TYPE due = -1;
+
+	MQTTProtocol_retryClient(MQTTTime_now(), m->c, 0);
+	if ((due = MQTTProtocol_retryDue(MQTTTime_now(), m->c)) >= 0)
+		MQTTAsync_scheduleTimer(&m->retry_timer, (due == 0) ? retryLoopIntervalms : due);
+}
+
+
+void MQTTAsync_initTimers(MQTTAsyncs* m)
+{
+	TimerWheel_initEntry(&m->timeout_timer, MQTTAsync_timeoutTimer, m);
+	TimerWheel_initEntry(&m->keepalive_timer, MQTTAsync_keepaliveTimer, m);
+	TimerWheel_initEntry(&m->retry_timer, MQTTAsync_retryTimer, m);
+}
+
+
+/**
+ * Make sure the timers of a client are armed for any deadlines it now has.  Called
+ * with mqttasync_mutex held wherever a client's state changes in a way that could
+ * bring a deadline forward.  The keepalive and retry timers reschedule themselves
+ * while they are armed, so they are only worked out here if they are not.
+ * @param m the client
+ */
+void MQTTAsync_armTimers(MQTTAsyncs* m)
+{
+	DIFF_TIME_TYPE due = -1;
+	START_TIME_TYPE now;
+
+	FUNC_ENTRY;
+	if (m->c == NULL)
+		goto exit;
+	if ((due = MQTTAsync_timeoutDue(m)) >= 0)
+		MQTTAsync_scheduleTimer(&m->timeout_timer, due);
+	now = MQTTTime_now();
+	if (!m->keepalive_timer.armed && (due = MQTTProtocol_keepaliveDue(now, m->c)) >= 0)
+		MQTTAsync_scheduleTimer(&m->keepalive_timer, due);
+	if (!m->retry_timer.armed && (due = MQTTProtocol_retryDue(now, m->c)) >= 0)
+		MQTTAsync_scheduleTimer(&m->retry_timer, due);
+exit:
+	FUNC_EXIT;
+}
+
+
+void MQTTAsync_cancelTimers(MQTTAsyncs* m)
+{
+	TimerWheel_cancel(&MQTTAsync_timers, &m->timeout_timer);
+	TimerWheel_cancel(&MQTTAsync_timers, &m->keepalive_timer);
+	TimerWheel_cancel(&MQTTAsync_timers, &m->retry_timer);
+}
+
+
 int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* options, int internal)
 {
 	MQTTAsyncs* m = handle;
@@ -2727,7 +3790,11 @@ int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* o
 		goto exit;
 	}
 	if (!internal)
+	{
+		MQTTAsync_lock_mutex(m->client_mutex);
 		m->shouldBeConnected = 0;
+		MQTTAsync_unlock_mutex(m->client_mutex);
+	}
 	if (m->c->connected == 0)
 	{
 		rc = MQTTASYNC_DISCONNECTED;
@@ -2735,7 +3802,7 @@ int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* o
 	}
 
 	/* Add disconnect request to operation queue */
-	if ((dis = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((dis = Slab_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -2788,9 +3855,30 @@ static int cmdMessageIDCompare(void* a, void* b)
 }
 
 
+/**
+ * Whether a message id is used in a list.  Unlike ListFindItem, this leaves the list's
+ * current element alone, as the I/O threads may be iterating over it.
+ * @param list the list
+ * @param msgid the message id
+ * @param compare the comparison of an element with a message id
+ * @return boolean
+ */
+static int MQTTAsync_msgIdInList(List* list, int msgid, int(*compare)(void*, void*))
+{
+	ListElement* current = NULL;
+
+	while (ListNextElement(list, &current))
+	{
+		if (compare(current->content, &msgid))
+			return 1;
+	}
+	return 0;
+}
+
+
 /**
  * Assign a new message id for a client.  Make sure it isn't already being used and does
- * not exceed the maximum.
+ * not exceed the maximum.  This may be called without the shard locked, to publish.
  * @param m a client structure
  * @return the next message id to use, or 0 if none available
  */
@@ -2798,18 +3886,19 @@ int MQTTAsync_assignMsgId(MQTTAsyncs* m)
 {
 	int start_msgid;
 	int msgid;
+	int in_use;
+	int i;
 
 	/* need to check: commands list and response list for a client */
 	FUNC_ENTRY;
-	/* Fetch last message ID in locked state */
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	MQTTAsync_lock_mutex(m->client_mutex);
 	start_msgid = m->c->msgID;
 	msgid = start_msgid;
 
-	MQTTAsync_lock_mutex(mqttcommand_mutex);
-	msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-	while (ListFindItem(MQTTAsync_commands, &msgid, cmdMessageIDCompare) ||
-			ListFindItem(m->c->outboundMsgs, &msgid, messageIDCompare) ||
-			ListFindItem(m->responses, &msgid, cmdMessageIDCompare))
+	/* the client's queued commands with message ids are all in its lanes and controls,
+	   so the commands of the shard's other clients needn't be looked through */
+	for (;;)
 	{
 		msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
 		if (msgid == start_msgid)
@@ -2817,34 +3906,24 @@ int MQTTAsync_assignMsgId(MQTTAsyncs* m)
 			msgid = 0;
 			break;
 		}
+		in_use = (msgid == m->sendingMsgId ||
+			MQTTAsync_msgIdInList(m->controls, msgid, cmdMessageIDCompare) ||
+			MQTTAsync_msgIdInList(m->c->outboundMsgs, msgid, messageIDCompare) ||
+			MQTTAsync_msgIdInList(m->responses, msgid, cmdMessageIDCompare));
+		for (i = 0; !in_use && i < MQTTASYNC_LANES; ++i)
+			in_use = MQTTAsync_msgIdInList(m->lanes[i], msgid, cmdMessageIDCompare);
+		if (!in_use)
+			break;
 	}
-	MQTTAsync_unlock_mutex(mqttcommand_mutex);
 	if (msgid != 0)
 		m->c->msgID = msgid;
+	MQTTAsync_unlock_mutex(m->client_mutex);
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
 	FUNC_EXIT_RC(msgid);
 	return msgid;
 }
 
 
-static void MQTTAsync_retry(void)
-{
-	static START_TIME_TYPE last = START_TIME_ZERO;
-	START_TIME_TYPE now;
-
-	FUNC_ENTRY;
-	now = MQTTTime_now();
-	if (MQTTTime_difftime(now, last) >= (DIFF_TIME_TYPE)(retryLoopIntervalms))
-	{
-		last = MQTTTime_now();
-		MQTTProtocol_keepalive(now);
-		MQTTProtocol_retry(now, 1, 0);
-	}
-	else
-		MQTTProtocol_retry(now, 0, 0);
-	FUNC_EXIT;
-}
-
-
 static int MQTTAsync_connecting(MQTTAsyncs* m)
 {
 	int rc = -1;
@@ -2933,9 +4012,6 @@ static int MQTTAsync_connecting(MQTTAsyncs* m)
 
 			if (setSocketForSSLrc != MQTTASYNC_SUCCESS)
 			{
-				if (m->c->session != NULL)
-					if ((rc = SSL_set_session(m->c->net.ssl, m->c->session)) != 1)
-						Log(TRACE_MIN, -1, "Failed to set SSL session with stored data, non critical");
 				rc = m->c->sslopts->struct_version >= 3 ?
 					SSLSocket_connect(m->c->net.ssl, m->c->net.socket, serverURI,
 						m->c->sslopts->verify, m->c->sslopts->ssl_error_cb, m->c->sslopts->ssl_error_context) :
@@ -2970,8 +4046,6 @@ static int MQTTAsync_connecting(MQTTAsyncs* m)
 							goto exit;
 						}
 					}
-					if (!m->c->cleansession && m->c->session == NULL)
-						m->c->session = SSL_get1_session(m->c->net.ssl);
 				}
 			}
 			else
@@ -3017,9 +4091,6 @@ static int MQTTAsync_connecting(MQTTAsyncs* m)
 		if (rc != 1)
 			goto exit;
 
-		if(!m->c->cleansession && m->c->session == NULL)
-			m->c->session = SSL_get1_session(m->c->net.ssl);
-
 		if ( m->websocket )
 		{
 			m->c->connect_state = WEBSOCKET_IN_PROGRESS;
@@ -3062,23 +4133,16 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 	int rc1 = 0;
 
 	FUNC_ENTRY;
+	if ((*sock = Socket_getPendingRead()) == -1
 #if defined(OPENSSL)
-	if ((*sock = SSLSocket_getPendingRead()) == -1)
-	{
+			&& (*sock = SSLSocket_getPendingRead()) == -1
 #endif
-		int should_stop = 0;
-
+			)
+	{
 		/* 0 from getReadySocket indicates no work to do, rc -1 == error */
-		*sock = Socket_getReadySocket(0, (int)timeout, socket_mutex, &rc1);
+		*sock = Socket_getReadySocket(0, (int)timeout, MQTTAsync_currentShard()->socket_mutex, &rc1);
 		*rc = rc1;
-		MQTTAsync_lock_mutex(mqttasync_mutex);
-		should_stop = MQTTAsync_tostop;
-		MQTTAsync_unlock_mutex(mqttasync_mutex);
-		if (!should_stop && *sock == 0 && (timeout > 0L))
-			MQTTAsync_sleep(100L);
-#if defined(OPENSSL)
 	}
-#endif
 	MQTTAsync_lock_mutex(mqttasync_mutex);
 	if (*sock > 0 && rc1 == 0)
 	{
@@ -3117,7 +4181,7 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 
 				/* This block is so that the ack variable is local and isn't accidentally reused */
 				{
-					static Ack ack;
+					static THREAD_LOCAL Ack ack;
 					ack = *(Ack*)pack;
 					/* these values are stored because the packet structure is freed in the handle functions */
 					msgid = ack.msgId;
@@ -3130,6 +4194,8 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 					}
 				}
 
+				if (m) /* the handlers remove acknowledged messages from the outbound messages */
+					MQTTAsync_lock_mutex(m->client_mutex);
 				if (msgtype == PUBCOMP)
 				{
 					*rc = MQTTProtocol_handlePubcomps(pack, *sock, &pubToRemove);
@@ -3152,6 +4218,8 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 						Thread_post_sem(send_sem);
 #endif
 				}
+				if (m)
+					MQTTAsync_unlock_mutex(m->client_mutex);
 				if (!m)
 					Log(LOG_ERROR, -1, "PUBCOMP, PUBACK or PUBREC received for no client, msgid %d", msgid);
 				if (m && (msgtype != PUBREC || ackrc >= MQTTREASONCODE_UNSPECIFIED_ERROR))
@@ -3169,8 +4237,10 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 						MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
 						if (command->command.token == msgid)
 						{
+							MQTTAsync_lock_mutex(m->client_mutex);
 							if (!ListDetach(m->responses, command)) /* then remove the response from the list */
 								Log(LOG_ERROR, -1, "Publish command not removed from command list");
+							MQTTAsync_unlock_mutex(m->client_mutex);
 							if (command->command.onSuccess)
 							{
 								MQTTAsync_successData data;
@@ -3228,6 +4298,8 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 				}
 				if (pubToRemove != NULL)
 					MQTTProtocol_removePublication(pubToRemove);
+				if (m && m->c->connect_state == DISCONNECTING)
+					MQTTAsync_armTimers(m); /* the disconnect can complete once all flows have finished */
 			}
 			else if (pack->header.bits.type == PUBREL)
 				*rc = MQTTProtocol_handlePubrels(pack, *sock);
@@ -3239,7 +4311,6 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 				pack = NULL;
 		}
 	}
-	MQTTAsync_retry();
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
 	FUNC_EXIT_RC(*rc);
 	return pack;
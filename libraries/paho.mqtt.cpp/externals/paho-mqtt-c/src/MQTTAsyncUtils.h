@@ -18,7 +18,12 @@
 #define MQTTASYNCUTILS_H_
 
 #include "MQTTPacket.h"
+#include "MQTTProtocol.h"
+#include "SocketBuffer.h"
+#include "WebSocket.h"
 #include "Thread.h"
+#include "TimerWheel.h"
+#include "Tree.h"
 
 #define URI_TCP  "tcp://"
 #define URI_MQTT "mqtt://"
@@ -26,11 +31,80 @@
 #define URI_WSS  "wss://"
 #define URI_UNIX "unix://"
 
+/* the most packets read by one turn of an event loop, so it can't be kept busy by one client */
+#define MQTTASYNC_LOOP_READS 64
+
+/* the publish priority lanes of each client: high, normal and low */
+#define MQTTASYNC_LANES 3
+#define MQTTASYNC_LANE_NORMAL 1
+
 enum MQTTAsync_threadStates
 {
 	STOPPED, STARTING, RUNNING, STOPPING
 };
 
+/**
+ * A group of clients served by one send thread and one receive thread.  Each shard has its
+ * own socket set, command queue and timers, so the shards do not contend with each other.
+ * The mutexes come first, for the static initializer of the default shard.
+ */
+typedef struct MQTTAsync_shard
+{
+	mutex_type mutex;         /* held while the shard's clients change, and in their callbacks */
+	mutex_type command_mutex; /* protects the command queue */
+	mutex_type socket_mutex;  /* protects the socket set */
+#if defined(_WIN32) || defined(_WIN64)
+	sem_type sendSem;        /* wakes the send thread */
+#else
+	cond_type sendCond;      /* wakes the send thread */
+#endif
+	int index;                /* -1 for the shard of a client with an event loop */
+	int eventLoop;            /* driven by MQTTAsync_runOnce, with no threads of its own */
+	int initialized;          /* whether the lists and the socket set have been created */
+	List* handles;            /* the clients of the shard */
+	List* commands;           /* the commands waiting for the send thread */
+	List* discarded;          /* buffered publishes discarded, whose failure callbacks the send thread calls */
+	int tostop;
+	TimerWheel timers;
+	uint64_t sendThreadWakeTime; /* the time on the timers' clock until which the send thread waits */
+	enum MQTTAsync_threadStates sendThreadState;
+	enum MQTTAsync_threadStates receiveThreadState;
+	thread_id_type sendThreadId;
+	thread_id_type receiveThreadId;
+	/* the state of the lower layers, NULL in the default shard which uses their defaults */
+	Sockets* sockets;
+	SocketBuffers* buffers;
+	WebSocket_frames* frames;
+	MQTTProtocol* protocol;
+	ClientStates* clientstates;
+} MQTTAsync_shard;
+
+MQTTAsync_shard* MQTTAsync_currentShard(void);
+void MQTTAsync_bindShard(MQTTAsync_shard* shard);
+int MQTTAsync_inCallback(void);
+int MQTTAsync_lockShard(MQTTAsync_shard* shard);
+int MQTTAsync_lockClient(MQTTAsync handle);
+void MQTTAsync_unlockClient(void);
+
+/* the state of the shard whose clients the calling thread is working on */
+#define mqttasync_mutex (MQTTAsync_currentShard()->mutex)
+#define mqttcommand_mutex (MQTTAsync_currentShard()->command_mutex)
+#if defined(_WIN32) || defined(_WIN64)
+#define send_sem (MQTTAsync_currentShard()->sendSem)
+#else
+#define send_cond (MQTTAsync_currentShard()->sendCond)
+#endif
+#define MQTTAsync_handles (MQTTAsync_currentShard()->handles)
+#define MQTTAsync_commands (MQTTAsync_currentShard()->commands)
+#define MQTTAsync_discarded (MQTTAsync_currentShard()->discarded)
+#define MQTTAsync_tostop (MQTTAsync_currentShard()->tostop)
+#define MQTTAsync_timers (MQTTAsync_currentShard()->timers)
+#define sendThread_wakeTime (MQTTAsync_currentShard()->sendThreadWakeTime)
+#define sendThread_state (MQTTAsync_currentShard()->sendThreadState)
+#define receiveThread_state (MQTTAsync_currentShard()->receiveThreadState)
+#define sendThread_id (MQTTAsync_currentShard()->sendThreadId)
+#define receiveThread_id (MQTTAsync_currentShard()->receiveThreadId)
+
 typedef struct
 {
 	MQTTAsync_message* msg;
@@ -120,6 +194,7 @@ typedef struct MQTTAsync_struct
 
 	List* responses;
 	unsigned int command_seqno;
+	START_TIME_TYPE commandIndexTime; /* when the command index snapshot was last written */
 
 	MQTTPacket* pack;
 
@@ -127,6 +202,15 @@ typedef struct MQTTAsync_struct
 	MQTTAsync_createOptions* createOptions;
 	int shouldBeConnected;
 	int noBufferedMessages; /* the current number of buffered (publish) messages for this client */
+	List* lanes[MQTTASYNC_LANES]; /* the buffered publish commands of each priority lane, oldest first */
+	int laneCredit[MQTTASYNC_LANES]; /* the weighted round robin state of the lanes */
+	List* controls; /* the other queued commands, which no publish queued after them may overtake */
+	unsigned int command_order; /* the order of the next command added to lanes or controls */
+	Tree* coalesced; /* the buffered publish commands which have a coalescing key, by key */
+	size_t bufferedBytes; /* the payload, topic and properties bytes the buffered publishes hold in memory */
+	unsigned long droppedMessages; /* publishes refused or discarded because the buffer was full */
+	unsigned long droppedBytes;
+	unsigned long spilledMessages; /* publishes persisted only because maxBufferedBytes was reached */
 
 	/* added for automatic reconnect */
 	int automaticReconnect;
@@ -146,6 +230,21 @@ typedef struct MQTTAsync_struct
 	MQTTProperties* connectProps;
 	MQTTProperties* willProps;
 
+	/* deadlines in the timer wheel serviced by the send thread */
+	TimerWheel_entry timeout_timer;   /* connect, disconnect and reconnect timeouts */
+	TimerWheel_entry keepalive_timer;
+	TimerWheel_entry retry_timer;
+
+	MQTTAsync_shard* shard; /* the shard whose threads serve this client */
+
+	/* A publish checks the client without locking its shard, so the client's connection flags,
+	   message id and the outbound message and response lists are changed with this held too.
+	   The lock order is the shard's mutex, its command_mutex, then this.  The send thread holds
+	   it across MQTTProtocol_startPublish, so the persistence store, the shard's socket_mutex
+	   and the log and heap mutexes can be taken inside it, but no shard or client mutex. */
+	mutex_type client_mutex;
+	MQTTAsync_token sendingMsgId; /* of the command the send thread is sending, while in no list */
+
 } MQTTAsyncs;
 
 typedef struct
@@ -155,6 +254,14 @@ typedef struct
 	unsigned int seqno; /* only used on restore */
 	int not_restored;
 	char* key; /* if not_restored, this holds the key */
+	int persisted; /* the MQTT version of the persisted command, or 0 if not persisted */
+	ListElement link; /* its place in MQTTAsync_commands or the client's responses */
+	ListElement buffer_link; /* its place in one of the client's lanes, or in its controls */
+	unsigned int order; /* when it was queued, relative to the client's other commands */
+	int lane; /* for a publish, its priority lane */
+	int bytes; /* for a publish, the bytes counted in the client's bufferedBytes */
+	char* coalesce_key; /* for a publish, the key of the buffered messages it replaces, or NULL */
+	int discard_rc; /* for a command taken out of the queue unsent, the return code given to its failure callback */
 } MQTTAsync_queuedCommand;
 
 void MQTTAsync_lock_mutex(mutex_type amutex);
@@ -162,8 +269,10 @@ void MQTTAsync_unlock_mutex(mutex_type amutex);
 void MQTTAsync_terminate(void);
 #if !defined(NO_PERSISTENCE)
 int MQTTAsync_restoreCommands(MQTTAsyncs* client);
+int MQTTAsync_persistCommandIndex(MQTTAsyncs* client);
 #endif
 int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size);
+int MQTTAsync_coalesceCompare(void* a, void* b, int content);
 void MQTTAsync_emptyMessageQueue(Clients* client);
 void MQTTAsync_freeResponses(MQTTAsyncs* m);
 void MQTTAsync_freeCommands(MQTTAsyncs* m);
@@ -173,8 +282,13 @@ int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* o
 int MQTTAsync_assignMsgId(MQTTAsyncs* m);
 int MQTTAsync_getNoBufferedMessages(MQTTAsyncs* m);
 void MQTTAsync_writeContinue(SOCKET socket);
+int MQTTAsync_loopTimeout(void);
+void MQTTAsync_runLoop(int timeout);
 void MQTTAsync_writeComplete(SOCKET socket, int rc);
 void setRetryLoopInterval(int keepalive);
+void MQTTAsync_initTimers(MQTTAsyncs* m);
+void MQTTAsync_armTimers(MQTTAsyncs* m);
+void MQTTAsync_cancelTimers(MQTTAsyncs* m);
 void MQTTAsync_NULLPublishResponses(MQTTAsyncs* m);
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -44,6 +44,7 @@
  *
  */
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #if !defined(_WIN32) && !defined(_WIN64)
@@ -66,6 +67,7 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Slab.h"
 
 #if defined(OPENSSL)
 #include <openssl/ssl.h>
@@ -124,6 +126,9 @@ extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 #endif
 extern mutex_type log_mutex;
+#if defined(SLAB_ALLOCATOR)
+extern mutex_type slab_mutex;
+#endif
 
 int MQTTClient_init(void)
 {
@@ -169,6 +174,14 @@ int MQTTClient_init(void)
 			printf("log_mutex error %d\n", rc);
 			goto exit;
 		}
+#if defined(SLAB_ALLOCATOR)
+		if ((slab_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
+		{
+			rc = GetLastError();
+			printf("slab_mutex error %d\n", rc);
+			goto exit;
+		}
+#endif
 		if ((socket_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
 		{
 			rc = GetLastError();
@@ -194,6 +207,10 @@ void MQTTClient_cleanup(void)
 #endif
 	if (log_mutex)
 		CloseHandle(log_mutex);
+#if defined(SLAB_ALLOCATOR)
+	if (slab_mutex)
+		CloseHandle(slab_mutex);
+#endif
 	if (socket_mutex)
 		CloseHandle(socket_mutex);
 	if (mqttclient_mutex)
@@ -390,7 +407,8 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 		goto exit;
 	}
 
-	if (strlen(clientId) == 0 && persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT)
+	if (strlen(clientId) == 0 && (persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT ||
+		persistence_type == MQTTCLIENT_PERSISTENCE_LOG))
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
@@ -507,8 +525,8 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 	memset(m->c, '\0', sizeof(Clients));
 	m->c->context = m;
 	m->c->MQTTVersion = (options) ? options->MQTTVersion : MQTTVERSION_DEFAULT;
-	m->c->outboundMsgs = ListInitialize();
-	m->c->inboundMsgs = ListInitialize();
+	m->c->outboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
+	m->c->inboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
 	m->c->messageQueue = ListInitialize();
 	m->c->outboundQueue = ListInitialize();
 	m->c->clientID = MQTTStrdup(clientId);
@@ -554,6 +572,7 @@ static void MQTTClient_terminate(void)
 		ListFree(handles);
 		handles = NULL;
 		WebSocket_terminate();
+		/* the slab chunks are kept for the next client, as the run thread is not joined */
 		#if !defined(NO_HEAP_TRACKING)
 			Heap_terminate();
 		#endif
@@ -1002,8 +1021,6 @@ static thread_return_type WINAPI MQTTClient_run(void* n)
 						m->c->sslopts->verify, NULL, NULL);
 				if (rc == 1 || rc == SSL_FATAL)
 				{
-					if (rc == 1 && (m->c->cleansession == 0 && m->c->cleanstart == 0) && m->c->session == NULL)
-						m->c->session = SSL_get1_session(m->c->net.ssl);
 					m->rc = rc;
 					Log(TRACE_MIN, -1, "Posting connect semaphore for SSL client %s rc %d", m->c->clientID, m->rc);
 					m->c->connect_state = NOT_IN_PROGRESS;
@@ -1116,12 +1133,11 @@ static void MQTTClient_closeSession(Clients* client, enum MQTTReasonCodes reason
 		WebSocket_close(&client->net, WebSocket_CLOSE_NORMAL, NULL);
 
 #if defined(OPENSSL)
-		SSL_SESSION_free(client->session); /* is a no-op if session is NULL */
-		client->session = NULL; /* show the session has been freed */
 		SSLSocket_close(&client->net);
 #endif
 		Paho_thread_unlock_mutex(socket_mutex);
 		Socket_close(client->net.socket);
+		Socket_freeReadBuffer(&client->net.readbuf);
 		client->net.socket = 0;
 #if defined(OPENSSL)
 		client->net.ssl = NULL;
@@ -1299,9 +1315,6 @@ static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_c
 
 			if (setSocketForSSLrc != MQTTCLIENT_SUCCESS)
 			{
-				if (m->c->session != NULL)
-					if ((rc = SSL_set_session(m->c->net.ssl, m->c->session)) != 1)
-						Log(TRACE_MIN, -1, "Failed to set SSL session with stored data, non critical");
 				rc = m->c->sslopts->struct_version >= 3 ?
 					SSLSocket_connect(m->c->net.ssl, m->c->net.socket, serverURI,
 						m->c->sslopts->verify, m->c->sslopts->ssl_error_cb, m->c->sslopts->ssl_error_context) :
@@ -1332,8 +1345,6 @@ static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_c
 							rc = SOCKET_ERROR;
 							goto exit;
 						}
-						if ((m->c->cleansession == 0 && m->c->cleanstart == 0) && m->c->session == NULL)
-							m->c->session = SSL_get1_session(m->c->net.ssl);
 					}
 				}
 			}
@@ -1384,9 +1395,6 @@ static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_c
 			rc = SOCKET_ERROR;
 			goto exit;
 		}
-		if((m->c->cleansession == 0 && m->c->cleanstart == 0) && m->c->session == NULL)
-			m->c->session = SSL_get1_session(m->c->net.ssl);
-
 		if ( m->websocket )
 		{
 			/* wait for websocket connect */
@@ -2422,12 +2430,11 @@ MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int p
 		goto exit;
 	}
 
-	if ((p = malloc(sizeof(Publish))) == NULL)
+	if ((p = Slab_malloc(sizeof(Publish))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit_and_free;
 	}
-	memset(p->mask, '\0', sizeof(p->mask));
 	p->payload = NULL;
 	p->payloadlen = payloadlen;
 	if (payloadlen > 0)
@@ -2601,19 +2608,19 @@ static MQTTPacket* MQTTClient_cycle(SOCKET* sock, ELAPSED_TIME_TYPE timeout, int
 	START_TIME_TYPE start;
 
 	FUNC_ENTRY;
+	if ((*sock = Socket_getPendingRead()) == -1
 #if defined(OPENSSL)
-	if ((*sock = SSLSocket_getPendingRead()) == -1)
+			&& (*sock = SSLSocket_getPendingRead()) == -1
+#endif
+			)
 	{
 		/* 0 from getReadySocket indicates no work to do, rc -1 == error */
-#endif
 		start = MQTTTime_start_clock();
 		*sock = Socket_getReadySocket(0, (int)timeout, socket_mutex, rc);
 		*rc = rc1;
 		if (*sock == 0 && timeout >= 100L && MQTTTime_elapsed(start) < (int64_t)10)
 			MQTTTime_sleep(100L);
-#if defined(OPENSSL)
 	}
-#endif
 	Paho_thread_lock_mutex(mqttclient_mutex);
 	if (*sock > 0 && rc1 == 0)
 	{
@@ -2758,11 +2765,7 @@ static MQTTPacket* MQTTClient_waitfor(MQTTClient handle, int packet_type, int* r
 					if (*rc == SSL_FATAL)
 						break;
 					else if (*rc == 1) /* rc == 1 means SSL connect has finished and succeeded */
-					{
-						if ((m->c->cleansession == 0 && m->c->cleanstart == 0) && m->c->session == NULL)
-							m->c->session = SSL_get1_session(m->c->net.ssl);
 						break;
-					}
 				}
 #endif
 				else if (m->c->connect_state == WEBSOCKET_IN_PROGRESS && *rc != TCPSOCKET_INTERRUPTED)
@@ -2995,6 +2998,18 @@ void MQTTClient_setTraceCallback(MQTTClient_traceCallback* callback)
 }
 
 
+void MQTTClient_setTraceRing(int entries)
+{
+	Log_setTraceRing(entries);
+}
+
+
+int MQTTClient_dumpTrace(const char* dest)
+{
+	return Log_dumpTrace(dest);
+}
+
+
 int MQTTClient_setCommandTimeout(MQTTClient handle, unsigned long milliSeconds)
 {
 	int rc = MQTTCLIENT_SUCCESS;
@@ -3010,6 +3025,27 @@ int MQTTClient_setCommandTimeout(MQTTClient handle, unsigned long milliSeconds)
 }
 
 
+void MQTTClient_getSSLCacheStats(MQTTClient_SSLCacheStats* stats)
+{
+	FUNC_ENTRY;
+	memset(stats, '\0', sizeof(*stats));
+#if defined(OPENSSL)
+	{
+		SSLSocket_cacheStats sslstats;
+
+		SSLSocket_getCacheStats(&sslstats);
+		stats->contextHits = sslstats.contextHits;
+		stats->contextMisses = sslstats.contextMisses;
+		stats->sessionHits = sslstats.sessionHits;
+		stats->sessionMisses = sslstats.sessionMisses;
+		stats->resumedHandshakes = sslstats.resumedHandshakes;
+		stats->fullHandshakes = sslstats.fullHandshakes;
+	}
+#endif
+	FUNC_EXIT;
+}
+
+
 MQTTClient_nameValue* MQTTClient_getVersionInfo(void)
 {
 	#define MAX_INFO_STRINGS 8
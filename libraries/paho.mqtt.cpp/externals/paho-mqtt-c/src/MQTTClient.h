@@ -537,6 +537,10 @@ LIBMQTT_API int MQTTClient_setPublished(MQTTClient handle, void* context, MQTTCl
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Use the built-in log-structured file
+ * persistence, which appends to a few segment files rather than writing a
+ * file for each message.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
  * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
@@ -544,6 +548,8 @@ LIBMQTT_API int MQTTClient_setPublished(MQTTClient handle, void* context, MQTTCl
  * to NULL, the persistence directory used is the working directory).
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
+ * For ::MQTTCLIENT_PERSISTENCE_LOG persistence, it points to an
+ * ::MQTTClient_logPersistenceOptions structure, or is NULL for the defaults.
  * @return ::MQTTCLIENT_SUCCESS if the client is successfully created, otherwise
  * an error code is returned.
  */
@@ -600,6 +606,10 @@ typedef struct
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Use the built-in log-structured file
+ * persistence, which appends to a few segment files rather than writing a
+ * file for each message.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
  * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
@@ -607,6 +617,8 @@ typedef struct
  * to NULL, the persistence directory used is the working directory).
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
+ * For ::MQTTCLIENT_PERSISTENCE_LOG persistence, it points to an
+ * ::MQTTClient_logPersistenceOptions structure, or is NULL for the defaults.
  * @param options additional options for the create.
  * @return ::MQTTCLIENT_SUCCESS if the client is successfully created, otherwise
  * an error code is returned.
@@ -807,6 +819,40 @@ typedef struct
   */
 LIBMQTT_API MQTTClient_nameValue* MQTTClient_getVersionInfo(void);
 
+/**
+ * Counts of how often TLS connections have been able to reuse the SSL context
+ * and TLS session of an earlier connection.
+ *
+ * Connections whose SSL options have the same contents (including the
+ * modification times of the files they name) share an SSL context, so the
+ * certificates and keys are loaded only once.  Options which set a PSK callback
+ * are never shared.  The last TLS session received from each server is offered
+ * when reconnecting to it, which lets the server skip the full handshake.
+ */
+typedef struct
+{
+	/** Connections which used a cached SSL context */
+	unsigned long contextHits;
+	/** Connections which created and loaded a new SSL context */
+	unsigned long contextMisses;
+	/** Connections which offered a cached TLS session to the server */
+	unsigned long sessionHits;
+	/** Connections with no cached TLS session to offer */
+	unsigned long sessionMisses;
+	/** Handshakes in which the server resumed the offered session */
+	unsigned long resumedHandshakes;
+	/** Handshakes in which the server did not resume a session */
+	unsigned long fullHandshakes;
+} MQTTClient_SSLCacheStats;
+
+/**
+  * This function returns the SSL context and TLS session cache statistics for
+  * the process, since the library was initialized.  All the counts are zero
+  * if the library was built without TLS support.
+  * @param stats the statistics, returned
+  */
+LIBMQTT_API void MQTTClient_getSSLCacheStats(MQTTClient_SSLCacheStats* stats);
+
 /**
  * MQTTClient_connectOptions defines several settings that control the way the
  * client connects to an MQTT server.
@@ -1466,6 +1512,27 @@ typedef void MQTTClient_traceCallback(enum MQTTCLIENT_TRACE_LEVELS level, char*
   */
 LIBMQTT_API void MQTTClient_setTraceCallback(MQTTClient_traceCallback* callback);
 
+/**
+  * This function switches trace to binary per-thread rings.  Instead of being formatted and
+  * written out as they are made, trace entries below ::MQTTCLIENT_TRACE_ERROR are stored in a
+  * ring of fixed size belonging to the thread, without taking any lock.  The oldest entries
+  * are overwritten when a ring is full.  Use MQTTClient_dumpTrace() to format and write out the
+  * entries.  Trace entries are still filtered by the trace level.
+  * @param entries the number of entries in each ring, which is rounded up to a power of 2.
+  * 0 switches the rings off.  This setting takes effect for threads which do not yet have
+  * a ring, so should be made before any client is created.
+  */
+LIBMQTT_API void MQTTClient_setTraceRing(int entries);
+
+/**
+  * This function formats and writes out the entries in the trace rings, oldest first,
+  * merging the entries of all threads.  The entries are kept, so they can be dumped again.
+  * @param dest a file name, or "stdout" or "stderr".  If NULL, the entries are written to the
+  * trace destination set by the environment variables, and to the trace callback.
+  * @return the number of entries written, or -1 if the file could not be opened.
+  */
+LIBMQTT_API int MQTTClient_dumpTrace(const char* dest);
+
 /**
   * Sets the timeout value for un/subscribe commands when waiting for the un/suback response from
   * the server.  Values less than 5000 are not allowed.
@@ -1910,6 +1977,11 @@ exit:
   * to a file.  Two files are used at most, when they are full, the last one is overwritten with the
   * new trace entries.  The default size is 1000 lines.
   *
+  * Setting MQTT_C_CLIENT_TRACE_RING to a number of entries stores trace in binary per-thread
+  * rings of that size rather than formatting it as it is made, see MQTTClient_setTraceRing().
+  * The rings are written to the trace destination when the library is terminated, or
+  * on demand with MQTTClient_dumpTrace().  ERROR and higher entries are always written immediately.
+  *
   * ### MQTT Packet Tracing
   *
   * A feature that can be very useful is printing the MQTT packets that are sent and received.  To
@@ -41,6 +41,15 @@
  * ::MQTTClient_persistence structure as the <i>persistence_context</i> 
  * argument to MQTTClient_create().
  *
+ * The log-structured persistence type (::MQTTCLIENT_PERSISTENCE_LOG) appends
+ * all the data for a client to a small number of segment files, rather than
+ * writing one file per message. Its <i>persistence_context</i> is a pointer to
+ * an ::MQTTClient_logPersistenceOptions structure, or NULL for the defaults.
+ *
+ * A ring persistence, created by MQTTClient_createRingPersistence(), keeps the
+ * data in a single preallocated file of fixed-size slots, mapped into memory.
+ * It is passed to MQTTClient_create() as a user persistence.
+ *
  * If the functions defined return an ::MQTTCLIENT_PERSISTENCE_ERROR then the 
  * state of the persisted data should remain as it was prior to the function 
  * being called. For example, if Persistence_put() returns 
@@ -62,6 +71,8 @@
 /// @endcond
 */
 
+#include "MQTTExportDeclarations.h"
+
 /**
   * This <i>persistence_type</i> value specifies the default file system-based 
   * persistence mechanism (see MQTTClient_create()).
@@ -77,6 +88,12 @@
   * persistence mechanism (see MQTTClient_create()).
   */
 #define MQTTCLIENT_PERSISTENCE_USER 2
+/**
+  * This <i>persistence_type</i> value specifies the built-in log-structured
+  * file persistence mechanism (see MQTTClient_create() and
+  * ::MQTTClient_logPersistenceOptions).
+  */
+#define MQTTCLIENT_PERSISTENCE_LOG 3
 
 /** 
   * Application-specific persistence functions must return this error code if 
@@ -252,6 +269,105 @@ typedef struct {
 } MQTTClient_persistence;
 
 
+/** Log persistence sync mode: leave writing the log to disk to the operating system */
+#define MQTTCLIENT_LOG_SYNC_NONE 0
+/** Log persistence sync mode: sync the log from a background thread, so that one
+ * sync covers all the writes made in an interval */
+#define MQTTCLIENT_LOG_SYNC_GROUP 1
+/** Log persistence sync mode: sync the log before each put or remove returns */
+#define MQTTCLIENT_LOG_SYNC_ALWAYS 2
+
+/**
+  * @brief The options for the log-structured persistence, ::MQTTCLIENT_PERSISTENCE_LOG.
+  *
+  * Records are appended to the current segment file of the log, and removals are
+  * recorded as tombstones.  An index of the live records is held in memory, and
+  * rebuilt by reading the log when the persistence is opened.  Once a segment is
+  * full a new one is started, and the live records of the older segments are
+  * copied forward in the background when enough of them are dead, so that the old
+  * segment files can be deleted.
+  */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQLP. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0. */
+	int struct_version;
+	/** The base directory for the log, as for ::MQTTCLIENT_PERSISTENCE_DEFAULT.
+	 * NULL means the working directory. */
+	const char* directory;
+	/** When the log is synced to disk: one of ::MQTTCLIENT_LOG_SYNC_NONE,
+	 * ::MQTTCLIENT_LOG_SYNC_GROUP or ::MQTTCLIENT_LOG_SYNC_ALWAYS */
+	int sync_mode;
+	/** For ::MQTTCLIENT_LOG_SYNC_GROUP, the longest time in milliseconds between
+	 * a write and the sync which covers it */
+	int sync_interval;
+	/** The size in bytes after which a new segment file is started */
+	int segment_size;
+	/** The percentage of the full segments which must be dead records before
+	 * they are compacted */
+	int compaction_threshold;
+} MQTTClient_logPersistenceOptions;
+
+#define MQTTClient_logPersistenceOptions_initializer { {'M', 'Q', 'L', 'P'}, 0, NULL, \
+	MQTTCLIENT_LOG_SYNC_GROUP, 10, 4*1024*1024, 50 }
+
+
+/**
+  * @brief The options for a memory-mapped ring persistence, created by
+  * MQTTClient_createRingPersistence().
+  *
+  * The data for a client is held in one file, of a fixed number of fixed-size
+  * slots, which is created at its full size and mapped into memory.  Each record
+  * takes as many consecutive slots as its key and data need, and its slots are
+  * released when it is removed.  A put fails if there is no run of free slots long
+  * enough, so the file never grows.
+  */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQRP. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0. */
+	int struct_version;
+	/** The base directory for the file, as for ::MQTTCLIENT_PERSISTENCE_DEFAULT.
+	 * NULL means the working directory. */
+	const char* directory;
+	/** The size of each slot in bytes, a multiple of 8.  The first slot of each
+	 * record starts with a 24 byte header. */
+	int slot_size;
+	/** The number of slots in the file */
+	int slot_count;
+	/** When the file is synced to disk: one of ::MQTTCLIENT_LOG_SYNC_NONE,
+	 * ::MQTTCLIENT_LOG_SYNC_GROUP or ::MQTTCLIENT_LOG_SYNC_ALWAYS */
+	int sync_mode;
+	/** For ::MQTTCLIENT_LOG_SYNC_GROUP, the longest time in milliseconds between
+	 * a write and the sync which covers it */
+	int sync_interval;
+} MQTTClient_ringPersistenceOptions;
+
+#define MQTTClient_ringPersistenceOptions_initializer { {'M', 'Q', 'R', 'P'}, 0, NULL, \
+	256, 4096, MQTTCLIENT_LOG_SYNC_GROUP, 10 }
+
+/**
+ * Create a memory-mapped ring persistence.  The result is passed to
+ * MQTTClient_create() or MQTTAsync_create() with ::MQTTCLIENT_PERSISTENCE_USER,
+ * and must be freed with MQTTClient_freeRingPersistence() once the clients using
+ * it have been destroyed.
+ * @param persistence set to the new persistence structure
+ * @param options the options, or NULL for the defaults
+ * @return 0 if success, ::MQTTCLIENT_PERSISTENCE_ERROR if the options are not
+ * valid, or another error code.
+ */
+LIBMQTT_API int MQTTClient_createRingPersistence(MQTTClient_persistence** persistence,
+		const MQTTClient_ringPersistenceOptions* options);
+
+/**
+ * Free a persistence structure created by MQTTClient_createRingPersistence().
+ * @param persistence the address of the persistence structure, which is set to NULL
+ */
+LIBMQTT_API void MQTTClient_freeRingPersistence(MQTTClient_persistence** persistence);
+
+
 /**
  * A callback which is invoked just before a write to persistence.  This can be
  * used to transform the data, for instance to encrypt it.
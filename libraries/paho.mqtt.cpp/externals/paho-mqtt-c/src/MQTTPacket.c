@@ -36,11 +36,16 @@
 #include "StackTrace.h"
 #include "WebSocket.h"
 #include "MQTTTime.h"
+#if defined(OPENSSL)
+#include "SSLSocket.h"
+#endif
 
 #include <stdlib.h>
 #include <string.h>
 
 #include "Heap.h"
+#include "Slab.h"
+#include "Thread.h"
 
 #if !defined(min)
 #define min(A,B) ( (A) < (B) ? (A):(B))
@@ -95,6 +100,11 @@ pf new_packets[] =
 
 static char* readUTFlen(char** pptr, char* enddata, int* len);
 static int MQTTPacket_send_ack(int MQTTVersion, int type, int msgid, int dup, networkHandles *net);
+static void* MQTTPacket_create(int MQTTVersion, networkHandles* net, Header header, char* data,
+		size_t remaining_length, int* error);
+static void* MQTTPacket_readBuffered(int MQTTVersion, networkHandles* net, int* error);
+static int MQTTPacket_write(networkHandles* net, Header header, char** buf0, size_t* buf0len, PacketBuffers* bufs);
+static int MQTTPacket_writeBuffered(networkHandles* net);
 
 /**
  * Reads one MQTT packet from a socket.
@@ -105,9 +115,8 @@ static int MQTTPacket_send_ack(int MQTTVersion, int type, int msgid, int dup, ne
 void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 {
 	char* data = NULL;
-	static Header header;
+	static THREAD_LOCAL Header header;
 	size_t remaining_length;
-	int ptype;
 	void* pack = NULL;
 	size_t actual_len = 0;
 
@@ -116,6 +125,12 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 
 	const size_t headerWsFramePos = WebSocket_framePos();
 
+	if (!net->websocket)
+	{
+		pack = MQTTPacket_readBuffered(MQTTVersion, net, error);
+		goto exit;
+	}
+
 	/* read the packet data from the socket */
 	*error = WebSocket_getch(net, &header.byte);
 	if (*error != TCPSOCKET_COMPLETE)   /* first byte is the header byte */
@@ -138,46 +153,68 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 		*error = TCPSOCKET_INTERRUPTED;
 		net->lastReceived = MQTTTime_now();
 	}
+	else
+		pack = MQTTPacket_create(MQTTVersion, net, header, data, remaining_length, error);
+exit:
+	if (*error == TCPSOCKET_INTERRUPTED)
+		WebSocket_framePosSeekTo(headerWsFramePos);
+
+	FUNC_EXIT_RC(*error);
+	return pack;
+}
+
+
+/**
+ * Builds a packet structure from the data read from the network.
+ * @param MQTTVersion the version of MQTT being used
+ * @param net the network handles the packet was read from
+ * @param header the fixed header byte of the packet
+ * @param data the variable header and payload of the packet
+ * @param remaining_length the length of data
+ * @param error set to TCPSOCKET_COMPLETE, or SOCKET_ERROR if the packet is bad
+ * @return the packet structure or NULL
+ */
+static void* MQTTPacket_create(int MQTTVersion, networkHandles* net, Header header, char* data,
+		size_t remaining_length, int* error)
+{
+	int ptype = header.bits.type;
+	void* pack = NULL;
+
+	FUNC_ENTRY;
+	*error = TCPSOCKET_COMPLETE;
+	if (ptype < CONNECT || (MQTTVersion < MQTTVERSION_5 && ptype >= DISCONNECT) ||
+			(MQTTVersion >= MQTTVERSION_5 && ptype > AUTH) ||
+			new_packets[ptype] == NULL)
+		Log(TRACE_MIN, 2, NULL, ptype);
 	else
 	{
-		ptype = header.bits.type;
-		if (ptype < CONNECT || (MQTTVersion < MQTTVERSION_5 && ptype >= DISCONNECT) ||
-				(MQTTVersion >= MQTTVERSION_5 && ptype > AUTH) ||
-				new_packets[ptype] == NULL)
-			Log(TRACE_MIN, 2, NULL, ptype);
-		else
+		if ((pack = (*new_packets[ptype])(MQTTVersion, header.byte, data, remaining_length)) == NULL)
 		{
-			if ((pack = (*new_packets[ptype])(MQTTVersion, header.byte, data, remaining_length)) == NULL)
-			{
-				*error = SOCKET_ERROR; // was BAD_MQTT_PACKET;
-				Log(LOG_ERROR, -1, "Bad MQTT packet, type %d", ptype);
-			}
+			*error = SOCKET_ERROR; // was BAD_MQTT_PACKET;
+			Log(LOG_ERROR, -1, "Bad MQTT packet, type %d", ptype);
+		}
 #if !defined(NO_PERSISTENCE)
-			else if (header.bits.type == PUBLISH && header.bits.qos == 2)
+		else if (header.bits.type == PUBLISH && header.bits.qos == 2)
+		{
+			int buf0len;
+			char *buf = malloc(10);
+
+			if (buf == NULL)
 			{
-				int buf0len;
-				char *buf = malloc(10);
-
-				if (buf == NULL)
-				{
-					*error = SOCKET_ERROR;
-					goto exit;
-				}
-				buf[0] = header.byte;
-				buf0len = 1 + MQTTPacket_encode(&buf[1], remaining_length);
-				*error = MQTTPersistence_putPacket(net->socket, buf, buf0len, 1,
-					&data, &remaining_length, header.bits.type, ((Publish *)pack)->msgId, 1, MQTTVersion);
-				free(buf);
+				*error = SOCKET_ERROR;
+				goto exit;
 			}
-#endif
+			buf[0] = header.byte;
+			buf0len = 1 + MQTTPacket_encode(&buf[1], remaining_length);
+			*error = MQTTPersistence_putPacket(net->socket, buf, buf0len, 1,
+				&data, &remaining_length, header.bits.type, ((Publish *)pack)->msgId, 1, MQTTVersion);
+			free(buf);
 		}
+#endif
 	}
 	if (pack)
 		net->lastReceived = MQTTTime_now();
 exit:
-	if (*error == TCPSOCKET_INTERRUPTED)
-		WebSocket_framePosSeekTo(headerWsFramePos);
-
 	FUNC_EXIT_RC(*error);
 	return pack;
 }
@@ -225,8 +262,7 @@ int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buf
 	packetbufs.buffers = &buffer;
 	packetbufs.buflens = &buflen;
 	packetbufs.frees = &freeData;
-	memset(packetbufs.mask, '\0', sizeof(packetbufs.mask));
-	rc = WebSocket_putdatas(net, &buf, &buf0len, &packetbufs);
+	rc = MQTTPacket_write(net, header, &buf, &buf0len, &packetbufs);
 
 	if (rc == TCPSOCKET_COMPLETE)
 		net->lastSent = MQTTTime_now();
@@ -249,10 +285,11 @@ exit:
  * @param count the number of buffers
  * @param buffers the rest of the buffers to write (not including remaining length)
  * @param buflens the lengths of the data in the array of buffers to be written
+ * @param persisted the form of the packet to persist, if not the same as the one sent, or NULL
  * @param the MQTT version being used
  * @return the completion code (TCPSOCKET_COMPLETE etc)
  */
-int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* bufs, int MQTTVersion)
+int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* bufs, PacketBuffers* persisted, int MQTTVersion)
 {
 	int i, rc = SOCKET_ERROR;
 	size_t buf0len, total = 0;
@@ -276,11 +313,25 @@ int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* bufs, in
 	{   /* persist PUBLISH QoS1 and Qo2 */
 		char *ptraux = bufs->buffers[2];
 		int msgId = readInt(&ptraux);
-		rc = MQTTPersistence_putPacket(net->socket, buf, buf0len, bufs->count, bufs->buffers, bufs->buflens,
-			header.bits.type, msgId, 0, MQTTVersion);
+
+		if (persisted == NULL)
+			rc = MQTTPersistence_putPacket(net->socket, buf, buf0len, bufs->count, bufs->buffers, bufs->buflens,
+				header.bits.type, msgId, 0, MQTTVersion);
+		else
+		{
+			char pbuf0[5];
+			size_t pbuf0len, ptotal = 0;
+
+			for (i = 0; i < persisted->count; i++)
+				ptotal += persisted->buflens[i];
+			pbuf0[0] = header.byte;
+			pbuf0len = 1 + MQTTPacket_encode(&pbuf0[1], ptotal);
+			rc = MQTTPersistence_putPacket(net->socket, pbuf0, pbuf0len, persisted->count, persisted->buffers,
+				persisted->buflens, header.bits.type, msgId, 0, MQTTVersion);
+		}
 	}
 #endif
-	rc = WebSocket_putdatas(net, &buf, &buf0len, bufs);
+	rc = MQTTPacket_write(net, header, &buf, &buf0len, bufs);
 
 	if (rc == TCPSOCKET_COMPLETE)
 		net->lastSent = MQTTTime_now();
@@ -293,6 +344,91 @@ exit:
 }
 
 
+/**
+ * Writes a packet to the network.  When outbound coalescing is on for a TCP or TLS connection,
+ * PUBLISH packets are added to the output buffer, which is written out once it reaches its
+ * size limit or its oldest data reaches the time limit.  Any other packet is added and then
+ * written out straight away with everything before it, so ordering is kept.  On a TLS
+ * connection the size limit is at most one full TLS record, so that small packets share
+ * records rather than each having a record of its own.
+ * @param net the network handles to write to
+ * @param header the one-byte MQTT header
+ * @param buf0 the fixed header buffer
+ * @param buf0len the length of the fixed header
+ * @param bufs the rest of the packet
+ * @return the completion code (TCPSOCKET_COMPLETE etc)
+ */
+static int MQTTPacket_write(networkHandles* net, Header header, char** buf0, size_t* buf0len, PacketBuffers* bufs)
+{
+	Socket_writeBuffer* wb = &net->writebuf;
+	size_t limit = wb->limit;
+	int rc = SOCKET_ERROR;
+
+	FUNC_ENTRY;
+	if (limit == 0 || net->websocket)
+	{
+		rc = WebSocket_putdatas(net, buf0, buf0len, bufs);
+		goto exit;
+	}
+#if defined(OPENSSL)
+	if (net->ssl && limit > SSL3_RT_MAX_PLAIN_LENGTH)
+		limit = SSL3_RT_MAX_PLAIN_LENGTH;
+#endif
+
+	if ((rc = Socket_bufferdatas(wb, *buf0, *buf0len, *bufs)) != TCPSOCKET_COMPLETE)
+		goto exit;
+	if (header.bits.type != PUBLISH || wb->len >= limit ||
+			(wb->delay_us > 0 && MQTTTime_difftime_us(MQTTTime_now(), wb->first) >= wb->delay_us))
+	{
+		/* the data has been copied, so the caller's buffers are finished with even if the write isn't */
+		if ((rc = MQTTPacket_writeBuffered(net)) == TCPSOCKET_INTERRUPTED)
+			rc = TCPSOCKET_COMPLETE;
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Writes out the data in a connection's output buffer, over TLS if the connection uses it.
+ * @param net the network handles to write to
+ * @return completion code, TCPSOCKET_INTERRUPTED if the write is still pending
+ */
+static int MQTTPacket_writeBuffered(networkHandles* net)
+{
+	int rc = SOCKET_ERROR;
+
+#if defined(OPENSSL)
+	if (net->ssl)
+		rc = SSLSocket_flushBuffered(net->ssl, net->socket, &net->writebuf);
+	else
+#endif
+		rc = Socket_flushBuffered(net->socket, &net->writebuf);
+	return rc;
+}
+
+
+/**
+ * Writes out any packets waiting in a connection's output buffer.
+ * @param net the network handles to write to
+ * @return the completion code (TCPSOCKET_COMPLETE etc)
+ */
+int MQTTPacket_flush(networkHandles* net)
+{
+	int rc = TCPSOCKET_COMPLETE;
+
+	FUNC_ENTRY;
+	if (net->writebuf.len > 0)
+	{
+		if ((rc = MQTTPacket_writeBuffered(net)) == TCPSOCKET_COMPLETE)
+			net->lastSent = MQTTTime_now();
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Encodes the message length according to the MQTT algorithm
  * @param buf the buffer into which the encoded data is written
@@ -356,6 +492,105 @@ exit:
 }
 
 
+/**
+ * Decodes the fixed header of the packet at the front of a receive buffer.
+ * @param rb the receive buffer
+ * @param hdrlen returns the length of the fixed header, or 0 if it has not all been read
+ * @param value returns the decoded remaining length, as far as it has been read
+ * @return TCPSOCKET_COMPLETE if the whole packet is in the buffer, TCPSOCKET_INTERRUPTED
+ * if more data is needed, or SOCKET_ERROR if the remaining length is malformed
+ */
+static int MQTTPacket_decodeBuffered(Socket_readBuffer* rb, size_t* hdrlen, size_t* value)
+{
+	size_t avail = rb->end - rb->start;
+	unsigned char* ptr = NULL;
+	size_t multiplier = 1;
+	size_t len = 1; /* skip the header byte */
+	int rc = TCPSOCKET_INTERRUPTED;
+
+	*hdrlen = *value = 0;
+	if (avail < 2)
+		goto exit;
+	ptr = (unsigned char*)&rb->buf[rb->start];
+	do
+	{
+		if (len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+		{
+			rc = SOCKET_ERROR;	/* bad data */
+			goto exit;
+		}
+		if (len == avail)
+		{
+			*value = 0;
+			goto exit;
+		}
+		*value += (ptr[len] & 127) * multiplier;
+		multiplier *= 128;
+	} while ((ptr[len++] & 128) != 0);
+	*hdrlen = len;
+	if (avail - len >= *value)
+		rc = TCPSOCKET_COMPLETE;
+exit:
+	return rc;
+}
+
+
+/**
+ * Reads one MQTT packet from a TCP or TLS connection through its receive buffer.  Data is
+ * read in large chunks, so back to back packets need one recv or one pass over the received
+ * TLS records between them rather than several reads each, and the packet is parsed in
+ * place.  The packet structure can point into the receive buffer, so must be finished with
+ * before the next read on the connection.
+ * @param MQTTVersion the version of MQTT being used
+ * @param net the network handles to read from
+ * @param error pointer to the error code which is completed if no packet is returned
+ * @return the packet structure or NULL if there was an error
+ */
+static void* MQTTPacket_readBuffered(int MQTTVersion, networkHandles* net, int* error)
+{
+	Socket_readBuffer* rb = &net->readbuf;
+	Header header;
+	size_t hdrlen = 0,
+		remaining_length = 0;
+	char* data = NULL;
+	void* pack = NULL;
+
+	FUNC_ENTRY;
+	if ((*error = MQTTPacket_decodeBuffered(rb, &hdrlen, &remaining_length)) == TCPSOCKET_INTERRUPTED)
+	{
+		/* the buffer is made big enough for the whole packet, if we know how long it is */
+#if defined(OPENSSL)
+		if (net->ssl)
+			*error = SSLSocket_readBuffered(net->ssl, net->socket, rb, hdrlen + remaining_length);
+		else
+#endif
+			*error = Socket_readBuffered(net->socket, rb, hdrlen + remaining_length);
+		if (*error != TCPSOCKET_COMPLETE)
+			goto exit;
+		if ((*error = MQTTPacket_decodeBuffered(rb, &hdrlen, &remaining_length)) == TCPSOCKET_INTERRUPTED)
+			net->lastReceived = MQTTTime_now();
+	}
+	if (*error != TCPSOCKET_COMPLETE)
+		goto exit;
+
+	header.byte = rb->buf[rb->start];
+	data = &rb->buf[rb->start + hdrlen];
+	rb->start += hdrlen + remaining_length;
+	pack = MQTTPacket_create(MQTTVersion, net, header, data, remaining_length, error);
+
+	/* the socket won't be signalled as ready for data we, or OpenSSL, have already read */
+	if (MQTTPacket_decodeBuffered(rb, &hdrlen, &remaining_length) != TCPSOCKET_INTERRUPTED
+#if defined(OPENSSL)
+			|| (net->ssl && SSLSocket_hasPending(net->ssl))
+#endif
+			)
+		Socket_addPendingRead(net->socket);
+exit:
+	FUNC_EXIT_RC(*error);
+	return pack;
+}
+
+
 /**
  * Calculates an integer from two bytes read from the input buffer
  * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
@@ -499,7 +734,7 @@ void writeData(char** pptr, const void* data, int datalen)
  */
 void* MQTTPacket_header_only(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
-	static unsigned char header = 0;
+	static THREAD_LOCAL unsigned char header = 0;
 	header = aHeader;
 	return &header;
 }
@@ -562,7 +797,7 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
 	char* enddata = &data[datalen];
 
 	FUNC_ENTRY;
-	if ((pack = malloc(sizeof(Publish))) == NULL)
+	if ((pack = Slab_malloc(sizeof(Publish))) == NULL)
 		goto exit;
 	memset(pack, '\0', sizeof(Publish));
 	pack->MQTTVersion = MQTTVersion;
@@ -800,7 +1035,7 @@ void* MQTTPacket_ack(int MQTTVersion, unsigned char aHeader, char* data, size_t
 	char* enddata = &data[datalen];
 
 	FUNC_ENTRY;
-	if ((pack = malloc(sizeof(Ack))) == NULL)
+	if ((pack = Slab_malloc(sizeof(Ack))) == NULL)
 		goto exit;
 	pack->MQTTVersion = MQTTVersion;
 	pack->header.byte = aHeader;
@@ -885,15 +1120,21 @@ int MQTTPacket_formatPayload(int buflen, char* buf, int payloadlen, char* payloa
 
 /**
  * Send an MQTT PUBLISH packet down a socket.
+ *
+ * If the connection has an outbound topic alias table, the PUBLISH is sent with the alias
+ * for its topic, and with an empty topic once the alias is known to the server.  The form
+ * persisted keeps the topic and no alias, as aliases don't last beyond the connection.
  * @param pack a structure from which to get some values to use, e.g topic, payload
  * @param dup boolean - whether to set the MQTT DUP flag
  * @param qos the value to use for the MQTT QoS setting
  * @param retained boolean - whether to set the MQTT retained flag
  * @param socket the open socket to send the data to
  * @param clientID the string client identifier, only used for tracing
+ * @param aliases the outbound topic aliases for the connection, or NULL
  * @return the completion code (e.g. TCPSOCKET_COMPLETE)
  */
-int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, networkHandles* net, const char* clientID)
+int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, networkHandles* net, const char* clientID,
+		TopicAliases* aliases)
 {
 	Header header;
 	char *topiclen;
@@ -910,27 +1151,65 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, netwo
 	header.bits.retain = retained;
 	if (qos > 0 || pack->MQTTVersion >= 5)
 	{
-		int buflen = ((qos > 0) ? 2 : 0) + ((pack->MQTTVersion >= 5) ? MQTTProperties_len(&pack->properties) : 0);
+		MQTTProperties props = pack->properties;
+		int alias = 0, assigned = 0;
+		int buflen = 0;
 		char *ptr = NULL;
 		char* bufs[4] = {topiclen, pack->topic, NULL, pack->payload};
-		size_t lens[4] = {2, strlen(pack->topic), buflen, pack->payloadlen};
+		size_t lens[4] = {2, strlen(pack->topic), 0, pack->payloadlen};
 		int frees[4] = {1, 0, 1, 0};
-		PacketBuffers packetbufs = {4, bufs, lens, frees, {pack->mask[0], pack->mask[1], pack->mask[2], pack->mask[3]}};
-
+		PacketBuffers packetbufs = {4, bufs, lens, frees};
+		char ptopiclen[2];
+		char* pbufs[4] = {ptopiclen, pack->topic, NULL, pack->payload};
+		size_t plens[4] = {2, lens[1], 0, pack->payloadlen};
+		int pfrees[4] = {0, 0, 0, 0};
+		PacketBuffers persisted = {4, pbufs, plens, pfrees};
+
+		if (aliases && pack->MQTTVersion >= 5 &&
+				!MQTTProperties_hasProperty(&pack->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS))
+			alias = TopicAliases_outbound(aliases, pack->topic, lens[1], &assigned);
+		if (alias > 0)
+		{
+			props.length += 3; /* identifier and two byte alias */
+			if (!assigned)
+				lens[1] = 0;
+		}
+		buflen = ((qos > 0) ? 2 : 0) + ((pack->MQTTVersion >= 5) ? MQTTProperties_len(&props) : 0);
+		lens[2] = buflen;
 		bufs[2] = ptr = malloc(buflen);
 		if (ptr == NULL)
 			goto exit_free;
 		if (qos > 0)
 			writeInt(&ptr, pack->msgId);
 		if (pack->MQTTVersion >= 5)
+			MQTTProperties_write(&ptr, &props);
+		if (alias > 0)
+		{
+			writeChar(&ptr, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+			writeInt(&ptr, alias);
+		}
+
+		if (alias > 0 && qos > 0)
+		{
+			plens[2] = 2 + MQTTProperties_len(&pack->properties);
+			if ((pbufs[2] = ptr = malloc(plens[2])) == NULL)
+			{
+				free(bufs[2]);
+				goto exit_free;
+			}
+			writeInt(&ptr, pack->msgId);
 			MQTTProperties_write(&ptr, &pack->properties);
+			ptr = ptopiclen;
+			writeInt(&ptr, (int)plens[1]);
+		}
 
 		ptr = topiclen;
 		writeInt(&ptr, (int)lens[1]);
-		rc = MQTTPacket_sends(net, header, &packetbufs, pack->MQTTVersion);
+		rc = MQTTPacket_sends(net, header, &packetbufs, (pbufs[2] != NULL) ? &persisted : NULL, pack->MQTTVersion);
 		if (rc != TCPSOCKET_INTERRUPTED)
 			free(bufs[2]);
-		memcpy(pack->mask, packetbufs.mask, sizeof(pack->mask));
+		if (pbufs[2] != NULL)
+			free(pbufs[2]);
 	}
 	else
 	{
@@ -938,11 +1217,10 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, netwo
 		char* bufs[3] = {topiclen, pack->topic, pack->payload};
 		size_t lens[3] = {2, strlen(pack->topic), pack->payloadlen};
 		int frees[3] = {1, 0, 0};
-		PacketBuffers packetbufs = {3, bufs, lens, frees, {pack->mask[0], pack->mask[1], pack->mask[2], pack->mask[3]}};
+		PacketBuffers packetbufs = {3, bufs, lens, frees};
 
 		writeInt(&ptr, (int)lens[1]);
-		rc = MQTTPacket_sends(net, header, &packetbufs, pack->MQTTVersion);
-		memcpy(pack->mask, packetbufs.mask, sizeof(pack->mask));
+		rc = MQTTPacket_sends(net, header, &packetbufs, NULL, pack->MQTTVersion);
 	}
 	{
 #if defined(_WIN32) || defined(_WIN64)
@@ -1109,7 +1387,7 @@ exit:
 }
 
 
-static char* bufptr;
+static THREAD_LOCAL char* bufptr;
 
 int bufchar(char* c, int count)
 {
@@ -28,6 +28,8 @@
 
 #include "MQTTPersistence.h"
 #include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "MQTTPersistenceRing.h"
 #include "MQTTProtocolClient.h"
 #include "Heap.h"
 
@@ -86,6 +88,9 @@ int MQTTPersistence_create(MQTTClient_persistence** persistence, int type, void*
 			else
 				rc = PAHO_MEMORY_ERROR;
 			break;
+		case MQTTCLIENT_PERSISTENCE_LOG :
+			rc = plogcreate(&per, (MQTTClient_logPersistenceOptions*)pcontext);
+			break;
 		case MQTTCLIENT_PERSISTENCE_USER :
 			per = (MQTTClient_persistence *)pcontext;
 			if ( per == NULL || (per != NULL && (per->context == NULL || per->pclear == NULL ||
@@ -144,7 +149,7 @@ int MQTTPersistence_close(Clients *c)
 	{
 		rc = c->persistence->pclose(c->phandle);
 
-		if (c->persistence->popen == pstopen) {
+		if (c->persistence->popen == pstopen || c->persistence->popen == plogopen) {
 			if (c->persistence->context)
 				free(c->persistence->context);
 			free(c->persistence);
@@ -176,6 +181,54 @@ int MQTTPersistence_clear(Clients *c)
 }
 
 
+/**
+ * Starts a batch of writes to the persistent store, which are made durable together by
+ * ::MQTTPersistence_endBatch.  Only the log and ring stores put off their syncs; for any
+ * other store, each write is complete when it returns, as it is outside a batch.
+ * @param client the client as ::Clients.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
+int MQTTPersistence_beginBatch(Clients *c)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE)
+	if (c->persistence == NULL)
+		;
+	else if (c->persistence->pput == plogput)
+		rc = plogbeginbatch(c->phandle);
+	else if (c->persistence->pput == pringput)
+		rc = pringbeginbatch(c->phandle);
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Ends a batch of writes to the persistent store, started by ::MQTTPersistence_beginBatch.
+ * @param client the client as ::Clients.
+ * @return 0 if the writes are durable, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
+int MQTTPersistence_endBatch(Clients *c)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE)
+	if (c->persistence == NULL)
+		;
+	else if (c->persistence->pput == plogput)
+		rc = plogendbatch(c->phandle);
+	else if (c->persistence->pput == pringput)
+		rc = pringendbatch(c->phandle);
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Restores the persisted records to the outbound and inbound message queues of the
  * client.
@@ -203,7 +256,8 @@ int MQTTPersistence_restorePackets(Clients *c)
 				;
 			}
 			else if (strncmp(msgkeys[i], PERSISTENCE_QUEUE_KEY, strlen(PERSISTENCE_QUEUE_KEY)) == 0 ||
-					 strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) == 0)
+					 strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) == 0 ||
+					 strcmp(msgkeys[i], PERSISTENCE_COMMAND_INDEX_KEY) == 0)
 			{
 				;
 			}
@@ -447,7 +501,6 @@ int MQTTPersistence_putPacket(SOCKET socket, char* buf0, size_t buf0len, int cou
 						char** buffers, size_t* buflens, int htype, int msgId, int scr, int MQTTVersion)
 {
 	int rc = 0;
-	extern ClientStates* bstate;
 	int nbufs, i;
 	int* lens = NULL;
 	char** bufs = NULL;
@@ -455,7 +508,7 @@ int MQTTPersistence_putPacket(SOCKET socket, char* buf0, size_t buf0len, int cou
 	Clients* client = NULL;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &socket, clientSocketCompare)->content);
+	client = (Clients*)(ListFindItem(MQTTProtocol_getClients()->clients, &socket, clientSocketCompare)->content);
 	if (client->persistence != NULL)
 	{
 		const size_t keysize = PERSISTENCE_MAX_KEY_LENGTH + 1;
@@ -49,6 +49,8 @@
 #define PERSISTENCE_QUEUE_KEY "q-"
 /** Stem of the key for an MQTT V5 incoming message queue */
 #define PERSISTENCE_V5_QUEUE_KEY "q5-"
+/** Key of the async client's snapshot of its queued command index */
+#define PERSISTENCE_COMMAND_INDEX_KEY "ci-"
 /** Maximum length of a stem for a persistence key */
 #define PERSISTENCE_MAX_STEM_LENGTH 4
 /** Maximum allowed length of a persistence key */
@@ -60,6 +62,8 @@ int MQTTPersistence_create(MQTTClient_persistence** per, int type, void* pcontex
 int MQTTPersistence_initialize(Clients* c, const char* serverURI);
 int MQTTPersistence_close(Clients* c);
 int MQTTPersistence_clear(Clients* c);
+int MQTTPersistence_beginBatch(Clients* c);
+int MQTTPersistence_endBatch(Clients* c);
 int MQTTPersistence_restorePackets(Clients* c);
 void* MQTTPersistence_restorePacket(int MQTTVersion, char* buffer, size_t buflen);
 void MQTTPersistence_insertInOrder(List* list, void* content, size_t size);
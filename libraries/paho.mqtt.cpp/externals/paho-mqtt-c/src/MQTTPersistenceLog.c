@@ -0,0 +1,1270 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - log-structured persistence
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A log-structured file persistence implementation.
+ *
+ * The directory for each client is the same as for the default persistence (see ::pstopen),
+ * but rather than a file per key, the records are appended to segment files named
+ * log-<n>.plog.  Each record is a header, the key and the data.  A remove appends a record
+ * with no data, a tombstone.  An index in memory maps each live key to its latest record,
+ * so a get reads the data directly and the keys are listed without reading the directory.
+ * The index is rebuilt when the persistence is opened, by reading the segments in order;
+ * a torn record at the end of a segment is cut off.
+ *
+ * When the current segment reaches the configured size, a new one is started.  A background
+ * thread syncs the log for ::MQTTCLIENT_LOG_SYNC_GROUP, and once enough of the records in the
+ * full segments are dead, it copies the live ones forward to the current segment and deletes
+ * the full segments, oldest first.
+ *
+ * For ::MQTTCLIENT_LOG_SYNC_ALWAYS, the records put between ::plogbeginbatch and
+ * ::plogendbatch are synced once, by ::plogendbatch, rather than one by one.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+	#include <io.h>
+	#define snprintf _snprintf
+	#define fileno _fileno
+	#define fsync _commit
+	#define ftruncate _chsize_s
+#else
+	#include <dirent.h>
+	#include <unistd.h>
+#endif
+
+#include "MQTTPersistenceLog.h"
+#include "MQTTPersistenceDefault.h"
+#include "LinkedList.h"
+#include "Thread.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define WINAPI
+#endif
+
+#define LOG_RECORD_MAGIC 0x504C4F47 /* PLOG */
+#define LOG_RECORD_TOMBSTONE 0x80000000 /* set in the key length of a remove */
+#define LOG_MAX_KEY_LENGTH 1024
+#define LOG_INDEX_SIZE 256 /* initial number of index buckets, a power of 2 */
+#define LOG_MIN_WAIT 20 /* semaphore waits are made in 10ms steps */
+#define LOG_COMPACTION_WAIT 1000 /* how often to look for compaction when there is no group sync */
+
+/**
+ * The header of each record in a segment, followed by the key and the data
+ */
+typedef struct
+{
+	unsigned int magic;
+	unsigned int keylen;	/**< with LOG_RECORD_TOMBSTONE set for a remove */
+	unsigned int datalen;
+	unsigned int checksum;	/**< of the key and data */
+} logRecordHeader;
+
+/**
+ * One segment file of the log
+ */
+typedef struct
+{
+	int id;
+	FILE* fp;
+	long size;	/**< bytes written to the segment */
+	long live;	/**< bytes in the records which are still live */
+} logSegment;
+
+/**
+ * Index entry for a live key.  The key is stored after the structure.
+ */
+typedef struct logEntryStruct
+{
+	struct logEntryStruct* next;	/**< next entry in the same bucket */
+	unsigned int hash;
+	logSegment* segment;	/**< the segment holding the latest record for the key */
+	long offset;	/**< offset of the record in the segment */
+	int datalen;
+	char* key;
+} logEntry;
+
+/**
+ * The state of the log for one client
+ */
+typedef struct
+{
+	char* clientDir;	/**< from pstopen */
+	MQTTClient_logPersistenceOptions options;
+	mutex_type mutex;
+	List* segments;	/**< oldest first; the last is the one being written */
+	logEntry** index;
+	unsigned int index_size;
+	int count;	/**< the number of live keys */
+	int dirty;	/**< written to since the last sync */
+	int batches;	/**< the number of batches in progress */
+	int stopping;
+	sem_type wake;
+	sem_type stopped;
+} logStore;
+
+static int plogsegments(logStore* store);
+static thread_return_type WINAPI plogthread(void* n);
+
+
+/**
+ * Allocate a persistence structure for the log-structured persistence, taking a copy of the options.
+ * @param persistence the persistence structure allocated
+ * @param options the options, or NULL for the defaults
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise.
+ */
+int plogcreate(MQTTClient_persistence** persistence, MQTTClient_logPersistenceOptions* options)
+{
+	MQTTClient_logPersistenceOptions defaults = MQTTClient_logPersistenceOptions_initializer;
+	MQTTClient_logPersistenceOptions* copy = NULL;
+	MQTTClient_persistence* per = NULL;
+	const char* directory = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (options == NULL)
+		options = &defaults;
+	if (strncmp(options->struct_id, "MQLP", 4) != 0 || options->struct_version != 0 ||
+		options->sync_mode < MQTTCLIENT_LOG_SYNC_NONE || options->sync_mode > MQTTCLIENT_LOG_SYNC_ALWAYS ||
+		options->sync_interval < 0 || options->segment_size <= 0 ||
+		options->compaction_threshold < 0 || options->compaction_threshold > 100)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	directory = (options->directory) ? options->directory : "."; /* working directory */
+
+	if ((per = malloc(sizeof(MQTTClient_persistence))) == NULL ||
+		(copy = malloc(sizeof(MQTTClient_logPersistenceOptions) + strlen(directory) + 1)) == NULL)
+	{
+		if (per)
+			free(per);
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	*copy = *options;
+	copy->directory = (char*)(copy + 1);
+	strcpy((char*)copy->directory, directory);
+
+	per->context      = copy;
+	per->popen        = plogopen;
+	per->pclose       = plogclose;
+	per->pput         = plogput;
+	per->pget         = plogget;
+	per->premove      = plogremove;
+	per->pkeys        = plogkeys;
+	per->pclear       = plogclear;
+	per->pcontainskey = plogcontainskey;
+	*persistence = per;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * FNV-1a hash, used both for the index and as the record checksum
+ * @param hash the hash so far, or 2166136261 to start
+ * @param data the bytes to add to the hash
+ * @param len the number of bytes
+ * @return the updated hash
+ */
+static unsigned int ploghash(unsigned int hash, const char* data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+#define LOG_HASH_START 2166136261U
+
+
+static char* plogsegmentname(logStore* store, int id)
+{
+	size_t alloclen = strlen(store->clientDir) + strlen(LOG_FILENAME_PREFIX) + strlen(LOG_FILENAME_EXTENSION) + 13;
+	char* name = malloc(alloclen);
+
+	if (name && snprintf(name, alloclen, "%s/%s%d%s", store->clientDir, LOG_FILENAME_PREFIX, id, LOG_FILENAME_EXTENSION) >= alloclen)
+	{
+		free(name);
+		name = NULL;
+	}
+	return name;
+}
+
+
+/**
+ * Open a segment file, creating it if necessary, and add it to the end of the segment list.
+ * @param store the log
+ * @param id the number of the segment
+ * @return the segment, or NULL on error
+ */
+static logSegment* plogopensegment(logStore* store, int id)
+{
+	logSegment* segment = NULL;
+	char* name = NULL;
+
+	FUNC_ENTRY;
+	if ((name = plogsegmentname(store, id)) == NULL)
+		goto exit;
+	if ((segment = malloc(sizeof(logSegment))) == NULL)
+		goto exit;
+	memset(segment, '\0', sizeof(logSegment));
+	segment->id = id;
+	if ((segment->fp = fopen(name, "a+b")) == NULL ||
+		ListAppend(store->segments, segment, sizeof(logSegment)) == NULL)
+	{
+		if (segment->fp)
+			fclose(segment->fp);
+		free(segment);
+		segment = NULL;
+	}
+exit:
+	if (name)
+		free(name);
+	FUNC_EXIT;
+	return segment;
+}
+
+
+/**
+ * Close a segment file and delete it.
+ * @param store the log
+ * @param segment the segment, which is removed from the segment list and freed
+ */
+static void plogdeletesegment(logStore* store, logSegment* segment)
+{
+	char* name = plogsegmentname(store, segment->id);
+
+	fclose(segment->fp);
+	if (name)
+	{
+		if (remove(name) != 0)
+			Log(LOG_ERROR, 0, "Error %d removing persistence segment %s", errno, name);
+		free(name);
+	}
+	ListRemove(store->segments, segment);
+}
+
+
+static int plogsync(logStore* store)
+{
+	logSegment* segment = (logSegment*)(store->segments->last->content);
+	int rc = 0;
+
+	if (fflush(segment->fp) != 0 || fsync(fileno(segment->fp)) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+		store->dirty = 0;
+	return rc;
+}
+
+
+static logEntry* plogfind(logStore* store, const char* key, unsigned int hash, logEntry*** prev)
+{
+	logEntry** link = &store->index[hash & (store->index_size - 1)];
+
+	while (*link && ((*link)->hash != hash || strcmp((*link)->key, key) != 0))
+		link = &(*link)->next;
+	if (prev)
+		*prev = link;
+	return *link;
+}
+
+
+static size_t plogrecordsize(logEntry* entry)
+{
+	return sizeof(logRecordHeader) + strlen(entry->key) + entry->datalen;
+}
+
+
+/**
+ * Double the number of index buckets, keeping the average chain length at or below 1.
+ */
+static void plogresize(logStore* store)
+{
+	unsigned int new_size = store->index_size * 2;
+	logEntry** new_index = NULL;
+	unsigned int i;
+
+	if ((new_index = malloc(new_size * sizeof(logEntry*))) == NULL)
+		return; /* the chains just get longer */
+	memset(new_index, '\0', new_size * sizeof(logEntry*));
+	for (i = 0; i < store->index_size; ++i)
+	{
+		logEntry* entry = store->index[i];
+
+		while (entry)
+		{
+			logEntry* next = entry->next;
+			logEntry** bucket = &new_index[entry->hash & (new_size - 1)];
+
+			entry->next = *bucket;
+			*bucket = entry;
+			entry = next;
+		}
+	}
+	free(store->index);
+	store->index = new_index;
+	store->index_size = new_size;
+}
+
+
+/**
+ * Point the index at a new record for a key, or remove the key from the index for a tombstone.
+ * The space used by the record previously current for the key becomes dead.
+ * @return 0 if success, #PAHO_MEMORY_ERROR otherwise
+ */
+static int plogupdate(logStore* store, const char* key, unsigned int hash, logSegment* segment,
+		long offset, int datalen, int tombstone)
+{
+	logEntry** prev = NULL;
+	logEntry* entry = plogfind(store, key, hash, &prev);
+	int rc = 0;
+
+	if (entry)
+	{
+		entry->segment->live -= (long)plogrecordsize(entry);
+		if (tombstone)
+		{
+			*prev = entry->next;
+			free(entry);
+			--store->count;
+			goto exit;
+		}
+	}
+	else if (tombstone)
+		goto exit;
+	else
+	{
+		size_t keylen = strlen(key);
+
+		if ((entry = malloc(sizeof(logEntry) + keylen + 1)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		entry->key = (char*)(entry + 1);
+		memcpy(entry->key, key, keylen + 1);
+		entry->hash = hash;
+		entry->next = *prev;
+		*prev = entry;
+		if (++store->count > (int)store->index_size)
+			plogresize(store);
+	}
+	entry->segment = segment;
+	entry->offset = offset;
+	entry->datalen = datalen;
+	segment->live += (long)plogrecordsize(entry);
+exit:
+	return rc;
+}
+
+
+/**
+ * Append a record to the segment being written.  If the write fails, the segment is cut
+ * back so that no partial record is left.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int plogappend(logStore* store, const char* key, int bufcount, char* buffers[], int buflens[],
+		int tombstone, logSegment** segment, long* offset)
+{
+	logSegment* current = (store->segments->last) ? (logSegment*)(store->segments->last->content) : NULL;
+	logRecordHeader header;
+	size_t keylen = strlen(key);
+	int i;
+	int rc = 0;
+
+	if (current == NULL)
+		return MQTTCLIENT_PERSISTENCE_ERROR; /* a new segment could not be started */
+	header.magic = LOG_RECORD_MAGIC;
+	header.keylen = (unsigned int)keylen | (tombstone ? LOG_RECORD_TOMBSTONE : 0);
+	header.datalen = 0;
+	header.checksum = ploghash(LOG_HASH_START, key, keylen);
+	for (i = 0; i < bufcount; ++i)
+	{
+		header.datalen += buflens[i];
+		header.checksum = ploghash(header.checksum, buffers[i], buflens[i]);
+	}
+
+	if (fseek(current->fp, 0, SEEK_END) != 0 ||
+		fwrite(&header, sizeof(header), 1, current->fp) != 1 ||
+		fwrite(key, 1, keylen, current->fp) != keylen)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	for (i = 0; rc == 0 && i < bufcount; ++i)
+	{
+		if (fwrite(buffers[i], 1, buflens[i], current->fp) != (size_t)buflens[i])
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	/* hand the record to the operating system, so that it survives the process */
+	if (rc == 0 && fflush(current->fp) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	if (rc != 0)
+	{
+		Log(LOG_ERROR, 0, "Error %d writing persistence segment %d", errno, current->id);
+		fflush(current->fp);
+		if (ftruncate(fileno(current->fp), current->size) != 0)
+			Log(LOG_ERROR, 0, "Error %d truncating persistence segment %d", errno, current->id);
+		goto exit;
+	}
+
+	*segment = current;
+	*offset = current->size;
+	current->size += (long)(sizeof(header) + keylen + header.datalen);
+	store->dirty = 1;
+exit:
+	return rc;
+}
+
+
+/**
+ * Make the writes so far durable, according to the sync mode, and start a new segment if the
+ * current one is full.
+ */
+static int plogcommit(logStore* store)
+{
+	logSegment* current = (logSegment*)(store->segments->last->content);
+	int rc = 0;
+
+	if ((store->options.sync_mode == MQTTCLIENT_LOG_SYNC_ALWAYS && store->batches == 0) ||
+		(current->size >= store->options.segment_size && store->options.sync_mode != MQTTCLIENT_LOG_SYNC_NONE))
+		rc = plogsync(store);
+	if (rc == 0 && current->size >= store->options.segment_size)
+	{
+		if (plogopensegment(store, current->id + 1) == NULL)
+			Log(LOG_ERROR, 0, "Error starting persistence segment %d", current->id + 1);
+		else
+			Thread_post_sem(store->wake); /* the full segments may now need compacting */
+	}
+	return rc;
+}
+
+
+/**
+ * Read the records of one segment into the index.  A record which is not complete and intact
+ * ends the segment, and is cut off so that later appends follow the last good record.
+ * @return 0 if success, #PAHO_MEMORY_ERROR otherwise
+ */
+static int plogscan(logStore* store, logSegment* segment)
+{
+	logRecordHeader header;
+	char* buffer = NULL;
+	size_t buflen = 0;
+	long end = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (fseek(segment->fp, 0, SEEK_END) != 0 || (end = ftell(segment->fp)) < 0 ||
+		fseek(segment->fp, 0, SEEK_SET) != 0)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	while (segment->size + (long)sizeof(header) <= end)
+	{
+		size_t keylen = 0;
+		size_t reclen = 0;
+
+		if (fread(&header, sizeof(header), 1, segment->fp) != 1 || header.magic != LOG_RECORD_MAGIC)
+			break;
+		keylen = header.keylen & ~LOG_RECORD_TOMBSTONE;
+		reclen = keylen + header.datalen;
+		if (keylen == 0 || keylen > LOG_MAX_KEY_LENGTH || header.datalen > (unsigned int)(end - segment->size))
+			break;
+		if (reclen + 1 > buflen)
+		{
+			char* newbuf = (buffer == NULL) ? malloc(reclen + 1) : realloc(buffer, reclen + 1);
+
+			if (newbuf == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				goto exit;
+			}
+			buffer = newbuf;
+			buflen = reclen + 1;
+		}
+		if (fread(buffer, 1, reclen, segment->fp) != reclen ||
+			ploghash(LOG_HASH_START, buffer, reclen) != header.checksum)
+			break;
+		buffer[keylen] = '\0'; /* the key, as a string */
+		if ((rc = plogupdate(store, buffer, ploghash(LOG_HASH_START, buffer, keylen), segment, segment->size,
+				(int)header.datalen, (header.keylen & LOG_RECORD_TOMBSTONE) != 0)) != 0)
+			goto exit;
+		segment->size += (long)(sizeof(header) + reclen);
+	}
+
+	if (segment->size < end)
+	{
+		Log(LOG_ERROR, 0, "Persistence segment %d cut from %ld to %ld bytes", segment->id, end, segment->size);
+		fflush(segment->fp);
+		if (ftruncate(fileno(segment->fp), segment->size) != 0)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+exit:
+	if (buffer)
+		free(buffer);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static int plogidcompare(const void* a, const void* b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+
+/**
+ * Find the segment files of the log, open them in order and build the index from them.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise.
+ */
+static int plogsegments(logStore* store)
+{
+	int* ids = NULL;
+	int nids = 0, maxids = 0;
+	int i;
+	int rc = 0;
+	size_t prefixlen = strlen(LOG_FILENAME_PREFIX);
+#if defined(_WIN32) || defined(_WIN64)
+	char* pattern = NULL;
+	size_t alloclen = strlen(store->clientDir) + prefixlen + strlen(LOG_FILENAME_EXTENSION) + 3;
+	WIN32_FIND_DATAA data;
+	HANDLE find = INVALID_HANDLE_VALUE;
+#else
+	DIR* dp = NULL;
+	struct dirent* dir_entry = NULL;
+#endif
+
+	FUNC_ENTRY;
+#if defined(_WIN32) || defined(_WIN64)
+	if ((pattern = malloc(alloclen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	snprintf(pattern, alloclen, "%s/%s*%s", store->clientDir, LOG_FILENAME_PREFIX, LOG_FILENAME_EXTENSION);
+	find = FindFirstFileA(pattern, &data);
+	free(pattern);
+	while (find != INVALID_HANDLE_VALUE)
+	{
+		const char* name = data.cFileName;
+#else
+	if ((dp = opendir(store->clientDir)) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	while ((dir_entry = readdir(dp)) != NULL)
+	{
+		const char* name = dir_entry->d_name;
+#endif
+		char* end = NULL;
+		long id = 0;
+
+		if (strncmp(name, LOG_FILENAME_PREFIX, prefixlen) == 0 &&
+			(id = strtol(name + prefixlen, &end, 10)) > 0 && strcmp(end, LOG_FILENAME_EXTENSION) == 0)
+		{
+			if (nids == maxids)
+			{
+				int* newids = NULL;
+
+				maxids = (maxids == 0) ? 8 : maxids * 2;
+				if ((newids = (ids == NULL) ? malloc(maxids * sizeof(int)) : realloc(ids, maxids * sizeof(int))) == NULL)
+				{
+					rc = PAHO_MEMORY_ERROR;
+					break;
+				}
+				ids = newids;
+			}
+			ids[nids++] = (int)id;
+		}
+#if defined(_WIN32) || defined(_WIN64)
+		if (!FindNextFileA(find, &data))
+			break;
+	}
+	if (find != INVALID_HANDLE_VALUE)
+		FindClose(find);
+#else
+	}
+	closedir(dp);
+#endif
+	if (rc != 0)
+		goto exit;
+
+	qsort(ids, nids, sizeof(int), plogidcompare);
+	for (i = 0; rc == 0 && i < nids; ++i)
+	{
+		logSegment* segment = plogopensegment(store, ids[i]);
+
+		if (segment == NULL)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else
+			rc = plogscan(store, segment);
+	}
+	if (rc == 0 && store->segments->count == 0 && plogopensegment(store, 1) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+exit:
+	if (ids)
+		free(ids);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static void plogfreeindex(logStore* store)
+{
+	unsigned int i;
+
+	for (i = 0; i < store->index_size; ++i)
+	{
+		while (store->index[i])
+		{
+			logEntry* entry = store->index[i];
+
+			store->index[i] = entry->next;
+			free(entry);
+		}
+	}
+	store->count = 0;
+}
+
+
+/**
+ * Whether enough of the full segments are dead records to be worth compacting.
+ */
+static int plogcompactiondue(logStore* store)
+{
+	ListElement* current = NULL;
+	long size = 0, live = 0;
+
+	while (ListNextElement(store->segments, &current) && current != store->segments->last)
+	{
+		size += ((logSegment*)(current->content))->size;
+		live += ((logSegment*)(current->content))->live;
+	}
+	return size > 0 && (size - live) * 100 >= (long)store->options.compaction_threshold * size;
+}
+
+
+/**
+ * Copy the live records of the full segments to the current segment, then delete the full
+ * segments, oldest first, so that a crash part way through cannot bring back a removed key.
+ */
+static int plogcompact(logStore* store)
+{
+	logSegment* current = (logSegment*)(store->segments->last->content);
+	char* buffer = NULL;
+	size_t buflen = 0;
+	unsigned int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	for (i = 0; rc == 0 && i < store->index_size; ++i)
+	{
+		logEntry* entry = NULL;
+
+		for (entry = store->index[i]; rc == 0 && entry; entry = entry->next)
+		{
+			logSegment* segment = NULL;
+			long offset = 0;
+			size_t keylen = strlen(entry->key);
+			int datalen = entry->datalen;
+
+			if (entry->segment == current)
+				continue;
+			if ((size_t)datalen + 1 > buflen)
+			{
+				char* newbuf = (buffer == NULL) ? malloc(datalen + 1) : realloc(buffer, datalen + 1);
+
+				if (newbuf == NULL)
+				{
+					rc = PAHO_MEMORY_ERROR;
+					break;
+				}
+				buffer = newbuf;
+				buflen = datalen + 1;
+			}
+			if (fseek(entry->segment->fp, entry->offset + (long)(sizeof(logRecordHeader) + keylen), SEEK_SET) != 0 ||
+				fread(buffer, 1, datalen, entry->segment->fp) != (size_t)datalen)
+				rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			else if ((rc = plogappend(store, entry->key, 1, &buffer, &datalen, 0, &segment, &offset)) == 0)
+			{
+				entry->segment->live -= (long)plogrecordsize(entry);
+				entry->segment = segment;
+				entry->offset = offset;
+				segment->live += (long)plogrecordsize(entry);
+			}
+		}
+	}
+	if (rc == 0 && store->options.sync_mode != MQTTCLIENT_LOG_SYNC_NONE)
+		rc = plogsync(store); /* the copies must be on disk before the originals go */
+	while (rc == 0 && store->segments->first->content != current)
+		plogdeletesegment(store, (logSegment*)(store->segments->first->content));
+	if (buffer)
+		free(buffer);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * The background thread for a log: syncs it for group commit, and compacts it.
+ */
+static thread_return_type WINAPI plogthread(void* n)
+{
+	logStore* store = n;
+	int wait = (store->options.sync_mode == MQTTCLIENT_LOG_SYNC_GROUP) ?
+			store->options.sync_interval : LOG_COMPACTION_WAIT;
+
+	if (wait < LOG_MIN_WAIT)
+		wait = LOG_MIN_WAIT;
+	Thread_set_name("MQTTPersistLog");
+	while (!store->stopping)
+	{
+		Thread_wait_sem(store->wake, wait);
+		Paho_thread_lock_mutex(store->mutex);
+		if (store->dirty && store->options.sync_mode == MQTTCLIENT_LOG_SYNC_GROUP &&
+			fflush(((logSegment*)(store->segments->last->content))->fp) == 0)
+		{
+			/* sync without holding the lock, so that puts carry on meanwhile */
+			int fd = fileno(((logSegment*)(store->segments->last->content))->fp);
+			int rc = 0;
+
+			store->dirty = 0;
+			Paho_thread_unlock_mutex(store->mutex);
+			rc = fsync(fd);
+			Paho_thread_lock_mutex(store->mutex);
+			if (rc != 0)
+				store->dirty = 1;
+		}
+		if (!store->stopping && plogcompactiondue(store))
+			plogcompact(store);
+		Paho_thread_unlock_mutex(store->mutex);
+	}
+	Thread_post_sem(store->stopped);
+	return 0;
+}
+
+
+/** Open the log for the client, in the client directory: context/clientID-serverURI.
+ *  See ::Persistence_open
+ */
+int plogopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	MQTTClient_logPersistenceOptions* options = context;
+	logStore* store = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(logStore))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(store, '\0', sizeof(logStore));
+	store->options = *options;
+	store->index_size = LOG_INDEX_SIZE;
+	if ((store->index = malloc(store->index_size * sizeof(logEntry*))) == NULL ||
+		(store->segments = ListInitialize()) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto error;
+	}
+	memset(store->index, '\0', store->index_size * sizeof(logEntry*));
+	if ((rc = pstopen((void**)&store->clientDir, clientID, serverURI, (void*)options->directory)) != 0 ||
+		(rc = plogsegments(store)) != 0)
+		goto error;
+
+	store->mutex = Paho_thread_create_mutex(&rc);
+	store->wake = Thread_create_sem(&rc);
+	store->stopped = Thread_create_sem(&rc);
+	Paho_thread_start(plogthread, store);
+	*handle = store;
+	goto exit;
+
+error:
+	if (store->segments)
+	{
+		while (store->segments->count > 0)
+		{
+			logSegment* segment = (logSegment*)ListPopTail(store->segments);
+
+			fclose(segment->fp);
+			free(segment);
+		}
+		ListFree(store->segments);
+	}
+	if (store->index)
+	{
+		plogfreeindex(store);
+		free(store->index);
+	}
+	if (store->clientDir)
+		pstclose(store->clientDir);
+	free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Stop the background thread, sync and close the log.
+ *  See ::Persistence_close
+ */
+int plogclose(void* handle)
+{
+	logStore* store = handle;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	store->stopping = 1;
+	Thread_post_sem(store->wake);
+	Thread_wait_sem(store->stopped, 10000);
+
+	if (store->dirty && store->options.sync_mode != MQTTCLIENT_LOG_SYNC_NONE)
+		rc = plogsync(store);
+	while (store->segments->count > 0)
+	{
+		logSegment* segment = (logSegment*)ListPopTail(store->segments);
+
+		fclose(segment->fp);
+		free(segment);
+	}
+	ListFree(store->segments);
+	plogfreeindex(store);
+	free(store->index);
+	Paho_thread_destroy_mutex(store->mutex);
+	Thread_destroy_sem(store->wake);
+	Thread_destroy_sem(store->stopped);
+	pstclose(store->clientDir);
+	free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a record for the key to the log.
+ *  See ::Persistence_put
+ */
+int plogput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	logStore* store = handle;
+	logSegment* segment = NULL;
+	long offset = 0;
+	int datalen = 0;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL || strlen(key) == 0 || strlen(key) > LOG_MAX_KEY_LENGTH)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	Paho_thread_lock_mutex(store->mutex);
+	if ((rc = plogappend(store, key, bufcount, buffers, buflens, 0, &segment, &offset)) == 0 &&
+		(rc = plogupdate(store, key, ploghash(LOG_HASH_START, key, strlen(key)), segment, offset, datalen, 0)) == 0)
+		rc = plogcommit(store);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Start a batch of puts and removes, which are made durable together by ::plogendbatch.
+ * Batches may overlap.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int plogbeginbatch(void* handle)
+{
+	logStore* store = handle;
+
+	if (store == NULL)
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+	Paho_thread_lock_mutex(store->mutex);
+	++store->batches;
+	Paho_thread_unlock_mutex(store->mutex);
+	return 0;
+}
+
+
+/**
+ * End a batch, syncing everything written so far for ::MQTTCLIENT_LOG_SYNC_ALWAYS.  The sync
+ * isn't put off until the last overlapping batch ends, as the caller relies on its own writes
+ * being durable once this returns.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int plogendbatch(void* handle)
+{
+	logStore* store = handle;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if (store->batches > 0)
+		--store->batches;
+	if (store->dirty && store->options.sync_mode == MQTTCLIENT_LOG_SYNC_ALWAYS)
+		rc = plogsync(store);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Read the data of the latest record for the key.
+ *  See ::Persistence_get
+ */
+int plogget(void* handle, char* key, char** buffer, int* buflen)
+{
+	logStore* store = handle;
+	logEntry* entry = NULL;
+	char* data = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if ((entry = plogfind(store, key, ploghash(LOG_HASH_START, key, strlen(key)), NULL)) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else if ((data = malloc(entry->datalen + 1)) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	else if (fseek(entry->segment->fp, entry->offset + (long)(sizeof(logRecordHeader) + strlen(entry->key)), SEEK_SET) != 0 ||
+		fread(data, 1, entry->datalen, entry->segment->fp) != (size_t)entry->datalen)
+	{
+		free(data);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	else
+	{
+		*buffer = data;
+		*buflen = entry->datalen;
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a tombstone for the key to the log.
+ *  See ::Persistence_remove
+ */
+int plogremove(void* handle, char* key)
+{
+	logStore* store = handle;
+	logSegment* segment = NULL;
+	long offset = 0;
+	unsigned int hash = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	hash = ploghash(LOG_HASH_START, key, strlen(key));
+	Paho_thread_lock_mutex(store->mutex);
+	if (plogfind(store, key, hash, NULL) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else if ((rc = plogappend(store, key, 0, NULL, NULL, 1, &segment, &offset)) == 0 &&
+		(rc = plogupdate(store, key, hash, segment, offset, 0, 1)) == 0)
+		rc = plogcommit(store);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** List the live keys, from the index.
+ *  See ::Persistence_keys
+ */
+int plogkeys(void* handle, char*** keys, int* nkeys)
+{
+	logStore* store = handle;
+	char** fkeys = NULL;
+	int nfkeys = 0;
+	unsigned int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if (store->count > 0 && (fkeys = malloc(store->count * sizeof(char*))) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	for (i = 0; rc == 0 && i < store->index_size; ++i)
+	{
+		logEntry* entry = NULL;
+
+		for (entry = store->index[i]; entry; entry = entry->next)
+		{
+			if ((fkeys[nfkeys] = malloc(strlen(entry->key) + 1)) == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				break;
+			}
+			strcpy(fkeys[nfkeys++], entry->key);
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	if (rc != 0)
+	{
+		while (nfkeys > 0)
+			free(fkeys[--nfkeys]);
+		if (fkeys)
+			free(fkeys);
+		goto exit;
+	}
+	*keys = fkeys;
+	*nkeys = nfkeys;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete all the segments of the log, and start a new one.
+ *  See ::Persistence_clear
+ */
+int plogclear(void* handle)
+{
+	logStore* store = handle;
+	int next_id = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	plogfreeindex(store);
+	next_id = ((logSegment*)(store->segments->last->content))->id + 1;
+	while (store->segments->count > 0)
+		plogdeletesegment(store, (logSegment*)(store->segments->first->content));
+	store->dirty = 0;
+	if (plogopensegment(store, next_id) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Look the key up in the index.
+ *  See ::Persistence_containskey
+ */
+int plogcontainskey(void* handle, char* key)
+{
+	logStore* store = handle;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		goto exit;
+	Paho_thread_lock_mutex(store->mutex);
+	if (plogfind(store, key, ploghash(LOG_HASH_START, key, strlen(key)), NULL) != NULL)
+		rc = 0;
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+#if defined(PERSISTENCE_LOG_TEST)
+
+#define TEST_EXPECT(i,x) if (!(x)) {fprintf( stderr, "failed test: %s (for i == %d)\n", #x, i ); ++fails;}
+#define TEST_KEYS 1000
+#define TEST_KEPT 100
+
+static int test_put(void* handle, int i)
+{
+	char key[20];
+	char data[100];
+	char* buffers[2] = {key, data};
+	int buflens[2];
+
+	snprintf(key, sizeof(key), "s-%d", i);
+	buflens[0] = (int)strlen(key);
+	buflens[1] = snprintf(data, sizeof(data), " payload for message %d", i);
+	return plogput(handle, key, 2, buffers, buflens);
+}
+
+static int test_check(void* handle, int i)
+{
+	char key[20];
+	char expected[120];
+	char* buffer = NULL;
+	int buflen = 0;
+	int rc = 0;
+
+	snprintf(key, sizeof(key), "s-%d", i);
+	snprintf(expected, sizeof(expected), "s-%d payload for message %d", i, i);
+	if ((rc = plogget(handle, key, &buffer, &buflen)) == 0)
+	{
+		rc = (buflen == (int)strlen(expected) && memcmp(buffer, expected, buflen) == 0) ? 0 : -1;
+		free(buffer);
+	}
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	MQTTClient_logPersistenceOptions options = MQTTClient_logPersistenceOptions_initializer;
+	MQTTClient_persistence* per = NULL;
+	void* handle = NULL;
+	char** keys = NULL;
+	int nkeys = 0;
+	sem_type pause;
+	FILE* fp = NULL;
+	char* name = NULL;
+	int fails = 0;
+	int i, rc = 0;
+
+	options.directory = "plogtest";
+	options.segment_size = 8192;
+	options.sync_interval = 20;
+	pause = Thread_create_sem(&rc);
+	TEST_EXPECT(0, plogcreate(&per, &options) == 0);
+	TEST_EXPECT(0, plogopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	TEST_EXPECT(0, plogclear(handle) == 0);
+
+	for (i = 0; i < TEST_KEYS; ++i)
+		TEST_EXPECT(i, test_put(handle, i) == 0);
+	TEST_EXPECT(0, ((logStore*)handle)->segments->count > 2);
+	for (i = TEST_KEPT; i < TEST_KEYS; ++i)
+	{
+		char key[20];
+
+		snprintf(key, sizeof(key), "s-%d", i);
+		TEST_EXPECT(i, plogremove(handle, key) == 0);
+		TEST_EXPECT(i, plogcontainskey(handle, key) != 0);
+	}
+	TEST_EXPECT(0, plogremove(handle, "s-1000") != 0);
+	TEST_EXPECT(0, plogput(handle, "s-0", 0, NULL, NULL) == 0); /* replace with an empty record */
+
+	/* the background thread should compact the full segments away */
+	for (i = 0; i < 50 && ((logStore*)handle)->segments->count > 1; ++i)
+		Thread_wait_sem(pause, 100);
+	TEST_EXPECT(i, ((logStore*)handle)->segments->count == 1);
+	for (i = 1; i < TEST_KEPT; ++i)
+		TEST_EXPECT(i, test_check(handle, i) == 0);
+	TEST_EXPECT(0, plogclose(handle) == 0);
+
+	/* a torn record at the end of the log is cut off when it is reopened */
+	TEST_EXPECT(0, plogopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	name = plogsegmentname((logStore*)handle, ((logSegment*)(((logStore*)handle)->segments->last->content))->id);
+	TEST_EXPECT(0, plogclose(handle) == 0);
+	if ((fp = fopen(name, "ab")) != NULL)
+	{
+		logRecordHeader header = {LOG_RECORD_MAGIC, 4, 1000, 0};
+
+		fwrite(&header, sizeof(header), 1, fp);
+		fwrite("s-99", 1, 4, fp);
+		fclose(fp);
+	}
+	free(name);
+
+	TEST_EXPECT(0, plogopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	TEST_EXPECT(0, plogkeys(handle, &keys, &nkeys) == 0);
+	TEST_EXPECT(nkeys, nkeys == TEST_KEPT);
+	for (i = 0; i < nkeys; ++i)
+		free(keys[i]);
+	if (keys)
+		free(keys);
+	for (i = 1; i < TEST_KEPT; ++i)
+		TEST_EXPECT(i, test_check(handle, i) == 0);
+	TEST_EXPECT(0, test_put(handle, TEST_KEYS) == 0);
+	TEST_EXPECT(0, test_check(handle, TEST_KEYS) == 0);
+
+	TEST_EXPECT(0, plogclear(handle) == 0);
+	TEST_EXPECT(0, plogcontainskey(handle, "s-1") != 0);
+	TEST_EXPECT(0, plogclose(handle) == 0);
+
+	/* with sync always, the puts in a batch are synced once, when it ends */
+	((MQTTClient_logPersistenceOptions*)per->context)->sync_mode = MQTTCLIENT_LOG_SYNC_ALWAYS;
+	TEST_EXPECT(0, plogopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	TEST_EXPECT(0, test_put(handle, 1) == 0);
+	TEST_EXPECT(0, ((logStore*)handle)->dirty == 0);
+	TEST_EXPECT(0, plogbeginbatch(handle) == 0);
+	for (i = 2; i < TEST_KEPT; ++i)
+		TEST_EXPECT(i, test_put(handle, i) == 0);
+	TEST_EXPECT(0, ((logStore*)handle)->dirty == 1);
+	TEST_EXPECT(0, plogendbatch(handle) == 0);
+	TEST_EXPECT(0, ((logStore*)handle)->dirty == 0);
+	TEST_EXPECT(0, plogclose(handle) == 0);
+	TEST_EXPECT(0, plogopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	for (i = 1; i < TEST_KEPT; ++i)
+		TEST_EXPECT(i, test_check(handle, i) == 0);
+	TEST_EXPECT(0, plogclear(handle) == 0);
+	TEST_EXPECT(0, plogclose(handle) == 0);
+	free(per->context);
+	free(per);
+	Thread_destroy_sem(pause);
+
+	printf("%s: %d failures\n", (fails == 0) ? "passed" : "failed", fails);
+	return fails;
+}
+
+#endif /* PERSISTENCE_LOG_TEST */
+
+#endif /* NO_PERSISTENCE */
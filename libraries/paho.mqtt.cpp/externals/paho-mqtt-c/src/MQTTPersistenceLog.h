@@ -0,0 +1,42 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - log-structured persistence
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCELOG_H)
+#define MQTTPERSISTENCELOG_H
+
+#include "MQTTClientPersistence.h"
+
+/** Prefix of the segment filenames */
+#define LOG_FILENAME_PREFIX "log-"
+/** Extension of the segment filenames */
+#define LOG_FILENAME_EXTENSION ".plog"
+
+int plogcreate(MQTTClient_persistence** persistence, MQTTClient_logPersistenceOptions* options);
+
+/* prototypes of the functions for the log-structured file persistence */
+int plogopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int plogclose(void* handle);
+int plogput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int plogget(void* handle, char* key, char** buffer, int* buflen);
+int plogremove(void* handle, char* key);
+int plogkeys(void* handle, char*** keys, int* nkeys);
+int plogclear(void* handle);
+int plogcontainskey(void* handle, char* key);
+
+int plogbeginbatch(void* handle);
+int plogendbatch(void* handle);
+
+#endif
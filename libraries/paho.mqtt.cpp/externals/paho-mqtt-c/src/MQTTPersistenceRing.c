@@ -0,0 +1,1205 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - memory-mapped ring persistence
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A persistence implementation in a single memory-mapped file of fixed-size slots.
+ *
+ * The directory for each client is the same as for the default persistence (see ::pstopen).
+ * It holds one file, created at its full size: a header page, then the slots.  A record is
+ * a header, the key and the data, written to a run of consecutive free slots found from
+ * where the last one was put, wrapping round at the end of the file.  A remove clears the
+ * magic number in the header of the record, which frees its slots.
+ *
+ * Which slots are in use is kept in a bitmap in memory, with an index of the live keys, both
+ * rebuilt when the file is opened by walking the record headers.  A record whose checksum
+ * does not match was torn by a crash and is ignored.  If a crash leaves both the old and new
+ * records for a key, the one with the higher sequence number is kept.
+ *
+ * The file is written to through the mapping, so puts and gets cost memory copies only.  It
+ * is synced according to the sync mode of the options: never, by a background thread for
+ * ::MQTTCLIENT_LOG_SYNC_GROUP, which syncs the range of the file written to since the last
+ * sync, or for each put and remove.  Between ::pringbeginbatch and ::pringendbatch, the
+ * writes for ::MQTTCLIENT_LOG_SYNC_ALWAYS are gathered into one range, synced at the end.
+ */
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#if !defined(NO_PERSISTENCE)
+#if !defined(_WIN32) && !defined(_WIN64)
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+#endif
+
+#include "MQTTPersistenceRing.h"
+#include "MQTTPersistenceDefault.h"
+#include "Thread.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define WINAPI
+#endif
+
+#define RING_HEADER_SIZE 4096 /* a page, so that the slots start page aligned */
+#define RING_MIN_SLOT_SIZE 32
+#define RING_MAX_SIZE (INT_MAX - RING_HEADER_SIZE)
+
+
+/**
+ * Create a memory-mapped ring persistence, taking a copy of the options.
+ * See ::MQTTClient_createRingPersistence
+ */
+int MQTTClient_createRingPersistence(MQTTClient_persistence** persistence,
+		const MQTTClient_ringPersistenceOptions* options)
+{
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#if !defined(NO_PERSISTENCE)
+	MQTTClient_ringPersistenceOptions defaults = MQTTClient_ringPersistenceOptions_initializer;
+	MQTTClient_ringPersistenceOptions* copy = NULL;
+	MQTTClient_persistence* per = NULL;
+	const char* directory = NULL;
+
+	FUNC_ENTRY;
+	if (persistence == NULL)
+		goto exit;
+	if (options == NULL)
+		options = &defaults;
+	if (strncmp(options->struct_id, "MQRP", 4) != 0 || options->struct_version != 0 ||
+		options->slot_size < RING_MIN_SLOT_SIZE || options->slot_size % 8 != 0 ||
+		options->slot_count <= 0 || options->slot_count > RING_MAX_SIZE / options->slot_size ||
+		options->sync_mode < MQTTCLIENT_LOG_SYNC_NONE || options->sync_mode > MQTTCLIENT_LOG_SYNC_ALWAYS ||
+		options->sync_interval < 0)
+		goto exit;
+	directory = (options->directory) ? options->directory : "."; /* working directory */
+
+	if ((per = malloc(sizeof(MQTTClient_persistence))) == NULL ||
+		(copy = malloc(sizeof(MQTTClient_ringPersistenceOptions) + strlen(directory) + 1)) == NULL)
+	{
+		if (per)
+			free(per);
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	*copy = *options;
+	copy->directory = (char*)(copy + 1);
+	strcpy((char*)copy->directory, directory);
+
+	per->context      = copy;
+	per->popen        = pringopen;
+	per->pclose       = pringclose;
+	per->pput         = pringput;
+	per->pget         = pringget;
+	per->premove      = pringremove;
+	per->pkeys        = pringkeys;
+	per->pclear       = pringclear;
+	per->pcontainskey = pringcontainskey;
+	*persistence = per;
+	rc = 0;
+exit:
+	FUNC_EXIT_RC(rc);
+#endif
+	return rc;
+}
+
+
+/**
+ * Free a persistence structure created by ::MQTTClient_createRingPersistence
+ */
+void MQTTClient_freeRingPersistence(MQTTClient_persistence** persistence)
+{
+	if (persistence && *persistence)
+	{
+		if ((*persistence)->context)
+			free((*persistence)->context);
+		free(*persistence);
+		*persistence = NULL;
+	}
+}
+
+
+#if !defined(NO_PERSISTENCE)
+
+#define RING_FILE_MAGIC 0x50524E47 /* PRNG */
+#define RING_FILE_VERSION 1
+#define RING_RECORD_MAGIC 0x50524543 /* PREC */
+#define RING_NONE -1 /* the end of an index chain */
+#define RING_MIN_WAIT 20 /* semaphore waits are made in 10ms steps */
+
+/**
+ * The header at the start of the file
+ */
+typedef struct
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int slot_size;
+	unsigned int slot_count;
+} ringFileHeader;
+
+/**
+ * The header at the start of the first slot of a record, followed by the key and the data
+ */
+typedef struct
+{
+	unsigned int magic;	/**< written last, and cleared to remove the record */
+	unsigned int nslots;
+	unsigned int keylen;	/**< including the terminating null */
+	unsigned int datalen;
+	unsigned int sequence;	/**< to choose between two records for a key after a crash */
+	unsigned int checksum;	/**< of the fields above, bar the magic number, the key and the data */
+} ringRecordHeader;
+
+/**
+ * The state of the ring for one client
+ */
+typedef struct
+{
+	char* clientDir;	/**< from pstopen */
+	MQTTClient_ringPersistenceOptions options;
+	mutex_type mutex;
+	char* base;	/**< the start of the mapping */
+	size_t length;	/**< the size of the file and of the mapping */
+#if defined(_WIN32) || defined(_WIN64)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+	size_t page_size;
+#endif
+	unsigned int* bitmap;	/**< a bit for each slot, set if it is in use */
+	int* buckets;	/**< the first slot of the chain for each hash bucket, or RING_NONE */
+	unsigned int bucket_mask;
+	int* chain;	/**< for the first slot of each live record, the next in its chain */
+	unsigned int* hashes;	/**< for the first slot of each live record, the hash of its key */
+	int count;	/**< the number of live records */
+	int cursor;	/**< where to start looking for free slots */
+	unsigned int sequence;
+	size_t dirty_from;	/**< the range of the file written since the last sync */
+	size_t dirty_to;	/**< 0 if nothing has been written */
+	int batches;	/**< the number of batches in progress */
+	int stopping;
+	sem_type wake;
+	sem_type stopped;
+} ringStore;
+
+#define RING_OFFSET(store, slot) (RING_HEADER_SIZE + (size_t)(slot) * (store)->options.slot_size)
+#define RING_RECORD(store, slot) ((ringRecordHeader*)((store)->base + RING_OFFSET(store, slot)))
+#define RING_KEY(record) ((char*)((record) + 1))
+
+static thread_return_type WINAPI pringthread(void* n);
+
+
+/**
+ * FNV-1a hash, used both for the index and as the record checksum
+ */
+static unsigned int pringhash(unsigned int hash, const char* data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+#define RING_HASH_START 2166136261U
+
+
+static unsigned int pringchecksum(ringRecordHeader* record)
+{
+	unsigned int hash = pringhash(RING_HASH_START, (char*)&record->nslots, 4 * sizeof(unsigned int));
+
+	return pringhash(hash, RING_KEY(record), (size_t)record->keylen + record->datalen);
+}
+
+
+/**
+ * Write a range of the file to disk.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pringflush(ringStore* store, size_t from, size_t to)
+{
+	int rc = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+	if (!FlushViewOfFile(store->base + from, to - from) || !FlushFileBuffers(store->file))
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#else
+	from -= from % store->page_size; /* msync needs a page aligned address */
+	if (msync(store->base + from, to - from, MS_SYNC) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#endif
+	if (rc != 0)
+		Log(LOG_ERROR, 0, "Error %d syncing persistence ring", errno);
+	return rc;
+}
+
+
+/**
+ * Note that a range of the file has been written to, and sync it if the sync mode says so.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pringwritten(ringStore* store, size_t from, size_t to)
+{
+	int rc = 0;
+
+	if (store->options.sync_mode == MQTTCLIENT_LOG_SYNC_ALWAYS && store->batches == 0)
+		rc = pringflush(store, from, to);
+	else if (store->options.sync_mode != MQTTCLIENT_LOG_SYNC_NONE)
+	{
+		if (store->dirty_to == 0 || from < store->dirty_from)
+			store->dirty_from = from;
+		if (to > store->dirty_to)
+			store->dirty_to = to;
+	}
+	return rc;
+}
+
+
+static int pringused(ringStore* store, int slot)
+{
+	return (store->bitmap[slot >> 5] & (1U << (slot & 31))) != 0;
+}
+
+
+static void pringmark(ringStore* store, int slot, int nslots, int used)
+{
+	for (; nslots > 0; ++slot, --nslots)
+	{
+		if (used)
+			store->bitmap[slot >> 5] |= 1U << (slot & 31);
+		else
+			store->bitmap[slot >> 5] &= ~(1U << (slot & 31));
+	}
+}
+
+
+/**
+ * Find the first run of free slots in part of the ring.
+ * @return the first slot of the run, or RING_NONE if there is none
+ */
+static int pringfindrun(ringStore* store, int from, int to, int nslots)
+{
+	int run = 0;
+	int slot;
+
+	for (slot = from; slot < to; ++slot)
+	{
+		if ((slot & 31) == 0 && store->bitmap[slot >> 5] == 0xFFFFFFFF)
+		{
+			run = 0;
+			slot += 31; /* the whole word is in use */
+		}
+		else if (pringused(store, slot))
+			run = 0;
+		else if (++run == nslots)
+			return slot - nslots + 1;
+	}
+	return RING_NONE;
+}
+
+
+/**
+ * Take a run of free slots, looking from the cursor onwards first.
+ * @return the first slot of the run, or RING_NONE if the ring has no run long enough
+ */
+static int pringalloc(ringStore* store, int nslots)
+{
+	int slot = pringfindrun(store, store->cursor, store->options.slot_count, nslots);
+
+	if (slot == RING_NONE && store->cursor > 0)
+		slot = pringfindrun(store, 0, store->options.slot_count, nslots);
+	if (slot != RING_NONE)
+	{
+		pringmark(store, slot, nslots, 1);
+		store->cursor = (slot + nslots) % store->options.slot_count;
+	}
+	return slot;
+}
+
+
+/**
+ * Find the link in the index which points to the record for a key.
+ * @return the link, which holds RING_NONE if the key is not in the index
+ */
+static int* pringlink(ringStore* store, const char* key, unsigned int hash)
+{
+	int* link = &store->buckets[hash & store->bucket_mask];
+
+	while (*link != RING_NONE &&
+			(store->hashes[*link] != hash || strcmp(RING_KEY(RING_RECORD(store, *link)), key) != 0))
+		link = &store->chain[*link];
+	return link;
+}
+
+
+static void pringinsert(ringStore* store, int slot, unsigned int hash)
+{
+	int* bucket = &store->buckets[hash & store->bucket_mask];
+
+	store->hashes[slot] = hash;
+	store->chain[slot] = *bucket;
+	*bucket = slot;
+	++store->count;
+}
+
+
+/**
+ * Remove a record: take it out of the index, clear its magic number and free its slots.
+ * @param link the link in the index to the record
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pringrelease(ringStore* store, int* link)
+{
+	int slot = *link;
+	ringRecordHeader* record = RING_RECORD(store, slot);
+
+	*link = store->chain[slot];
+	--store->count;
+	record->magic = 0;
+	pringmark(store, slot, record->nslots, 0);
+	return pringwritten(store, RING_OFFSET(store, slot), RING_OFFSET(store, slot) + sizeof(record->magic));
+}
+
+
+static void pringresetindex(ringStore* store)
+{
+	unsigned int i;
+
+	for (i = 0; i <= store->bucket_mask; ++i)
+		store->buckets[i] = RING_NONE;
+	memset(store->bitmap, '\0', ((store->options.slot_count + 31) / 32) * sizeof(unsigned int));
+	store->count = 0;
+	store->cursor = 0;
+}
+
+
+/**
+ * Whether a slot holds the header of a complete, intact record.
+ */
+static int pringvalid(ringStore* store, int slot)
+{
+	ringRecordHeader* record = RING_RECORD(store, slot);
+
+	return record->magic == RING_RECORD_MAGIC && record->nslots > 0 &&
+		record->nslots <= (unsigned int)(store->options.slot_count - slot) && record->keylen > 1 &&
+		sizeof(ringRecordHeader) + (size_t)record->keylen + record->datalen <=
+			(size_t)record->nslots * store->options.slot_size &&
+		RING_KEY(record)[record->keylen - 1] == '\0' &&
+		strlen(RING_KEY(record)) == record->keylen - 1 &&
+		pringchecksum(record) == record->checksum;
+}
+
+
+/**
+ * Walk the records of the file, building the bitmap and the index.
+ */
+static void pringscan(ringStore* store)
+{
+	int latest = RING_NONE;
+	int slot = 0;
+
+	FUNC_ENTRY;
+	pringresetindex(store);
+	while (slot < store->options.slot_count)
+	{
+		ringRecordHeader* record = RING_RECORD(store, slot);
+		unsigned int hash = 0;
+		int* link = NULL;
+
+		if (!pringvalid(store, slot))
+		{
+			++slot;
+			continue;
+		}
+		hash = pringhash(RING_HASH_START, RING_KEY(record), record->keylen - 1);
+		link = pringlink(store, RING_KEY(record), hash);
+		if (*link != RING_NONE && (int)(record->sequence - RING_RECORD(store, *link)->sequence) < 0)
+		{
+			/* an older record for the key, left by a crash part way through a put */
+			record->magic = 0;
+			pringwritten(store, RING_OFFSET(store, slot), RING_OFFSET(store, slot) + sizeof(record->magic));
+		}
+		else
+		{
+			if (*link != RING_NONE)
+				pringrelease(store, link);
+			pringmark(store, slot, record->nslots, 1);
+			pringinsert(store, slot, hash);
+			if (latest == RING_NONE || (int)(record->sequence - store->sequence) > 0)
+			{
+				latest = slot;
+				store->sequence = record->sequence;
+			}
+		}
+		slot += record->nslots;
+	}
+	if (latest != RING_NONE)
+		store->cursor = (latest + RING_RECORD(store, latest)->nslots) % store->options.slot_count;
+	FUNC_EXIT;
+}
+
+
+/**
+ * Open the ring file, creating it at its full size if need be, and map it into memory.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pringmap(ringStore* store, const char* filename)
+{
+	ringFileHeader* header = NULL;
+	int created = 0;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#if defined(_WIN32) || defined(_WIN64)
+	LARGE_INTEGER size;
+#else
+	struct stat st;
+#endif
+
+	FUNC_ENTRY;
+#if defined(_WIN32) || defined(_WIN64)
+	store->file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+	if (store->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(store->file, &size))
+		goto error;
+	if (size.QuadPart == 0)
+		created = 1;
+	else if (size.QuadPart != (LONGLONG)store->length)
+		goto mismatch;
+	/* the mapping extends a new file to its full size */
+	if ((store->mapping = CreateFileMappingA(store->file, NULL, PAGE_READWRITE, 0, (DWORD)store->length, NULL)) == NULL ||
+		(store->base = MapViewOfFile(store->mapping, FILE_MAP_ALL_ACCESS, 0, 0, store->length)) == NULL)
+		goto error;
+#else
+	store->page_size = (size_t)sysconf(_SC_PAGESIZE);
+	if ((store->fd = open(filename, O_RDWR | O_CREAT, 0666)) < 0 || fstat(store->fd, &st) != 0)
+		goto error;
+	if (st.st_size == 0)
+	{
+		created = 1;
+		/* allocate the blocks now, so that a full disk cannot fault a write to the mapping */
+#if defined(__linux__)
+		if (posix_fallocate(store->fd, 0, (off_t)store->length) != 0)
+#endif
+		if (ftruncate(store->fd, (off_t)store->length) != 0)
+			goto error;
+	}
+	else if ((size_t)st.st_size != store->length)
+		goto mismatch;
+	if ((store->base = mmap(NULL, store->length, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0)) == MAP_FAILED)
+	{
+		store->base = NULL;
+		goto error;
+	}
+#endif
+
+	header = (ringFileHeader*)store->base;
+	if (!created && header->magic == 0)
+	{
+		/* a crash before the header of a new file was written */
+		memset(store->base, '\0', store->length);
+		created = 1;
+	}
+	if (created)
+	{
+		header->version = RING_FILE_VERSION;
+		header->slot_size = (unsigned int)store->options.slot_size;
+		header->slot_count = (unsigned int)store->options.slot_count;
+		header->magic = RING_FILE_MAGIC;
+		rc = pringflush(store, 0, store->length);
+		goto exit;
+	}
+	if (header->magic == RING_FILE_MAGIC && header->version == RING_FILE_VERSION &&
+		header->slot_size == (unsigned int)store->options.slot_size &&
+		header->slot_count == (unsigned int)store->options.slot_count)
+	{
+		rc = 0;
+		goto exit;
+	}
+mismatch:
+	Log(LOG_ERROR, 0, "Persistence ring %s does not match the slot size %d and count %d", filename,
+			store->options.slot_size, store->options.slot_count);
+	goto exit;
+error:
+	Log(LOG_ERROR, 0, "Error %d opening persistence ring %s", errno, filename);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static void pringunmap(ringStore* store)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	if (store->base)
+		UnmapViewOfFile(store->base);
+	if (store->mapping)
+		CloseHandle(store->mapping);
+	if (store->file != INVALID_HANDLE_VALUE)
+		CloseHandle(store->file);
+#else
+	if (store->base)
+		munmap(store->base, store->length);
+	if (store->fd >= 0)
+		close(store->fd);
+#endif
+}
+
+
+/**
+ * The background thread for ::MQTTCLIENT_LOG_SYNC_GROUP: syncs the range written to since
+ * the last sync, once per sync interval.
+ */
+static thread_return_type WINAPI pringthread(void* n)
+{
+	ringStore* store = n;
+	int wait = (store->options.sync_interval < RING_MIN_WAIT) ? RING_MIN_WAIT : store->options.sync_interval;
+
+	Thread_set_name("MQTTPersistRing");
+	while (!store->stopping)
+	{
+		Thread_wait_sem(store->wake, wait);
+		Paho_thread_lock_mutex(store->mutex);
+		if (store->dirty_to > 0)
+		{
+			/* sync without holding the lock, so that puts carry on meanwhile */
+			size_t from = store->dirty_from;
+			size_t to = store->dirty_to;
+
+			store->dirty_to = 0;
+			Paho_thread_unlock_mutex(store->mutex);
+			if (pringflush(store, from, to) != 0)
+			{
+				Paho_thread_lock_mutex(store->mutex);
+				pringwritten(store, from, to); /* try again next time */
+				Paho_thread_unlock_mutex(store->mutex);
+			}
+		}
+		else
+			Paho_thread_unlock_mutex(store->mutex);
+	}
+	Thread_post_sem(store->stopped);
+	return 0;
+}
+
+
+/** Open the ring file in the client directory: context/clientID-serverURI.
+ *  See ::Persistence_open
+ */
+int pringopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	MQTTClient_ringPersistenceOptions* options = context;
+	ringStore* store = NULL;
+	char* filename = NULL;
+	size_t alloclen = 0;
+	unsigned int nbuckets = 1;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(ringStore))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(store, '\0', sizeof(ringStore));
+	store->options = *options;
+	store->length = RING_OFFSET(store, options->slot_count);
+#if defined(_WIN32) || defined(_WIN64)
+	store->file = INVALID_HANDLE_VALUE;
+#else
+	store->fd = -1;
+#endif
+	while (nbuckets < (unsigned int)options->slot_count)
+		nbuckets <<= 1;
+	store->bucket_mask = nbuckets - 1;
+	if ((store->bitmap = malloc(((options->slot_count + 31) / 32) * sizeof(unsigned int))) == NULL ||
+		(store->buckets = malloc(nbuckets * sizeof(int))) == NULL ||
+		(store->chain = malloc(options->slot_count * sizeof(int))) == NULL ||
+		(store->hashes = malloc(options->slot_count * sizeof(unsigned int))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto error;
+	}
+	if ((rc = pstopen((void**)&store->clientDir, clientID, serverURI, (void*)options->directory)) != 0)
+		goto error;
+	alloclen = strlen(store->clientDir) + strlen(RING_FILENAME) + 2;
+	if ((filename = malloc(alloclen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto error;
+	}
+	snprintf(filename, alloclen, "%s/%s", store->clientDir, RING_FILENAME);
+	if ((rc = pringmap(store, filename)) != 0)
+		goto error;
+	pringscan(store);
+
+	store->mutex = Paho_thread_create_mutex(&rc);
+	if (store->options.sync_mode == MQTTCLIENT_LOG_SYNC_GROUP)
+	{
+		store->wake = Thread_create_sem(&rc);
+		store->stopped = Thread_create_sem(&rc);
+		Paho_thread_start(pringthread, store);
+	}
+	*handle = store;
+	goto exit;
+
+error:
+	pringunmap(store);
+	if (store->bitmap)
+		free(store->bitmap);
+	if (store->buckets)
+		free(store->buckets);
+	if (store->chain)
+		free(store->chain);
+	if (store->hashes)
+		free(store->hashes);
+	if (store->clientDir)
+		pstclose(store->clientDir);
+	free(store);
+exit:
+	if (filename)
+		free(filename);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Stop the background thread, sync and unmap the ring file.
+ *  See ::Persistence_close
+ */
+int pringclose(void* handle)
+{
+	ringStore* store = handle;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if (store->options.sync_mode == MQTTCLIENT_LOG_SYNC_GROUP)
+	{
+		store->stopping = 1;
+		Thread_post_sem(store->wake);
+		Thread_wait_sem(store->stopped, 10000);
+		Thread_destroy_sem(store->wake);
+		Thread_destroy_sem(store->stopped);
+		if (store->dirty_to > 0)
+			rc = pringflush(store, store->dirty_from, store->dirty_to);
+	}
+	pringunmap(store);
+	free(store->bitmap);
+	free(store->buckets);
+	free(store->chain);
+	free(store->hashes);
+	Paho_thread_destroy_mutex(store->mutex);
+	pstclose(store->clientDir);
+	free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Write a record for the key to a run of free slots, then remove the previous record for
+ *  the key, if any.
+ *  See ::Persistence_put
+ */
+int pringput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	ringStore* store = handle;
+	ringRecordHeader* record = NULL;
+	size_t keylen = 0, datalen = 0, size = 0;
+	unsigned int hash = 0;
+	int* link = NULL;
+	int nslots = 0;
+	int slot = RING_NONE;
+	char* ptr = NULL;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL || (keylen = strlen(key)) == 0)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	size = sizeof(ringRecordHeader) + keylen + 1 + datalen;
+	if (size > store->length - RING_HEADER_SIZE)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	nslots = (int)((size + store->options.slot_size - 1) / store->options.slot_size);
+	hash = pringhash(RING_HASH_START, key, keylen);
+
+	Paho_thread_lock_mutex(store->mutex);
+	if ((slot = pringalloc(store, nslots)) == RING_NONE)
+	{
+		Log(LOG_ERROR, 0, "Persistence ring has no run of %d free slots for %s", nslots, key);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto unlock;
+	}
+	record = RING_RECORD(store, slot);
+	ptr = RING_KEY(record);
+	memcpy(ptr, key, keylen + 1);
+	ptr += keylen + 1;
+	for (i = 0; i < bufcount; ++i)
+	{
+		memcpy(ptr, buffers[i], buflens[i]);
+		ptr += buflens[i];
+	}
+	record->nslots = (unsigned int)nslots;
+	record->keylen = (unsigned int)keylen + 1;
+	record->datalen = (unsigned int)datalen;
+	record->sequence = ++store->sequence;
+	record->checksum = pringchecksum(record);
+	record->magic = RING_RECORD_MAGIC;
+	if ((rc = pringwritten(store, RING_OFFSET(store, slot), RING_OFFSET(store, slot) + size)) != 0)
+	{
+		record->magic = 0;
+		pringmark(store, slot, nslots, 0);
+		goto unlock;
+	}
+
+	/* the new record is complete, so the old one can go */
+	link = pringlink(store, key, hash);
+	if (*link != RING_NONE && store->batches > 0 && store->options.sync_mode == MQTTCLIENT_LOG_SYNC_ALWAYS)
+	{
+		/* the new record must reach the disk before the old one is cleared */
+		if ((rc = pringflush(store, store->dirty_from, store->dirty_to)) != 0)
+		{
+			record->magic = 0;
+			pringmark(store, slot, nslots, 0);
+			goto unlock;
+		}
+		store->dirty_to = 0;
+	}
+	if (*link != RING_NONE)
+		rc = pringrelease(store, link);
+	pringinsert(store, slot, hash);
+unlock:
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Start a batch of puts and removes, which are synced together by ::pringendbatch.
+ * Batches may overlap.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int pringbeginbatch(void* handle)
+{
+	ringStore* store = handle;
+
+	if (store == NULL)
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+	Paho_thread_lock_mutex(store->mutex);
+	++store->batches;
+	Paho_thread_unlock_mutex(store->mutex);
+	return 0;
+}
+
+
+/**
+ * End a batch, syncing the range written so far for ::MQTTCLIENT_LOG_SYNC_ALWAYS, even if
+ * other batches are still in progress.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int pringendbatch(void* handle)
+{
+	ringStore* store = handle;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if (store->batches > 0)
+		--store->batches;
+	if (store->dirty_to > 0 && store->options.sync_mode == MQTTCLIENT_LOG_SYNC_ALWAYS)
+	{
+		if ((rc = pringflush(store, store->dirty_from, store->dirty_to)) == 0)
+			store->dirty_to = 0;
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Copy the data of the record for the key out of the ring.
+ *  See ::Persistence_get
+ */
+int pringget(void* handle, char* key, char** buffer, int* buflen)
+{
+	ringStore* store = handle;
+	int* link = NULL;
+	char* data = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	link = pringlink(store, key, pringhash(RING_HASH_START, key, strlen(key)));
+	if (*link == RING_NONE)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+	{
+		ringRecordHeader* record = RING_RECORD(store, *link);
+
+		if ((data = malloc(record->datalen + 1)) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			memcpy(data, RING_KEY(record) + record->keylen, record->datalen);
+			*buffer = data;
+			*buflen = (int)record->datalen;
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Clear the record for the key, freeing its slots.
+ *  See ::Persistence_remove
+ */
+int pringremove(void* handle, char* key)
+{
+	ringStore* store = handle;
+	int* link = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	link = pringlink(store, key, pringhash(RING_HASH_START, key, strlen(key)));
+	if (*link == RING_NONE)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+		rc = pringrelease(store, link);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** List the live keys, from the index.
+ *  See ::Persistence_keys
+ */
+int pringkeys(void* handle, char*** keys, int* nkeys)
+{
+	ringStore* store = handle;
+	char** fkeys = NULL;
+	int nfkeys = 0;
+	unsigned int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if (store->count > 0 && (fkeys = malloc(store->count * sizeof(char*))) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	for (i = 0; rc == 0 && i <= store->bucket_mask; ++i)
+	{
+		int slot;
+
+		for (slot = store->buckets[i]; slot != RING_NONE; slot = store->chain[slot])
+		{
+			ringRecordHeader* record = RING_RECORD(store, slot);
+
+			if ((fkeys[nfkeys] = malloc(record->keylen)) == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				break;
+			}
+			memcpy(fkeys[nfkeys++], RING_KEY(record), record->keylen);
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	if (rc != 0)
+	{
+		while (nfkeys > 0)
+			free(fkeys[--nfkeys]);
+		if (fkeys)
+			free(fkeys);
+		goto exit;
+	}
+	*keys = fkeys;
+	*nkeys = nfkeys;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Clear every record in the ring.
+ *  See ::Persistence_clear
+ */
+int pringclear(void* handle)
+{
+	ringStore* store = handle;
+	unsigned int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	for (i = 0; i <= store->bucket_mask; ++i)
+	{
+		int slot;
+
+		for (slot = store->buckets[i]; slot != RING_NONE; slot = store->chain[slot])
+			RING_RECORD(store, slot)->magic = 0;
+	}
+	pringresetindex(store);
+	rc = pringwritten(store, RING_HEADER_SIZE, store->length);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Look the key up in the index.
+ *  See ::Persistence_containskey
+ */
+int pringcontainskey(void* handle, char* key)
+{
+	ringStore* store = handle;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		goto exit;
+	Paho_thread_lock_mutex(store->mutex);
+	if (*pringlink(store, key, pringhash(RING_HASH_START, key, strlen(key))) != RING_NONE)
+		rc = 0;
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+#if defined(PERSISTENCE_RING_TEST)
+
+#define TEST_EXPECT(i,x) if (!(x)) {fprintf( stderr, "failed test: %s (for i == %d)\n", #x, i ); ++fails;}
+#define TEST_SLOTS 64
+#define TEST_KEYS 42 /* alternately of 2 slots and 1 slot, so that 63 slots are used */
+
+static int test_len(int i)
+{
+	return (i % 2) ? 10 : 60;
+}
+
+static int test_put(void* handle, int i, int len)
+{
+	char key[20];
+	char data[100];
+	char* buffers[2] = {key, data};
+	int buflens[2];
+
+	snprintf(key, sizeof(key), "s-%d", i);
+	buflens[0] = (int)strlen(key);
+	buflens[1] = len;
+	memset(data, 'a' + i % 26, len);
+	return pringput(handle, key, 2, buffers, buflens);
+}
+
+static int test_check(void* handle, int i, int len)
+{
+	char key[20];
+	char* buffer = NULL;
+	int buflen = 0;
+	int keylen = 0;
+	int rc = 0;
+
+	keylen = snprintf(key, sizeof(key), "s-%d", i);
+	if ((rc = pringget(handle, key, &buffer, &buflen)) == 0)
+	{
+		rc = (buflen == keylen + len && memcmp(buffer, key, keylen) == 0) ? 0 : -1;
+		for (; rc == 0 && len > 0; --len)
+			rc = (buffer[keylen + len - 1] == 'a' + i % 26) ? 0 : -1;
+		free(buffer);
+	}
+	return rc;
+}
+
+static int test_slot(ringStore* store, const char* key)
+{
+	return *pringlink(store, key, pringhash(RING_HASH_START, key, strlen(key)));
+}
+
+int main(int argc, char *argv[])
+{
+	MQTTClient_ringPersistenceOptions options = MQTTClient_ringPersistenceOptions_initializer;
+	MQTTClient_persistence* per = NULL;
+	ringStore* store = NULL;
+	ringRecordHeader* record = NULL;
+	void* handle = NULL;
+	char** keys = NULL;
+	int nkeys = 0;
+	int slot = 0, copy = 0;
+	int fails = 0;
+	int i;
+
+	options.directory = "pringtest";
+	options.slot_size = 64;
+	options.slot_count = TEST_SLOTS;
+	options.sync_interval = 20;
+	TEST_EXPECT(0, MQTTClient_createRingPersistence(&per, &options) == 0);
+	TEST_EXPECT(0, pringopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	TEST_EXPECT(0, pringclear(handle) == 0);
+
+	/* fill the ring with records of one and of two slots */
+	for (i = 0; i < TEST_KEYS; ++i)
+		TEST_EXPECT(i, test_put(handle, i, test_len(i)) == 0);
+	TEST_EXPECT(0, test_put(handle, TEST_KEYS, 60) != 0);
+	TEST_EXPECT(0, test_put(handle, TEST_KEYS + 1, 10) == 0);
+	for (i = 0; i < TEST_KEYS; ++i)
+		TEST_EXPECT(i, test_check(handle, i, test_len(i)) == 0);
+	TEST_EXPECT(0, test_check(handle, TEST_KEYS + 1, 10) == 0);
+
+	/* removing records frees their slots for new ones */
+	TEST_EXPECT(0, pringremove(handle, "s-0") == 0);
+	TEST_EXPECT(0, pringremove(handle, "s-0") != 0);
+	TEST_EXPECT(0, pringcontainskey(handle, "s-0") != 0);
+	TEST_EXPECT(0, test_put(handle, 1, 60) == 0);
+	TEST_EXPECT(0, test_put(handle, 3, 60) != 0); /* the record is kept if it cannot be replaced */
+	TEST_EXPECT(0, test_check(handle, 3, 10) == 0);
+	TEST_EXPECT(0, pringremove(handle, "s-2") == 0);
+	TEST_EXPECT(0, test_put(handle, 3, 60) == 0);
+	TEST_EXPECT(0, test_check(handle, 1, 60) == 0);
+	TEST_EXPECT(0, test_check(handle, 3, 60) == 0);
+	TEST_EXPECT(0, pringclose(handle) == 0);
+
+	/* the records are found again when the ring is reopened */
+	TEST_EXPECT(0, pringopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	store = handle;
+	TEST_EXPECT(0, pringkeys(handle, &keys, &nkeys) == 0);
+	TEST_EXPECT(nkeys, nkeys == TEST_KEYS - 1);
+	for (i = 0; i < nkeys; ++i)
+		free(keys[i]);
+	if (keys)
+		free(keys);
+	TEST_EXPECT(0, test_check(handle, 1, 60) == 0);
+	TEST_EXPECT(0, test_check(handle, 3, 60) == 0);
+	for (i = 4; i < TEST_KEYS; ++i)
+		TEST_EXPECT(i, test_check(handle, i, test_len(i)) == 0);
+
+	/* a torn record is ignored, and of two records for a key the later one is kept */
+	record = RING_RECORD(store, test_slot(store, "s-3"));
+	RING_KEY(record)[record->keylen] ^= 1;
+	TEST_EXPECT(0, pringremove(handle, "s-5") == 0);
+	TEST_EXPECT(0, pringremove(handle, "s-6") == 0);
+	slot = test_slot(store, "s-4");
+	record = RING_RECORD(store, slot);
+	TEST_EXPECT(0, (copy = pringalloc(store, record->nslots)) != RING_NONE);
+	memcpy(RING_RECORD(store, copy), record, record->nslots * options.slot_size);
+	record->sequence = ++store->sequence;
+	record->checksum = pringchecksum(record);
+	TEST_EXPECT(0, pringclose(handle) == 0);
+
+	TEST_EXPECT(0, pringopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	store = handle;
+	TEST_EXPECT(0, pringcontainskey(handle, "s-3") != 0);
+	TEST_EXPECT(0, test_check(handle, 4, 60) == 0);
+	TEST_EXPECT(0, test_slot(store, "s-4") == slot);
+	TEST_EXPECT(0, !pringused(store, copy));
+	TEST_EXPECT(store->count, store->count == TEST_KEYS - 4);
+	TEST_EXPECT(0, pringclose(handle) == 0);
+
+	/* with sync always, the writes in a batch are synced once, when it ends */
+	((MQTTClient_ringPersistenceOptions*)per->context)->sync_mode = MQTTCLIENT_LOG_SYNC_ALWAYS;
+	TEST_EXPECT(0, pringopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	store = handle;
+	TEST_EXPECT(0, pringbeginbatch(handle) == 0);
+	TEST_EXPECT(0, test_put(handle, 5, 10) == 0);
+	TEST_EXPECT(0, test_put(handle, 6, 60) == 0);
+	TEST_EXPECT(0, store->dirty_to > 0);
+	TEST_EXPECT(0, test_put(handle, 4, 10) == 0); /* a replacement syncs the new record first */
+	TEST_EXPECT(0, pringendbatch(handle) == 0);
+	TEST_EXPECT(0, store->dirty_to == 0);
+	TEST_EXPECT(0, pringclose(handle) == 0);
+	TEST_EXPECT(0, pringopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	TEST_EXPECT(0, test_check(handle, 4, 10) == 0);
+	TEST_EXPECT(0, test_check(handle, 5, 10) == 0);
+	TEST_EXPECT(0, test_check(handle, 6, 60) == 0);
+	TEST_EXPECT(0, pringclose(handle) == 0);
+	((MQTTClient_ringPersistenceOptions*)per->context)->sync_mode = MQTTCLIENT_LOG_SYNC_GROUP;
+
+	/* the geometry of an existing ring cannot be changed */
+	((MQTTClient_ringPersistenceOptions*)per->context)->slot_count = TEST_SLOTS * 2;
+	TEST_EXPECT(0, pringopen(&handle, "client", "tcp://localhost:1883", per->context) != 0);
+	((MQTTClient_ringPersistenceOptions*)per->context)->slot_count = TEST_SLOTS;
+
+	TEST_EXPECT(0, pringopen(&handle, "client", "tcp://localhost:1883", per->context) == 0);
+	TEST_EXPECT(0, pringclear(handle) == 0);
+	TEST_EXPECT(0, pringcontainskey(handle, "s-1") != 0);
+	TEST_EXPECT(0, pringclose(handle) == 0);
+	MQTTClient_freeRingPersistence(&per);
+	TEST_EXPECT(0, per == NULL);
+
+	printf("%s: %d failures\n", (fails == 0) ? "passed" : "failed", fails);
+	return fails;
+}
+
+#endif /* PERSISTENCE_RING_TEST */
+
+#endif /* NO_PERSISTENCE */
@@ -0,0 +1,38 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - memory-mapped ring persistence
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCERING_H)
+#define MQTTPERSISTENCERING_H
+
+#include "MQTTClientPersistence.h"
+
+/** Name of the ring file in the client directory */
+#define RING_FILENAME "persistence.ring"
+
+/* prototypes of the functions for the memory-mapped ring persistence */
+int pringopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int pringclose(void* handle);
+int pringput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int pringget(void* handle, char* key, char** buffer, int* buflen);
+int pringremove(void* handle, char* key);
+int pringkeys(void* handle, char*** keys, int* nkeys);
+int pringclear(void* handle);
+int pringcontainskey(void* handle, char* key);
+
+int pringbeginbatch(void* handle);
+int pringendbatch(void* handle);
+
+#endif
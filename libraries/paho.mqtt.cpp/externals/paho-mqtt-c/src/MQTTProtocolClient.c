@@ -40,13 +40,22 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Slab.h"
+#include "Thread.h"
 
 #if !defined(min)
 #define min(A,B) ( (A) < (B) ? (A):(B))
 #endif
 
-extern MQTTProtocol state;
-extern ClientStates* bstate;
+/* the adaptive inflight window a connection starts with */
+#define INFLIGHT_INITIAL_WINDOW 10
+
+extern MQTTProtocol state; /* defined by the client library */
+extern ClientStates* bstate; /* defined by the client library */
+
+/* the protocol state and clients chosen by this thread, or NULL for state and bstate */
+static THREAD_LOCAL MQTTProtocol* current_state = NULL;
+static THREAD_LOCAL ClientStates* current_clients = NULL;
 
 static void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish);
 static int MQTTProtocol_startPublishCommon(
@@ -57,6 +66,9 @@ static int MQTTProtocol_startPublishCommon(
 static void MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regardless);
 
 static int MQTTProtocol_queueAck(Clients* client, int ackType, int msgId);
+static void MQTTProtocol_inflightAcked(Clients* client, Messages* m);
+static void MQTTProtocol_inflightCongested(Clients* client);
+static int MQTTProtocol_resolveTopicAlias(Clients* client, Publish* publish);
 
 typedef struct {
 	int messageId;
@@ -64,6 +76,39 @@ typedef struct {
 } AckRequest;
 
 
+/**
+ * Choose the protocol state and clients used by the calling thread from now on, so that
+ * groups of clients can be served by different threads.
+ * @param protocol the protocol state, or NULL for the library's default
+ * @param clients the clients, or NULL for the library's default
+ */
+void MQTTProtocol_setCurrent(MQTTProtocol* protocol, ClientStates* clients)
+{
+	current_state = protocol;
+	current_clients = clients;
+}
+
+
+/**
+ * Get the protocol state used by the calling thread
+ * @return the protocol state
+ */
+MQTTProtocol* MQTTProtocol_getState(void)
+{
+	return (current_state) ? current_state : &state;
+}
+
+
+/**
+ * Get the clients served by the calling thread
+ * @return the client states
+ */
+ClientStates* MQTTProtocol_getClients(void)
+{
+	return (current_clients) ? current_clients : bstate;
+}
+
+
 /**
  * List callback function for comparing Message structures by message id
  * @param a first integer value
@@ -122,7 +167,7 @@ static void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish)
 		goto exit;
 	}
 	pw->socket = pubclient->net.socket;
-	if (!ListAppend(&(state.pending_writes), pw, sizeof(pending_write)+len))
+	if (!ListAppend(&(MQTTProtocol_getState()->pending_writes), pw, sizeof(pending_write)+len))
 	{
 		free(pw->p);
 		free(pw);
@@ -151,7 +196,8 @@ static int MQTTProtocol_startPublishCommon(Clients* pubclient, Publish* publish,
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	rc = MQTTPacket_send_publish(publish, 0, qos, retained, &pubclient->net, pubclient->clientID);
+	rc = MQTTPacket_send_publish(publish, 0, qos, retained, &pubclient->net, pubclient->clientID,
+			pubclient->outboundAliases);
 	if (qos == 0 && rc == TCPSOCKET_INTERRUPTED)
 		MQTTProtocol_storeQoS0(pubclient, publish);
 	FUNC_EXIT_RC(rc);
@@ -187,8 +233,6 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 		publish = &qos12pub;
 	}
 	rc = MQTTProtocol_startPublishCommon(pubclient, publish, qos, retained);
-	if (qos > 0)
-		memcpy((*mm)->publish->mask, publish->mask, sizeof((*mm)->publish->mask));
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -205,11 +249,12 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
  */
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, int retained, int allocatePayload)
 {
-	Messages* m = malloc(sizeof(Messages));
+	Messages* m = Slab_malloc(sizeof(Messages));
 
 	FUNC_ENTRY;
 	if (!m)
 		goto exit;
+	memset(m, '\0', sizeof(Messages));
 	m->len = sizeof(Messages);
 	if (*mm == NULL || (*mm)->publish == NULL)
 	{
@@ -261,7 +306,7 @@ exit:
  */
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 {
-	Publications* p = malloc(sizeof(Publications));
+	Publications* p = Slab_malloc(sizeof(Publications));
 
 	FUNC_ENTRY;
 	if (!p)
@@ -276,9 +321,8 @@ Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 	p->payload = publish->payload;
 	publish->payload = NULL;
 	*len += publish->payloadlen;
-	memcpy(p->mask, publish->mask, sizeof(p->mask));
 
-	if ((ListAppend(&(state.publications), p, *len)) == NULL)
+	if ((ListAppend(&(MQTTProtocol_getState()->publications), p, *len)) == NULL)
 	{
 		free(p);
 		p = NULL;
@@ -307,11 +351,50 @@ void MQTTProtocol_removePublication(Publications* p)
 			free(p->topic);
 			p->topic = NULL;
 		}
-		ListRemove(&(state.publications), p);
+		ListRemove(&(MQTTProtocol_getState()->publications), p);
 	}
 	FUNC_EXIT;
 }
 
+/**
+ * Give an incoming MQTT V5 publish with a topic alias the topic the server set for the alias.
+ * The topic is the client's to keep, as it is handed to the application with the message.
+ * @param client the client the publish was received by
+ * @param publish the publish packet
+ * @return completion code, SOCKET_ERROR if the alias is not valid, which is a protocol error
+ */
+static int MQTTProtocol_resolveTopicAlias(Clients* client, Publish* publish)
+{
+	int alias = (int)MQTTProperties_getNumericValue(&publish->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+	const char* topic = NULL;
+	size_t len = 0;
+	int rc = TCPSOCKET_COMPLETE;
+
+	FUNC_ENTRY;
+	if ((topic = TopicAliases_inbound(client->inboundAliases, alias, publish->topic, publish->topiclen, &len)) == NULL)
+	{
+		Log(LOG_ERROR, -1, "Topic alias %d received by client %s is not valid", alias, client->clientID);
+		rc = SOCKET_ERROR;
+	}
+	else if (publish->topiclen == 0)
+	{
+		char* resolved = NULL;
+
+		if ((resolved = realloc(publish->topic, len + 1)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		memcpy(resolved, topic, len + 1);
+		publish->topic = resolved;
+		publish->topiclen = (int)len;
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Process an incoming publish packet for a socket
  * The payload field of the packet has not been transferred to another buffer at this point.
@@ -329,7 +412,7 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 	int socketHasPendingWrites = 0;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = (Clients*)(ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare)->content);
 	clientid = client->clientID;
 
 	/* Format and print publish data to trace */
@@ -347,6 +430,11 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 						publish->header.bits.retain, publish->payloadlen, len, buf);
 	}
 
+	if (client->inboundAliases && publish->MQTTVersion >= MQTTVERSION_5 &&
+			MQTTProperties_hasProperty(&publish->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS) &&
+			(rc = MQTTProtocol_resolveTopicAlias(client, publish)) != TCPSOCKET_COMPLETE)
+		goto exit;
+
 	if (publish->header.bits.qos == 0)
 	{
 		Protocol_processPublication(publish, client, 1);
@@ -370,13 +458,14 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 		int len;
 		int already_received = 0;
 		ListElement* listElem = NULL;
-		Messages* m = malloc(sizeof(Messages));
+		Messages* m = Slab_malloc(sizeof(Messages));
 		Publications* p = NULL;
 		if (!m)
 		{
 			rc = PAHO_MEMORY_ERROR;
 			goto exit;
 		}
+		memset(m, '\0', sizeof(Messages));
 		p = MQTTProtocol_storePublication(publish, &len);
 
 		m->publish = p;
@@ -414,7 +503,7 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 			publish1.properties = m->properties;
 
 			Protocol_processPublication(&publish1, client, 1);
-			ListRemove(&(state.publications), m->publish);
+			ListRemove(&(MQTTProtocol_getState()->publications), m->publish);
 			m->publish = NULL;
 		} else
 		{	/* allocate and copy payload data as it's needed for pubrel.
@@ -453,7 +542,7 @@ int MQTTProtocol_handlePubacks(void* pack, SOCKET sock, Publications** pubToRemo
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = (Clients*)(ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare)->content);
 	Log(LOG_PROTOCOL, 14, NULL, sock, client->clientID, puback->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
@@ -467,6 +556,7 @@ int MQTTProtocol_handlePubacks(void* pack, SOCKET sock, Publications** pubToRemo
 		else
 		{
 			Log(TRACE_MIN, 6, NULL, "PUBACK", client->clientID, puback->msgId);
+			MQTTProtocol_inflightAcked(client, m);
 			#if !defined(NO_PERSISTENCE)
 				rc = MQTTPersistence_remove(client,
 						(m->MQTTVersion >= MQTTVERSION_5) ? PERSISTENCE_V5_PUBLISH_SENT : PERSISTENCE_PUBLISH_SENT,
@@ -503,7 +593,7 @@ int MQTTProtocol_handlePubrecs(void* pack, SOCKET sock, Publications** pubToRemo
 	int send_pubrel = 1; /* boolean to send PUBREL or not */
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = (Clients*)(ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare)->content);
 	Log(LOG_PROTOCOL, 15, NULL, sock, client->clientID, pubrec->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
@@ -528,6 +618,7 @@ int MQTTProtocol_handlePubrecs(void* pack, SOCKET sock, Publications** pubToRemo
 		}
 		else
 		{
+			MQTTProtocol_inflightAcked(client, m);
 			if (pubrec->MQTTVersion >= MQTTVERSION_5 && pubrec->rc >= MQTTREASONCODE_UNSPECIFIED_ERROR)
 			{
 				Log(TRACE_MIN, -1, "Pubrec error %d received for client %s msgid %d, not sending PUBREL",
@@ -544,12 +635,13 @@ int MQTTProtocol_handlePubrecs(void* pack, SOCKET sock, Publications** pubToRemo
 				if (m->MQTTVersion >= MQTTVERSION_5)
 					MQTTProperties_free(&m->properties);
 				ListRemove(client->outboundMsgs, m);
-				(++state.msgs_sent);
+				(++MQTTProtocol_getState()->msgs_sent);
 				send_pubrel = 0; /* in MQTT v5, stop the exchange if there is an error reported */
 			}
 			else
 			{
 				m->nextMessageType = PUBCOMP;
+				m->retried = 0;
 				m->lastTouch = MQTTTime_now();
 			}
 		}
@@ -582,7 +674,7 @@ int MQTTProtocol_handlePubrels(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = (Clients*)(ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare)->content);
 	Log(LOG_PROTOCOL, 17, NULL, sock, client->clientID, pubrel->msgId);
 
 	/* look for the message by message id in the records of inbound messages for this client */
@@ -627,9 +719,9 @@ int MQTTProtocol_handlePubrels(void* pack, SOCKET sock)
 			if (m->MQTTVersion >= MQTTVERSION_5)
 				MQTTProperties_free(&m->properties);
 			if (m->publish)
-				ListRemove(&(state.publications), m->publish);
+				ListRemove(&(MQTTProtocol_getState()->publications), m->publish);
 			ListRemove(client->inboundMsgs, m);
-			++(state.msgs_received);
+			++(MQTTProtocol_getState()->msgs_received);
 		}
 	}
 	/* Send ack under all circumstances because MQTT state can get out of step - this standard also says to do this */
@@ -659,7 +751,7 @@ int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRem
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = (Clients*)(ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare)->content);
 	Log(LOG_PROTOCOL, 19, NULL, sock, client->clientID, pubcomp->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
@@ -694,7 +786,7 @@ int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRem
 				if (m->MQTTVersion >= MQTTVERSION_5)
 					MQTTProperties_free(&m->properties);
 				ListRemove(client->outboundMsgs, m);
-				(++state.msgs_sent);
+				(++MQTTProtocol_getState()->msgs_sent);
 			}
 		}
 	}
@@ -715,86 +807,229 @@ void MQTTProtocol_keepalive(START_TIME_TYPE now)
 	ListElement* current = NULL;
 
 	FUNC_ENTRY;
-	ListNextElement(bstate->clients, &current);
+	ListNextElement(MQTTProtocol_getClients()->clients, &current);
 	while (current)
 	{
 		Clients* client =	(Clients*)(current->content);
-		ListNextElement(bstate->clients, &current);
+		ListNextElement(MQTTProtocol_getClients()->clients, &current);
+		MQTTProtocol_keepaliveClient(now, client);
+	}
+	FUNC_EXIT;
+}
 
-		if (client->connected == 0 || client->keepAliveInterval == 0)
-			continue;
 
-		if (client->ping_outstanding == 1)
+/**
+ * MQTT protocol keepAlive processing for one client.  Sends a PINGREQ packet if required.
+ * @param now current time
+ * @param client the client to check
+ */
+void MQTTProtocol_keepaliveClient(START_TIME_TYPE now, Clients* client)
+{
+	FUNC_ENTRY;
+	if (client->connected == 0 || client->keepAliveInterval == 0)
+		goto exit;
+
+	if (client->ping_outstanding == 1)
+	{
+		if (MQTTTime_difftime(now, client->net.lastPing) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500) &&
+			/* if last received is more recent, we could be receiving a large packet */
+			MQTTTime_difftime(now, client->net.lastReceived) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500))
 		{
-			if (MQTTTime_difftime(now, client->net.lastPing) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500) &&
-				/* if last received is more recent, we could be receiving a large packet */
-				MQTTTime_difftime(now, client->net.lastReceived) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500))
-			{
-				Log(TRACE_PROTOCOL, -1, "PINGRESP not received in keepalive interval for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
-				MQTTProtocol_closeSession(client, 1);
-			}
+			Log(TRACE_PROTOCOL, -1, "PINGRESP not received in keepalive interval for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
+			MQTTProtocol_closeSession(client, 1);
 		}
-		else if (client->ping_due == 1 &&
-			(MQTTTime_difftime(now, client->ping_due_time) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500)))
+	}
+	else if (client->ping_due == 1 &&
+		(MQTTTime_difftime(now, client->ping_due_time) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500)))
+	{
+		/* if the last received time is more recent than the ping due time, we could be receiving a large packet,
+		 * preventing the PINGRESP being received */
+		if (MQTTTime_difftime(now, client->ping_due_time) <= MQTTTime_difftime(now, client->net.lastReceived))
 		{
-			/* if the last received time is more recent than the ping due time, we could be receiving a large packet,
-			 * preventing the PINGRESP being received */
-			if (MQTTTime_difftime(now, client->ping_due_time) <= MQTTTime_difftime(now, client->net.lastReceived))
-			{
-				/* ping still outstanding after keep alive interval, so close session */
-				Log(TRACE_PROTOCOL, -1, "PINGREQ still outstanding for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
-				MQTTProtocol_closeSession(client, 1);
-			}
+			/* ping still outstanding after keep alive interval, so close session */
+			Log(TRACE_PROTOCOL, -1, "PINGREQ still outstanding for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
+			MQTTProtocol_closeSession(client, 1);
 		}
-		else if (MQTTTime_difftime(now, client->net.lastSent) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1000))
-		/* the time since we last sent a packet, or part of a packet has exceeded the keep alive, so we need to send a ping */
+	}
+	else if (MQTTTime_difftime(now, client->net.lastSent) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1000))
+	/* the time since we last sent a packet, or part of a packet has exceeded the keep alive, so we need to send a ping */
+	{
+		if (Socket_noPendingWrites(client->net.socket))
 		{
-			if (Socket_noPendingWrites(client->net.socket))
+			if (MQTTPacket_send_pingreq(&client->net, client->clientID) != TCPSOCKET_COMPLETE)
 			{
-				if (MQTTPacket_send_pingreq(&client->net, client->clientID) != TCPSOCKET_COMPLETE)
-				{
-					Log(TRACE_PROTOCOL, -1, "Error sending PINGREQ for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
-					MQTTProtocol_closeSession(client, 1);
-				}
-				else
-				{
-					client->ping_due = 0;
-					client->net.lastPing = now;
-					client->ping_outstanding = 1;
-				}
+				Log(TRACE_PROTOCOL, -1, "Error sending PINGREQ for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
+				MQTTProtocol_closeSession(client, 1);
 			}
-			else if (client->ping_due == 0)
+			else
 			{
-				Log(TRACE_PROTOCOL, -1, "Couldn't send PINGREQ for client %s on socket %d, noting",
-						client->clientID, client->net.socket);
-				client->ping_due = 1;
-				client->ping_due_time = now;
+				client->ping_due = 0;
+				client->net.lastPing = now;
+				client->ping_outstanding = 1;
 			}
 		}
-		else if (MQTTTime_difftime(now, client->net.lastReceived) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1000))
-		/* the time since we last received any data has exceeded the keep alive, so we can send a ping to see if the server is alive */
+		else if (client->ping_due == 0)
 		{
-			/* Check that no writes are pending for the socket. If there are, forget about it, as this PING use is optional */
-			if (Socket_noPendingWrites(client->net.socket))
+			Log(TRACE_PROTOCOL, -1, "Couldn't send PINGREQ for client %s on socket %d, noting",
+					client->clientID, client->net.socket);
+			client->ping_due = 1;
+			client->ping_due_time = now;
+		}
+	}
+	else if (MQTTTime_difftime(now, client->net.lastReceived) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1000))
+	/* the time since we last received any data has exceeded the keep alive, so we can send a ping to see if the server is alive */
+	{
+		/* Check that no writes are pending for the socket. If there are, forget about it, as this PING use is optional */
+		if (Socket_noPendingWrites(client->net.socket))
+		{
+			if (MQTTPacket_send_pingreq(&client->net, client->clientID) != TCPSOCKET_COMPLETE)
 			{
-				if (MQTTPacket_send_pingreq(&client->net, client->clientID) != TCPSOCKET_COMPLETE)
-				{
-					Log(TRACE_PROTOCOL, -1, "Error sending PINGREQ for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
-					MQTTProtocol_closeSession(client, 1);
-				}
-				else
-				{
-					client->ping_due = 0;
-					client->net.lastPing = now;
-					client->ping_outstanding = 1;
-				}
+				Log(TRACE_PROTOCOL, -1, "Error sending PINGREQ for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
+				MQTTProtocol_closeSession(client, 1);
+			}
+			else
+			{
+				client->ping_due = 0;
+				client->net.lastPing = now;
+				client->ping_outstanding = 1;
 			}
 		}
 	}
+exit:
 	FUNC_EXIT;
 }
 
 
+/**
+ * How long until MQTTProtocol_keepaliveClient next has something to do for a client.
+ * Used by timer driven callers, which can wait until then rather than polling.
+ * @param now current time
+ * @param client the client to check
+ * @return the number of milliseconds until keepalive processing is due, 0 if it is due
+ * now, or -1 if the client has no keepalive
+ */
+DIFF_TIME_TYPE MQTTProtocol_keepaliveDue(START_TIME_TYPE now, Clients* client)
+{
+	DIFF_TIME_TYPE due = -1;
+
+	FUNC_ENTRY;
+	if (client->connected == 0 || client->keepAliveInterval == 0)
+		goto exit;
+
+	if (client->ping_outstanding == 1)
+	{
+		/* the PINGRESP deadline, or when the next PINGREQ is due should the PINGRESP arrive first */
+		due = (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500) -
+			min(MQTTTime_difftime(now, client->net.lastPing), MQTTTime_difftime(now, client->net.lastReceived));
+		due = min(due, (DIFF_TIME_TYPE)(client->keepAliveInterval * 1000) - MQTTTime_difftime(now, client->net.lastSent));
+	}
+	else
+	{
+		due = (DIFF_TIME_TYPE)(client->keepAliveInterval * 1000) -
+			max(MQTTTime_difftime(now, client->net.lastSent), MQTTTime_difftime(now, client->net.lastReceived));
+		if (client->ping_due == 1) /* the PINGREQ could not be sent, so it is retried until the deadline */
+			due = min(due, (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500) - MQTTTime_difftime(now, client->ping_due_time));
+	}
+	if (due < 0)
+		due = 0;
+exit:
+	FUNC_EXIT;
+	return due;
+}
+
+
+/**
+ * The most QoS 1 and 2 messages, subscribes and unsubscribes a client may have in flight
+ * at once.  This is maxInflightMessages, as limited by the server's receive maximum, unless
+ * the adaptive window is on and smaller.
+ * @param client the client
+ * @return the inflight limit
+ */
+int MQTTProtocol_inflightLimit(Clients* client)
+{
+	if (client->inflightTargetRTT > 0 && client->inflightWindow < client->maxInflightMessages)
+		return client->inflightWindow;
+	return client->maxInflightMessages;
+}
+
+
+/**
+ * Start the adaptive inflight window again for a new connection.
+ * @param client the client
+ */
+void MQTTProtocol_inflightReset(Clients* client)
+{
+	client->inflightWindow = min(INFLIGHT_INITIAL_WINDOW, client->maxInflightMessages);
+	if (client->inflightWindow < 1)
+		client->inflightWindow = 1;
+	client->inflightThreshold = client->maxInflightMessages;
+	client->inflightAcks = 0;
+	client->inflightHold = 0;
+	client->inflightRTT = 0;
+}
+
+
+/**
+ * Adjust the adaptive inflight window for the first response to a QoS 1 or 2 PUBLISH.
+ *
+ * While the round trip stays within the target, the window grows by one for each response
+ * until it first has to shrink, and by one each round trip after that.  A round trip over
+ * the target halves it.  As with TCP congestion control, the window grows by a constant
+ * and shrinks by a factor, so it settles near the most the server and network handle
+ * without delay.  Messages resent after a timeout give no round trip, as it is not known
+ * which send was answered.
+ * @param client the client
+ * @param m the message that has been acknowledged
+ */
+static void MQTTProtocol_inflightAcked(Clients* client, Messages* m)
+{
+	DIFF_TIME_TYPE rtt = 0;
+
+	if (client->inflightTargetRTT <= 0)
+		return;
+	if (client->inflightHold > 0)
+		--client->inflightHold;
+	if (m->retried)
+		return;
+	rtt = MQTTTime_difftime_us(MQTTTime_now(), m->lastTouch);
+	if (rtt < 0)
+		rtt = 0;
+	client->inflightRTT = (client->inflightRTT == 0) ? rtt : client->inflightRTT + (rtt - client->inflightRTT) / 8;
+
+	if (rtt > (DIFF_TIME_TYPE)client->inflightTargetRTT * 1000)
+		MQTTProtocol_inflightCongested(client);
+	else if (client->inflightWindow < client->maxInflightMessages &&
+			client->outboundMsgs->count * 2 >= client->inflightWindow) /* only grow a window that is in use */
+	{
+		if (client->inflightWindow < client->inflightThreshold)
+			++client->inflightWindow;
+		else if (++client->inflightAcks >= client->inflightWindow)
+		{
+			++client->inflightWindow;
+			client->inflightAcks = 0;
+		}
+	}
+}
+
+
+/**
+ * Halve the adaptive inflight window, when a round trip is over the target or a message has
+ * to be resent.  The responses to messages which were already in flight are delayed by the
+ * same cause, so they don't halve it again.
+ * @param client the client
+ */
+static void MQTTProtocol_inflightCongested(Clients* client)
+{
+	if (client->inflightTargetRTT <= 0 || client->inflightHold > 0)
+		return;
+	client->inflightWindow = max(client->inflightWindow / 2, 1);
+	client->inflightThreshold = client->inflightWindow;
+	client->inflightAcks = 0;
+	client->inflightHold = client->outboundMsgs->count;
+	Log(TRACE_MIN, -1, "Inflight window for client %s reduced to %d", client->clientID, client->inflightWindow);
+}
+
+
 /**
  * MQTT retry processing per client
  * @param now current time
@@ -825,6 +1060,9 @@ static void MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regar
 		{
 			if (regardless)
 				++client->connect_sent;
+			else
+				MQTTProtocol_inflightCongested(client); /* the server is not keeping up */
+			m->retried = 1;
 			if (m->qos == 1 || (m->qos == 2 && m->nextMessageType == PUBREC))
 			{
 				Publish publish;
@@ -837,9 +1075,8 @@ static void MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regar
 				publish.payloadlen = m->publish->payloadlen;
 				publish.properties = m->properties;
 				publish.MQTTVersion = m->MQTTVersion;
-				memcpy(publish.mask, m->publish->mask, sizeof(publish.mask));
-				rc = MQTTPacket_send_publish(&publish, 1, m->qos, m->retain, &client->net, client->clientID);
-				memcpy(m->publish->mask, publish.mask, sizeof(m->publish->mask)); /* store websocket mask used in send */
+				rc = MQTTPacket_send_publish(&publish, 1, m->qos, m->retain, &client->net, client->clientID,
+						client->outboundAliases);
 				if (rc == SOCKET_ERROR)
 				{
 					client->good = 0;
@@ -876,6 +1113,62 @@ exit:
 }
 
 
+/**
+ * How long until MQTTProtocol_retryClient next has something to do for a client.
+ * @param now current time
+ * @param client the client to check
+ * @return the number of milliseconds until the next retry is due, 0 if one is due
+ * now, or -1 if there is nothing to retry
+ */
+DIFF_TIME_TYPE MQTTProtocol_retryDue(START_TIME_TYPE now, Clients* client)
+{
+	ListElement* outcurrent = NULL;
+	DIFF_TIME_TYPE due = -1;
+	DIFF_TIME_TYPE interval = 0;
+
+	FUNC_ENTRY;
+	if (client->connected == 0)
+		goto exit;
+	if (client->connect_sent < client->connect_count) /* a connect retry which didn't complete first time around */
+	{
+		due = 0;
+		goto exit;
+	}
+	if (client->retryInterval <= 0)
+		goto exit;
+
+	interval = (DIFF_TIME_TYPE)(max(client->retryInterval, 10) * 1000);
+	while (ListNextElement(client->outboundMsgs, &outcurrent))
+	{
+		Messages* m = (Messages*)(outcurrent->content);
+		DIFF_TIME_TYPE this_due = interval + 1 - MQTTTime_difftime(now, m->lastTouch);
+
+		if (this_due < 0)
+			this_due = 0;
+		if (due == -1 || this_due < due)
+			due = this_due;
+	}
+exit:
+	FUNC_EXIT;
+	return due;
+}
+
+
+/**
+ * MQTT retry processing for one client, if it is connected and able to write.
+ * @param now current time
+ * @param client the client to which to apply the retry processing
+ * @param regardless boolean - retry packets regardless of retry interval (used on reconnect)
+ */
+void MQTTProtocol_retryClient(START_TIME_TYPE now, Clients* client, int regardless)
+{
+	FUNC_ENTRY;
+	if (client->connected && client->good && Socket_noPendingWrites(client->net.socket))
+		MQTTProtocol_retries(now, client, regardless);
+	FUNC_EXIT;
+}
+
+
 /**
  * Queue an ack message. This is used when the socket is full (e.g. SSL_ERROR_WANT_WRITE).
  * To be completed/cleared when the socket is no longer full
@@ -916,12 +1209,12 @@ void MQTTProtocol_retry(START_TIME_TYPE now, int doRetry, int regardless)
 	ListElement* current = NULL;
 
 	FUNC_ENTRY;
-	ListNextElement(bstate->clients, &current);
+	ListNextElement(MQTTProtocol_getClients()->clients, &current);
 	/* look through the outbound message list of each client, checking to see if a retry is necessary */
 	while (current)
 	{
 		Clients* client = (Clients*)(current->content);
-		ListNextElement(bstate->clients, &current);
+		ListNextElement(MQTTProtocol_getClients()->clients, &current);
 		if (client->connected == 0)
 			continue;
 		if (client->good == 0)
@@ -950,6 +1243,8 @@ void MQTTProtocol_freeClient(Clients* client)
 	MQTTProtocol_freeMessageList(client->inboundMsgs);
 	ListFree(client->messageQueue);
 	ListFree(client->outboundQueue);
+	TopicAliases_free(client->outboundAliases);
+	TopicAliases_free(client->inboundAliases);
 	free(client->clientID);
         client->clientID = NULL;
 	if (client->will)
@@ -969,6 +1264,8 @@ void MQTTProtocol_freeClient(Clients* client)
 		free(client->httpsProxy);
 	if (client->net.http_proxy_auth)
 		free(client->net.http_proxy_auth);
+	Socket_freeReadBuffer(&client->net.readbuf);
+	Socket_freeWriteBuffer(&client->net.writebuf);
 #if defined(OPENSSL)
 	if (client->net.https_proxy_auth)
 		free(client->net.https_proxy_auth);
@@ -1051,7 +1348,7 @@ void MQTTProtocol_writeAvailable(SOCKET socket)
 
 	FUNC_ENTRY;
 
-	client = (Clients*)(ListFindItem(bstate->clients, &socket, clientSocketCompare)->content);
+	client = (Clients*)(ListFindItem(MQTTProtocol_getClients()->clients, &socket, clientSocketCompare)->content);
 
 	current = NULL;
 	while (ListNextElement(client->outboundQueue, &current) && rc == 0)
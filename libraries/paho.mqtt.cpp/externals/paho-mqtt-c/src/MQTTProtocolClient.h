@@ -31,6 +31,10 @@
 #define MAX_MSG_ID 65535
 #define MAX_CLIENTID_LEN 65535
 
+void MQTTProtocol_setCurrent(MQTTProtocol* protocol, ClientStates* clients);
+MQTTProtocol* MQTTProtocol_getState(void);
+ClientStates* MQTTProtocol_getClients(void);
+
 int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int retained, Messages** m);
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages** mm, int qos, int retained, int allocatePayload);
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len);
@@ -47,7 +51,13 @@ int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRem
 
 void MQTTProtocol_closeSession(Clients* c, int sendwill);
 void MQTTProtocol_keepalive(START_TIME_TYPE);
+void MQTTProtocol_keepaliveClient(START_TIME_TYPE now, Clients* client);
+DIFF_TIME_TYPE MQTTProtocol_keepaliveDue(START_TIME_TYPE now, Clients* client);
 void MQTTProtocol_retry(START_TIME_TYPE, int, int);
+void MQTTProtocol_retryClient(START_TIME_TYPE now, Clients* client, int regardless);
+DIFF_TIME_TYPE MQTTProtocol_retryDue(START_TIME_TYPE now, Clients* client);
+int MQTTProtocol_inflightLimit(Clients* client);
+void MQTTProtocol_inflightReset(Clients* client);
 void MQTTProtocol_freeClient(Clients* client);
 void MQTTProtocol_emptyMessageList(List* msgList);
 void MQTTProtocol_freeMessageList(List* msgList);
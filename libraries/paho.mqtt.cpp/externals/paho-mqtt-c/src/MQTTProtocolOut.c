@@ -42,8 +42,6 @@
 #include "Proxy.h"
 #include "Base64.h"
 
-extern ClientStates* bstate;
-
 
 
 /**
@@ -353,7 +351,7 @@ int MQTTProtocol_handlePingresps(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	result = ListFindItem(bstate->clients, &sock, clientSocketCompare);
+	result = ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare);
 	if (result)
 	{
 		client = (Clients*)(result->content);
@@ -400,7 +398,7 @@ int MQTTProtocol_handleSubacks(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	result = ListFindItem(bstate->clients, &sock, clientSocketCompare);
+	result = ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare);
 	if (result)
 	{
 		client = (Clients*)(result->content);
@@ -443,7 +441,7 @@ int MQTTProtocol_handleUnsubacks(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	result = ListFindItem(bstate->clients, &sock, clientSocketCompare);
+	result = ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare);
 	if (result)
 	{
 		client = (Clients*)(result->content);
@@ -469,7 +467,7 @@ int MQTTProtocol_handleDisconnects(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	result = ListFindItem(bstate->clients, &sock, clientSocketCompare);
+	result = ListFindItem(MQTTProtocol_getClients()->clients, &sock, clientSocketCompare);
 	if (result)
 	{
 		client = (Clients*)(result->content);
@@ -106,6 +106,35 @@ DIFF_TIME_TYPE MQTTTime_difftime(START_TIME_TYPE t_new, START_TIME_TYPE t_old)
 #endif
 
 
+#if defined(_WIN32) || defined(_WIN64)
+/*
+ * @param t_new most recent time in milliseconds from GetTickCount()
+ * @param t_old older time in milliseconds from GetTickCount()
+ * @return difference in microseconds, at millisecond resolution
+ */
+DIFF_TIME_TYPE MQTTTime_difftime_us(START_TIME_TYPE t_new, START_TIME_TYPE t_old)
+{
+	return MQTTTime_difftime(t_new, t_old) * 1000;
+}
+#elif defined(AIX)
+DIFF_TIME_TYPE MQTTTime_difftime_us(START_TIME_TYPE t_new, START_TIME_TYPE t_old)
+{
+	struct timespec result;
+
+	ntimersub(t_new, t_old, result);
+	return (DIFF_TIME_TYPE)((result.tv_sec)*1000000L + (result.tv_nsec)/1000L); /* convert to microseconds */
+}
+#else
+DIFF_TIME_TYPE MQTTTime_difftime_us(START_TIME_TYPE t_new, START_TIME_TYPE t_old)
+{
+	struct timeval result;
+
+	timersub(&t_new, &t_old, &result);
+	return (DIFF_TIME_TYPE)(((DIFF_TIME_TYPE)result.tv_sec)*1000000 + (DIFF_TIME_TYPE)result.tv_usec);
+}
+#endif
+
+
 ELAPSED_TIME_TYPE MQTTTime_elapsed(START_TIME_TYPE milliseconds)
 {
 	return (ELAPSED_TIME_TYPE)MQTTTime_difftime(MQTTTime_now(), milliseconds);
@@ -45,5 +45,6 @@ START_TIME_TYPE MQTTTime_start_clock(void);
 START_TIME_TYPE MQTTTime_now(void);
 ELAPSED_TIME_TYPE MQTTTime_elapsed(START_TIME_TYPE milliseconds);
 DIFF_TIME_TYPE MQTTTime_difftime(START_TIME_TYPE t_new, START_TIME_TYPE t_old);
+DIFF_TIME_TYPE MQTTTime_difftime_us(START_TIME_TYPE t_new, START_TIME_TYPE t_old);
 
 #endif
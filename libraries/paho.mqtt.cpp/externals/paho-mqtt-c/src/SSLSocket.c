@@ -39,12 +39,15 @@
 #include "Heap.h"
 
 #include <string.h>
+#include <sys/stat.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/crypto.h>
+#include <openssl/evp.h>
 #include <openssl/x509v3.h>
 
-extern Sockets mod_s;
+/** the socket data of the socket module used by this thread */
+#define mod_s (*Socket_getCurrent())
 
 static int SSLSocket_error(char* aString, SSL* ssl, SOCKET sock, int rc, int (*cb)(const char *str, size_t len, void *u), void* u);
 char* SSL_get_verify_result_string(int rc);
@@ -79,6 +82,17 @@ static ssl_mutex_type sslCoreMutex;
 /* Used to store MQTTClient_SSLOptions for TLS-PSK callback */
 static int tls_ex_index_ssl_opts;
 
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+typedef struct SSLSocket_cachedContext_s SSLSocket_cachedContext;
+static void SSLSocket_uncacheContext(SSLSocket_cachedContext* entry);
+static void SSLSocket_freeAddress(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+static List* context_cache = NULL;
+static ssl_mutex_type contextCacheMutex;
+static SSLSocket_cacheStats cache_stats;
+/* Used to store the server address in each SSL, for the new session callback */
+static int tls_ex_index_address;
+#endif
+
 #if defined(_WIN32) || defined(_WIN64)
 #define iov_len len
 #define iov_base buf
@@ -491,6 +505,12 @@ int SSLSocket_initialize(void)
 
 	tls_ex_index_ssl_opts = SSL_get_ex_new_index(0, "paho ssl options", NULL, NULL, NULL);
 
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	SSL_create_mutex(&contextCacheMutex);
+	context_cache = ListInitialize();
+	tls_ex_index_address = SSL_get_ex_new_index(0, "paho server address", NULL, NULL, SSLSocket_freeAddress);
+#endif
+
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -519,6 +539,20 @@ void SSLSocket_terminate(void)
 
 	SSL_destroy_mutex(&sslCoreMutex);
 
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	if (context_cache)
+	{
+		SSL_lock_mutex(&contextCacheMutex);
+		while (context_cache->first)
+			SSLSocket_uncacheContext((SSLSocket_cachedContext*)(context_cache->first->content));
+		ListFree(context_cache);
+		context_cache = NULL;
+		memset(&cache_stats, '\0', sizeof(cache_stats));
+		SSL_unlock_mutex(&contextCacheMutex);
+		SSL_destroy_mutex(&contextCacheMutex);
+	}
+#endif
+
 	FUNC_EXIT;
 }
 
@@ -543,11 +577,341 @@ exit:
 	return rc;
 }
 
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+
+/*
+ * Contexts are shared by all connections whose SSL options have the same contents, so
+ * certificates and keys are loaded once rather than on every connect.  The cache and
+ * each connection using a context hold their own OpenSSL reference to it.  The files
+ * named in the options are part of the key, by modification time and size, so
+ * replaced certificates are picked up by the next connection.
+ *
+ * Each cached context also keeps the last TLS session received for each server
+ * address it has connected to, which is offered to the server on the next connection.
+ */
+#define SSL_CONTEXT_CACHE_MAX 16
+
+typedef struct
+{
+	char* address;         /**< the server address the session was negotiated with */
+	SSL_SESSION* session;
+} SSLSocket_cachedSession;
+
+struct SSLSocket_cachedContext_s
+{
+	unsigned char key[EVP_MAX_MD_SIZE]; /**< digest of the SSL options */
+	unsigned int keylen;
+	SSL_CTX* ctx;
+	List* sessions;        /**< SSLSocket_cachedSession, for connections using this context */
+	unsigned long lastUsed;
+};
+
+static unsigned long context_uses = 0;
+
+
+static void SSLSocket_freeAddress(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp)
+{
+	free(ptr);
+}
+
+
+static void SSLSocket_digestString(EVP_MD_CTX* md, const char* str)
+{
+	size_t len = (str == NULL) ? 0 : strlen(str) + 1; /* so that NULL and "" differ */
+
+	EVP_DigestUpdate(md, &len, sizeof(len));
+	if (str)
+		EVP_DigestUpdate(md, str, len);
+}
+
+
+static void SSLSocket_digestFile(EVP_MD_CTX* md, const char* filename)
+{
+	struct stat buf;
+
+	SSLSocket_digestString(md, filename);
+	if (filename && stat(filename, &buf) == 0)
+	{
+		EVP_DigestUpdate(md, &buf.st_mtime, sizeof(buf.st_mtime));
+		EVP_DigestUpdate(md, &buf.st_size, sizeof(buf.st_size));
+	}
+}
+
+
+/**
+ * Calculate the context cache key for a set of SSL options
+ * @param opts the SSL options
+ * @param entry the cache entry to set the key in
+ * @return 1 if the options can share a context, 0 otherwise
+ */
+static int SSLSocket_contextKey(MQTTClient_SSLOptions* opts, SSLSocket_cachedContext* entry)
+{
+	EVP_MD_CTX* md = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	/* the PSK callback finds the options through the context, so the context can't be shared */
+	if (opts->ssl_psk_cb != NULL || (md = EVP_MD_CTX_new()) == NULL)
+		goto exit;
+	if (EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1)
+		goto exit;
+	SSLSocket_digestFile(md, opts->trustStore);
+	SSLSocket_digestFile(md, opts->keyStore);
+	SSLSocket_digestFile(md, opts->privateKey);
+	SSLSocket_digestString(md, opts->privateKeyPassword);
+	SSLSocket_digestString(md, opts->enabledCipherSuites);
+	SSLSocket_digestFile(md, opts->CApath);
+	EVP_DigestUpdate(md, &opts->enableServerCertAuth, sizeof(opts->enableServerCertAuth));
+	EVP_DigestUpdate(md, &opts->sslVersion, sizeof(opts->sslVersion));
+	EVP_DigestUpdate(md, &opts->disableDefaultTrustStore, sizeof(opts->disableDefaultTrustStore));
+	EVP_DigestUpdate(md, &opts->protos_len, sizeof(opts->protos_len));
+	if (opts->protos && opts->protos_len > 0)
+		EVP_DigestUpdate(md, opts->protos, opts->protos_len);
+	rc = EVP_DigestFinal_ex(md, entry->key, &entry->keylen);
+exit:
+	EVP_MD_CTX_free(md);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static int SSLSocket_contextKeyCompare(void* a, void* b)
+{
+	SSLSocket_cachedContext* entry = (SSLSocket_cachedContext*)a;
+	SSLSocket_cachedContext* key = (SSLSocket_cachedContext*)b;
+
+	return entry->keylen == key->keylen && memcmp(entry->key, key->key, key->keylen) == 0;
+}
+
+
+static int SSLSocket_contextCompare(void* a, void* b)
+{
+	return ((SSLSocket_cachedContext*)a)->ctx == (SSL_CTX*)b;
+}
+
+
+static int SSLSocket_sessionAddressCompare(void* a, void* b)
+{
+	return strcmp(((SSLSocket_cachedSession*)a)->address, (char*)b) == 0;
+}
+
+
+/**
+ * Remove a context and its sessions from the cache.  The cache mutex must be held.
+ * @param entry the cache entry
+ */
+static void SSLSocket_uncacheContext(SSLSocket_cachedContext* entry)
+{
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+	while (ListNextElement(entry->sessions, &current))
+	{
+		SSLSocket_cachedSession* s = (SSLSocket_cachedSession*)(current->content);
+
+		SSL_SESSION_free(s->session);
+		free(s->address);
+	}
+	ListFree(entry->sessions);
+	SSL_CTX_free(entry->ctx);
+	ListRemove(context_cache, entry);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Called by OpenSSL when the server sends a session which can be resumed later.  In
+ * TLS 1.3 that happens after the handshake has completed.
+ * @param ssl the connection
+ * @param session the new session
+ * @return 1 if the session has been kept, 0 for OpenSSL to free it
+ */
+static int SSLSocket_newSession(SSL* ssl, SSL_SESSION* session)
+{
+	const char* address = SSL_get_ex_data(ssl, tls_ex_index_address);
+	ListElement* elem = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (address == NULL)
+		goto exit;
+	SSL_lock_mutex(&contextCacheMutex);
+	if (context_cache && (elem = ListFindItem(context_cache, SSL_get_SSL_CTX(ssl), SSLSocket_contextCompare)) != NULL)
+	{
+		SSLSocket_cachedContext* entry = (SSLSocket_cachedContext*)(elem->content);
+		SSLSocket_cachedSession* s = NULL;
+
+		if ((elem = ListFindItem(entry->sessions, (void*)address, SSLSocket_sessionAddressCompare)) != NULL)
+		{
+			s = (SSLSocket_cachedSession*)(elem->content);
+			SSL_SESSION_free(s->session);
+		}
+		else if ((s = malloc(sizeof(SSLSocket_cachedSession))) != NULL)
+		{
+			if ((s->address = MQTTStrdup(address)) == NULL || ListAppend(entry->sessions, s, sizeof(*s)) == NULL)
+			{
+				free(s->address);
+				free(s);
+				s = NULL;
+			}
+		}
+		if (s)
+		{
+			s->session = session;
+			rc = 1;
+		}
+	}
+	SSL_unlock_mutex(&contextCacheMutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Find a cached context matching a set of SSL options
+ * @param opts the SSL options
+ * @param entry the cache key, set here
+ * @return a new reference to the context, or NULL
+ */
+static SSL_CTX* SSLSocket_getCachedContext(MQTTClient_SSLOptions* opts, SSLSocket_cachedContext* key)
+{
+	ListElement* elem = NULL;
+	SSL_CTX* ctx = NULL;
+
+	FUNC_ENTRY;
+	if (SSLSocket_contextKey(opts, key) &&
+		(elem = ListFindItem(context_cache, key, SSLSocket_contextKeyCompare)) != NULL)
+	{
+		SSLSocket_cachedContext* entry = (SSLSocket_cachedContext*)(elem->content);
+
+		ctx = entry->ctx;
+		SSL_CTX_up_ref(ctx);
+		entry->lastUsed = ++context_uses;
+		++cache_stats.contextHits;
+	}
+	else
+		++cache_stats.contextMisses;
+	FUNC_EXIT;
+	return ctx;
+}
+
+
+/**
+ * Add a new context to the cache, removing the least recently used if the cache is full
+ * @param key the cache key
+ * @param ctx the context
+ */
+static void SSLSocket_cacheContext(SSLSocket_cachedContext* key, SSL_CTX* ctx)
+{
+	SSLSocket_cachedContext* entry = NULL;
+
+	FUNC_ENTRY;
+	if (key->keylen == 0 || (entry = malloc(sizeof(SSLSocket_cachedContext))) == NULL)
+		goto exit;
+	memcpy(entry, key, sizeof(SSLSocket_cachedContext));
+	if ((entry->sessions = ListInitialize()) == NULL)
+	{
+		free(entry);
+		goto exit;
+	}
+	SSL_CTX_up_ref(ctx);
+	entry->ctx = ctx;
+	entry->lastUsed = ++context_uses;
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, SSLSocket_newSession);
+	if (ListAppend(context_cache, entry, sizeof(SSLSocket_cachedContext)) == NULL)
+	{
+		ListFree(entry->sessions);
+		SSL_CTX_free(ctx);
+		free(entry);
+		goto exit;
+	}
+	if (context_cache->count > SSL_CONTEXT_CACHE_MAX)
+	{
+		ListElement* current = NULL;
+		SSLSocket_cachedContext* oldest = entry;
+
+		while (ListNextElement(context_cache, &current))
+		{
+			if (((SSLSocket_cachedContext*)(current->content))->lastUsed < oldest->lastUsed)
+				oldest = (SSLSocket_cachedContext*)(current->content);
+		}
+		SSLSocket_uncacheContext(oldest);
+	}
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Offer the cached session for a server, if there is one, on a new connection
+ * @param ssl the connection
+ * @param address the server address
+ */
+static void SSLSocket_setCachedSession(SSL* ssl, const char* address)
+{
+	ListElement* elem = NULL;
+	SSL_SESSION* session = NULL;
+	char* addr_copy = NULL;
+
+	FUNC_ENTRY;
+	SSL_lock_mutex(&contextCacheMutex);
+	if ((elem = ListFindItem(context_cache, SSL_get_SSL_CTX(ssl), SSLSocket_contextCompare)) == NULL)
+		goto exit; /* sessions are only kept for cached contexts */
+	if ((addr_copy = MQTTStrdup(address)) == NULL)
+		goto exit;
+	SSL_set_ex_data(ssl, tls_ex_index_address, addr_copy);
+	elem = ListFindItem(((SSLSocket_cachedContext*)(elem->content))->sessions, (void*)address,
+			SSLSocket_sessionAddressCompare);
+	if (elem)
+		session = ((SSLSocket_cachedSession*)(elem->content))->session;
+	if (session && SSL_SESSION_is_resumable(session) && SSL_set_session(ssl, session) == 1)
+		++cache_stats.sessionHits;
+	else
+		++cache_stats.sessionMisses;
+exit:
+	SSL_unlock_mutex(&contextCacheMutex);
+	FUNC_EXIT;
+}
+
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10101000L */
+
+
+/**
+ * Get the number of times the SSL context and TLS session caches have been used
+ * @param stats the statistics, returned
+ */
+void SSLSocket_getCacheStats(SSLSocket_cacheStats* stats)
+{
+	FUNC_ENTRY;
+	memset(stats, '\0', sizeof(*stats));
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	if (context_cache)
+	{
+		SSL_lock_mutex(&contextCacheMutex);
+		*stats = cache_stats;
+		SSL_unlock_mutex(&contextCacheMutex);
+	}
+#endif
+	FUNC_EXIT;
+}
+
+
 int SSLSocket_createContext(networkHandles* net, MQTTClient_SSLOptions* opts)
 {
 	int rc = 1;
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	SSLSocket_cachedContext key;
+#endif
 
 	FUNC_ENTRY;
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	memset(&key, '\0', sizeof(key));
+	SSL_lock_mutex(&contextCacheMutex);
+	if (net->ctx == NULL && (net->ctx = SSLSocket_getCachedContext(opts, &key)) != NULL)
+		goto exit;
+#endif
 	if (net->ctx == NULL)
 	{
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
@@ -695,6 +1059,13 @@ int SSLSocket_createContext(networkHandles* net, MQTTClient_SSLOptions* opts)
 #endif
 
 	SSL_CTX_set_mode(net->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_info_callback(net->ctx, SSL_CTX_info_callback);
+	SSL_CTX_set_msg_callback(net->ctx, SSL_CTX_msg_callback);
+	if (opts->enableServerCertAuth)
+		SSL_CTX_set_verify(net->ctx, SSL_VERIFY_PEER, NULL);
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	SSLSocket_cacheContext(&key, net->ctx);
+#endif
 
 	goto exit;
 free_ctx:
@@ -702,6 +1073,9 @@ free_ctx:
 	net->ctx = NULL;
 
 exit:
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	SSL_unlock_mutex(&contextCacheMutex);
+#endif
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -719,12 +1093,11 @@ int SSLSocket_setSocketForSSL(networkHandles* net, MQTTClient_SSLOptions* opts,
 		char *hostname_plus_null;
 		int i;
 
-		SSL_CTX_set_info_callback(net->ctx, SSL_CTX_info_callback);
-		SSL_CTX_set_msg_callback(net->ctx, SSL_CTX_msg_callback);
-   		if (opts->enableServerCertAuth)
-			SSL_CTX_set_verify(net->ctx, SSL_VERIFY_PEER, NULL);
-
 		net->ssl = SSL_new(net->ctx);
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+		if (net->ssl)
+			SSLSocket_setCachedSession(net->ssl, hostname);
+#endif
 
 		/* Log all ciphers available to the SSL sessions (loaded in ctx) */
 		for (i = 0; ;i++)
@@ -771,6 +1144,17 @@ int SSLSocket_connect(SSL* ssl, SOCKET sock, const char* hostname, int verify, i
 
 	ERR_clear_error();
 	rc = SSL_connect(ssl);
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	if (rc == 1)
+	{
+		SSL_lock_mutex(&contextCacheMutex);
+		if (SSL_session_reused(ssl))
+			++cache_stats.resumedHandshakes;
+		else
+			++cache_stats.fullHandshakes;
+		SSL_unlock_mutex(&contextCacheMutex);
+	}
+#endif
 	if (rc != 1)
 	{
 		int error;
@@ -931,6 +1315,71 @@ exit:
 	return buf;
 }
 
+/**
+ *  Reads the data that is available on a TLS connection, non-blocking, into a receive buffer.
+ *  Read-ahead is turned on for the connection, so that OpenSSL takes in as much as the socket
+ *  has in one go, and then every record already received is decrypted into the buffer,
+ *  rather than a single SSL_read for each part of each packet.
+ *  @param ssl the SSL structure of the connection
+ *  @param socket the socket to read from
+ *  @param rb the receive buffer
+ *  @param min_len the number of unconsumed bytes the buffer must be able to hold
+ *  @return TCPSOCKET_COMPLETE if data was read, TCPSOCKET_INTERRUPTED if there was none
+ *  available, otherwise SOCKET_ERROR
+ */
+int SSLSocket_readBuffered(SSL* ssl, SOCKET socket, Socket_readBuffer* rb, size_t min_len)
+{
+	size_t start_end = 0;
+	int rc = SOCKET_ERROR;
+	int len = 0;
+
+	FUNC_ENTRY;
+	if (Socket_reserveReadBuffer(rb, min_len) != TCPSOCKET_COMPLETE)
+		goto exit;
+	if (!SSL_get_read_ahead(ssl))
+		SSL_set_read_ahead(ssl, 1);
+
+	start_end = rb->end;
+	ERR_clear_error();
+	while (rb->end < rb->buflen &&
+			(len = SSL_read(ssl, &rb->buf[rb->end], (int)(rb->buflen - rb->end))) > 0)
+	{
+		rb->end += len;
+		if (!SSLSocket_hasPending(ssl))
+			break;
+	}
+
+	if (rb->end > start_end)
+		rc = TCPSOCKET_COMPLETE; /* any error will be seen on the next read */
+	else if (len < 0)
+	{
+		int err = SSLSocket_error("SSL_read - readBuffered", ssl, socket, len, NULL, NULL);
+		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+			rc = TCPSOCKET_INTERRUPTED;
+	}
+	/* a return of 0 from SSL_read means the other end closed the connection */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ *  Whether a TLS connection has received data which OpenSSL is holding, which select
+ *  will not report the socket as readable for.
+ *  @param ssl the SSL structure of the connection
+ *  @return boolean - true if there is data to be read
+ */
+int SSLSocket_hasPending(SSL* ssl)
+{
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+	return SSL_has_pending(ssl);
+#else
+	return SSL_pending(ssl) > 0;
+#endif
+}
+
+
 void SSLSocket_destroyContext(networkHandles* net)
 {
 	FUNC_ENTRY;
@@ -940,7 +1389,8 @@ void SSLSocket_destroyContext(networkHandles* net)
 	FUNC_EXIT;
 }
 
-static List pending_reads = {NULL, NULL, NULL, 0, 0};
+/** the sockets with data buffered in their SSL object, kept with the socket data */
+#define pending_reads (mod_s.ssl_pending_reads)
 
 int SSLSocket_close(networkHandles* net)
 {
@@ -972,26 +1422,31 @@ int SSLSocket_putdatas(SSL* ssl, SOCKET socket, char* buf0, size_t buf0len, Pack
 	char *ptr;
 	iobuf iovec;
 	int sslerror;
+	int copied = (bufs.count > 0); /* data already in one buffer is written from where it is */
 
 	FUNC_ENTRY;
 	iovec.iov_len = (ULONG)buf0len;
 	for (i = 0; i < bufs.count; i++)
 		iovec.iov_len += (ULONG)bufs.buflens[i];
 
-	ptr = iovec.iov_base = (char *)malloc(iovec.iov_len);
-	if (!ptr)
+	if (!copied)
+		iovec.iov_base = buf0;
+	else if ((ptr = iovec.iov_base = (char *)malloc(iovec.iov_len)) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
 	}
-	memcpy(ptr, buf0, buf0len);
-	ptr += buf0len;
-	for (i = 0; i < bufs.count; i++)
+	else
 	{
-		if (bufs.buffers[i] != NULL && bufs.buflens[i] > 0)
+		memcpy(ptr, buf0, buf0len);
+		ptr += buf0len;
+		for (i = 0; i < bufs.count; i++)
 		{
-			memcpy(ptr, bufs.buffers[i], bufs.buflens[i]);
-			ptr += bufs.buflens[i];
+			if (bufs.buffers[i] != NULL && bufs.buflens[i] > 0)
+			{
+				memcpy(ptr, bufs.buffers[i], bufs.buflens[i]);
+				ptr += bufs.buflens[i];
+			}
 		}
 	}
 
@@ -1030,10 +1485,14 @@ int SSLSocket_putdatas(SSL* ssl, SOCKET socket, char* buf0, size_t buf0len, Pack
 	SSL_unlock_mutex(&sslCoreMutex);
 
 	if (rc != TCPSOCKET_INTERRUPTED)
-		free(iovec.iov_base);
+	{
+		if (copied)
+			free(iovec.iov_base);
+	}
 	else
 	{
-		free(buf0);
+		if (copied) /* otherwise buf0 is now owned by the pending write */
+			free(buf0);
 		for (i = 0; i < bufs.count; ++i)
 		{
 		    if (bufs.frees[i])
@@ -1049,6 +1508,43 @@ exit:
 }
 
 
+/**
+ *  Writes out the data gathered in a TLS connection's output buffer, in one SSL_write.
+ *  If the write is not complete, the socket buffer takes over the rest of the data, and
+ *  the output buffer's storage with it.  If an earlier write is still pending, the data
+ *  is kept for later.
+ *  @param ssl the SSL structure of the connection
+ *  @param socket the socket to write to
+ *  @param wb the output buffer
+ *  @return completion code, TCPSOCKET_INTERRUPTED if the write is still pending
+ */
+int SSLSocket_flushBuffered(SSL* ssl, SOCKET socket, Socket_writeBuffer* wb)
+{
+	PacketBuffers none = {0, NULL, NULL, NULL};
+	int rc = TCPSOCKET_COMPLETE;
+
+	FUNC_ENTRY;
+	if (wb->len == 0)
+		goto exit;
+	if (!Socket_noPendingWrites(socket))
+	{
+		rc = TCPSOCKET_INTERRUPTED; /* keep the data until the earlier write has finished */
+		goto exit;
+	}
+
+	rc = SSLSocket_putdatas(ssl, socket, wb->buf, wb->len, none);
+	if (rc == TCPSOCKET_INTERRUPTED)
+	{
+		wb->buf = NULL; /* now owned by the pending write */
+		wb->buflen = 0;
+	}
+	wb->len = 0;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 void SSLSocket_addPendingRead(SOCKET sock)
 {
 	FUNC_ENTRY;
@@ -1068,6 +1564,12 @@ void SSLSocket_addPendingRead(SOCKET sock)
 }
 
 
+int SSLSocket_hasPendingRead(void)
+{
+	return pending_reads.count > 0;
+}
+
+
 SOCKET SSLSocket_getPendingRead(void)
 {
 	SOCKET sock = -1;
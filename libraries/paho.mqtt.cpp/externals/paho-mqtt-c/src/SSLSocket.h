@@ -33,6 +33,19 @@
 #define URI_SSL   "ssl://"
 #define URI_MQTTS "mqtts://"
 
+/**
+ * Counts of SSL context and TLS session cache use, since the library was initialized
+ */
+typedef struct
+{
+	unsigned long contextHits;       /**> connections which used a cached SSL context */
+	unsigned long contextMisses;     /**> connections which created and loaded a new SSL context */
+	unsigned long sessionHits;       /**> connections which offered a cached session to the server */
+	unsigned long sessionMisses;     /**> connections with no cached session to offer */
+	unsigned long resumedHandshakes; /**> handshakes in which the server resumed a session */
+	unsigned long fullHandshakes;    /**> handshakes in which the server did not resume a session */
+} SSLSocket_cacheStats;
+
 /** if we should handle openssl initialization (bool_value == 1) or depend on it to be initalized externally (bool_value == 0) */
 void SSLSocket_handleOpensslInit(int bool_value);
 
@@ -42,12 +55,17 @@ int SSLSocket_setSocketForSSL(networkHandles* net, MQTTClient_SSLOptions* opts,
 
 int SSLSocket_getch(SSL* ssl, SOCKET socket, char* c);
 char *SSLSocket_getdata(SSL* ssl, SOCKET socket, size_t bytes, size_t* actual_len, int* rc);
+int SSLSocket_readBuffered(SSL* ssl, SOCKET socket, Socket_readBuffer* rb, size_t min_len);
+int SSLSocket_hasPending(SSL* ssl);
 
 int SSLSocket_close(networkHandles* net);
 int SSLSocket_putdatas(SSL* ssl, SOCKET socket, char* buf0, size_t buf0len, PacketBuffers bufs);
+int SSLSocket_flushBuffered(SSL* ssl, SOCKET socket, Socket_writeBuffer* wb);
 int SSLSocket_connect(SSL* ssl, SOCKET sock, const char* hostname, int verify, int (*cb)(const char *str, size_t len, void *u), void* u);
+void SSLSocket_getCacheStats(SSLSocket_cacheStats* stats);
 
 SOCKET SSLSocket_getPendingRead(void);
+int SSLSocket_hasPendingRead(void);
 int SSLSocket_continueWrite(pending_writes* pw);
 int SSLSocket_abortWrite(pending_writes* pw);
 
@@ -0,0 +1,604 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - slab allocator for fixed size structures
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Slab allocator for the small fixed size structures allocated for every message
+ *
+ * List elements, queued commands, and the Messages, Publications, Publish and Ack
+ * structures are allocated with Slab_malloc.  Blocks of a few size classes are carved
+ * from aligned chunks, and each thread keeps a cache of free blocks of each class, so
+ * that most allocations and frees take no lock.  Blocks freed on one thread and
+ * allocated on another move between the threads through a shared depot, a batch at
+ * a time.
+ *
+ * The blocks are freed with free(), as they always have been: Heap.h sends free() to
+ * Slab_free, or myfree to Slab_release, which recognize a slab block by looking up the
+ * chunk it is in.  Anything else is passed on.
+ *
+ * The slab allocator is built in when SLAB_ALLOCATOR is defined.
+ */
+
+#define SLAB_C /* so that free isn't redefined by Heap.h */
+
+#include "Slab.h"
+#include "Thread.h"
+#include "Heap.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(SLAB_ALLOCATOR)
+
+#undef malloc
+#undef realloc
+#undef free
+
+#define SLAB_CHUNK_SIZE 32768 /**< the size, and alignment, of the chunks blocks are carved from */
+#define SLAB_CHUNK_HEADER 64  /**< the space taken by the slabChunk header at the start of a chunk */
+#define SLAB_TABLE_SIZE 8192  /**< the size of the chunk lookup table, a power of 2 */
+#define SLAB_MAX_CHUNKS (SLAB_TABLE_SIZE / 2)
+#define SLAB_BATCH 32         /**< the number of blocks moved between a thread cache and the depot */
+#define SLAB_CACHE_MAX (2 * SLAB_BATCH)
+
+static const size_t class_sizes[SLAB_CLASSES] = {32, 48, 64, 96, 128, 192, 256};
+
+/** the size class of each size, indexed by (size + 15) / 16 */
+static const int size_classes[SLAB_MAX_SIZE / 16 + 1] = {0, 0, 0, 1, 2, 3, 3, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6};
+
+typedef struct slabBlock
+{
+	struct slabBlock* next;
+} slabBlock;
+
+/**
+ * The start of each chunk.
+ */
+typedef struct slabChunk
+{
+	struct slabChunk* next_chunk;
+	int class_index;
+} slabChunk;
+
+/**
+ * The free blocks held by one thread.  Only that thread uses the lists, so they need no lock.
+ */
+typedef struct slabCache
+{
+	struct slabCache* next_cache;
+	int owned;                          /**< whether a running thread owns the cache */
+	slabBlock* blocks[SLAB_CLASSES];
+	int count[SLAB_CLASSES];
+} slabCache;
+
+/**
+ * Free blocks of one class which are not in any thread cache.
+ */
+typedef struct
+{
+	slabBlock* blocks;
+	size_t count;
+	size_t chunks;
+} slabDepot;
+
+static slabDepot depot[SLAB_CLASSES];
+static slabChunk* slab_chunks = NULL;
+static slabCache* slab_caches = NULL;
+static size_t chunk_count = 0;
+static size_t fallbacks = 0;
+static int slab_key_created = 0;
+
+/** the addresses of the chunks, so that a pointer can be checked for being in one without
+ * touching the memory it points to.  Entries are only added until Slab_terminate. */
+static volatile uintptr_t chunk_table[SLAB_TABLE_SIZE];
+
+#if defined(_WIN32) || defined(_WIN64)
+mutex_type slab_mutex;
+static DWORD slab_key = FLS_OUT_OF_INDEXES;
+static void WINAPI Slab_releaseCache(void* cache);
+#else
+static pthread_mutex_t slab_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type slab_mutex = &slab_mutex_store;
+static pthread_key_t slab_key;
+static void Slab_releaseCache(void* cache);
+#endif
+
+
+static size_t Slab_hash(uintptr_t base)
+{
+	return (size_t)(((uint64_t)(base / SLAB_CHUNK_SIZE) * 0x9E3779B97F4A7C15ULL) >> 32) & (SLAB_TABLE_SIZE - 1);
+}
+
+
+/**
+ * Finds the chunk a pointer is in.
+ * @param p the pointer
+ * @return the chunk, or NULL if p is not a slab block
+ */
+static slabChunk* Slab_findChunk(void* p)
+{
+	uintptr_t base = (uintptr_t)p & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1);
+	size_t i = Slab_hash(base);
+	uintptr_t entry = 0;
+
+	while ((entry = chunk_table[i]) != 0)
+	{
+		if (entry == base)
+			return (slabChunk*)base;
+		i = (i + 1) & (SLAB_TABLE_SIZE - 1);
+	}
+	return NULL;
+}
+
+
+/**
+ * Allocates a new chunk, and puts all its blocks in the depot.  Called with slab_mutex held.
+ * @param c the size class
+ * @return 1 if a chunk was added, 0 if not
+ */
+static int Slab_newChunk(int c)
+{
+	slabChunk* chunk = NULL;
+	size_t size = class_sizes[c];
+	size_t count = (SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER) / size;
+	size_t i = 0;
+
+	if (chunk_count >= SLAB_MAX_CHUNKS)
+		return 0;
+#if defined(_WIN32) || defined(_WIN64)
+	if ((chunk = _aligned_malloc(SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE)) == NULL)
+		return 0;
+#else
+	if (posix_memalign((void**)&chunk, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE) != 0)
+		return 0;
+#endif
+	chunk->class_index = c;
+	chunk->next_chunk = slab_chunks;
+	slab_chunks = chunk;
+
+	for (i = 0; i < count; ++i)
+	{
+		slabBlock* block = (slabBlock*)((char*)chunk + SLAB_CHUNK_HEADER + i * size);
+
+		block->next = depot[c].blocks;
+		depot[c].blocks = block;
+	}
+	depot[c].count += count;
+	++depot[c].chunks;
+
+	i = Slab_hash((uintptr_t)chunk);
+	while (chunk_table[i] != 0)
+		i = (i + 1) & (SLAB_TABLE_SIZE - 1);
+	chunk_table[i] = (uintptr_t)chunk;
+	++chunk_count;
+	return 1;
+}
+
+
+/**
+ * Moves blocks of one class from a thread cache to the depot.  Called with slab_mutex held.
+ * @param cache the thread cache
+ * @param c the size class
+ * @param count the number of blocks to move
+ */
+static void Slab_drain(slabCache* cache, int c, int count)
+{
+	while (count-- > 0 && cache->blocks[c])
+	{
+		slabBlock* block = cache->blocks[c];
+
+		cache->blocks[c] = block->next;
+		--cache->count[c];
+		block->next = depot[c].blocks;
+		depot[c].blocks = block;
+		++depot[c].count;
+	}
+}
+
+
+#if defined(_WIN32) || defined(_WIN64)
+static void WINAPI Slab_releaseCache(void* cache)
+#else
+static void Slab_releaseCache(void* cache)
+#endif
+{
+	slabCache* released = (slabCache*)cache;
+	int c;
+
+	if (released == NULL)
+		return;
+	Paho_thread_lock_mutex(slab_mutex);
+	for (c = 0; c < SLAB_CLASSES; ++c)
+		Slab_drain(released, c, released->count[c]);
+	released->owned = 0;
+	Paho_thread_unlock_mutex(slab_mutex);
+}
+
+
+/**
+ * Finds the current thread a cache, reusing one left by a thread which has ended if possible.
+ * @return the cache, or NULL if there is not enough memory
+ */
+static slabCache* Slab_newCache(void)
+{
+	slabCache* cache = NULL;
+
+	Paho_thread_lock_mutex(slab_mutex);
+	if (!slab_key_created)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		if ((slab_key = FlsAlloc(Slab_releaseCache)) == FLS_OUT_OF_INDEXES)
+#else
+		if (pthread_key_create(&slab_key, Slab_releaseCache) != 0)
+#endif
+			goto exit;
+		slab_key_created = 1;
+	}
+	for (cache = slab_caches; cache; cache = cache->next_cache)
+	{
+		if (!cache->owned)
+			break;
+	}
+	if (cache == NULL)
+	{
+		if ((cache = malloc(sizeof(slabCache))) == NULL)
+			goto exit;
+		memset(cache, '\0', sizeof(slabCache));
+		cache->next_cache = slab_caches;
+		slab_caches = cache;
+	}
+	cache->owned = 1;
+#if defined(_WIN32) || defined(_WIN64)
+	FlsSetValue(slab_key, cache);
+#else
+	pthread_setspecific(slab_key, cache);
+#endif
+exit:
+	Paho_thread_unlock_mutex(slab_mutex);
+	return cache;
+}
+
+
+static slabCache* Slab_getCache(void)
+{
+	slabCache* cache = NULL;
+
+	if (slab_key_created)
+#if defined(_WIN32) || defined(_WIN64)
+		cache = (slabCache*)FlsGetValue(slab_key);
+#else
+		cache = (slabCache*)pthread_getspecific(slab_key);
+#endif
+	if (cache == NULL)
+		cache = Slab_newCache();
+	return cache;
+}
+
+
+static void* Slab_fallback(size_t size)
+{
+	Paho_thread_lock_mutex(slab_mutex);
+	++fallbacks;
+	Paho_thread_unlock_mutex(slab_mutex);
+#if !defined(NO_HEAP_TRACKING)
+	return mymalloc(__FILE__, __LINE__, size);
+#else
+	return malloc(size);
+#endif
+}
+
+
+/**
+ * Allocates a block for one of the fixed size structures.
+ * @param size the size of the structure
+ * @return the block, or NULL if there is not enough memory.  The block is freed with free().
+ */
+void* Slab_malloc(size_t size)
+{
+	slabCache* cache = NULL;
+	slabBlock* block = NULL;
+	int c = 0;
+
+	if (size > SLAB_MAX_SIZE || (cache = Slab_getCache()) == NULL)
+		return Slab_fallback(size);
+
+	c = size_classes[(size + 15) / 16];
+	if (cache->blocks[c] == NULL)
+	{
+		/* refill the thread cache from the depot, carving a new chunk if that is empty too */
+		Paho_thread_lock_mutex(slab_mutex);
+		if (depot[c].count == 0)
+			Slab_newChunk(c);
+		while (cache->count[c] < SLAB_BATCH && depot[c].blocks)
+		{
+			block = depot[c].blocks;
+			depot[c].blocks = block->next;
+			--depot[c].count;
+			block->next = cache->blocks[c];
+			cache->blocks[c] = block;
+			++cache->count[c];
+		}
+		Paho_thread_unlock_mutex(slab_mutex);
+		if (cache->blocks[c] == NULL)
+			return Slab_fallback(size);
+	}
+	block = cache->blocks[c];
+	cache->blocks[c] = block->next;
+	--cache->count[c];
+	return block;
+}
+
+
+/**
+ * Frees a block if it came from Slab_malloc.
+ * @param p the pointer to free
+ * @return 1 if p was a slab block, and has been freed, otherwise 0
+ */
+int Slab_release(void* p)
+{
+	slabChunk* chunk = NULL;
+	slabCache* cache = NULL;
+	slabBlock* block = (slabBlock*)p;
+	int c = 0;
+
+	if (chunk_count == 0 || (chunk = Slab_findChunk(p)) == NULL)
+		return 0;
+
+	c = chunk->class_index;
+	if ((cache = Slab_getCache()) == NULL)
+	{
+		Paho_thread_lock_mutex(slab_mutex);
+		block->next = depot[c].blocks;
+		depot[c].blocks = block;
+		++depot[c].count;
+		Paho_thread_unlock_mutex(slab_mutex);
+	}
+	else
+	{
+		block->next = cache->blocks[c];
+		cache->blocks[c] = block;
+		if (++cache->count[c] > SLAB_CACHE_MAX)
+		{
+			/* this thread frees more than it allocates, so pass some on */
+			Paho_thread_lock_mutex(slab_mutex);
+			Slab_drain(cache, c, SLAB_BATCH);
+			Paho_thread_unlock_mutex(slab_mutex);
+		}
+	}
+	return 1;
+}
+
+
+/**
+ * Frees any heap pointer, slab block or not.  Heap.h redefines free as this when
+ * heap tracking is off.
+ * @param p the pointer to free
+ */
+void Slab_free(void* p)
+{
+#if !defined(NO_HEAP_TRACKING)
+	myfree(__FILE__, __LINE__, p); /* which calls Slab_release */
+#else
+	if (!Slab_release(p))
+		free(p);
+#endif
+}
+
+
+/**
+ * Frees all the chunks and thread caches.  Any blocks still allocated are lost.
+ * Only to be called when every thread which has used the allocator has been joined, so
+ * the clients leave the chunks to be reused, and released at process exit.
+ */
+void Slab_terminate(void)
+{
+	if (slab_key_created)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		FlsFree(slab_key); /* calls Slab_releaseCache for the caches still set, so not under slab_mutex */
+#else
+		pthread_key_delete(slab_key);
+#endif
+		slab_key_created = 0;
+	}
+	Paho_thread_lock_mutex(slab_mutex);
+	while (slab_caches)
+	{
+		slabCache* cache = slab_caches;
+
+		slab_caches = cache->next_cache;
+		free(cache);
+	}
+	chunk_count = 0;
+	memset((void*)chunk_table, '\0', sizeof(chunk_table));
+	while (slab_chunks)
+	{
+		slabChunk* chunk = slab_chunks;
+
+		slab_chunks = chunk->next_chunk;
+#if defined(_WIN32) || defined(_WIN64)
+		_aligned_free(chunk);
+#else
+		free(chunk);
+#endif
+	}
+	memset(depot, '\0', sizeof(depot));
+	fallbacks = 0;
+	Paho_thread_unlock_mutex(slab_mutex);
+}
+
+#endif /* SLAB_ALLOCATOR */
+
+
+/**
+ * Gets the occupancy of each slab size class.
+ * @param info the structure to fill in
+ * @return 0 on success, -1 if the library was built without the slab allocator
+ */
+int Slab_get_info(slab_info* info)
+{
+#if defined(SLAB_ALLOCATOR)
+	slabCache* cache = NULL;
+	int c;
+
+	memset(info, '\0', sizeof(slab_info));
+	Paho_thread_lock_mutex(slab_mutex);
+	info->classes = SLAB_CLASSES;
+	for (c = 0; c < SLAB_CLASSES; ++c)
+	{
+		slab_class_info* ci = &info->class_info[c];
+
+		ci->block_size = class_sizes[c];
+		ci->chunks = depot[c].chunks;
+		ci->blocks = depot[c].chunks * ((SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER) / class_sizes[c]);
+		for (cache = slab_caches; cache; cache = cache->next_cache)
+			ci->cached += cache->count[c];
+		if (ci->blocks >= ci->cached + depot[c].count)
+			ci->in_use = ci->blocks - ci->cached - depot[c].count;
+	}
+	info->fallbacks = fallbacks;
+	Paho_thread_unlock_mutex(slab_mutex);
+	return 0;
+#else
+	memset(info, '\0', sizeof(slab_info));
+	return -1;
+#endif
+}
+
+
+#if defined(SLAB_TEST)
+#include <stdio.h>
+
+#define TEST_EXPECT(i,x) if (!(x)) {fprintf( stderr, "failed test: %s (for i == %d)\n", #x, i ); ++fails;}
+#define TEST_THREADS 4
+#define TEST_BLOCKS 5000
+
+static void* blocks[TEST_THREADS][TEST_BLOCKS];
+static int test_phase = 0;
+static sem_type test_done[TEST_THREADS]; /* Thread_post_sem doesn't count beyond 1 */
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define WINAPI
+#endif
+
+/* allocates blocks in phase 0, and frees another thread's in phase 1 */
+static thread_return_type WINAPI test_thread(void* arg)
+{
+	int t = (int)(intptr_t)arg;
+	int i;
+
+	for (i = 0; i < TEST_BLOCKS; ++i)
+	{
+		if (test_phase == 0)
+		{
+			size_t size = 1 + (size_t)((i * 7 + t) % SLAB_MAX_SIZE);
+
+			blocks[t][i] = Slab_malloc(size);
+			memset(blocks[t][i], t, size);
+		}
+		else
+			Slab_free(blocks[(t + 1) % TEST_THREADS][i]);
+	}
+	Thread_post_sem(test_done[t]);
+	return 0;
+}
+
+static void test_run_threads(int phase)
+{
+	int i;
+
+	test_phase = phase;
+	for (i = 0; i < TEST_THREADS; ++i)
+		Paho_thread_start(test_thread, (void*)(intptr_t)i);
+	for (i = 0; i < TEST_THREADS; ++i)
+		Thread_wait_sem(test_done[i], 10000);
+}
+
+int main(void)
+{
+	unsigned int fails = 0u;
+	slab_info info;
+	void* p[1000];
+	void* big = NULL;
+	int i, c, rc = 0;
+
+	/* every size fits its class, and blocks are distinct and reused */
+	for (i = 0; i < 1000; ++i)
+	{
+		p[i] = Slab_malloc(1 + (size_t)(i % SLAB_MAX_SIZE));
+		TEST_EXPECT(i, p[i] != NULL);
+		memset(p[i], 0xAB, 1 + (size_t)(i % SLAB_MAX_SIZE));
+	}
+	TEST_EXPECT(0, Slab_get_info(&info) == 0);
+	TEST_EXPECT(0, info.classes == SLAB_CLASSES);
+	{
+		size_t in_use = 0;
+
+		for (c = 0; c < info.classes; ++c)
+		{
+			in_use += info.class_info[c].in_use;
+			TEST_EXPECT(c, info.class_info[c].in_use + info.class_info[c].cached <= info.class_info[c].blocks);
+		}
+		TEST_EXPECT((int)in_use, in_use == 1000);
+	}
+	for (i = 0; i < 1000; ++i)
+		Slab_free(p[i]);
+	Slab_get_info(&info);
+	for (c = 0; c < info.classes; ++c)
+		TEST_EXPECT(c, info.class_info[c].in_use == 0);
+
+	/* sizes above the largest class, and pointers from malloc, pass through */
+	big = Slab_malloc(SLAB_MAX_SIZE + 1);
+	TEST_EXPECT(0, big != NULL && Slab_release(big) == 0);
+	Slab_free(big);
+	big = malloc(40);
+	TEST_EXPECT(0, Slab_release(big) == 0);
+	Slab_free(big);
+	Slab_free(NULL);
+
+	/* blocks allocated on one thread and freed on another, so that they go through the depot */
+	for (i = 0; i < TEST_THREADS; ++i)
+		test_done[i] = Thread_create_sem(&rc);
+	for (i = 0; i < 3; ++i)
+	{
+		test_run_threads(0);
+		Slab_get_info(&info);
+		TEST_EXPECT(i, info.class_info[SLAB_CLASSES - 1].in_use > 0);
+		test_run_threads(1);
+	}
+	for (i = 0; i < TEST_THREADS; ++i)
+		Thread_destroy_sem(test_done[i]);
+	Slab_get_info(&info);
+	for (c = 0; c < info.classes; ++c)
+	{
+		TEST_EXPECT(c, info.class_info[c].in_use == 0);
+		printf("class %d size %d chunks %d blocks %d cached %d\n", c, (int)info.class_info[c].block_size,
+			(int)info.class_info[c].chunks, (int)info.class_info[c].blocks, (int)info.class_info[c].cached);
+	}
+	TEST_EXPECT(0, info.fallbacks == 1);
+
+	Slab_terminate();
+	Slab_get_info(&info);
+	TEST_EXPECT(0, info.class_info[0].chunks == 0);
+	p[0] = Slab_malloc(24);
+	TEST_EXPECT(0, p[0] != NULL);
+	Slab_free(p[0]);
+	Slab_terminate();
+
+	printf("Slab test %s\n", (fails == 0) ? "passed" : "failed");
+	return (int)fails;
+}
+#endif /* SLAB_TEST */
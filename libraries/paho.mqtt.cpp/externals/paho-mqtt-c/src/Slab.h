@@ -0,0 +1,74 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - slab allocator for fixed size structures
+ *******************************************************************************/
+
+#if !defined(SLAB_H)
+#define SLAB_H
+
+#include "MQTTExportDeclarations.h"
+
+#include <stddef.h>
+
+/** the number of size classes, the largest of which is SLAB_MAX_SIZE bytes */
+#define SLAB_CLASSES 7
+#define SLAB_MAX_SIZE 256
+
+/**
+ * Occupancy of one slab size class.  The counts are a snapshot, taken without stopping
+ * the threads which are allocating.
+ */
+typedef struct
+{
+	size_t block_size;	/**< the size of the blocks in this class */
+	size_t chunks;		/**< the number of chunks the blocks have been carved from */
+	size_t blocks;		/**< the total number of blocks in the chunks */
+	size_t in_use;		/**< blocks currently allocated */
+	size_t cached;		/**< free blocks held in thread caches */
+} slab_class_info;
+
+/**
+ * Information about the state of the slab allocator.
+ */
+typedef struct
+{
+	int classes;		/**< the number of entries in class_info */
+	slab_class_info class_info[SLAB_CLASSES];
+	size_t fallbacks;	/**< allocations which were passed on to malloc */
+} slab_info;
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if defined(SLAB_ALLOCATOR)
+void* Slab_malloc(size_t size);
+int Slab_release(void* p);
+void Slab_free(void* p);
+void Slab_terminate(void);
+#else
+/**
+ * Without the slab allocator, the structures which would use it are allocated as any other.
+ * @param x the size of the item to be allocated
+ */
+#define Slab_malloc(x) malloc(x)
+#endif
+
+LIBMQTT_API int Slab_get_info(slab_info* info);
+
+#ifdef __cplusplus
+     }
+#endif
+
+#endif /* SLAB_H */
@@ -33,6 +33,7 @@
 #include "SocketBuffer.h"
 #include "Messages.h"
 #include "StackTrace.h"
+#include "Thread.h"
 #if defined(OPENSSL)
 #include "SSLSocket.h"
 #endif
@@ -70,15 +71,20 @@ int Socket_abortWrite(SOCKET socket);
 #define snprintf _snprintf
 #endif
 
+extern mutex_type socket_mutex;
+
 /**
- * Structure to hold all socket data for this module
+ * Structure to hold all socket data for this module, used by the threads which have not
+ * chosen another set
  */
-Sockets mod_s;
-#if defined(USE_SELECT)
-static fd_set wset;
-#endif
+static Sockets default_sockets;
+static THREAD_LOCAL Sockets* current_sockets = NULL; /**< the set chosen by this thread, or NULL */
+static THREAD_LOCAL mutex_type current_mutex = NULL; /**< the mutex which protects current_sockets */
 
-extern mutex_type socket_mutex;
+/** the socket data used by this thread */
+#define mod_s (*((current_sockets) ? current_sockets : &default_sockets))
+/** the mutex protecting mod_s, socket_mutex for the default set */
+#define sockets_mutex ((current_mutex) ? current_mutex : socket_mutex)
 
 /**
  * Set a socket non-blocking, OS independently
@@ -165,6 +171,7 @@ void Socket_outInitialize(void)
 	SocketBuffer_initialize();
 	mod_s.connect_pending = ListInitialize();
 	mod_s.write_pending = ListInitialize();
+	mod_s.read_pending = ListInitialize();
 	
 #if defined(USE_SELECT)
 	mod_s.clientsds = ListInitialize();
@@ -195,6 +202,8 @@ void Socket_outTerminate(void)
 	FUNC_ENTRY;
 	ListFree(mod_s.connect_pending);
 	ListFree(mod_s.write_pending);
+	ListFree(mod_s.read_pending);
+	ListEmpty(&(mod_s.ssl_pending_reads));
 #if defined(USE_SELECT)
 	ListFree(mod_s.clientsds);
 #else
@@ -215,6 +224,30 @@ void Socket_outTerminate(void)
 }
 
 
+/**
+ * Choose the socket set used by the calling thread from now on, so that groups of sockets
+ * can be served by different threads.  The set must have been initialized by
+ * Socket_outInitialize, called while it was current.
+ * @param sockets the socket set, or NULL for the default set
+ * @param mutex the mutex which protects the set, or NULL for socket_mutex
+ */
+void Socket_setCurrent(Sockets* sockets, mutex_type mutex)
+{
+	current_sockets = sockets;
+	current_mutex = mutex;
+}
+
+
+/**
+ * Get the socket set used by the calling thread
+ * @return the socket set
+ */
+Sockets* Socket_getCurrent(void)
+{
+	return &mod_s;
+}
+
+
 #if defined(USE_SELECT)
 /**
  * Add a socket to the list of socket to check with select
@@ -290,7 +323,7 @@ int Socket_addSocket(SOCKET newSd)
 	int rc = 0;
 
 	FUNC_ENTRY;
-	Paho_thread_lock_mutex(socket_mutex);
+	Paho_thread_lock_mutex(sockets_mutex);
 	mod_s.nfds++;
 	if (mod_s.fds_read)
 	{
@@ -352,7 +385,7 @@ int Socket_addSocket(SOCKET newSd)
 		Log(LOG_ERROR, -1, "addSocket: setnonblocking");
 
 exit:
-	Paho_thread_unlock_mutex(socket_mutex);
+	Paho_thread_unlock_mutex(sockets_mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -437,7 +470,7 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int*
 
 	while (mod_s.cur_clientsds != NULL)
 	{
-		if (isReady(*((int*)(mod_s.cur_clientsds->content)), &(mod_s.rset), &wset))
+		if (isReady(*((int*)(mod_s.cur_clientsds->content)), &(mod_s.rset), &(mod_s.wset)))
 			break;
 		ListNextElement(mod_s.clientsds, &mod_s.cur_clientsds);
 	}
@@ -481,8 +514,8 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int*
 			goto exit;
 		}
 
-		memcpy((void*)&wset, (void*)&(mod_s.rset_saved), sizeof(wset));
-		if ((rc1 = select(mod_s.maxfdp1, NULL, &(wset), NULL, &zero)) == SOCKET_ERROR)
+		memcpy((void*)&(mod_s.wset), (void*)&(mod_s.rset_saved), sizeof(mod_s.wset));
+		if ((rc1 = select(mod_s.maxfdp1, NULL, &(mod_s.wset), NULL, &zero)) == SOCKET_ERROR)
 		{
 			Socket_error("write select", 0);
 			*rc = rc1;
@@ -500,7 +533,7 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int*
 		while (mod_s.cur_clientsds != NULL)
 		{
 			int cursock = *((int*)(mod_s.cur_clientsds->content));
-			if (isReady(cursock, &(mod_s.rset), &wset))
+			if (isReady(cursock, &(mod_s.rset), &(mod_s.wset)))
 				break;
 			ListNextElement(mod_s.clientsds, &mod_s.cur_clientsds);
 		}
@@ -758,6 +791,104 @@ exit:
 }
 
 
+/**
+ *  Makes room in a receive buffer for the next read.  Any unconsumed data is moved to the
+ *  front of the buffer, and the buffer is grown if it can't hold min_len bytes, so that the
+ *  packet being read ends up contiguous.
+ *  @param rb the receive buffer
+ *  @param min_len the number of unconsumed bytes the buffer must be able to hold
+ *  @return TCPSOCKET_COMPLETE, or PAHO_MEMORY_ERROR if the buffer could not be grown
+ */
+int Socket_reserveReadBuffer(Socket_readBuffer* rb, size_t min_len)
+{
+	size_t size = max(min_len, SOCKET_READ_CHUNK);
+	int rc = TCPSOCKET_COMPLETE;
+
+	FUNC_ENTRY;
+	if (rb->start == rb->end)
+	{
+		rb->start = rb->end = 0;
+		if (rb->buflen > SOCKET_READ_CHUNK && size == SOCKET_READ_CHUNK)
+		{	/* give back the space taken by a large packet once it has been consumed */
+			free(rb->buf);
+			rb->buf = NULL;
+			rb->buflen = 0;
+		}
+	}
+	else if (rb->start > 0)
+	{
+		memmove(rb->buf, &rb->buf[rb->start], rb->end - rb->start);
+		rb->end -= rb->start;
+		rb->start = 0;
+	}
+
+	if (rb->buflen < size)
+	{
+		/* the heap tracking realloc doesn't take NULL */
+		char* newbuf = (rb->buf == NULL) ? malloc(size) : realloc(rb->buf, size);
+
+		if (newbuf == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			rb->buf = newbuf;
+			rb->buflen = size;
+		}
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ *  Reads as much data as is available from a socket, non-blocking, into a receive buffer.
+ *  @param socket the socket to read from
+ *  @param rb the receive buffer
+ *  @param min_len the number of unconsumed bytes the buffer must be able to hold
+ *  @return TCPSOCKET_COMPLETE if data was read, TCPSOCKET_INTERRUPTED if there was none
+ *  available, otherwise SOCKET_ERROR
+ */
+int Socket_readBuffered(SOCKET socket, Socket_readBuffer* rb, size_t min_len)
+{
+	int rc = SOCKET_ERROR;
+
+	FUNC_ENTRY;
+	if (Socket_reserveReadBuffer(rb, min_len) != TCPSOCKET_COMPLETE)
+		goto exit;
+
+	if ((rc = recv(socket, &rb->buf[rb->end], (int)(rb->buflen - rb->end), 0)) == SOCKET_ERROR)
+	{
+		int err = Socket_error("recv - readBuffered", socket);
+		if (err == EWOULDBLOCK || err == EAGAIN)
+			rc = TCPSOCKET_INTERRUPTED;
+	}
+	else if (rc == 0)
+		rc = SOCKET_ERROR; /* the other end closed the socket */
+	else
+	{
+		rb->end += rc;
+		rc = TCPSOCKET_COMPLETE;
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ *  Free the storage held by a receive buffer, discarding any unconsumed data.
+ *  @param rb the receive buffer
+ */
+void Socket_freeReadBuffer(Socket_readBuffer* rb)
+{
+	FUNC_ENTRY;
+	if (rb->buf)
+		free(rb->buf);
+	memset(rb, '\0', sizeof(Socket_readBuffer));
+	FUNC_EXIT;
+}
+
+
 /**
  *  Indicate whether any data is pending outbound for a socket.
  *  @return boolean - true == no pending data.
@@ -918,6 +1049,104 @@ exit:
 }
 
 
+/**
+ *  Adds a packet to a connection's output buffer rather than writing it to the socket.
+ *  The data is copied, so the caller's buffers can be freed as if the packet had been written.
+ *  @param wb the output buffer
+ *  @param buf0 the first buffer
+ *  @param buf0len the length of data in the first buffer
+ *  @param bufs the rest of the packet
+ *  @return TCPSOCKET_COMPLETE, or PAHO_MEMORY_ERROR
+ */
+int Socket_bufferdatas(Socket_writeBuffer* wb, char* buf0, size_t buf0len, PacketBuffers bufs)
+{
+	size_t total = buf0len;
+	int rc = TCPSOCKET_COMPLETE, i;
+
+	FUNC_ENTRY;
+	for (i = 0; i < bufs.count; i++)
+		total += bufs.buflens[i];
+
+	if (wb->len + total > wb->buflen)
+	{
+		size_t size = max(wb->len + total, wb->limit);
+		char* newbuf = (wb->buf == NULL) ? malloc(size) : realloc(wb->buf, size);
+
+		if (newbuf == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		wb->buf = newbuf;
+		wb->buflen = size;
+	}
+	if (wb->len == 0)
+		wb->first = MQTTTime_now();
+
+	memcpy(&wb->buf[wb->len], buf0, buf0len);
+	wb->len += buf0len;
+	for (i = 0; i < bufs.count; i++)
+	{
+		memcpy(&wb->buf[wb->len], bufs.buffers[i], bufs.buflens[i]);
+		wb->len += bufs.buflens[i];
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ *  Writes out the data gathered in a connection's output buffer.  If the write is not
+ *  complete, the socket buffer takes over the rest of the data, and the output buffer's
+ *  storage with it.  If an earlier write is still pending, the data is kept for later.
+ *  @param socket the socket to write to
+ *  @param wb the output buffer
+ *  @return completion code, TCPSOCKET_INTERRUPTED if the write is still pending
+ */
+int Socket_flushBuffered(SOCKET socket, Socket_writeBuffer* wb)
+{
+	PacketBuffers none = {0, NULL, NULL, NULL};
+	int rc = TCPSOCKET_COMPLETE;
+
+	FUNC_ENTRY;
+	if (wb->len == 0)
+		goto exit;
+	if (!Socket_noPendingWrites(socket))
+	{
+		rc = TCPSOCKET_INTERRUPTED; /* keep the data until the earlier write has finished */
+		goto exit;
+	}
+
+	rc = Socket_putdatas(socket, wb->buf, wb->len, none);
+	if (rc == TCPSOCKET_INTERRUPTED)
+	{
+		wb->buf = NULL; /* now owned by the pending write */
+		wb->buflen = 0;
+	}
+	wb->len = 0;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ *  Free the storage held by an output buffer, discarding any data not yet written.
+ *  The buffer's settings are kept.
+ *  @param wb the output buffer
+ */
+void Socket_freeWriteBuffer(Socket_writeBuffer* wb)
+{
+	FUNC_ENTRY;
+	if (wb->buf)
+		free(wb->buf);
+	wb->buf = NULL;
+	wb->buflen = wb->len = 0;
+	FUNC_EXIT;
+}
+
+
 /**
  *  Add a socket to the pending write list, so that it is checked for writing in select.  This is used
  *  in connect processing when the TCP connect is incomplete, as we need to check the socket for both
@@ -945,6 +1174,68 @@ void Socket_clearPendingWrite(SOCKET socket)
 }
 
 
+/**
+ *  Add a socket to the list of those with a complete packet in their receive buffer,
+ *  which the socket may not be signalled as ready for.
+ *  @param socket the socket to add
+ */
+void Socket_addPendingRead(SOCKET socket)
+{
+	FUNC_ENTRY;
+	if (ListFindItem(mod_s.read_pending, &socket, intcompare) == NULL) /* make sure we don't add the same socket twice */
+	{
+		SOCKET* psock = (SOCKET*)malloc(sizeof(SOCKET));
+		if (psock)
+		{
+			*psock = socket;
+			ListAppend(mod_s.read_pending, psock, sizeof(socket));
+		}
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ *  Take the next socket from the list of those with a complete packet in their receive buffer.
+ *  @return the socket, or -1 if there are none
+ */
+SOCKET Socket_getPendingRead(void)
+{
+	SOCKET sock = -1;
+
+	if (mod_s.read_pending && mod_s.read_pending->count > 0)
+	{
+		sock = *(SOCKET*)(mod_s.read_pending->first->content);
+		ListRemoveHead(mod_s.read_pending);
+	}
+	return sock;
+}
+
+
+/**
+ *  Indicate whether any socket has a complete packet in its receive buffer.
+ *  @return boolean - true == there is a packet to be read without waiting.
+ */
+int Socket_hasPendingRead(void)
+{
+	return mod_s.read_pending && mod_s.read_pending->count > 0;
+}
+
+
+/**
+ *  Indicate whether a socket has to become writable for a connect or a write to continue.
+ *  @param socket the socket
+ *  @return boolean - true == the socket should be waited on for writing.
+ */
+int Socket_wantsWrite(SOCKET socket)
+{
+	SOCKET cursock = socket;
+
+	return (mod_s.connect_pending && ListFindItem(mod_s.connect_pending, &cursock, intcompare) != NULL) ||
+		(mod_s.write_pending && ListFindItem(mod_s.write_pending, &cursock, intcompare) != NULL);
+}
+
+
 /**
  *  Close a socket without removing it from the select list.
  *  @param socket the socket to close
@@ -993,6 +1284,7 @@ int Socket_close(SOCKET socket)
 	SocketBuffer_cleanup(socket);
 	ListRemoveItem(mod_s.connect_pending, &socket, intcompare);
 	ListRemoveItem(mod_s.write_pending, &socket, intcompare);
+	ListRemoveItem(mod_s.read_pending, &socket, intcompare);
 
 	if (ListRemoveItem(mod_s.clientsds, &socket, intcompare))
 		Log(TRACE_MIN, -1, "Removed socket %d", socket);
@@ -1029,7 +1321,7 @@ int Socket_close(SOCKET socket)
 	int rc = 0;
 
 	FUNC_ENTRY;
-	Paho_thread_lock_mutex(socket_mutex);
+	Paho_thread_lock_mutex(sockets_mutex);
 	Socket_close_only(socket);
 	Socket_abortWrite(socket);
 	SocketBuffer_cleanup(socket);
@@ -1111,7 +1403,7 @@ int Socket_close(SOCKET socket)
 	else
 		Log(LOG_ERROR, -1, "Failed to remove socket %d", socket);
 exit:
-	Paho_thread_unlock_mutex(socket_mutex);
+	Paho_thread_unlock_mutex(sockets_mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1288,9 +1580,9 @@ int Socket_new(const char* addr, size_t addr_len, int port, SOCKET* sock)
 						goto exit;
 					}
 					*pnewSd = *sock;
-					Paho_thread_lock_mutex(socket_mutex);
+					Paho_thread_lock_mutex(sockets_mutex);
 					listResult = ListAppend(mod_s.connect_pending, pnewSd, sizeof(SOCKET));
-					Paho_thread_unlock_mutex(socket_mutex);
+					Paho_thread_unlock_mutex(sockets_mutex);
 					if (!listResult)
 					{
 						free(pnewSd);
@@ -71,6 +71,7 @@
 #endif
 
 #include "mutex_type.h" /* Needed for mutex_type */
+#include "MQTTTime.h"
 
 /** socket operation completed successfully */
 #define TCPSOCKET_COMPLETE 0
@@ -102,10 +103,42 @@ typedef struct
 	char** buffers;    /**> array of byte buffers */
 	size_t* buflens;   /**> array of lengths of buffers */
 	int* frees;        /**> array of flags indicating whether each buffer needs to be freed */
-	uint8_t mask[4];   /**> websocket mask used to mask the buffer data, if any */
 } PacketBuffers;
 
 
+/** the amount of data asked for by each recv into a receive buffer */
+#define SOCKET_READ_CHUNK 65536
+
+/**
+ * Receive buffer for a connection.  Data is read in large chunks, and the MQTT packets
+ * it contains are parsed in place.  Unconsumed data is moved to the front of the buffer
+ * before each read, so a packet is always contiguous and pointers into it remain valid
+ * until the next read.
+ */
+typedef struct
+{
+	char* buf;
+	size_t buflen;     /**> allocated size of buf */
+	size_t start;      /**> offset of the first unconsumed byte */
+	size_t end;        /**> offset after the last byte read */
+} Socket_readBuffer;
+
+
+/**
+ * Output buffer for a connection, in which consecutive packets are gathered so that
+ * they can be written with one system call.
+ */
+typedef struct
+{
+	char* buf;
+	size_t buflen;     /**> allocated size of buf */
+	size_t len;        /**> length of the data waiting to be written */
+	size_t limit;      /**> write once this much data is waiting, 0 means packets are not gathered */
+	long delay_us;     /**> write once the oldest data has waited this long, 0 means no deadline */
+	START_TIME_TYPE first; /**> when the oldest waiting data was added */
+} Socket_writeBuffer;
+
+
 /**
  * Structure to hold all socket data for the module
  */
@@ -113,6 +146,8 @@ typedef struct
 {
 	List* connect_pending; /**< list of sockets for which a connect is pending */
 	List* write_pending; /**< list of sockets for which a write is pending */
+	List* read_pending; /**< list of sockets with a complete packet already in their receive buffer */
+	List ssl_pending_reads; /**< list of sockets with data buffered in their SSL object */
 
 #if defined(USE_SELECT)
 	fd_set rset, /**< socket read set (see select doc) */
@@ -121,6 +156,7 @@ typedef struct
 	List* clientsds; /**< list of client socket descriptors */
 	ListElement* cur_clientsds; /**< current client socket descriptor (iterator) */
 	fd_set pending_wset; /**< socket pending write set for select */
+	fd_set wset; /**< sockets ready for writing, as found by the last select */
 #else
 	unsigned int nfds;         /**< no of file descriptors for poll */
 	struct pollfd* fds_read;        /**< poll read file descriptors */
@@ -138,10 +174,18 @@ typedef struct
 
 void Socket_outInitialize(void);
 void Socket_outTerminate(void);
+void Socket_setCurrent(Sockets* sockets, mutex_type mutex);
+Sockets* Socket_getCurrent(void);
 SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int* rc);
 int Socket_getch(SOCKET socket, char* c);
 char *Socket_getdata(SOCKET socket, size_t bytes, size_t* actual_len, int* rc);
+int Socket_reserveReadBuffer(Socket_readBuffer* rb, size_t min_len);
+int Socket_readBuffered(SOCKET socket, Socket_readBuffer* rb, size_t min_len);
+void Socket_freeReadBuffer(Socket_readBuffer* rb);
 int Socket_putdatas(SOCKET socket, char* buf0, size_t buf0len, PacketBuffers bufs);
+int Socket_bufferdatas(Socket_writeBuffer* wb, char* buf0, size_t buf0len, PacketBuffers bufs);
+int Socket_flushBuffered(SOCKET socket, Socket_writeBuffer* wb);
+void Socket_freeWriteBuffer(Socket_writeBuffer* wb);
 int Socket_close(SOCKET socket);
 #if defined(__GNUC__) && defined(__linux__)
 /* able to use GNU's getaddrinfo_a to make timeouts possible */
@@ -156,6 +200,10 @@ char* Socket_getpeer(SOCKET sock);
 
 void Socket_addPendingWrite(SOCKET socket);
 void Socket_clearPendingWrite(SOCKET socket);
+void Socket_addPendingRead(SOCKET socket);
+SOCKET Socket_getPendingRead(void);
+int Socket_hasPendingRead(void);
+int Socket_wantsWrite(SOCKET socket);
 
 typedef void Socket_writeContinue(SOCKET socket);
 void Socket_setWriteContinueCallback(Socket_writeContinue*);
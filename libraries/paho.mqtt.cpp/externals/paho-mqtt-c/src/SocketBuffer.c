@@ -27,6 +27,7 @@
 #include "Log.h"
 #include "Messages.h"
 #include "StackTrace.h"
+#include "Thread.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -39,20 +40,32 @@
 #define iov_base buf
 #endif
 
+/**
+ * The buffers used by the threads which have not chosen another set
+ */
+static SocketBuffers default_buffers;
+
+/**
+ * The buffers chosen by this thread, or NULL
+ */
+static THREAD_LOCAL SocketBuffers* current_buffers = NULL;
+
+#define buffers_in_use ((current_buffers) ? current_buffers : &default_buffers)
+
 /**
  * Default input queue buffer
  */
-static socket_queue* def_queue;
+#define def_queue (buffers_in_use->def_queue)
 
 /**
  * List of queued input buffers
  */
-static List* queues;
+#define queues (buffers_in_use->queues)
 
 /**
  * List of queued write buffers
  */
-static List writes;
+#define writes (buffers_in_use->writes)
 
 
 int socketcompare(void* a, void* b);
@@ -144,6 +157,17 @@ void SocketBuffer_terminate(void)
 }
 
 
+/**
+ * Choose the buffers used by the calling thread from now on, which go with the socket set
+ * it has chosen.  See Socket_setCurrent.
+ * @param buffers the buffers, or NULL for the default ones
+ */
+void SocketBuffer_setCurrent(SocketBuffers* buffers)
+{
+	current_buffers = buffers;
+}
+
+
 /**
  * Cleanup any buffers for a specific socket
  * @param socket the socket to clean up
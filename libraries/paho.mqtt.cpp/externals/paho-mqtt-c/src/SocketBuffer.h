@@ -54,6 +54,16 @@ typedef struct
 	int frees[5];
 } pending_writes;
 
+/**
+ * The partial reads and the pending writes of a set of sockets
+ */
+typedef struct
+{
+	socket_queue* def_queue; /**< queue for the socket being read, when it has no queue of its own */
+	List* queues; /**< queues of the sockets whose reads were interrupted */
+	List writes; /**< pending writes */
+} SocketBuffers;
+
 #define SOCKETBUFFER_COMPLETE 0
 #if !defined(SOCKET_ERROR)
 	#define SOCKET_ERROR -1
@@ -62,6 +72,7 @@ typedef struct
 
 int SocketBuffer_initialize(void);
 void SocketBuffer_terminate(void);
+void SocketBuffer_setCurrent(SocketBuffers* buffers);
 void SocketBuffer_cleanup(SOCKET socket);
 char* SocketBuffer_getQueuedData(SOCKET socket, size_t bytes, size_t* actual_len);
 int SocketBuffer_getQueuedChar(SOCKET socket, char* c);
@@ -68,6 +68,13 @@
 	int Thread_destroy_cond(cond_type);
 #endif
 
+/** storage class for a variable of which each thread has its own copy */
+#if defined(_WIN32) || defined(_WIN64)
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 LIBMQTT_API void Paho_thread_start(thread_fn, void*);
 int Thread_set_name(const char* thread_name);
 
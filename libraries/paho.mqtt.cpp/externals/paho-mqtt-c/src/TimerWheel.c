@@ -0,0 +1,426 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - hierarchical timing wheel for client deadlines
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Hierarchical timing wheel
+ *
+ * An entry is held at the lowest level at which its deadline and the wheel's
+ * current tick agree in all the higher order slot bits.  When the current tick
+ * reaches the start of a higher level slot, the entries in that slot are moved
+ * down to the level below.  Level 0 slots are exactly one tick wide, so every
+ * entry found there has expired.
+ */
+
+#include "TimerWheel.h"
+
+#include <string.h>
+
+#define SLOT_SHIFT(level) (TIMERWHEEL_SLOT_BITS * (level))
+
+
+static void TimerWheel_link(TimerWheel_entry** head, TimerWheel_entry* entry)
+{
+	entry->prev = NULL;
+	entry->next = *head;
+	if (*head)
+		(*head)->prev = entry;
+	*head = entry;
+}
+
+
+static void TimerWheel_insert(TimerWheel* wheel, TimerWheel_entry* entry)
+{
+	uint64_t deadline = entry->deadline;
+	uint64_t diff;
+	int level;
+
+	if (deadline < wheel->current)
+		deadline = wheel->current;  /* already due - fire on the next tick processed */
+	diff = deadline ^ wheel->current;
+	for (level = 0; level < TIMERWHEEL_LEVELS; ++level)
+	{
+		if ((diff >> SLOT_SHIFT(level + 1)) == 0)
+			break;
+	}
+	entry->level = level;
+	if (level == TIMERWHEEL_LEVELS)
+	{
+		entry->slot = 0;
+		TimerWheel_link(&wheel->overflow, entry);
+	}
+	else
+	{
+		entry->slot = (int)((deadline >> SLOT_SHIFT(level)) & TIMERWHEEL_SLOT_MASK);
+		TimerWheel_link(&wheel->slots[level][entry->slot], entry);
+		wheel->occupied[level] |= ((uint64_t)1 << entry->slot);
+	}
+}
+
+
+static void TimerWheel_unlink(TimerWheel* wheel, TimerWheel_entry* entry)
+{
+	TimerWheel_entry** head = (entry->level == TIMERWHEEL_LEVELS) ?
+			&wheel->overflow : &wheel->slots[entry->level][entry->slot];
+
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		*head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	if (*head == NULL && entry->level < TIMERWHEEL_LEVELS)
+		wheel->occupied[entry->level] &= ~((uint64_t)1 << entry->slot);
+	entry->next = entry->prev = NULL;
+}
+
+
+/**
+ * Move all the entries in a list back into the wheel relative to the current tick
+ * @param wheel the timer wheel
+ * @param list the detached list of entries to reinsert
+ */
+static void TimerWheel_reinsert(TimerWheel* wheel, TimerWheel_entry* list)
+{
+	while (list)
+	{
+		TimerWheel_entry* next = list->next;
+
+		TimerWheel_insert(wheel, list);
+		list = next;
+	}
+}
+
+
+/**
+ * Cascade the higher level slots which start at the current tick.  The highest
+ * level goes first so that entries can drop through more than one level.
+ */
+static void TimerWheel_cascade(TimerWheel* wheel)
+{
+	uint64_t tick = wheel->current;
+	int level = 1;
+	TimerWheel_entry* list = NULL;
+
+	while (level < TIMERWHEEL_LEVELS && (tick & (((uint64_t)1 << SLOT_SHIFT(level)) - 1)) == 0)
+		++level;
+	/* level is now one more than the highest level whose slot boundary has been reached */
+	if (level == TIMERWHEEL_LEVELS && (tick & (((uint64_t)1 << SLOT_SHIFT(TIMERWHEEL_LEVELS)) - 1)) == 0)
+	{
+		list = wheel->overflow;
+		wheel->overflow = NULL;
+		TimerWheel_reinsert(wheel, list);
+	}
+	while (--level > 0)
+	{
+		int slot = (int)((tick >> SLOT_SHIFT(level)) & TIMERWHEEL_SLOT_MASK);
+
+		list = wheel->slots[level][slot];
+		wheel->slots[level][slot] = NULL;
+		wheel->occupied[level] &= ~((uint64_t)1 << slot);
+		TimerWheel_reinsert(wheel, list);
+	}
+}
+
+
+/**
+ * Find the next tick at which the wheel has work to do, either firing level 0
+ * entries or cascading a higher level slot.  The current tick must have no work.
+ */
+static uint64_t TimerWheel_nextEvent(TimerWheel* wheel)
+{
+	int level;
+
+	for (level = 0; level < TIMERWHEEL_LEVELS; ++level)
+	{
+		if (wheel->occupied[level])
+		{
+			uint64_t slot = 0;
+
+			while ((wheel->occupied[level] & ((uint64_t)1 << slot)) == 0)
+				++slot;
+			return (wheel->current & ~(((uint64_t)1 << SLOT_SHIFT(level + 1)) - 1)) | (slot << SLOT_SHIFT(level));
+		}
+	}
+	if (wheel->overflow)
+		return ((wheel->current >> SLOT_SHIFT(TIMERWHEEL_LEVELS)) + 1) << SLOT_SHIFT(TIMERWHEEL_LEVELS);
+	return UINT64_MAX;
+}
+
+
+/**
+ * Initialize a timer wheel.  The wheel's clock starts at 0 now.
+ * @param wheel the timer wheel to initialize
+ */
+void TimerWheel_initialize(TimerWheel* wheel)
+{
+	memset(wheel, '\0', sizeof(TimerWheel));
+	wheel->start = MQTTTime_start_clock();
+}
+
+
+/**
+ * Initialize a timer entry before its first use
+ * @param entry the entry
+ * @param callback the function to call when the deadline is reached
+ * @param context the value passed to the callback
+ */
+void TimerWheel_initEntry(TimerWheel_entry* entry, TimerWheel_callback* callback, void* context)
+{
+	memset(entry, '\0', sizeof(TimerWheel_entry));
+	entry->callback = callback;
+	entry->context = context;
+}
+
+
+/**
+ * The current time on the wheel's clock
+ * @param wheel the timer wheel
+ * @return the number of milliseconds since the wheel was initialized
+ */
+uint64_t TimerWheel_now(TimerWheel* wheel)
+{
+	return MQTTTime_elapsed(wheel->start);
+}
+
+
+/**
+ * Set or move the deadline of an entry
+ * @param wheel the timer wheel
+ * @param entry the entry, which may already be armed
+ * @param deadline the time on the wheel's clock at which the entry should fire
+ */
+void TimerWheel_schedule(TimerWheel* wheel, TimerWheel_entry* entry, uint64_t deadline)
+{
+	if (entry->armed)
+		TimerWheel_unlink(wheel, entry);
+	else
+	{
+		entry->armed = 1;
+		++wheel->count;
+	}
+	entry->deadline = deadline;
+	TimerWheel_insert(wheel, entry);
+}
+
+
+/**
+ * Remove an entry from the wheel, if it is armed
+ * @param wheel the timer wheel
+ * @param entry the entry
+ */
+void TimerWheel_cancel(TimerWheel* wheel, TimerWheel_entry* entry)
+{
+	if (entry->armed)
+	{
+		TimerWheel_unlink(wheel, entry);
+		entry->armed = 0;
+		--wheel->count;
+	}
+}
+
+
+/**
+ * Advance the wheel, calling the callbacks of all the entries whose deadline has
+ * been reached.  An entry is disarmed before its callback is called, so the callback
+ * can schedule it again.
+ * @param wheel the timer wheel
+ * @param now the current time on the wheel's clock
+ * @return the number of callbacks called
+ */
+int TimerWheel_expire(TimerWheel* wheel, uint64_t now)
+{
+	int fired = 0;
+
+	while (wheel->current <= now && wheel->count > 0)
+	{
+		int slot = (int)(wheel->current & TIMERWHEEL_SLOT_MASK);
+		uint64_t next = 0;
+
+		if (slot == 0)
+			TimerWheel_cascade(wheel);
+		if (wheel->occupied[0] & ((uint64_t)1 << slot))
+		{
+			uint64_t tick = wheel->current++; /* anything rescheduled from a callback goes into a later slot */
+			TimerWheel_entry* entry = NULL;
+
+			/* take the entries off the live list one at a time, as a callback may cancel
+			 * other entries in the same slot */
+			do
+			{
+				entry = wheel->slots[0][slot];
+				while (entry && entry->deadline > tick)
+					entry = entry->next;  /* rescheduled into this slot for the next time round */
+				if (entry)
+				{
+					TimerWheel_unlink(wheel, entry);
+					entry->armed = 0;
+					--wheel->count;
+					++fired;
+					(*(entry->callback))(entry->context);
+				}
+			} while (entry);
+			continue;
+		}
+		next = TimerWheel_nextEvent(wheel);
+		wheel->current = (next > now + 1) ? now + 1 : next;
+	}
+	if (wheel->current <= now)
+		wheel->current = now + 1;  /* nothing armed, so no cascade can be missed */
+	return fired;
+}
+
+
+/**
+ * Find the earliest deadline of the armed entries
+ * @param wheel the timer wheel
+ * @param deadline set to the earliest deadline
+ * @return 1 if there is an armed entry, 0 if not
+ */
+int TimerWheel_nextDeadline(TimerWheel* wheel, uint64_t* deadline)
+{
+	TimerWheel_entry* list = NULL;
+	int level;
+
+	if (wheel->count == 0)
+		return 0;
+	/* every entry at a level is earlier than every entry at the levels above it */
+	for (level = 0; level < TIMERWHEEL_LEVELS; ++level)
+	{
+		if (wheel->occupied[level])
+		{
+			int slot = 0;
+
+			while ((wheel->occupied[level] & ((uint64_t)1 << slot)) == 0)
+				++slot;
+			list = wheel->slots[level][slot];
+			break;
+		}
+	}
+	if (list == NULL)
+		list = wheel->overflow;
+	*deadline = UINT64_MAX;
+	for (; list; list = list->next)
+	{
+		if (list->deadline < *deadline)
+			*deadline = list->deadline;
+	}
+	return 1;
+}
+
+
+#if defined(TIMERWHEEL_TEST)
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_EXPECT(i,x) if (!(x)) {fprintf( stderr, "failed test: %s (for i == %d)\n", #x, i ); ++fails;}
+
+#define ENTRIES 2000
+
+static uint64_t fired_at[ENTRIES];
+static uint64_t clock_now = 0;
+
+static TimerWheel_entry entries[ENTRIES];
+static uint64_t deadlines[ENTRIES];
+
+static void fire(void* context)
+{
+	int i = (int)(intptr_t)context;
+
+	fired_at[i] = clock_now;
+}
+
+int main(void)
+{
+	TimerWheel wheel;
+	unsigned int fails = 0u;
+	uint64_t next = 0;
+	int i;
+
+	srand(1);
+	TimerWheel_initialize(&wheel);
+	for (i = 0; i < ENTRIES; ++i)
+	{
+		TimerWheel_initEntry(&entries[i], fire, (void*)(intptr_t)i);
+		switch (i % 4)
+		{
+		case 0: deadlines[i] = (uint64_t)(rand() % 64); break;
+		case 1: deadlines[i] = (uint64_t)(rand() % 5000); break;
+		case 2: deadlines[i] = (uint64_t)(rand() % 300000); break;
+		default: deadlines[i] = (uint64_t)rand() * 4096; break; /* large, some in the overflow list */
+		}
+		fired_at[i] = UINT64_MAX;
+		TimerWheel_schedule(&wheel, &entries[i], deadlines[i]);
+	}
+	/* cancel every tenth entry, reschedule every seventh */
+	for (i = 0; i < ENTRIES; i += 10)
+		TimerWheel_cancel(&wheel, &entries[i]);
+	for (i = 3; i < ENTRIES; i += 7)
+	{
+		if (entries[i].armed)
+		{
+			deadlines[i] = deadlines[i] / 2 + 1;
+			TimerWheel_schedule(&wheel, &entries[i], deadlines[i]);
+		}
+	}
+
+	/* step through time in jumps, as a thread sleeping until the next deadline would */
+	while (TimerWheel_nextDeadline(&wheel, &next))
+	{
+		uint64_t check = 0;
+
+		TEST_EXPECT(0, next >= clock_now);
+		clock_now = next;
+		TimerWheel_expire(&wheel, clock_now);
+		TEST_EXPECT(0, !TimerWheel_nextDeadline(&wheel, &check) || check > clock_now);
+	}
+	for (i = 0; i < ENTRIES; ++i)
+	{
+		if (i % 10 == 0)
+		{
+			TEST_EXPECT(i, fired_at[i] == UINT64_MAX);
+		}
+		else
+		{
+			TEST_EXPECT(i, fired_at[i] == deadlines[i]);
+		}
+	}
+	TEST_EXPECT(0, wheel.count == 0);
+
+	/* step through time in fixed increments, firing late by less than one step */
+	for (i = 0; i < ENTRIES; ++i)
+	{
+		deadlines[i] = clock_now + (uint64_t)(rand() % 100000);
+		fired_at[i] = UINT64_MAX;
+		TimerWheel_schedule(&wheel, &entries[i], deadlines[i]);
+	}
+	while (wheel.count > 0)
+	{
+		clock_now += 7;
+		TimerWheel_expire(&wheel, clock_now);
+	}
+	for (i = 0; i < ENTRIES; ++i)
+	{
+		TEST_EXPECT(i, fired_at[i] >= deadlines[i] && fired_at[i] - deadlines[i] < 7);
+	}
+
+	if ( fails )
+		printf( "%u test failed!\n", fails );
+	else
+		printf( "all tests passed\n" );
+	return fails;
+}
+#endif /* if defined(TIMERWHEEL_TEST) */
@@ -0,0 +1,70 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - hierarchical timing wheel for client deadlines
+ *******************************************************************************/
+
+#if !defined(TIMERWHEEL_H)
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include "MQTTTime.h"
+
+#define TIMERWHEEL_SLOT_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+#define TIMERWHEEL_SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_LEVELS 5 /* 64^5 ms is over 12 days, later deadlines wait in the overflow list */
+
+typedef void TimerWheel_callback(void* context);
+
+/**
+ * A deadline registered in a timer wheel.  Entries are intended to be embedded in
+ * the structure they time, so scheduling never allocates.
+ */
+typedef struct TimerWheel_entry_s
+{
+	struct TimerWheel_entry_s* next;
+	struct TimerWheel_entry_s* prev;
+	uint64_t deadline;  /**< in milliseconds on the wheel's clock */
+	int level;          /**< wheel level, or TIMERWHEEL_LEVELS for the overflow list */
+	int slot;
+	int armed;
+	TimerWheel_callback* callback;
+	void* context;
+} TimerWheel_entry;
+
+/**
+ * Hierarchical timing wheel with millisecond ticks.  Level n slots each cover
+ * 64^n ms; entries move down a level as their slot comes round, so expiry work is
+ * proportional to the number of timers which actually fire.  Not thread safe - the
+ * caller provides the locking.
+ */
+typedef struct
+{
+	START_TIME_TYPE start;  /**< the wheel's clock is milliseconds since this time */
+	uint64_t current;       /**< the next tick to be processed */
+	uint64_t occupied[TIMERWHEEL_LEVELS]; /**< bitmap of non-empty slots per level */
+	TimerWheel_entry* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+	TimerWheel_entry* overflow;
+	int count;
+} TimerWheel;
+
+void TimerWheel_initialize(TimerWheel* wheel);
+void TimerWheel_initEntry(TimerWheel_entry* entry, TimerWheel_callback* callback, void* context);
+uint64_t TimerWheel_now(TimerWheel* wheel);
+void TimerWheel_schedule(TimerWheel* wheel, TimerWheel_entry* entry, uint64_t deadline);
+void TimerWheel_cancel(TimerWheel* wheel, TimerWheel_entry* entry);
+int TimerWheel_expire(TimerWheel* wheel, uint64_t now);
+int TimerWheel_nextDeadline(TimerWheel* wheel, uint64_t* deadline);
+
+#endif
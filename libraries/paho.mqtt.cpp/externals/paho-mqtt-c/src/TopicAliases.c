@@ -0,0 +1,340 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - MQTT V5 topic alias tables
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief MQTT V5 topic alias tables
+ *
+ * The outbound table is a fixed array of entries, one for each alias, found by topic
+ * through a hash table with chains threaded through the entries.  The entries are also
+ * kept on a list in order of use, so that when every alias has been assigned, the one
+ * used longest ago is reassigned.  The first PUBLISH with a newly assigned alias carries
+ * both the topic and the alias; later ones carry the alias alone.
+ *
+ * The inbound table holds the topics the server has set for its aliases, so that each
+ * PUBLISH carrying only an alias can be given its topic without searching.
+ */
+
+#include "TopicAliases.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Heap.h"
+
+#define TOPICALIASES_NONE -1
+#define TOPICALIASES_HASH_START 2166136261U
+
+
+/**
+ * FNV-1a hash of a topic
+ */
+static unsigned int TopicAliases_hash(const char* topic, size_t topiclen)
+{
+	unsigned int hash = TOPICALIASES_HASH_START;
+	size_t i;
+
+	for (i = 0; i < topiclen; ++i)
+	{
+		hash ^= (unsigned char)topic[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+/**
+ * Create an empty outbound alias table.
+ * @param maximum the number of aliases which may be assigned, from 1 to 65535
+ * @return the table, or NULL if the maximum is out of range or there is no memory
+ */
+TopicAliases* TopicAliases_create(int maximum)
+{
+	TopicAliases* aliases = NULL;
+	unsigned int buckets = 1;
+	unsigned int i;
+
+	if (maximum < 1 || maximum > 65535)
+		goto exit;
+	while (buckets < (unsigned int)maximum)
+		buckets <<= 1;
+	if ((aliases = calloc(1, sizeof(TopicAliases))) == NULL)
+		goto exit;
+	if ((aliases->entries = calloc((size_t)maximum, sizeof(TopicAliases_entry))) == NULL ||
+		(aliases->buckets = malloc(buckets * sizeof(int))) == NULL)
+	{
+		TopicAliases_free(aliases);
+		aliases = NULL;
+		goto exit;
+	}
+	for (i = 0; i < buckets; ++i)
+		aliases->buckets[i] = TOPICALIASES_NONE;
+	aliases->bucket_mask = buckets - 1;
+	aliases->maximum = maximum;
+	aliases->newest = aliases->oldest = TOPICALIASES_NONE;
+exit:
+	return aliases;
+}
+
+
+/**
+ * Free an outbound alias table and the topics it holds.
+ * @param aliases the table, which may be NULL
+ */
+void TopicAliases_free(TopicAliases* aliases)
+{
+	int i;
+
+	if (aliases == NULL)
+		return;
+	if (aliases->entries)
+	{
+		for (i = 0; i < aliases->maximum; ++i)
+		{
+			if (aliases->entries[i].topic)
+				free(aliases->entries[i].topic);
+		}
+		free(aliases->entries);
+	}
+	if (aliases->buckets)
+		free(aliases->buckets);
+	free(aliases);
+}
+
+
+static void TopicAliases_unlinkUse(TopicAliases* aliases, int i)
+{
+	TopicAliases_entry* entry = &aliases->entries[i];
+
+	if (entry->newer != TOPICALIASES_NONE)
+		aliases->entries[entry->newer].older = entry->older;
+	else
+		aliases->newest = entry->older;
+	if (entry->older != TOPICALIASES_NONE)
+		aliases->entries[entry->older].newer = entry->newer;
+	else
+		aliases->oldest = entry->newer;
+}
+
+
+static void TopicAliases_linkUse(TopicAliases* aliases, int i)
+{
+	TopicAliases_entry* entry = &aliases->entries[i];
+
+	entry->newer = TOPICALIASES_NONE;
+	entry->older = aliases->newest;
+	if (aliases->newest != TOPICALIASES_NONE)
+		aliases->entries[aliases->newest].newer = i;
+	else
+		aliases->oldest = i;
+	aliases->newest = i;
+}
+
+
+static void TopicAliases_unlinkBucket(TopicAliases* aliases, int i)
+{
+	int* link = &aliases->buckets[aliases->entries[i].hash & aliases->bucket_mask];
+
+	while (*link != i)
+		link = &aliases->entries[*link].next;
+	*link = aliases->entries[i].next;
+}
+
+
+/**
+ * Find the alias for a topic to be published, assigning one if the topic has none.
+ * @param aliases the table
+ * @param topic the topic
+ * @param topiclen the length of the topic
+ * @param assigned set to 1 if the alias has just been assigned to the topic, so that the
+ * topic must be sent with it, or to 0 if the alias can be sent in place of the topic
+ * @return the alias, or 0 if there is none for the topic
+ */
+int TopicAliases_outbound(TopicAliases* aliases, const char* topic, size_t topiclen, int* assigned)
+{
+	unsigned int hash = 0;
+	char* copy = NULL;
+	int i;
+
+	*assigned = 0;
+	if (topiclen == 0)
+		return 0;
+	hash = TopicAliases_hash(topic, topiclen);
+	for (i = aliases->buckets[hash & aliases->bucket_mask]; i != TOPICALIASES_NONE; i = aliases->entries[i].next)
+	{
+		TopicAliases_entry* entry = &aliases->entries[i];
+
+		if (entry->hash == hash && entry->topiclen == topiclen && memcmp(entry->topic, topic, topiclen) == 0)
+		{
+			if (aliases->newest != i)
+			{
+				TopicAliases_unlinkUse(aliases, i);
+				TopicAliases_linkUse(aliases, i);
+			}
+			return i + 1;
+		}
+	}
+
+	if ((copy = malloc(topiclen + 1)) == NULL)
+		return 0;
+	memcpy(copy, topic, topiclen);
+	copy[topiclen] = '\0';
+	if (aliases->count < aliases->maximum)
+		i = aliases->count++;
+	else
+	{
+		/* reassign the alias used longest ago */
+		i = aliases->oldest;
+		TopicAliases_unlinkUse(aliases, i);
+		TopicAliases_unlinkBucket(aliases, i);
+		free(aliases->entries[i].topic);
+	}
+	aliases->entries[i].topic = copy;
+	aliases->entries[i].topiclen = topiclen;
+	aliases->entries[i].hash = hash;
+	aliases->entries[i].next = aliases->buckets[hash & aliases->bucket_mask];
+	aliases->buckets[hash & aliases->bucket_mask] = i;
+	TopicAliases_linkUse(aliases, i);
+	*assigned = 1;
+	return i + 1;
+}
+
+
+/**
+ * Resolve the topic of a received PUBLISH which has a topic alias.  A PUBLISH with a topic
+ * sets the topic of its alias, and one without takes the topic that was set last.
+ * @param aliases the inbound table
+ * @param alias the topic alias from the PUBLISH
+ * @param topic the topic from the PUBLISH, which may be empty
+ * @param topiclen the length of the topic
+ * @param resolvedlen set to the length of the topic returned
+ * @return the topic for the alias, which belongs to the table, or NULL if the alias is out
+ * of range or has no topic set, or there is no memory
+ */
+const char* TopicAliases_inbound(TopicAliases* aliases, int alias, const char* topic, size_t topiclen,
+		size_t* resolvedlen)
+{
+	TopicAliases_entry* entry = NULL;
+
+	if (alias < 1 || alias > aliases->maximum)
+		return NULL;
+	entry = &aliases->entries[alias - 1];
+	if (topiclen > 0 && (entry->topic == NULL || entry->topiclen != topiclen ||
+			memcmp(entry->topic, topic, topiclen) != 0))
+	{
+		/* the server is setting the alias, or giving it a new topic */
+		char* copy = NULL;
+
+		if ((copy = malloc(topiclen + 1)) == NULL)
+			return NULL;
+		memcpy(copy, topic, topiclen);
+		copy[topiclen] = '\0';
+		if (entry->topic)
+			free(entry->topic);
+		entry->topic = copy;
+		entry->topiclen = topiclen;
+	}
+	*resolvedlen = entry->topiclen;
+	return entry->topic;
+}
+
+
+#if defined(TOPICALIASES_TEST)
+#include <stdio.h>
+
+#define TEST_EXPECT(i,x) if (!(x)) {fprintf( stderr, "failed test: %s (for i == %d)\n", #x, i ); ++fails;}
+
+static int test_outbound(TopicAliases* aliases, int i, int* assigned)
+{
+	char topic[40];
+
+	snprintf(topic, sizeof(topic), "rooms/%d/messages", i);
+	return TopicAliases_outbound(aliases, topic, strlen(topic), assigned);
+}
+
+int main(void)
+{
+	TopicAliases* aliases = NULL;
+	int alias[8];
+	int assigned = 0;
+	int fails = 0;
+	int i;
+
+	TEST_EXPECT(0, TopicAliases_create(0) == NULL);
+	TEST_EXPECT(0, TopicAliases_create(65536) == NULL);
+	TEST_EXPECT(0, (aliases = TopicAliases_create(4)) != NULL);
+
+	/* each new topic is given the next alias, which is sent alone after the first time */
+	for (i = 0; i < 4; ++i)
+	{
+		alias[i] = test_outbound(aliases, i, &assigned);
+		TEST_EXPECT(i, alias[i] == i + 1 && assigned == 1);
+	}
+	for (i = 0; i < 4; ++i)
+	{
+		TEST_EXPECT(i, test_outbound(aliases, i, &assigned) == alias[i] && assigned == 0);
+	}
+	TEST_EXPECT(0, TopicAliases_outbound(aliases, "", 0, &assigned) == 0 && assigned == 0);
+
+	/* when they are all in use, the least recently used alias is reassigned */
+	TEST_EXPECT(0, test_outbound(aliases, 0, &assigned) == alias[0] && assigned == 0);
+	TEST_EXPECT(4, test_outbound(aliases, 4, &assigned) == alias[1] && assigned == 1);
+	TEST_EXPECT(5, test_outbound(aliases, 5, &assigned) == alias[2] && assigned == 1);
+	TEST_EXPECT(0, test_outbound(aliases, 0, &assigned) == alias[0] && assigned == 0);
+	TEST_EXPECT(3, test_outbound(aliases, 3, &assigned) == alias[3] && assigned == 0);
+	TEST_EXPECT(1, test_outbound(aliases, 1, &assigned) == alias[1] && assigned == 1);
+	TEST_EXPECT(4, test_outbound(aliases, 4, &assigned) == alias[2] && assigned == 1);
+	TEST_EXPECT(5, test_outbound(aliases, 5, &assigned) == alias[0] && assigned == 1);
+	TopicAliases_free(aliases);
+
+	/* a larger table, with topics sharing hash buckets */
+	TEST_EXPECT(0, (aliases = TopicAliases_create(1000)) != NULL);
+	for (i = 0; i < 3000; ++i)
+		test_outbound(aliases, i, &assigned);
+	for (i = 2000; i < 3000; ++i)
+	{
+		TEST_EXPECT(i, test_outbound(aliases, i, &assigned) > 0 && assigned == 0);
+	}
+	TEST_EXPECT(0, test_outbound(aliases, 0, &assigned) > 0 && assigned == 1);
+	TopicAliases_free(aliases);
+
+	/* inbound aliases are set by the server, and then resolved */
+	{
+		const char* topic = NULL;
+		const char* interned = NULL;
+		size_t len = 0;
+
+		TEST_EXPECT(0, (aliases = TopicAliases_create(10)) != NULL);
+		TEST_EXPECT(0, TopicAliases_inbound(aliases, 1, "", 0, &len) == NULL);
+		TEST_EXPECT(0, TopicAliases_inbound(aliases, 0, "a/b", 3, &len) == NULL);
+		TEST_EXPECT(0, TopicAliases_inbound(aliases, 11, "a/b", 3, &len) == NULL);
+		TEST_EXPECT(0, (interned = TopicAliases_inbound(aliases, 10, "a/b", 3, &len)) != NULL);
+		TEST_EXPECT(0, len == 3 && strcmp(interned, "a/b") == 0);
+		TEST_EXPECT(0, TopicAliases_inbound(aliases, 10, "", 0, &len) == interned && len == 3);
+		/* the same topic again keeps the same string */
+		TEST_EXPECT(0, TopicAliases_inbound(aliases, 10, "a/b", 3, &len) == interned);
+		TEST_EXPECT(0, (topic = TopicAliases_inbound(aliases, 10, "a/b/c", 5, &len)) != NULL);
+		TEST_EXPECT(0, len == 5 && strcmp(topic, "a/b/c") == 0);
+		TEST_EXPECT(0, TopicAliases_inbound(aliases, 10, "", 0, &len) == topic && len == 5);
+		TEST_EXPECT(0, TopicAliases_inbound(aliases, 9, "", 0, &len) == NULL);
+		TopicAliases_free(aliases);
+	}
+
+	printf("%s: %d failures\n", (fails == 0) ? "passed" : "failed", fails);
+	return fails;
+}
+
+#endif /* TOPICALIASES_TEST */
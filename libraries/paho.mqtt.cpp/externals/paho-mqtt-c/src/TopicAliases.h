@@ -0,0 +1,58 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - MQTT V5 topic alias tables
+ *******************************************************************************/
+
+#if !defined(TOPICALIASES_H)
+#define TOPICALIASES_H
+
+#include <stddef.h>
+
+/**
+ * The topic an outbound alias stands for
+ */
+typedef struct
+{
+	char* topic;
+	size_t topiclen;
+	unsigned int hash;
+	int next;	/**< the next entry in the same hash bucket, or -1 */
+	int newer;	/**< the entry used next after this one, or -1 */
+	int older;	/**< the entry used last before this one, or -1 */
+} TopicAliases_entry;
+
+/**
+ * The topic aliases in one direction on one connection.  Entry n holds the topic of
+ * alias n + 1.  For outbound aliases, once they are all in use, the least recently used
+ * one is given to the next new topic.  Inbound aliases are set by the server, so only the
+ * entries are used.  Not thread safe - the caller provides the locking.
+ */
+typedef struct
+{
+	int maximum;	/**< the number of aliases which may be assigned */
+	int count;	/**< the number which have been assigned */
+	TopicAliases_entry* entries;
+	int* buckets;	/**< the first entry in each hash bucket, or -1 */
+	unsigned int bucket_mask;
+	int newest;	/**< the most recently used entry, or -1 */
+	int oldest;	/**< the least recently used entry, or -1 */
+} TopicAliases;
+
+TopicAliases* TopicAliases_create(int maximum);
+void TopicAliases_free(TopicAliases* aliases);
+int TopicAliases_outbound(TopicAliases* aliases, const char* topic, size_t topiclen, int* assigned);
+const char* TopicAliases_inbound(TopicAliases* aliases, int alias, const char* topic, size_t topiclen,
+		size_t* resolvedlen);
+
+#endif
@@ -34,6 +34,8 @@
 #include "MQTTProtocolOut.h"
 #include "SocketBuffer.h"
 #include "StackTrace.h"
+#include "Thread.h"
+#include "WebSocketMask.h"
 
 #if defined(__linux__)
 #  include <endian.h>
@@ -153,16 +155,24 @@ struct ws_frame
 	size_t pos; /**< current position within the buffer */
 };
 
+/** The frames used by the threads which have not chosen another set */
+static WebSocket_frames default_frames;
+
+/** The frames chosen by this thread, or NULL */
+static THREAD_LOCAL WebSocket_frames* current_frames = NULL;
+
+#define frames_in_use ((current_frames) ? current_frames : &default_frames)
+
 /** Current frame being processed */
-struct ws_frame *last_frame = NULL;
+#define last_frame (frames_in_use->last_frame)
 
 /** Holds any received websocket frames, to be process */
-static List* in_frames = NULL;
+#define in_frames (frames_in_use->in_frames)
 
-static char * frame_buffer = NULL;
-static size_t frame_buffer_len = 0;
-static size_t frame_buffer_index = 0;
-static size_t frame_buffer_data_len = 0;
+#define frame_buffer (frames_in_use->frame_buffer)
+#define frame_buffer_len (frames_in_use->frame_buffer_len)
+#define frame_buffer_index (frames_in_use->frame_buffer_index)
+#define frame_buffer_data_len (frames_in_use->frame_buffer_data_len)
 
 /* static function declarations */
 static const char *WebSocket_strcasefind(
@@ -215,20 +225,18 @@ size_t WebSocket_calculateFrameHeaderSize(networkHandles *net, int mask_data, si
 /**
  * @brief builds a websocket frame for data transmission
  *
- * write a websocket header and will mask the payload in all the passed in
- * buffers
+ * allocates a single buffer holding the websocket header followed by the
+ * data from all the passed in buffers, masking the data as it is copied.
+ * The passed in buffers are not modified.
  *
- * @param[in,out]  net                 network connection
+ * @param[in]      net                 network connection
  * @param[in]      opcode              websocket opcode for the packet
  * @param[in]      mask_data           whether to mask the data
- * @param[in,out]  buf0                first buffer, will write before this
+ * @param[in]      buf0                first buffer
  * @param[in]      buf0len             size of first buffer
- * @param[in]      count               number of payload buffers
- * @param[in,out]  buffers             array of payload buffers
- * @param[in]      buflens             array of payload buffer sizes
- * @param[in]      freeData            array indicating to free payload buffers
+ * @param[in]      bufs                payload buffers
  *
- * @return amount of data to write to socket
+ * @return the frame, whose buffer is NULL on failure
  */
 struct frameData {
 	char* wsbuf0;
@@ -236,55 +244,44 @@ struct frameData {
 };
 
 static struct frameData WebSocket_buildFrame(networkHandles* net, int opcode, int mask_data,
-	char** pbuf0, size_t* pbuf0len, PacketBuffers* bufs)
+	const char* buf0, size_t buf0len, const PacketBuffers* bufs)
 {
 	int buf_len = 0u;
 	struct frameData rc;
-	int new_mask = 0;
 
 	FUNC_ENTRY;
 	memset(&rc, '\0', sizeof(rc));
 	if ( net->websocket )
 	{
+		uint8_t mask[4] = { 0u, 0u, 0u, 0u };
 		size_t ws_header_size = 0u;
 		size_t data_len = 0L;
+		size_t pos;
 		int i;
 
 		/* Calculate total length of MQTT buffers */
-		data_len = *pbuf0len;
+		data_len = buf0len;
 		for (i = 0; i < bufs->count; ++i)
 			data_len += bufs->buflens[i];
 
 		/* add space for websocket frame header */
 		ws_header_size = WebSocket_calculateFrameHeaderSize(net, mask_data, data_len);
-		if (*pbuf0)
-		{
-			rc.wsbuf0len = *pbuf0len + ws_header_size;
-			rc.wsbuf0 = malloc(rc.wsbuf0len);
-			if (rc.wsbuf0 == NULL)
-				goto exit;
-			memcpy(&rc.wsbuf0[ws_header_size], *pbuf0, *pbuf0len);
-		}
-		else
-		{
-			rc.wsbuf0 = malloc(ws_header_size);
-			if (rc.wsbuf0 == NULL)
-				goto exit;
-			rc.wsbuf0len = ws_header_size;
-		}
+		rc.wsbuf0len = ws_header_size + data_len;
+		rc.wsbuf0 = malloc(rc.wsbuf0len);
+		if (rc.wsbuf0 == NULL)
+			goto exit;
 
-		if (mask_data && (bufs->mask[0] == 0))
+		if (mask_data)
 		{
 			/* generate mask, since we are a client */
 #if defined(OPENSSL)
-			RAND_bytes(&bufs->mask[0], sizeof(bufs->mask));
+			RAND_bytes(&mask[0], sizeof(mask));
 #else /* if defined(OPENSSL) */
-			bufs->mask[0] = (rand() % UINT8_MAX);
-			bufs->mask[1] = (rand() % UINT8_MAX);
-			bufs->mask[2] = (rand() % UINT8_MAX);
-			bufs->mask[3] = (rand() % UINT8_MAX);
+			mask[0] = (rand() % UINT8_MAX);
+			mask[1] = (rand() % UINT8_MAX);
+			mask[2] = (rand() % UINT8_MAX);
+			mask[3] = (rand() % UINT8_MAX);
 #endif /* else if defined(OPENSSL) */
-			new_mask = 1;
 		}
 
 		/* 1st byte */
@@ -318,34 +315,33 @@ static struct frameData WebSocket_buildFrame(networkHandles* net, int opcode, in
 		else
 		{
 			Log(TRACE_PROTOCOL, 1, "Data too large for websocket frame" );
+			free(rc.wsbuf0);
+			memset(&rc, '\0', sizeof(rc));
 			buf_len = -1;
+			goto exit;
 		}
 
 		if (mask_data)
 		{
-			size_t idx = 0u;
-
 			/* copy masking key into ws header */
-			memcpy( &rc.wsbuf0[buf_len], &bufs->mask, sizeof(uint32_t));
+			memcpy( &rc.wsbuf0[buf_len], mask, sizeof(uint32_t));
 			buf_len += sizeof(uint32_t);
+		}
 
-			/* mask packet fixed header */
-			for (i = (int)ws_header_size; i < (int)rc.wsbuf0len; ++i, ++idx)
-				rc.wsbuf0[i] ^= bufs->mask[idx % 4];
-
-			/* variable data buffers */
-			for (i = 0; i < bufs->count; ++i)
-			{
-				size_t j;
+		/* copy the data into the frame, masking it on the way */
+		pos = ws_header_size;
+		for (i = -1; i < bufs->count; ++i)
+		{
+			const char* src = (i < 0) ? buf0 : bufs->buffers[i];
+			size_t len = (i < 0) ? buf0len : bufs->buflens[i];
 
-				if (new_mask == 0 && (i == 2 || i == bufs->count-1))
-					/* topic (2) and payload (last) buffers are already masked */
-					break;
-				for ( j = 0u; j < bufs->buflens[i]; ++j, ++idx )
-				{
-					bufs->buffers[i][j] ^= bufs->mask[idx % 4];
-				}
-			}
+			if (len == 0)
+				continue;
+			if (mask_data)
+				WebSocket_mask(&rc.wsbuf0[pos], src, len, mask, pos - ws_header_size);
+			else
+				memcpy(&rc.wsbuf0[pos], src, len);
+			pos += len;
 		}
 	}
 exit:
@@ -354,20 +350,34 @@ exit:
 }
 
 
-static void WebSocket_unmaskData(size_t idx, PacketBuffers* bufs)
+/**
+ * writes a complete websocket frame to the socket
+ *
+ * @param[in]      net                 network connection
+ * @param[in]      frame               the frame to write
+ *
+ * @return the result of the write.  Unless it is TCPSOCKET_INTERRUPTED, the
+ * frame buffer has been freed
+ */
+static int WebSocket_sendFrame(networkHandles* net, struct frameData* frame)
 {
-	int i;
+	PacketBuffers nulbufs = {0, NULL, NULL, NULL};
+	int rc;
 
 	FUNC_ENTRY;
-	for (i = 0; i < bufs->count; ++i)
-	{
-		size_t j;
-		for (j = 0u; j < bufs->buflens[i]; ++j, ++idx)
-			bufs->buffers[i][j] ^= bufs->mask[idx % 4];
-	}
-	/* show that the mask has been removed */
-	bufs->mask[0] = bufs->mask[1] = bufs->mask[2] = bufs->mask[3] = 0;
-	FUNC_EXIT;
+#if defined(OPENSSL)
+	if (net->ssl)
+		rc = SSLSocket_putdatas(net->ssl, net->socket, frame->wsbuf0, frame->wsbuf0len, nulbufs);
+	else
+#endif
+		rc = Socket_putdatas(net->socket, frame->wsbuf0, frame->wsbuf0len, nulbufs);
+
+	/* an interrupted write owns the frame from now on */
+	if (rc != TCPSOCKET_INTERRUPTED)
+		free(frame->wsbuf0);
+	frame->wsbuf0 = NULL;
+	FUNC_EXIT_RC(rc);
+	return rc;
 }
 
 
@@ -504,7 +514,7 @@ int WebSocket_connect( networkHandles *net, int ssl, const char *uri)
 
 	if ( buf )
 	{
-		PacketBuffers nulbufs = {0, NULL, NULL, NULL, {0, 0, 0, 0}};
+		PacketBuffers nulbufs = {0, NULL, NULL, NULL};
 
 #if defined(OPENSSL)
 		if (net->ssl)
@@ -536,7 +546,7 @@ exit:
 void WebSocket_close(networkHandles *net, int status_code, const char *reason)
 {
 	struct frameData fd;
-	PacketBuffers nulbufs = {0, NULL, NULL, NULL, {0, 0, 0, 0}};
+	PacketBuffers nulbufs = {0, NULL, NULL, NULL};
 
 	FUNC_ENTRY;
 	if ( net->websocket )
@@ -565,16 +575,9 @@ void WebSocket_close(networkHandles *net, int status_code, const char *reason)
 		if ( reason )
 			strcpy( &buf0[sizeof(uint16_t)], reason );
 
-		fd = WebSocket_buildFrame( net, WebSocket_OP_CLOSE, mask_data, &buf0, &buf0len, &nulbufs);
-
-#if defined(OPENSSL)
-		if (net->ssl)
-			SSLSocket_putdatas(net->ssl, net->socket, fd.wsbuf0, fd.wsbuf0len, nulbufs);
-		else
-#endif
-			Socket_putdatas(net->socket, fd.wsbuf0, fd.wsbuf0len, nulbufs);
-
-		free(fd.wsbuf0); /* free temporary ws header */
+		fd = WebSocket_buildFrame( net, WebSocket_OP_CLOSE, mask_data, buf0, buf0len, &nulbufs);
+		if (fd.wsbuf0)
+			WebSocket_sendFrame(net, &fd);
 
 		/* websocket connection is now closed */
 		net->websocket = 0;
@@ -920,26 +923,17 @@ void WebSocket_pong(networkHandles *net, char *app_data, size_t app_data_len)
 	FUNC_ENTRY;
 	if ( net->websocket )
 	{
-		char *buf0 = NULL;
-		size_t buf0len = 0;
 		int freeData = 0;
 		struct frameData fd;
 		const int mask_data = 1; /* all frames from client must be masked */
-		PacketBuffers appbuf = {1, &app_data, &app_data_len, &freeData, {0, 0, 0, 0}};
+		PacketBuffers appbuf = {1, &app_data, &app_data_len, &freeData};
 
-		fd = WebSocket_buildFrame( net, WebSocket_OP_PONG, mask_data, &buf0, &buf0len, &appbuf);
+		fd = WebSocket_buildFrame( net, WebSocket_OP_PONG, mask_data, NULL, 0, &appbuf);
 
 		Log(TRACE_PROTOCOL, 1, "Sending WebSocket PONG" );
 
-#if defined(OPENSSL)
-		if (net->ssl)
-			SSLSocket_putdatas(net->ssl, net->socket, fd.wsbuf0, fd.wsbuf0len /*header_len + app_data_len*/, appbuf);
-		else
-#endif
-			Socket_putdatas(net->socket, fd.wsbuf0, fd.wsbuf0len /*header_len + app_data_len*/, appbuf);
-
-		free(fd.wsbuf0);
-		free(buf0);
+		if (fd.wsbuf0)
+			WebSocket_sendFrame(net, &fd);
 	}
 	FUNC_EXIT;
 }
@@ -947,10 +941,9 @@ void WebSocket_pong(networkHandles *net, char *app_data, size_t app_data_len)
 /**
  * writes data to a socket (websocket header will be prepended if required)
  *
- * @warning buf0 will be expanded (backwords before @p buf0 buffer, to add a
- * websocket frame header to the data if required).  So use
- * @p WebSocket_calculateFrameHeader, to determine if extra space is needed
- * before the @p buf0 pointer.
+ * For a websocket, the data is copied into a separate, masked frame.  If that
+ * write is interrupted, @p buf0 and the payload buffers marked to be freed are
+ * freed here, just as they would have been once a direct write completed.
  *
  * @param[in,out]  net                 network connection
  * @param[in,out]  buf0                first buffer
@@ -974,20 +967,29 @@ int WebSocket_putdatas(networkHandles* net, char** buf0, size_t* buf0len, Packet
 	{
 		struct frameData wsdata;
 
-		wsdata = WebSocket_buildFrame(net, WebSocket_OP_BINARY, mask_data, buf0, buf0len, bufs);
-
-#if defined(OPENSSL)
-		if (net->ssl)
-			rc = SSLSocket_putdatas(net->ssl, net->socket, wsdata.wsbuf0, wsdata.wsbuf0len, *bufs);
-		else
-#endif
-			rc = Socket_putdatas(net->socket, wsdata.wsbuf0, wsdata.wsbuf0len, *bufs);
+		wsdata = WebSocket_buildFrame(net, WebSocket_OP_BINARY, mask_data, *buf0, *buf0len, bufs);
+		if (wsdata.wsbuf0 == NULL)
+		{
+			rc = SOCKET_ERROR;
+			goto exit;
+		}
 
-		if (rc != TCPSOCKET_INTERRUPTED)
+		if ((rc = WebSocket_sendFrame(net, &wsdata)) == TCPSOCKET_INTERRUPTED)
 		{
-			if (mask_data)
-				WebSocket_unmaskData(*buf0len, bufs);
-			free(wsdata.wsbuf0); /* free temporary ws header */
+			int i;
+
+			/* the frame holds a copy of the data, so the buffers which an interrupted
+			 * write would have freed are finished with now */
+			free(*buf0);
+			*buf0 = NULL;
+			for (i = 0; i < bufs->count; ++i)
+			{
+				if (bufs->frees[i])
+				{
+					free(bufs->buffers[i]);
+					bufs->buffers[i] = NULL;
+				}
+			}
 		}
 	}
 	else
@@ -999,7 +1001,7 @@ int WebSocket_putdatas(networkHandles* net, char** buf0, size_t* buf0len, Packet
 #endif
 			rc = Socket_putdatas(net->socket, *buf0, *buf0len, *bufs);
 	}
-
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1136,7 +1138,6 @@ int WebSocket_receiveFrame(networkHandles *net, size_t *actual_len)
 
 				if ( has_mask )
 				{
-					uint8_t mask[4];
 					b = WebSocket_getRawSocketData(net, 4u, &len, &rcs);
 					if (rcs == SOCKET_ERROR)
 					{
@@ -1176,11 +1177,7 @@ int WebSocket_receiveFrame(networkHandles *net, size_t *actual_len)
 
 				/* unmask data */
 				if ( has_mask )
-				{
-					size_t i;
-					for ( i = 0u; i < payload_len; ++i )
-						b[i] ^= mask[i % 4];
-				}
+					WebSocket_mask(b, b, payload_len, mask, 0);
 
 				if ( res )
 					cur_len = res->len;
@@ -1292,6 +1289,20 @@ const char *WebSocket_strcasefind(const char *buf, const char *str, size_t len)
  * releases resources used by the websocket sub-system
  */
 void WebSocket_terminate( void )
+{
+	FUNC_ENTRY;
+	WebSocket_freeFrames();
+	Socket_outTerminate();
+#if defined(OPENSSL)
+	SSLSocket_terminate();
+#endif
+	FUNC_EXIT;
+}
+
+/**
+ * releases the websocket frames of the socket set in use by this thread
+ */
+void WebSocket_freeFrames( void )
 {
 	FUNC_ENTRY;
 	/* clean up and un-processed websocket frames */
@@ -1321,14 +1332,19 @@ void WebSocket_terminate( void )
 	frame_buffer_len = 0;
 	frame_buffer_index = 0;
 	frame_buffer_data_len = 0;
-
-	Socket_outTerminate();
-#if defined(OPENSSL)
-	SSLSocket_terminate();
-#endif
 	FUNC_EXIT;
 }
 
+/**
+ * chooses the websocket frames used by the calling thread from now on, which go with the
+ * socket set it has chosen.  See Socket_setCurrent.
+ * @param frames the frames, or NULL for the default ones
+ */
+void WebSocket_setCurrent( WebSocket_frames* frames )
+{
+	current_frames = frames;
+}
+
 /**
  * handles the websocket upgrade response
  *
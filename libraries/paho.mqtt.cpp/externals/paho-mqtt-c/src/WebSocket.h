@@ -51,6 +51,19 @@
 #define WebSocket_CLOSE_TLS_FAIL        1015 /* reserved: not be used */
 /** @} */
 
+/**
+ * The websocket frames being processed for a set of sockets
+ */
+typedef struct
+{
+	List* in_frames; /**< received frames, still to be processed */
+	struct ws_frame* last_frame; /**< current frame being processed */
+	char* frame_buffer; /**< payload of the received frames */
+	size_t frame_buffer_len; /**< allocated size of frame_buffer */
+	size_t frame_buffer_index; /**< read position within frame_buffer */
+	size_t frame_buffer_data_len; /**< length of the data in frame_buffer */
+} WebSocket_frames;
+
 /* closes a websocket connection */
 void WebSocket_close(networkHandles *net, int status_code, const char *reason);
 
@@ -69,6 +82,12 @@ int WebSocket_putdatas(networkHandles* net, char** buf0, size_t* buf0len, Packet
 /* releases any resources used by the websocket system */
 void WebSocket_terminate(void);
 
+/* frees the frames of the current socket set */
+void WebSocket_freeFrames(void);
+
+/* chooses the frames used by the calling thread, which go with its socket set */
+void WebSocket_setCurrent(WebSocket_frames* frames);
+
 /* handles websocket upgrade request */
 int WebSocket_upgrade(networkHandles *net);
 
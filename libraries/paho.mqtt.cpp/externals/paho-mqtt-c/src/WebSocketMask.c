@@ -0,0 +1,182 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - vectorized websocket masking
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief WebSocket masking (RFC 6455 section 5.3)
+ *
+ * The 4 byte masking key is XORed over the payload.  The key is first rotated to the
+ * position in the frame the data starts at, so that the rest of the work can be done
+ * in whole vectors: 32 bytes a step with AVX2, 16 with SSE2, and 8 in the portable
+ * version.  The instruction set is chosen when the library is compiled.
+ */
+
+#include "WebSocketMask.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WEBSOCKETMASK_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WEBSOCKETMASK_SSE2
+#endif
+
+
+/**
+ * Masks or unmasks data.  The source and destination may be the same.
+ * @param dest where to write the result
+ * @param src the data to be masked
+ * @param len the length of the data
+ * @param mask the masking key
+ * @param offset the position of the data in the frame payload, which selects the
+ * byte of the key the data starts with
+ */
+void WebSocket_mask(char* dest, const char* src, size_t len, const uint8_t mask[4], size_t offset)
+{
+	uint8_t pattern[8];
+	uint32_t key32;
+	uint64_t key64;
+	size_t i = 0;
+
+	for (i = 0; i < sizeof(pattern); ++i)
+		pattern[i] = mask[(offset + i) % 4];
+	memcpy(&key32, pattern, sizeof(key32));
+	memcpy(&key64, pattern, sizeof(key64));
+	i = 0;
+
+#if defined(WEBSOCKETMASK_AVX2)
+	if (len >= 32)
+	{
+		const __m256i key = _mm256_set1_epi32((int)key32);
+
+		for (; i + 32 <= len; i += 32)
+		{
+			__m256i data = _mm256_loadu_si256((const __m256i*)&src[i]);
+			_mm256_storeu_si256((__m256i*)&dest[i], _mm256_xor_si256(data, key));
+		}
+	}
+#endif
+#if defined(WEBSOCKETMASK_SSE2)
+	if (len - i >= 16)
+	{
+		const __m128i key = _mm_set1_epi32((int)key32);
+
+		for (; i + 16 <= len; i += 16)
+		{
+			__m128i data = _mm_loadu_si128((const __m128i*)&src[i]);
+			_mm_storeu_si128((__m128i*)&dest[i], _mm_xor_si128(data, key));
+		}
+	}
+#endif
+	/* whole vectors are a multiple of 4 bytes, so the key is still in phase */
+	for (; i + 8 <= len; i += 8)
+	{
+		uint64_t data;
+
+		memcpy(&data, &src[i], sizeof(data));
+		data ^= key64;
+		memcpy(&dest[i], &data, sizeof(data));
+	}
+	for (; i < len; ++i)
+		dest[i] = src[i] ^ pattern[i % 4];
+}
+
+
+#if defined(WEBSOCKETMASK_TEST)
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_EXPECT(i,x) if (!(x)) {fprintf( stderr, "failed test: %s (for i == %d)\n", #x, i ); ++fails;}
+
+static void mask_bytewise(char* dest, const char* src, size_t len, const uint8_t mask[4], size_t offset)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		dest[i] = src[i] ^ mask[(offset + i) % 4];
+}
+
+int main(void)
+{
+	const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+	const size_t big = 1024 * 1024;
+	char src[300 + 8], expect[300 + 8], out[300 + 8];
+	unsigned int fails = 0u;
+	char* buf = NULL;
+	clock_t start;
+	size_t len, offset, align;
+	int i, loops = 200;
+
+	srand(1);
+	for (i = 0; i < (int)sizeof(src); ++i)
+		src[i] = (char)rand();
+
+	/* all lengths through several vector widths, at every key phase and alignment */
+	for (len = 0; len <= 300; ++len)
+	{
+		for (offset = 0; offset < 8; ++offset)
+		{
+			for (align = 0; align < 4; ++align)
+			{
+				mask_bytewise(expect, &src[align], len, mask, offset);
+				WebSocket_mask(out, &src[align], len, mask, offset);
+				TEST_EXPECT((int)len, memcmp(out, expect, len) == 0);
+
+				/* in place, and unmasking gives the original data back */
+				memcpy(out, &src[align], len);
+				WebSocket_mask(out, out, len, mask, offset);
+				TEST_EXPECT((int)len, memcmp(out, expect, len) == 0);
+				WebSocket_mask(out, out, len, mask, offset);
+				TEST_EXPECT((int)len, memcmp(out, &src[align], len) == 0);
+			}
+		}
+	}
+
+	/* masking split across buffers matches masking in one go */
+	mask_bytewise(expect, src, 300, mask, 0);
+	WebSocket_mask(out, src, 7, mask, 0);
+	WebSocket_mask(&out[7], &src[7], 90, mask, 7);
+	WebSocket_mask(&out[97], &src[97], 203, mask, 97);
+	TEST_EXPECT(0, memcmp(out, expect, 300) == 0);
+
+	if ((buf = malloc(big)) != NULL)
+	{
+		double t_vector, t_bytewise;
+
+		memset(buf, 'x', big);
+		start = clock();
+		for (i = 0; i < loops; ++i)
+			WebSocket_mask(buf, buf, big, mask, (size_t)i);
+		t_vector = (double)(clock() - start) / CLOCKS_PER_SEC;
+		start = clock();
+		for (i = 0; i < loops; ++i)
+			mask_bytewise(buf, buf, big, mask, (size_t)i);
+		t_bytewise = (double)(clock() - start) / CLOCKS_PER_SEC;
+		printf("masked %d MB: %.3fs vectorized, %.3fs bytewise\n", loops, t_vector, t_bytewise);
+		free(buf);
+	}
+
+	if ( fails )
+		printf( "%u test failed!\n", fails );
+	else
+		printf( "all tests passed\n" );
+	return fails;
+}
+#endif /* if defined(WEBSOCKETMASK_TEST) */
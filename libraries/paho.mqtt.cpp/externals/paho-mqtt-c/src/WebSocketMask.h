@@ -0,0 +1,25 @@
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation - vectorized websocket masking
+ *******************************************************************************/
+
+#if !defined(WEBSOCKETMASK_H)
+#define WEBSOCKETMASK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void WebSocket_mask(char* dest, const char* src, size_t len, const uint8_t mask[4], size_t offset);
+
+#endif /* WEBSOCKETMASK_H */
@@ -22,14 +22,31 @@
  * See page 104 of the Unicode Standard 5.0 for the list of well formed
  * UTF-8 byte sequences.
  *
+ * Most topics and strings are ASCII, so runs of ASCII are skipped a word or
+ * vector at a time.  When compiled for SSSE3 (or AVX2), multibyte text is
+ * checked 16 bytes at a time as well, using the lookup table method of Keiser
+ * and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
  */
 #include "utf-8.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "StackTrace.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UTF8_AVX2
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <tmmintrin.h>
+#define UTF8_SSSE3
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTF8_SSE2
+#endif
+
 /**
  * Macro to determine the number of elements in a single-dimension array
  */
@@ -38,6 +55,8 @@
 #endif
 
 
+/* the table driven check of one character at a time, kept to test the faster ones against */
+#if defined(UNIT_TESTS)
 /**
  * Structure to hold the valid ranges of UTF-8 characters, for each byte up to 4
  */
@@ -118,6 +137,266 @@ static const char* UTF8_char_validate(int len, const char* data)
 	exit:
 	return rc;
 }
+#endif /* if defined(UNIT_TESTS) */
+
+
+#if defined(UTF8_SSSE3)
+
+/*
+ * Error flags for the lookup tables.  Each pair of adjacent bytes is classified
+ * by three tables - the high and low nibbles of the first byte and the high
+ * nibble of the second - and the pair is in error if a flag is set in all three.
+ */
+#define UTF8_TOO_SHORT      (1 << 0) /* lead byte not followed by a continuation */
+#define UTF8_TOO_LONG       (1 << 1) /* ASCII followed by a continuation */
+#define UTF8_OVERLONG_3     (1 << 2)
+#define UTF8_TOO_LARGE      (1 << 3) /* above U+10FFFF */
+#define UTF8_SURROGATE      (1 << 4)
+#define UTF8_OVERLONG_2     (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4     (1 << 6)
+#define UTF8_TWO_CONTS      (1 << 7) /* two continuations, valid only as bytes 3 or 4 */
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const uint8_t byte_1_high[16] =
+{
+	/* 0_______ */
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	/* 10______ */
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	/* 1100____ */
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	/* 1101____ */
+	UTF8_TOO_SHORT,
+	/* 1110____ */
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	/* 1111____ */
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+static const uint8_t byte_1_low[16] =
+{
+	/* ____0000 */
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+	/* ____0001 */
+	UTF8_CARRY | UTF8_OVERLONG_2,
+	/* ____001_ */
+	UTF8_CARRY,
+	UTF8_CARRY,
+	/* ____0100 */
+	UTF8_CARRY | UTF8_TOO_LARGE,
+	/* ____0101 to ____1100 */
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	/* ____1101 */
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+	/* ____111_ */
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+static const uint8_t byte_2_high[16] =
+{
+	/* 0_______ */
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	/* 1000____ */
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+	/* 1001____ */
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+	/* 101_____ */
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	/* 11______ */
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/* the largest values the last three bytes of a block can have without starting a
+ * character which continues into the next block */
+static const uint8_t incomplete_max[16] =
+{
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF
+};
+
+typedef struct
+{
+	__m128i prev;       /**< the previous block */
+	__m128i incomplete; /**< non-zero if the previous block ended part way through a character */
+	__m128i error;      /**< non-zero once any error has been found */
+} UTF8_state;
+
+
+/**
+ * Check the next 16 bytes of a string, carrying state over from the previous 16
+ * @param state the validation state
+ * @param input the next block
+ */
+static void UTF8_checkBlock(UTF8_state* state, __m128i input)
+{
+	if (_mm_movemask_epi8(input) == 0)
+	{
+		/* all ASCII - only a character left unfinished by the last block can be wrong */
+		state->error = _mm_or_si128(state->error, state->incomplete);
+		state->incomplete = _mm_setzero_si128();
+	}
+	else
+	{
+		const __m128i nibble = _mm_set1_epi8(0x0F);
+		__m128i prev1 = _mm_alignr_epi8(input, state->prev, 15);
+		__m128i prev2 = _mm_alignr_epi8(input, state->prev, 14);
+		__m128i prev3 = _mm_alignr_epi8(input, state->prev, 13);
+		__m128i special, must23;
+
+		/* errors which can be seen from two adjacent bytes */
+		special = _mm_and_si128(
+			_mm_and_si128(
+				_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)byte_1_high),
+					_mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+				_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)byte_1_low),
+					_mm_and_si128(prev1, nibble))),
+			_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)byte_2_high),
+				_mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+		/* the third and fourth bytes of a character must be continuations, and are the
+		 * only places two continuations in a row are allowed */
+		must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))),
+			_mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80))));
+		must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+
+		state->error = _mm_or_si128(state->error, _mm_xor_si128(must23, special));
+		state->incomplete = _mm_subs_epu8(input, _mm_loadu_si128((const __m128i*)incomplete_max));
+	}
+	state->prev = input;
+}
+
+
+/**
+ * Validate a length-delimited string has only UTF-8 characters, 16 bytes at a time
+ * @param len the length of the string in "data"
+ * @param data the bytes to check for valid UTF-8 characters
+ * @return 1 (true) if the string has only UTF-8 characters, 0 (false) otherwise
+ */
+static int UTF8_validateBlocks(size_t len, const char* data)
+{
+	UTF8_state state;
+	char last[16];
+	size_t i = 0;
+
+	state.prev = state.incomplete = state.error = _mm_setzero_si128();
+	while (i + 16 <= len)
+	{
+#if defined(UTF8_AVX2)
+		if (i + 32 <= len)
+		{
+			__m256i input = _mm256_loadu_si256((const __m256i*)&data[i]);
+
+			if (_mm256_movemask_epi8(input) == 0)
+			{
+				state.error = _mm_or_si128(state.error, state.incomplete);
+				state.incomplete = _mm_setzero_si128();
+				state.prev = _mm256_extracti128_si256(input, 1);
+				i += 32;
+				continue;
+			}
+		}
+#endif
+		UTF8_checkBlock(&state, _mm_loadu_si128((const __m128i*)&data[i]));
+		i += 16;
+	}
+	if (i < len)
+	{
+		/* pad the last block with ASCII */
+		memset(last, 0, sizeof(last));
+		memcpy(last, &data[i], len - i);
+		UTF8_checkBlock(&state, _mm_loadu_si128((const __m128i*)last));
+	}
+	state.error = _mm_or_si128(state.error, state.incomplete);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(state.error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+#else /* if defined(UTF8_SSSE3) */
+
+/**
+ * Validate a single multibyte UTF-8 character
+ * @param end the end of the string
+ * @param data the bytes to check for a valid UTF-8 char
+ * @return pointer to the start of the next UTF-8 character in "data", or NULL
+ */
+static const char* UTF8_multibyte_validate(const char* end, const char* data)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	unsigned char lower = 0x80, upper = 0xBF;
+	int charlen;
+
+	if (p[0] < 0xC2 || p[0] > 0xF4)
+		return NULL;
+	charlen = (p[0] >= 0xF0) ? 4 : (p[0] >= 0xE0) ? 3 : 2;
+	if (charlen > end - data)
+		return NULL;
+	/* the second byte is narrowed to rule out overlong forms, surrogates and values over U+10FFFF */
+	if (p[0] == 0xE0)
+		lower = 0xA0;
+	else if (p[0] == 0xED)
+		upper = 0x9F;
+	else if (p[0] == 0xF0)
+		lower = 0x90;
+	else if (p[0] == 0xF4)
+		upper = 0x8F;
+	if (p[1] < lower || p[1] > upper)
+		return NULL;
+	if (charlen >= 3 && (p[2] & 0xC0) != 0x80)
+		return NULL;
+	if (charlen == 4 && (p[3] & 0xC0) != 0x80)
+		return NULL;
+	return data + charlen;
+}
+
+
+/**
+ * Validate a length-delimited string has only UTF-8 characters, skipping ASCII a
+ * word or vector at a time
+ * @param len the length of the string in "data"
+ * @param data the bytes to check for valid UTF-8 characters
+ * @return 1 (true) if the string has only UTF-8 characters, 0 (false) otherwise
+ */
+static int UTF8_validateBlocks(size_t len, const char* data)
+{
+	const char* end = data + len;
+
+	while (data && data < end)
+	{
+#if defined(UTF8_SSE2)
+		while (end - data >= 16 && _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)data)) == 0)
+			data += 16;
+#endif
+		while (end - data >= 8)
+		{
+			uint64_t word;
+
+			memcpy(&word, data, sizeof(word));
+			if (word & 0x8080808080808080ULL)
+				break;
+			data += 8;
+		}
+		if (data == end)
+			break;
+		if ((*data & 0x80) == 0)
+			++data;
+		else
+			data = UTF8_multibyte_validate(end, data);
+	}
+	return data != NULL;
+}
+
+#endif /* else if defined(UTF8_SSSE3) */
 
 
 /**
@@ -128,7 +407,6 @@ static const char* UTF8_char_validate(int len, const char* data)
  */
 int UTF8_validate(int len, const char* data)
 {
-	const char* curdata = NULL;
 	int rc = 0;
 
 	FUNC_ENTRY;
@@ -137,11 +415,8 @@ int UTF8_validate(int len, const char* data)
 		rc = 1;
 		goto exit;
 	}
-	curdata = UTF8_char_validate(len, data);
-	while (curdata && (curdata < data + len))
-		curdata = UTF8_char_validate((int)(data + len - curdata), curdata);
-
-	rc = curdata != NULL;
+	if (len > 0)
+		rc = UTF8_validateBlocks((size_t)len, data);
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -170,6 +445,7 @@ int UTF8_validateString(const char* string)
 
 #if defined(UNIT_TESTS)
 #include <stdio.h>
+#include <time.h>
 
 typedef struct
 {
@@ -186,6 +462,8 @@ tests valid_strings[] =
 		{9, {0xE6, 0x97, 0xA5, 0xE6, 0x9C, 0xAC, 0xE8, 0xAA, 0x9E} },
 		{4, {0x2F, 0x2E, 0x2E, 0x2F} },
 		{7, {0xEF, 0xBB, 0xBF, 0xF0, 0xA3, 0x8E, 0xB4} },
+		{4, {0xF4, 0x8F, 0xBF, 0xBF} },
+		{19, {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 0xF0, 0x90, 0x80, 0x80} },
 };
 
 tests invalid_strings[] =
@@ -194,11 +472,46 @@ tests invalid_strings[] =
 		{5, {0x2F, 0xC0, 0xAE, 0x2E, 0x2F} },
 		{6, {0xED, 0xA1, 0x8C, 0xED, 0xBE, 0xB4} },
 		{1, {0xF4} },
+		{4, {0xF4, 0x90, 0x80, 0x80} },
+		{3, {0xE0, 0x9F, 0xBF} },
+		{2, {0x80, 0x41} },
+		{1, {0xFF} },
+		{16, {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 0xE2} },
+		{17, {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 0xE2, 0x89} },
 };
 
+/* the character by character check, to compare the results and speed against */
+static int UTF8_validate_bytewise(int len, const char* data)
+{
+	const char* curdata = UTF8_char_validate(len, data);
+
+	while (curdata && (curdata < data + len))
+		curdata = UTF8_char_validate((int)(data + len - curdata), curdata);
+	return curdata != NULL;
+}
+
+static double benchmark(int (*validate)(int, const char*), int len, const char* data, int loops)
+{
+	clock_t start = clock();
+	int i, valid = 0;
+
+	for (i = 0; i < loops; ++i)
+		valid += validate(len, data);
+	if (valid != loops)
+		printf("benchmark string not valid\n");
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
 int main (int argc, char *argv[])
 {
-	int i, failed = 0;
+	static const char* pieces[] = {"a", "/", "sensor", "\xC3\xA9", "\xE6\x97\xA5", "\xF0\x9F\x98\x80",
+		"\xED\x9F\xBF", "\xEF\xBF\xBD", "\xC2\x80"};
+	static const char* bench[] = {
+		"factory/building-7/line-3/station-12/sensor/temperature/celsius/current",
+		"\xE5\xB7\xA5\xE5\xA0\xB4/\xE3\x83\xA9\xE3\x82\xA4\xE3\x83\xB3/\xE6\xB8\xA9\xE5\xBA\xA6/"
+			"\xE7\x8F\xBE\xE5\x9C\xA8\xE5\x80\xA4/\xE6\x91\x82\xE6\xB0\x8F"};
+	char buf[512];
+	int i, j, failed = 0;
 
 	for (i = 0; i < ARRAY_SIZE(valid_strings); ++i)
 	{
@@ -222,6 +535,48 @@ int main (int argc, char *argv[])
 			printf("invalid test %d passed\n", i);
 	}
 
+	/* random mixtures of characters, and of bytes, must get the same answer as the bytewise check */
+	srand(1);
+	for (i = 0; i < 200000; ++i)
+	{
+		int len = 0, target = 1 + rand() % 200;
+
+		while (len < target)
+		{
+			if (i % 2)
+				buf[len++] = (char)rand();
+			else
+			{
+				const char* piece = pieces[rand() % ARRAY_SIZE(pieces)];
+				size_t plen = strlen(piece);
+
+				memcpy(&buf[len], piece, plen);
+				len += (int)plen;
+				if (rand() % 20 == 0)
+					buf[rand() % len] = (char)rand(); /* corrupt a byte */
+			}
+		}
+		if (UTF8_validate(len, buf) != UTF8_validate_bytewise(len, buf))
+		{
+			printf("random test %d failed\n", i);
+			failed = 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bench); ++i)
+	{
+		for (j = 1; j <= 4; j *= 4)
+		{
+			int k, len = 0;
+
+			for (k = 0; k < j; ++k)
+				len += sprintf(&buf[len], "%s", bench[i]);
+			printf("%d byte %s string: %.3fs validating, %.3fs bytewise\n", len, (i == 0) ? "ASCII" : "multibyte",
+				benchmark(UTF8_validate, len, buf, 2000000), benchmark(UTF8_validate_bytewise, len, buf, 2000000));
+		}
+	}
+
 	if (failed)
 		printf("Failed\n");
 	else
@@ -232,8 +587,7 @@ int main (int argc, char *argv[])
 	UTF8_validate(1, NULL);
 	UTF8_char_validate(1, NULL);
 
-	return 0;
+	return failed;
 } /* End of main function*/
 
 #endif
-
@@ -34,6 +34,7 @@
 #ifndef __mqtt_async_client_h
 #define __mqtt_async_client_h
 
+#include <atomic>
 #include <functional>
 #include <list>
 #include <memory>
@@ -149,6 +150,15 @@ public:
     using disconnected_handler = std::function<void(const properties&, ReasonCode)>;
     /** Handler for updating connection data before an auto-reconnect. */
     using update_connection_handler = std::function<bool(connect_data&)>;
+    /**
+     * The state of the buffer of messages waiting to be sent, with counts
+     * of the messages dropped because it was full.
+     */
+    using buffer_stats = MQTTAsync_bufferStats;
+    /**
+     * The occupancy of the library's slab allocator, per size class.
+     */
+    using slab_info = MQTTAsync_slabInfo;
 
 private:
     /** Lock guard type for this class */
@@ -188,6 +198,19 @@ private:
     std::list<delivery_token_ptr> pendingDeliveryTokens_;
     /** A queue of messages for consumer API */
     consumer_queue_type que_;
+    /**
+     * The topics of the server's topic aliases, shared by the messages that
+     * arrive with them. Only used from the C-lib message callback.
+     */
+    std::vector<string_ref> aliasTopics_;
+    /** The notification descriptor, or -1 if the client has none */
+    int notifyFd_{-1};
+    /** The descriptor written to signal notifyFd_; the same one for an eventfd */
+    int notifyWriteFd_{-1};
+    /** Whether notifyFd_ has been signaled since it was last cleared */
+    std::atomic<bool> notified_{false};
+    /** The tokens completed since they were last drained (with notifyFd_) */
+    std::vector<token_ptr> completedTokens_;
 
     /** Callbacks from the C library */
     static void on_connected(void* context, char* cause);
@@ -227,6 +250,17 @@ private:
      * @throw exception if an argument is invalid
      */
     void create();
+    /**
+     * Creates the notification descriptor, if the create options ask for
+     * one.
+     * @throw exception if the descriptor can't be created
+     */
+    void create_notify_fd();
+    /**
+     * Makes the notification descriptor readable, if the client has one
+     * and it is not readable already.
+     */
+    void notify();
 
 public:
     /**
@@ -533,6 +567,98 @@ public:
      * @return true if connected, false otherwise.
      */
     bool is_connected() const override { return to_bool(MQTTAsync_isConnected(cli_)); }
+    /**
+     * Gets the most QoS 1 and 2 messages, subscribes and unsubscribes that
+     * the client can now have in flight at once.
+     * This is the adaptive window if the connect options set a target round
+     * trip time, otherwise the maximum in-flight messages.
+     * @return The current in-flight window.
+     */
+    int get_inflight_window() const;
+    /**
+     * Gets the smoothed round trip time from sending a QoS 1 or 2 message to
+     * receiving its first acknowledgment, which the adaptive in-flight
+     * window is based on.
+     * @return The round trip time estimate, or zero if the adaptive window
+     *  	   is off or nothing has been acknowledged yet.
+     */
+    std::chrono::microseconds get_rtt_estimate() const;
+    /**
+     * Gets how full the buffer of messages waiting to be sent is, and how
+     * many messages it has refused or deleted, as limited by the
+     * create options' maximum buffered messages and bytes.
+     * @return The buffer state and counters.
+     */
+    buffer_stats get_buffer_stats() const;
+    /**
+     * Gets the I/O shard that runs this client's network I/O and callbacks.
+     * @return The shard number, from zero.
+     * @throw exception if the client was created with an event loop, so has
+     *  	  no shard threads.
+     */
+    int get_shard() const;
+    /**
+     * Sets the number of I/O shards the library spreads clients over.
+     * Each shard has its own send and receive threads, so many clients can
+     * do their network I/O in parallel. A callback may only call clients
+     * on its own shard. The number can only be changed while no clients
+     * exist; otherwise the request is ignored. The default is a single
+     * shard.
+     * @param n The number of shards, from 1 to MQTTASYNC_MAX_SHARDS.
+     * @throw std::invalid_argument if the number is out of range.
+     */
+    static void set_io_shards(int n);
+    /**
+     * Gets the occupancy of each size class of the library's slab allocator,
+     * which holds the small structures allocated for every message, and is
+     * shared by all the clients in the process.
+     * @return The slab allocator state. If the library was built without the
+     *  	   slab allocator, the number of classes is zero.
+     */
+    static slab_info get_slab_info();
+    /**
+     * Gets the socket that the application's event loop should wait on, for
+     * a client created with create_options::set_event_loop(). The socket
+     * changes as the client connects and reconnects, so it should be got
+     * again after each call to run_once().
+     * @param wantWrite If not null, set to whether the loop should wait for
+     *  				the socket to be writable as well as readable.
+     * @return The socket, or -1 if the client has none at the moment.
+     * @throw exception if the client was not created with an event loop.
+     */
+    int get_loop_socket(bool* wantWrite = nullptr) const;
+    /**
+     * Gets the longest time the application's event loop may wait for the
+     * socket before calling run_once(), which is zero when there is work
+     * waiting.
+     * @return The time to wait, or -1ms if there is no deadline.
+     * @throw exception if the client was not created with an event loop.
+     */
+    std::chrono::milliseconds get_loop_timeout() const;
+    /**
+     * Runs one turn of the network I/O of a client created with
+     * create_options::set_event_loop(), on the calling thread. The client's
+     * callbacks are called from here, so messages can be handled without
+     * passing through a consumer queue. Only one thread may run a client's
+     * loop, and it must not wait on the client's tokens.
+     * @param timeout The most milliseconds to wait for the socket to be
+     *  			  ready. Zero suits a loop that waits on the socket
+     *  			  itself.
+     * @throw exception if the client was not created with an event loop, or
+     *  	  if called from a callback.
+     */
+    void run_once(int timeout = 0);
+    /**
+     * Runs one turn of the network I/O of a client created with
+     * create_options::set_event_loop(), on the calling thread.
+     * @param timeout The most time to wait for the socket to be ready.
+     * @throw exception if the client was not created with an event loop, or
+     *  	  if called from a callback.
+     */
+    template <class Rep, class Period>
+    void run_once(const std::chrono::duration<Rep, Period>& timeout) {
+        run_once((int)to_milliseconds_count(timeout));
+    }
     /**
      * Publishes a message to a topic on the server
      * @param topic The topic to deliver the message to
@@ -631,6 +757,23 @@ public:
     delivery_token_ptr publish(
         const_message_ptr msg, void* userContext, iaction_listener& cb
     ) override;
+    /**
+     * Publishes a number of messages, in order, as a batch. This is the
+     * same as publishing each of them in turn, except that with a log or
+     * ring persistence synced on every write, the messages are synced to
+     * disk once for the whole batch, rather than once each.
+     *
+     * If a message is not accepted for publication, the messages after it
+     * are not attempted. The tokens of those messages, and of the one that
+     * was refused, are returned already complete, with the error code.
+     * @param msgs The messages to deliver to the server
+     * @return The tokens used to track and wait for each publish to
+     *  	   complete, one for each message, in the same order.
+     * @throw exception if the messages were accepted, but could not be
+     *  	  synced to disk. They will still be delivered, and their tokens
+     *  	  can be got with get_pending_delivery_tokens().
+     */
+    std::vector<delivery_token_ptr> publish_many(const std::vector<const_message_ptr>& msgs);
     /**
      * Subscribe to a topic, which may include wildcards.
      * @param topicFilter the topic to subscribe to, which can include
@@ -841,6 +984,41 @@ public:
      *  	   event was available.
      */
     bool try_consume_event(event* evt) override;
+    /**
+     * Reads all the client events in the queue without blocking.
+     * @return The events, in the order they arrived. This is empty if
+     *  	   there were none.
+     */
+    std::vector<event> try_consume_events();
+    /**
+     * Gets the file descriptor that becomes readable when an event is put
+     * in the consumer queue or one of the client's tokens completes, for a
+     * client created with create_options::set_notify_fd(). This lets the
+     * client be waited on with the application's other I/O, with epoll()
+     * or the like, rather than parking a thread in consume_message() or
+     * token::wait(). When it is readable, call clear_notify(), then drain
+     * the client with try_consume_events() and try_consume_tokens().
+     * Every completed token is kept until it is drained, so an application
+     * that has no use for them must still call try_consume_tokens(), or
+     * they accumulate for the life of the client.
+     * @return The descriptor, or -1 if the client has none.
+     */
+    int get_notify_fd() const { return notifyFd_; }
+    /**
+     * Makes the notification descriptor unreadable, until there is
+     * something new to drain. This must be called before draining, so that
+     * anything arriving while draining signals the descriptor again.
+     * @return @em true if the descriptor had been signaled.
+     */
+    bool clear_notify();
+    /**
+     * Takes the tokens that have completed since the last call, without
+     * blocking. They are only kept for a client created with
+     * create_options::set_notify_fd(), and for that client they are all
+     * kept until they are taken.
+     * @return The completed tokens, in the order they completed.
+     */
+    std::vector<token_ptr> try_consume_tokens();
     /**
      * Waits a limited time for a client event to appear.
      * @param evt Pointer to the value to receive the event.
@@ -557,6 +557,69 @@ public:
      *  			 proxy.
      */
     void set_https_proxy(const string& httpsProxy);
+    /**
+     * Gets the most topic aliases the client assigns to the topics it
+     * publishes to (MQTT v5 only).
+     * @return The outbound topic alias maximum, or zero if aliases are not
+     *  	   assigned.
+     */
+    int get_outbound_topic_alias_maximum() const { return opts_.outboundTopicAliasMaximum; }
+    /**
+     * Sets the most topic aliases the client assigns to the topics it
+     * publishes to (MQTT v5 only).
+     * When this is non-zero and the server accepts topic aliases, the
+     * client gives an alias to each topic it publishes to, up to the
+     * smaller of this and the server's maximum, reassigning the least
+     * recently used alias once they are all in use. After the first
+     * message to a topic, later ones carry only the alias.
+     * @param n The outbound topic alias maximum. Zero, the default, turns
+     *  		topic aliases off.
+     */
+    void set_outbound_topic_alias_maximum(int n) {
+        opts_.outboundTopicAliasMaximum = (n < 0) ? 0 : n;
+    }
+    /**
+     * Gets the round trip time that the adaptive in-flight window aims for.
+     * @return The target round trip time, or zero if the in-flight window
+     *  	   is fixed at the maximum.
+     */
+    std::chrono::milliseconds get_inflight_target_rtt() const {
+        return std::chrono::milliseconds(opts_.inflightTargetRTT);
+    }
+    /**
+     * Sets the round trip time, from sending a QoS 1 or 2 message to
+     * receiving its first acknowledgment, that an adaptive in-flight window
+     * aims for.
+     * The window starts small, grows while round trips stay within the
+     * target, and halves when one goes over it or a message has to be
+     * resent. It never exceeds the maximum in-flight messages, or the
+     * server's receive maximum.
+     * @param rtt The target round trip time. Zero, the default, keeps the
+     *  		  window fixed at the maximum.
+     */
+    template <class Rep, class Period>
+    void set_inflight_target_rtt(const std::chrono::duration<Rep, Period>& rtt) {
+        auto ms = to_milliseconds_count(rtt);
+        opts_.inflightTargetRTT = (ms < 0) ? 0 : int(ms);
+    }
+    /**
+     * Gets the Topic Alias Maximum advertised to the server in the connect
+     * properties (MQTT v5 only).
+     * @return The number of topic aliases the server may use when sending
+     *  	   to this client, or zero if it may not use any.
+     */
+    uint16_t get_topic_alias_maximum() const;
+    /**
+     * Sets the Topic Alias Maximum advertised to the server in the connect
+     * properties (MQTT v5 only).
+     * This lets the server replace the topics of the messages it sends
+     * with aliases. The client keeps the topic the server sets for each
+     * alias, and messages arriving with only an alias are given the full
+     * topic, shared by all the messages with that alias.
+     * @param n The number of topic aliases the server may use. Zero removes
+     *  		the property, so the server may not use any.
+     */
+    void set_topic_alias_maximum(uint16_t n);
 };
 
 /** Smart/shared pointer to a connection options object. */
@@ -941,6 +1004,36 @@ public:
         opts_.set_https_proxy(httpsProxy);
         return *this;
     }
+    /**
+     * Sets the most topic aliases the client assigns to the topics it
+     * publishes to (MQTT v5 only).
+     * @param n The outbound topic alias maximum. Zero turns topic aliases
+     *  		off.
+     */
+    auto outbound_topic_alias_maximum(int n) -> self& {
+        opts_.set_outbound_topic_alias_maximum(n);
+        return *this;
+    }
+    /**
+     * Sets the round trip time that an adaptive in-flight window aims for.
+     * @param rtt The target round trip time. Zero keeps the window fixed at
+     *  		  the maximum.
+     */
+    template <class Rep, class Period>
+    auto inflight_target_rtt(const std::chrono::duration<Rep, Period>& rtt) -> self& {
+        opts_.set_inflight_target_rtt(rtt);
+        return *this;
+    }
+    /**
+     * Sets the Topic Alias Maximum advertised to the server in the connect
+     * properties (MQTT v5 only).
+     * @param n The number of topic aliases the server may use. Zero removes
+     *  		the property.
+     */
+    auto topic_alias_maximum(uint16_t n) -> self& {
+        opts_.set_topic_alias_maximum(n);
+        return *this;
+    }
     /**
      * Finish building the options and return them.
      * @return The option struct as built.
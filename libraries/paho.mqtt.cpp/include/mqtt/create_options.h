@@ -42,6 +42,114 @@ struct no_persistence
 /** A constant used to indicate that no persistence is desired */
 constexpr no_persistence NO_PERSISTENCE{};
 
+/**
+ * The options for the built-in log-structured file persistence, for use as
+ * a `persistent_type` variant option.
+ *
+ * Rather than writing a file for each message, the data for the client is
+ * appended to a few segment files, with an index of the live records held
+ * in memory. Full segments are compacted in the background.
+ */
+class log_persistence
+{
+    /** The underlying C options */
+    MQTTClient_logPersistenceOptions opts_ MQTTClient_logPersistenceOptions_initializer;
+
+    /** The base directory for the persistence store */
+    string dir_{};
+
+public:
+    /** When the log is synced to disk */
+    enum SyncMode {
+        /** Leave writing the log to disk to the operating system */
+        NO_SYNC = MQTTCLIENT_LOG_SYNC_NONE,
+        /** Sync in the background, once per sync interval */
+        GROUP_SYNC = MQTTCLIENT_LOG_SYNC_GROUP,
+        /** Sync before every write to the store returns */
+        ALWAYS_SYNC = MQTTCLIENT_LOG_SYNC_ALWAYS
+    };
+
+    /**
+     * Log persistence with the default options, in the working directory.
+     */
+    log_persistence() {}
+    /**
+     * Log persistence with the default options.
+     * @param dir The directory for the persistence store.
+     */
+    explicit log_persistence(const string& dir) : dir_{dir} {}
+    /**
+     * Gets the directory for the persistence store.
+     * @return The directory for the persistence store. Empty means the
+     *  	   working directory.
+     */
+    const string& get_directory() const { return dir_; }
+    /**
+     * Sets the directory for the persistence store.
+     * @param dir The directory for the persistence store.
+     */
+    void set_directory(const string& dir) { dir_ = dir; }
+    /**
+     * Gets when the log is synced to disk.
+     * @return The sync mode.
+     */
+    SyncMode get_sync_mode() const { return SyncMode(opts_.sync_mode); }
+    /**
+     * Sets when the log is synced to disk.
+     * @param mode The sync mode.
+     */
+    void set_sync_mode(SyncMode mode) { opts_.sync_mode = int(mode); }
+    /**
+     * Gets the longest time between a write and the sync that covers it,
+     * for @ref GROUP_SYNC.
+     * @return The sync interval.
+     */
+    std::chrono::milliseconds get_sync_interval() const {
+        return std::chrono::milliseconds(opts_.sync_interval);
+    }
+    /**
+     * Sets the longest time between a write and the sync that covers it,
+     * for @ref GROUP_SYNC.
+     * @param interval The sync interval.
+     */
+    template <class Rep, class Period>
+    void set_sync_interval(const std::chrono::duration<Rep, Period>& interval) {
+        opts_.sync_interval = (int)to_milliseconds_count(interval);
+    }
+    /**
+     * Gets the size at which a new segment file is started.
+     * @return The segment size, in bytes.
+     */
+    size_t get_segment_size() const { return size_t(opts_.segment_size); }
+    /**
+     * Sets the size at which a new segment file is started.
+     * @param n The segment size, in bytes.
+     */
+    void set_segment_size(size_t n) { opts_.segment_size = int(n); }
+    /**
+     * Gets the percentage of the full segments which must be dead records
+     * before they are compacted.
+     * @return The compaction threshold, as a percentage.
+     */
+    int get_compaction_threshold() const { return opts_.compaction_threshold; }
+    /**
+     * Sets the percentage of the full segments which must be dead records
+     * before they are compacted.
+     * @param pct The compaction threshold, as a percentage.
+     */
+    void set_compaction_threshold(int pct) { opts_.compaction_threshold = pct; }
+    /**
+     * Gets the C options for the persistence, which refer to this object's
+     * directory string.
+     * @return The C options.
+     */
+    MQTTClient_logPersistenceOptions c_struct() const {
+        auto opts{opts_};
+        opts.directory = dir_.empty() ? nullptr : dir_.c_str();
+        return opts;
+    }
+};
+
 /**
  * A variant for the different type of persistence:
  * @li @em no_persistence: Any object of this type indicates no persistence
@@ -49,8 +157,10 @@ constexpr no_persistence NO_PERSISTENCE{};
  * @li @em string: Indicates file persistence. The string specifies the
  *     directory for the persistence store.
  * @li @em iclient_persistence*: User-defined persistence
+ * @li @em log_persistence: The built-in log-structured file persistence
  */
-using persistence_type = std::variant<no_persistence, string, iclient_persistence*>;
+using persistence_type =
+    std::variant<no_persistence, string, iclient_persistence*, log_persistence>;
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -87,6 +197,9 @@ class create_options
     /** The persistence for the client */
     persistence_type persistence_{};
 
+    /** Whether the client has a notification file descriptor */
+    bool notifyFd_{false};
+
     /** The client and tests have special access */
     friend class async_client;
     friend class create_options_builder;
@@ -171,7 +284,8 @@ public:
         : opts_{opts.opts_},
           serverURI_{serverURI},
           clientId_{clientId},
-          persistence_{persistence} {}
+          persistence_{persistence},
+          notifyFd_{opts.notifyFd_} {}
     /**
      * Copy constructor.
      * @param opts The other options.
@@ -180,7 +294,8 @@ public:
         : opts_{opts.opts_},
           serverURI_{opts.serverURI_},
           clientId_{opts.clientId_},
-          persistence_{opts.persistence_} {}
+          persistence_{opts.persistence_},
+          notifyFd_{opts.notifyFd_} {}
     /**
      * Move constructor.
      * @param opts The other options.
@@ -189,7 +304,8 @@ public:
         : opts_{opts.opts_},
           serverURI_{std::move(opts.serverURI_)},
           clientId_{std::move(opts.clientId_)},
-          persistence_{std::move(opts.persistence_)} {}
+          persistence_{std::move(opts.persistence_)},
+          notifyFd_{opts.notifyFd_} {}
 
     create_options& operator=(const create_options& rhs);
     create_options& operator=(create_options&& rhs);
@@ -252,6 +368,84 @@ public:
      * @param n The maximum number of offline buffered messages.
      */
     void set_max_buffered_messages(int n) { opts_.maxBufferedMessages = n; }
+    /**
+     * Gets the maximum number of bytes the offline buffered messages may
+     * hold in memory.
+     * @return The byte limit of the buffer, or zero if there is none.
+     */
+    size_t get_max_buffered_bytes() const { return size_t(opts_.maxBufferedBytes); }
+    /**
+     * Sets the maximum number of bytes of payload, topic, and properties
+     * that the offline buffered messages may hold in memory, in addition to
+     * the limit on their number.
+     * Messages that have been persisted hold none. When a new message would
+     * go over the limit it is refused, or if the oldest messages are
+     * deleted, as many as needed are removed to make room.
+     * @param n The byte limit of the buffer, or zero for none.
+     */
+    void set_max_buffered_bytes(size_t n) { opts_.maxBufferedBytes = int(n); }
+    /**
+     * Whether new messages are written to persistence, rather than held in
+     * memory, when the byte limit of the buffer is reached.
+     * @return @em true if messages spill to persistence, @em false if not.
+     */
+    bool get_spill_buffered_messages() const { return to_bool(opts_.spillBufferedMessages); }
+    /**
+     * Determines whether new messages are written to persistence, rather
+     * than held in memory, when the byte limit of the buffer is reached.
+     * With a persistence store, only QoS 0 messages that are not otherwise
+     * persisted (see set_persist_qos0()) are held in memory, so only they
+     * can spill.
+     * @param on @em true to spill messages to persistence, @em false to
+     *  		 refuse or delete them as for a full buffer.
+     */
+    void set_spill_buffered_messages(bool on) { opts_.spillBufferedMessages = to_int(on); }
+    /**
+     * Gets the I/O shard requested for the client.
+     * @return The requested shard, or -1 to let the library choose.
+     */
+    int get_shard() const { return opts_.shard; }
+    /**
+     * Sets the I/O shard that will run the client's network I/O and
+     * callbacks. The number is taken modulo the number of shards set with
+     * async_client::set_io_shards(). A negative value lets the library
+     * choose: a client created from a callback goes on the same shard as
+     * that callback, others are spread round-robin.
+     * @param n The shard number, or -1 to let the library choose.
+     */
+    void set_shard(int n) { opts_.shard = n; }
+    /**
+     * Whether the client is driven by the application's own event loop,
+     * rather than by library threads.
+     * @return @em true if the client has an event loop, @em false if not.
+     */
+    bool get_event_loop() const { return to_bool(opts_.eventLoop); }
+    /**
+     * Determines whether the client is driven by the application's own
+     * event loop, calling async_client::run_once() when the client's socket
+     * is ready or its timeout has passed, instead of by library threads.
+     * The client's callbacks then run on the loop's thread. The shard is
+     * ignored, as the client has one of its own.
+     * @param on @em true for the client to have an event loop.
+     */
+    void set_event_loop(bool on) { opts_.eventLoop = to_int(on); }
+    /**
+     * Whether the client has a file descriptor that becomes readable when
+     * there is something to drain from it.
+     * @return @em true if the client has a notification descriptor.
+     */
+    bool get_notify_fd() const { return notifyFd_; }
+    /**
+     * Determines whether the client has a file descriptor that becomes
+     * readable when an event is put in its consumer queue or one of its
+     * tokens completes. See async_client::get_notify_fd(). This lets an
+     * application wait on the client together with its other I/O, and
+     * then drain it without blocking. The client keeps each of its tokens
+     * that completes until it is drained with
+     * async_client::try_consume_tokens(). It is not available on Windows.
+     * @param on @em true for the client to have a notification descriptor.
+     */
+    void set_notify_fd(bool on) { notifyFd_ = on; }
     /**
      * Gets the MQTT version used to create the client.
      * @return The MQTT version used to create the client.
@@ -304,6 +498,43 @@ public:
      * @param on @em true if QoS 0 messages are persisted, @em false if not.
      */
     void set_persist_qos0(bool on) { opts_.persistQoS0 = to_int(on); }
+    /**
+     * Gets the number of bytes of outgoing publish packets gathered into one
+     * network write.
+     * @return The size limit for gathering packets, or zero if outbound
+     *  	   coalescing is off.
+     */
+    size_t get_coalesce_bytes() const { return size_t(opts_.coalesceBytes); }
+    /**
+     * Sets the number of bytes of outgoing publish packets to gather into
+     * one network write.
+     * Gathered packets are written when this size is reached, when there
+     * are no more requests ready to send, or when any other packet is sent.
+     * This applies to TCP and TLS connections, but not WebSockets. Over TLS
+     * at most one full TLS record (16KB) is gathered. A QoS 0 publish
+     * completes once it has been gathered.
+     * @param n The size limit for gathering packets, or zero to write each
+     *  		packet as it is sent.
+     */
+    void set_coalesce_bytes(size_t n) { opts_.coalesceBytes = int(n); }
+    /**
+     * Gets the longest time a gathered publish packet waits while more
+     * requests keep arriving.
+     * @return The coalescing deadline, or zero if there is none.
+     */
+    std::chrono::microseconds get_coalesce_delay() const {
+        return std::chrono::microseconds(opts_.coalesceDelayUs);
+    }
+    /**
+     * Sets the longest time a gathered publish packet waits while more
+     * requests keep arriving.
+     * @param delay The coalescing deadline, or zero for none.
+     */
+    template <class Rep, class Period>
+    void set_coalesce_delay(const std::chrono::duration<Rep, Period>& delay) {
+        opts_.coalesceDelayUs =
+            int(std::chrono::duration_cast<std::chrono::microseconds>(delay).count());
+    }
 };
 
 /** Smart/shared pointer to a connection options object. */
@@ -376,6 +607,59 @@ public:
         opts_.opts_.maxBufferedMessages = n;
         return *this;
     }
+    /**
+     * Sets the maximum number of bytes the offline buffered messages may
+     * hold in memory. (Defaults to zero, which is no limit)
+     * @param n The byte limit of the buffer.
+     * @return A reference to this object.
+     */
+    auto max_buffered_bytes(size_t n) -> self& {
+        opts_.set_max_buffered_bytes(n);
+        return *this;
+    }
+    /**
+     * Determines whether new messages are written to persistence, rather
+     * than held in memory, when the byte limit of the buffer is reached.
+     * (Defaults false)
+     * @param on @em true to spill messages to persistence.
+     * @return A reference to this object.
+     */
+    auto spill_buffered_messages(bool on = true) -> self& {
+        opts_.set_spill_buffered_messages(on);
+        return *this;
+    }
+    /**
+     * Sets the I/O shard that will run the client's network I/O and
+     * callbacks. (Defaults to -1, which lets the library choose)
+     * @param n The shard number.
+     * @return A reference to this object.
+     */
+    auto shard(int n) -> self& {
+        opts_.set_shard(n);
+        return *this;
+    }
+    /**
+     * Sets whether the client is driven by the application's own event
+     * loop, calling async_client::run_once(), instead of by library
+     * threads. (Defaults false)
+     * @param on @em true for the client to have an event loop.
+     * @return A reference to this object.
+     */
+    auto event_loop(bool on = true) -> self& {
+        opts_.set_event_loop(on);
+        return *this;
+    }
+    /**
+     * Sets whether the client has a file descriptor that becomes readable
+     * when an event is put in its consumer queue or one of its tokens
+     * completes. (Defaults false)
+     * @param on @em true for the client to have a notification descriptor.
+     * @return A reference to this object.
+     */
+    auto notify_fd(bool on = true) -> self& {
+        opts_.set_notify_fd(on);
+        return *this;
+    }
     /**
      * Sets the MQTT version used to create the client.
      * @param ver The MQTT version used to create the client.
@@ -417,6 +701,27 @@ public:
         opts_.opts_.persistQoS0 = to_int(on);
         return *this;
     }
+    /**
+     * Sets the number of bytes of outgoing publish packets to gather into
+     * one network write. (Defaults to zero, which is off)
+     * @param n The size limit for gathering packets.
+     * @return A reference to this object
+     */
+    auto coalesce_bytes(size_t n) -> self& {
+        opts_.set_coalesce_bytes(n);
+        return *this;
+    }
+    /**
+     * Sets the longest time a gathered publish packet waits while more
+     * requests keep arriving. (Defaults to zero, which is no deadline)
+     * @param delay The coalescing deadline.
+     * @return A reference to this object
+     */
+    template <class Rep, class Period>
+    auto coalesce_delay(const std::chrono::duration<Rep, Period>& delay) -> self& {
+        opts_.set_coalesce_delay(delay);
+        return *this;
+    }
     /**
      * Finish building the options and return them.
      * @return The option struct as built.
@@ -60,6 +60,12 @@ public:
     static constexpr int DFLT_QOS = 0;
     /** The default retained flag */
     static constexpr bool DFLT_RETAINED = false;
+    /** The priority of messages sent ahead of normal ones */
+    static constexpr int PRIORITY_HIGH = MQTTASYNC_PRIORITY_HIGH;
+    /** The default priority of a message */
+    static constexpr int PRIORITY_NORMAL = MQTTASYNC_PRIORITY_NORMAL;
+    /** The priority of bulk messages, sent after the others */
+    static constexpr int PRIORITY_LOW = MQTTASYNC_PRIORITY_LOW;
 
 private:
     /** Initializer for the C struct (from the C library) */
@@ -77,6 +83,10 @@ private:
     binary_ref payload_;
     /** The properties for the message  */
     properties props_;
+    /** The priority lane the message is sent from */
+    int priority_{PRIORITY_NORMAL};
+    /** The key of the messages this one replaces while they wait to be sent */
+    string coalesceKey_;
 
     /** The client has special access. */
     friend class async_client;
@@ -298,6 +308,17 @@ public:
      * server, false otherwise.
      */
     bool is_retained() const { return to_bool(msg_.retained); }
+    /**
+     * Gets the priority with which the client sends this message.
+     * @return The priority, from PRIORITY_LOW to PRIORITY_HIGH.
+     */
+    int get_priority() const { return priority_; }
+    /**
+     * Gets the key of the messages this one replaces while they wait to be
+     * sent.
+     * @return The coalescing key, or an empty string if there is none.
+     */
+    const string& get_coalesce_key() const { return coalesceKey_; }
     /**
      * Sets the payload of this message to be the specified buffer.
      * Note that this accepts copy or move operations:
@@ -337,6 +358,27 @@ public:
      *  			   broker, @em false if not.
      */
     void set_retained(bool retained) { msg_.retained = to_int(retained); }
+    /**
+     * Sets the priority with which the client sends this message.
+     * Each priority has its own lane of messages waiting to be sent. While
+     * more than one has messages waiting, the client sends 16 high and 4
+     * normal priority messages for each low priority one, so a bulk
+     * transfer at low priority doesn't hold up urgent messages, and still
+     * gets through. The priority is not kept in persistence.
+     * @param priority PRIORITY_LOW, PRIORITY_NORMAL, or PRIORITY_HIGH
+     */
+    void set_priority(int priority) { priority_ = priority; }
+    /**
+     * Sets a key for messages of which only the latest value matters, like
+     * a presence state or an unread count. When this message is published,
+     * if one with the same key is still waiting in the client to be sent,
+     * this one takes its place, and the token of the one replaced fails with
+     * the MQTTASYNC_SUPERSEDED return code. That token is completed by the
+     * library's send thread, so not before the client first connects. The
+     * key is not kept in persistence.
+     * @param key The coalescing key, or an empty string for none.
+     */
+    void set_coalesce_key(const string& key) { coalesceKey_ = key; }
     /**
      * Gets the properties in the message.
      * @return A const reference to the properties in the message.
@@ -485,6 +527,22 @@ public:
         msg_->set_retained(on);
         return *this;
     }
+    /**
+     * Sets the priority with which the client sends the message.
+     * @param priority PRIORITY_LOW, PRIORITY_NORMAL, or PRIORITY_HIGH
+     */
+    auto priority(int priority) -> self& {
+        msg_->set_priority(priority);
+        return *this;
+    }
+    /**
+     * Sets a key for messages of which only the latest value matters.
+     * @param key The coalescing key.
+     */
+    auto coalesce_key(const string& key) -> self& {
+        msg_->set_coalesce_key(key);
+        return *this;
+    }
     /**
      * Sets the properties for the disconnect message.
      * @param props The properties for the disconnect message.
@@ -0,0 +1,223 @@
+/////////////////////////////////////////////////////////////////////////////
+/// @file ring_persistence.h
+/// Declaration of the ring_persistence class, which adapts the C library's
+/// memory-mapped ring persistence to the iclient_persistence interface.
+/////////////////////////////////////////////////////////////////////////////
+
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation and documentation
+ *******************************************************************************/
+
+#ifndef __mqtt_ring_persistence_h
+#define __mqtt_ring_persistence_h
+
+#include <chrono>
+
+#include "MQTTAsync.h"
+#include "mqtt/iclient_persistence.h"
+#include "mqtt/types.h"
+
+namespace mqtt {
+
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Persistence in a single preallocated file of fixed-size slots, which is
+ * mapped into memory.
+ *
+ * This is the memory-mapped ring persistence of the C library, made
+ * available as an iclient_persistence, so it is given to a client in the
+ * same way as a user-defined persistence:
+ *
+ * @code
+ *     mqtt::ring_persistence persist{"persist", 256, 4096};
+ *     mqtt::async_client cli(serverURI, clientId, &persist);
+ * @endcode
+ *
+ * Each record takes as many consecutive slots as its key and data need, so
+ * the store holds at most @em slot_count records, and a put fails once
+ * there is no run of free slots large enough. The file never grows past
+ * its initial size. The slot size and count can't be changed for an
+ * existing store.
+ */
+class ring_persistence : public iclient_persistence
+{
+    /** The options for the C persistence */
+    MQTTClient_ringPersistenceOptions opts_ MQTTClient_ringPersistenceOptions_initializer;
+
+    /** The base directory for the persistence store */
+    string dir_{};
+
+    /** The C persistence, while the store is open */
+    MQTTClient_persistence* per_{nullptr};
+
+    /** The handle of the open store */
+    void* handle_{nullptr};
+
+    /** Gets the handle of the open store, or throws if it's not open */
+    void* handle() const;
+
+public:
+    /** When the file is synced to disk */
+    enum SyncMode {
+        /** Leave writing the file to disk to the operating system */
+        NO_SYNC = MQTTCLIENT_LOG_SYNC_NONE,
+        /** Sync in the background, once per sync interval */
+        GROUP_SYNC = MQTTCLIENT_LOG_SYNC_GROUP,
+        /** Sync before every write to the store returns */
+        ALWAYS_SYNC = MQTTCLIENT_LOG_SYNC_ALWAYS
+    };
+
+    /**
+     * Ring persistence with the default options, in the working directory.
+     */
+    ring_persistence() {}
+    /**
+     * Ring persistence with the default slot size and count.
+     * @param dir The directory for the persistence store.
+     */
+    explicit ring_persistence(const string& dir) : dir_{dir} {}
+    /**
+     * Ring persistence with the given slot size and count.
+     * @param dir The directory for the persistence store.
+     * @param slotSize The size of each slot, in bytes. This must be a
+     *  			   multiple of 8.
+     * @param slotCount The number of slots.
+     */
+    ring_persistence(const string& dir, size_t slotSize, size_t slotCount);
+    /**
+     * Closes the store, if it's open.
+     */
+    ~ring_persistence() override;
+
+    ring_persistence(const ring_persistence&) = delete;
+    ring_persistence& operator=(const ring_persistence&) = delete;
+
+    /**
+     * Gets the directory for the persistence store.
+     * @return The directory for the persistence store. Empty means the
+     *  	   working directory.
+     */
+    const string& get_directory() const { return dir_; }
+    /**
+     * Sets the directory for the persistence store. This takes effect
+     * when the store is next opened.
+     * @param dir The directory for the persistence store.
+     */
+    void set_directory(const string& dir) { dir_ = dir; }
+    /**
+     * Gets the size of each slot.
+     * @return The slot size, in bytes.
+     */
+    size_t get_slot_size() const { return size_t(opts_.slot_size); }
+    /**
+     * Sets the size of each slot. This takes effect when the store is next
+     * opened.
+     * @param n The slot size, in bytes. This must be a multiple of 8.
+     */
+    void set_slot_size(size_t n) { opts_.slot_size = int(n); }
+    /**
+     * Gets the number of slots.
+     * @return The number of slots.
+     */
+    size_t get_slot_count() const { return size_t(opts_.slot_count); }
+    /**
+     * Sets the number of slots. This takes effect when the store is next
+     * opened.
+     * @param n The number of slots.
+     */
+    void set_slot_count(size_t n) { opts_.slot_count = int(n); }
+    /**
+     * Gets when the file is synced to disk.
+     * @return The sync mode.
+     */
+    SyncMode get_sync_mode() const { return SyncMode(opts_.sync_mode); }
+    /**
+     * Sets when the file is synced to disk. This takes effect when the
+     * store is next opened.
+     * @param mode The sync mode.
+     */
+    void set_sync_mode(SyncMode mode) { opts_.sync_mode = int(mode); }
+    /**
+     * Gets the longest time between a write and the sync that covers it,
+     * for @ref GROUP_SYNC.
+     * @return The sync interval.
+     */
+    std::chrono::milliseconds get_sync_interval() const {
+        return std::chrono::milliseconds(opts_.sync_interval);
+    }
+    /**
+     * Sets the longest time between a write and the sync that covers it,
+     * for @ref GROUP_SYNC. This takes effect when the store is next opened.
+     * @param interval The sync interval.
+     */
+    template <class Rep, class Period>
+    void set_sync_interval(const std::chrono::duration<Rep, Period>& interval) {
+        opts_.sync_interval = (int)to_milliseconds_count(interval);
+    }
+    /**
+     * Determines if the store is open.
+     * @return @em true if the store is open, @em false if not.
+     */
+    bool is_open() const { return handle_ != nullptr; }
+
+    /**
+     * Opens the persistence file for the client, creating it if necessary.
+     * @param clientId The identifier string for the client.
+     * @param serverURI The server to which the client is connected.
+     */
+    void open(const string& clientId, const string& serverURI) override;
+    /**
+     * Syncs and closes the persistence file.
+     */
+    void close() override;
+    /**
+     * Removes all the records from the store.
+     */
+    void clear() override;
+    /**
+     * Returns whether or not data is persisted using the specified key.
+     * @param key The key to find
+     * @return @em true if the key exists, @em false if not.
+     */
+    bool contains_key(const string& key) override;
+    /**
+     * Returns the keys in the store.
+     * @return A collection of the keys in the store.
+     */
+    string_collection keys() const override;
+    /**
+     * Puts the specified data into the store.
+     * @param key The key.
+     * @param bufs The data to store
+     */
+    void put(const string& key, const std::vector<string_view>& bufs) override;
+    /**
+     * Gets the specified data out of the store.
+     * @param key The key
+     * @return A copy of the data associated with the key.
+     */
+    string get(const string& key) const override;
+    /**
+     * Removes the data for the specified key.
+     * @param key The key
+     */
+    void remove(const string& key) override;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+}  // namespace mqtt
+
+#endif  // __mqtt_ring_persistence_h
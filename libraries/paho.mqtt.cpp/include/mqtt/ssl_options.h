@@ -64,6 +64,13 @@ public:
         const string& hint, char* identity, size_t max_identity_len, unsigned char* psk,
         size_t max_psk_len
     )>;
+    /**
+     * Counters for the library-wide cache of TLS contexts and sessions.
+     * Connections with the same TLS options share a context, and a
+     * reconnect to the same server resumes its previous session rather
+     * than doing a full handshake.
+     */
+    using cache_stats = MQTTAsync_SSLCacheStats;
 
 private:
     /** The default C struct */
@@ -360,6 +367,12 @@ public:
      * @param protos The list of ALPN protocols to be negotiated.
      */
     void set_alpn_protos(const std::vector<string>& protos);
+    /**
+     * Gets the current counters of the TLS context and session cache,
+     * shared by all the clients in the process.
+     * @return The TLS cache counters.
+     */
+    static cache_stats get_cache_stats();
 };
 
 /**
@@ -344,6 +344,29 @@ public:
         notFullCond_.notify_one();
         return true;
     }
+    /**
+     * Removes all the values in the queue without blocking.
+     * This takes the lock once for the whole batch, so it is cheaper than
+     * repeated calls to try_get() for draining the queue.
+     * @param vals Pointer to a container to receive the values, which are
+     *  		   appended to it in the order they were queued.
+     * @return The number of values removed from the queue.
+     */
+    template <class OutContainer>
+    size_type try_get_all(OutContainer* vals) {
+        if (!vals)
+            return 0;
+
+        guard g{lock_};
+        size_type n = que_.size();
+        while (!que_.empty()) {
+            vals->push_back(std::move(que_.front()));
+            que_.pop();
+        }
+        if (n > 0)
+            notFullCond_.notify_all();
+        return n;
+    }
     /**
      * Attempt to remove an item from the queue for a bounded amount of time.
      * This will retrieve the next item from the queue. If the queue is
@@ -21,11 +21,20 @@
 
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <mutex>
 #include <thread>
 
+#if defined(__linux__)
+    #include <sys/eventfd.h>
+#endif
+#if !defined(_WIN32)
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
 #include "mqtt/disconnect_options.h"
 #include "mqtt/message.h"
 #include "mqtt/response_options.h"
@@ -66,6 +75,14 @@ void async_client::create()
             const_cast<char*>(dir->c_str()), &copts
         );
     }
+    else if (const auto logp{std::get_if<log_persistence>(&opts.persistence_)}; logp) {
+        // The C library takes a copy of the options
+        auto logopts{logp->c_struct()};
+        rc = MQTTAsync_createWithOptions(
+            &cli_, serverURI.c_str(), clientId.c_str(), MQTTCLIENT_PERSISTENCE_LOG, &logopts,
+            &copts
+        );
+    }
     else {
         persist_.reset(new MQTTClient_persistence{
             *userp, &iclient_persistence::persistence_open,
@@ -82,9 +99,47 @@ void async_client::create()
     }
     if (rc != MQTTASYNC_SUCCESS)
         throw exception(rc);
+
+    if (opts.get_notify_fd()) {
+        try {
+            create_notify_fd();
+        }
+        catch (...) {
+            MQTTAsync_destroy(&cli_);
+            throw;
+        }
+    }
 }
 
-async_client::~async_client() { MQTTAsync_destroy(&cli_); }
+void async_client::create_notify_fd()
+{
+#if defined(__linux__)
+    notifyFd_ = notifyWriteFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif !defined(_WIN32)
+    int fds[2];
+    if (::pipe(fds) == 0) {
+        for (int fd : fds) {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        notifyFd_ = fds[0];
+        notifyWriteFd_ = fds[1];
+    }
+#endif
+    if (notifyFd_ < 0)
+        throw exception(MQTTASYNC_FAILURE, "Can't create the notification descriptor");
+}
+
+async_client::~async_client()
+{
+    MQTTAsync_destroy(&cli_);
+#if !defined(_WIN32)
+    if (notifyWriteFd_ >= 0 && notifyWriteFd_ != notifyFd_)
+        ::close(notifyWriteFd_);
+    if (notifyFd_ >= 0)
+        ::close(notifyFd_);
+#endif
+}
 
 // --------------------------------------------------------------------------
 // Class static callbacks.
@@ -120,8 +175,10 @@ void async_client::on_connected(void* context, char* cause)
         if (connHandler)
             connHandler(cause_str);
 
-        if (que)
+        if (que) {
             que->put(connected_event{cause_str});
+            cli->notify();
+        }
     }
 }
 
@@ -151,8 +208,10 @@ void async_client::on_connection_lost(void* context, char* cause)
         if (connLostHandler)
             connLostHandler(cause_str);
 
-        if (que)
+        if (que) {
             que->put(connection_lost_event{cause_str});
+            cli->notify();
+        }
     }
 }
 
@@ -176,8 +235,10 @@ void async_client::on_disconnected(
         if (disconnectedHandler)
             disconnectedHandler(props, ReasonCode(reasonCode));
 
-        if (que)
+        if (que) {
             que->put(disconnected_event{std::move(props), ReasonCode(reasonCode)});
+            cli->notify();
+        }
     }
 }
 
@@ -198,8 +259,26 @@ int async_client::on_message_arrived(
 
     if (cb || que || msgHandler) {
         size_t len = (topicLen == 0) ? strlen(topicName) : size_t(topicLen);
+        string_ref topic;
+
+        // Messages arriving with the same topic alias share one topic string
+        auto alias = ::MQTTProperties_getNumericValue(&msg->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+
+        if (alias > 0 && alias <= 65535) {
+            auto& topics = cli->aliasTopics_;
+            if (size_t(alias) > topics.size())
+                topics.resize(size_t(alias));
+
+            auto& aliasTopic = topics[size_t(alias - 1)];
+            if (!aliasTopic || aliasTopic.size() != len ||
+                std::memcmp(aliasTopic.data(), topicName, len) != 0)
+                aliasTopic = string_ref{topicName, len};
+            topic = aliasTopic;
+        }
+        else {
+            topic = string_ref{topicName, len};
+        }
 
-        string topic{topicName, len};
         auto m = message::create(std::move(topic), *msg);
 
         if (msgHandler)
@@ -208,8 +287,10 @@ int async_client::on_message_arrived(
         if (cb)
             cb->message_arrived(m);
 
-        if (que)
+        if (que) {
             que->put(m);
+            cli->notify();
+        }
     }
 
     MQTTAsync_freeMessage(&msg);
@@ -290,6 +371,11 @@ void async_client::remove_token(token* tok)
             delivery_token_ptr dtok = *p;
             pendingDeliveryTokens_.erase(p);
 
+            if (notifyFd_ >= 0) {
+                completedTokens_.push_back(dtok);
+                notify();
+            }
+
             // If there's a user callback registered, we can now call
             // delivery_complete()
 
@@ -306,12 +392,35 @@ void async_client::remove_token(token* tok)
     }
     for (auto p = pendingTokens_.begin(); p != pendingTokens_.end(); ++p) {
         if (p->get() == tok) {
+            if (notifyFd_ >= 0) {
+                completedTokens_.push_back(*p);
+                notify();
+            }
             pendingTokens_.erase(p);
             return;
         }
     }
 }
 
+// The descriptor is only written when it goes from clear to signaled, so a
+// burst of events costs one system call, and one wakeup of the reader.
+
+void async_client::notify()
+{
+    if (notifyWriteFd_ < 0 || notified_.exchange(true))
+        return;
+
+#if defined(__linux__)
+    uint64_t one = 1;
+    auto n = ::write(notifyWriteFd_, &one, sizeof(one));
+    UNUSED(n);
+#elif !defined(_WIN32)
+    char c = 0;
+    auto n = ::write(notifyWriteFd_, &c, 1);
+    UNUSED(n);
+#endif
+}
+
 // --------------------------------------------------------------------------
 // Callback management
 
@@ -561,6 +670,108 @@ std::vector<delivery_token_ptr> async_client::get_pending_delivery_tokens() cons
     return toks;
 }
 
+int async_client::get_inflight_window() const
+{
+    int window = 0;
+    int rc = MQTTAsync_getInflightWindow(cli_, &window, nullptr);
+    if (rc != MQTTASYNC_SUCCESS)
+        throw exception(rc);
+    return window;
+}
+
+std::chrono::microseconds async_client::get_rtt_estimate() const
+{
+    int window = 0, rtt = 0;
+    int rc = MQTTAsync_getInflightWindow(cli_, &window, &rtt);
+    if (rc != MQTTASYNC_SUCCESS)
+        throw exception(rc);
+    return std::chrono::microseconds(rtt);
+}
+
+async_client::buffer_stats async_client::get_buffer_stats() const
+{
+    buffer_stats stats;
+    int rc = MQTTAsync_getBufferStats(cli_, &stats);
+    if (rc != MQTTASYNC_SUCCESS)
+        throw exception(rc);
+    return stats;
+}
+
+int async_client::get_shard() const
+{
+    int shard = MQTTAsync_getShard(cli_);
+    if (shard < 0)
+        throw exception(shard);
+    return shard;
+}
+
+void async_client::set_io_shards(int n)
+{
+    if (n < 1 || n > MQTTASYNC_MAX_SHARDS)
+        throw std::invalid_argument("Number of I/O shards out of range");
+
+    MQTTAsync_init_options opts = MQTTAsync_init_options_initializer;
+    opts.ioShards = n;
+    MQTTAsync_global_init(&opts);
+}
+
+async_client::slab_info async_client::get_slab_info()
+{
+    slab_info info = MQTTAsync_slabInfo_initializer;
+    MQTTAsync_getSlabInfo(&info);
+    return info;
+}
+
+int async_client::get_loop_socket(bool* wantWrite /*=nullptr*/) const
+{
+    int want = 0;
+    int sock = MQTTAsync_getLoopSocket(cli_, &want);
+    if (sock < -1)
+        throw exception(sock);
+    if (wantWrite)
+        *wantWrite = to_bool(want);
+    return sock;
+}
+
+std::chrono::milliseconds async_client::get_loop_timeout() const
+{
+    int ms = MQTTAsync_getLoopTimeout(cli_);
+    if (ms < -1)
+        throw exception(ms);
+    return std::chrono::milliseconds(ms);
+}
+
+void async_client::run_once(int timeout /*=0*/)
+{
+    int rc = MQTTAsync_runOnce(cli_, timeout);
+    if (rc != MQTTASYNC_SUCCESS)
+        throw exception(rc);
+}
+
+bool async_client::clear_notify()
+{
+    if (notifyFd_ < 0)
+        return false;
+
+    bool signaled = false;
+#if !defined(_WIN32)
+    uint64_t buf;
+    while (::read(notifyFd_, &buf, sizeof(buf)) > 0) signaled = true;
+#endif
+    // Only after emptying the descriptor, so that an event signaled from
+    // now on writes to it again.
+    notified_ = false;
+    return signaled;
+}
+
+std::vector<token_ptr> async_client::try_consume_tokens()
+{
+    std::vector<token_ptr> toks;
+    guard g(lock_);
+    toks.swap(completedTokens_);
+    return toks;
+}
+
 // --------------------------------------------------------------------------
 // Publish
 
@@ -597,6 +808,9 @@ delivery_token_ptr async_client::publish(const_message_ptr msg)
     add_token(tok);
 
     delivery_response_options rspOpts(tok, mqttVersion_);
+    rspOpts.opts_.priority = msg->get_priority();
+    if (!msg->get_coalesce_key().empty())
+        rspOpts.opts_.coalesceKey = msg->get_coalesce_key().c_str();
 
     int rc =
         MQTTAsync_sendMessage(cli_, msg->get_topic().c_str(), &(msg->msg_), &rspOpts.opts_);
@@ -620,6 +834,9 @@ delivery_token_ptr async_client::publish(
     add_token(tok);
 
     delivery_response_options rspOpts(tok, mqttVersion_);
+    rspOpts.opts_.priority = msg->get_priority();
+    if (!msg->get_coalesce_key().empty())
+        rspOpts.opts_.coalesceKey = msg->get_coalesce_key().c_str();
 
     int rc =
         MQTTAsync_sendMessage(cli_, msg->get_topic().c_str(), &(msg->msg_), &rspOpts.opts_);
@@ -635,6 +852,57 @@ delivery_token_ptr async_client::publish(
     return tok;
 }
 
+std::vector<delivery_token_ptr> async_client::publish_many(
+    const std::vector<const_message_ptr>& msgs
+)
+{
+    const size_t n = msgs.size();
+
+    std::vector<delivery_token_ptr> toks;
+    std::vector<char*> topics;
+    std::vector<MQTTAsync_message> cmsgs;
+    std::vector<MQTTAsync_responseOptions> rsps;
+
+    toks.reserve(n);
+    topics.reserve(n);
+    cmsgs.reserve(n);
+    rsps.reserve(n);
+
+    for (const auto& msg : msgs) {
+        auto tok = delivery_token::create(*this, msg);
+        add_token(tok);
+
+        delivery_response_options rspOpts(tok, mqttVersion_);
+        rspOpts.opts_.priority = msg->get_priority();
+        if (!msg->get_coalesce_key().empty())
+            rspOpts.opts_.coalesceKey = msg->get_coalesce_key().c_str();
+
+        toks.push_back(std::move(tok));
+        topics.push_back(const_cast<char*>(msg->get_topic().c_str()));
+        cmsgs.push_back(msg->msg_);
+        rsps.push_back(rspOpts.opts_);
+    }
+
+    int nAccepted = 0;
+    int rc = MQTTAsync_sendMany(
+        cli_, int(n), topics.data(), cmsgs.data(), rsps.data(), &nAccepted
+    );
+
+    for (size_t i = 0; i < size_t(nAccepted); ++i) toks[i]->set_message_id(rsps[i].token);
+
+    if (rc == MQTTASYNC_PERSISTENCE_ERROR && size_t(nAccepted) == n)
+        throw exception(rc);
+
+    // The rest were never queued, so fail their tokens here
+    for (size_t i = size_t(nAccepted); i < n; ++i) {
+        MQTTAsync_failureData rsp{};
+        rsp.code = rc;
+        toks[i]->on_failure(&rsp);
+    }
+
+    return toks;
+}
+
 // --------------------------------------------------------------------------
 // Subscribe
 
@@ -911,6 +1179,16 @@ bool async_client::try_consume_event(event* evt)
     return res;
 }
 
+std::vector<event> async_client::try_consume_events()
+{
+    if (!que_)
+        throw mqtt::exception(-1, "Consumer not started");
+
+    std::vector<event> evts;
+    que_->try_get_all(&evts);
+    return evts;
+}
+
 const_message_ptr async_client::consume_message()
 {
     if (!que_)
@@ -335,6 +335,25 @@ void connect_options::set_properties(properties&& props)
     opts_.MQTTVersion = MQTTVERSION_5;
 }
 
+uint16_t connect_options::get_topic_alias_maximum() const
+{
+    return props_.contains(property::TOPIC_ALIAS_MAXIMUM)
+               ? get<uint16_t>(props_, property::TOPIC_ALIAS_MAXIMUM)
+               : uint16_t(0);
+}
+
+void connect_options::set_topic_alias_maximum(uint16_t n)
+{
+    properties props;
+    for (const auto& prop : props_) {
+        if (prop.type() != property::TOPIC_ALIAS_MAXIMUM)
+            props.add(prop);
+    }
+    if (n > 0)
+        props.add(property{property::TOPIC_ALIAS_MAXIMUM, int32_t(n)});
+    set_properties(std::move(props));
+}
+
 void connect_options::set_http_proxy(const string& httpProxy)
 {
     httpProxy_ = httpProxy;
@@ -41,6 +41,7 @@ create_options& create_options::operator=(const create_options& rhs)
         serverURI_ = rhs.serverURI_;
         clientId_ = rhs.clientId_;
         persistence_ = rhs.persistence_;
+        notifyFd_ = rhs.notifyFd_;
     }
     return *this;
 }
@@ -52,6 +53,7 @@ create_options& create_options::operator=(create_options&& rhs)
         serverURI_ = std::move(rhs.serverURI_);
         clientId_ = std::move(rhs.clientId_);
         persistence_ = std::move(rhs.persistence_);
+        notifyFd_ = rhs.notifyFd_;
     }
     return *this;
 }
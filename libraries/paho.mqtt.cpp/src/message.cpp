@@ -65,14 +65,22 @@ message::message(string_ref topic, const MQTTAsync_message& cmsg)
 }
 
 message::message(const message& other)
-    : msg_(other.msg_), topic_(other.topic_), props_(other.props_)
+    : msg_(other.msg_),
+      topic_(other.topic_),
+      props_(other.props_),
+      priority_(other.priority_),
+      coalesceKey_(other.coalesceKey_)
 {
     set_payload(other.payload_);
     msg_.properties = props_.c_struct();
 }
 
 message::message(message&& other)
-    : msg_(other.msg_), topic_(std::move(other.topic_)), props_(std::move(other.props_))
+    : msg_(other.msg_),
+      topic_(std::move(other.topic_)),
+      props_(std::move(other.props_)),
+      priority_(other.priority_),
+      coalesceKey_(std::move(other.coalesceKey_))
 {
     set_payload(std::move(other.payload_));
     other.msg_.payloadlen = 0;
@@ -87,6 +95,8 @@ message& message::operator=(const message& rhs)
         topic_ = rhs.topic_;
         set_payload(rhs.payload_);
         set_properties(rhs.props_);
+        priority_ = rhs.priority_;
+        coalesceKey_ = rhs.coalesceKey_;
     }
     return *this;
 }
@@ -98,6 +108,8 @@ message& message::operator=(message&& rhs)
         topic_ = std::move(rhs.topic_);
         set_payload(std::move(rhs.payload_));
         set_properties(std::move(rhs.props_));
+        priority_ = rhs.priority_;
+        coalesceKey_ = std::move(rhs.coalesceKey_);
 
         rhs.msg_ = DFLT_C_STRUCT;
     }
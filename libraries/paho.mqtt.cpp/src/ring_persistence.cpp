@@ -0,0 +1,164 @@
+// ring_persistence.cpp
+
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation and documentation
+ *******************************************************************************/
+
+#include "mqtt/ring_persistence.h"
+
+#include <vector>
+
+#include "mqtt/exception.h"
+
+namespace mqtt {
+
+/////////////////////////////////////////////////////////////////////////////
+
+ring_persistence::ring_persistence(const string& dir, size_t slotSize, size_t slotCount)
+    : dir_{dir}
+{
+    opts_.slot_size = int(slotSize);
+    opts_.slot_count = int(slotCount);
+}
+
+ring_persistence::~ring_persistence()
+{
+    try {
+        close();
+    }
+    catch (...) {
+    }
+}
+
+void* ring_persistence::handle() const
+{
+    if (!handle_)
+        throw persistence_exception("Ring persistence is not open");
+    return handle_;
+}
+
+void ring_persistence::open(const string& clientId, const string& serverURI)
+{
+    if (handle_)
+        throw persistence_exception("Ring persistence is already open");
+
+    auto opts{opts_};
+    opts.directory = dir_.empty() ? nullptr : dir_.c_str();
+
+    int rc = MQTTClient_createRingPersistence(&per_, &opts);
+    if (rc != MQTTASYNC_SUCCESS)
+        throw persistence_exception(rc);
+
+    rc = per_->popen(&handle_, clientId.c_str(), serverURI.c_str(), per_->context);
+    if (rc != MQTTASYNC_SUCCESS) {
+        handle_ = nullptr;
+        MQTTClient_freeRingPersistence(&per_);
+        throw persistence_exception(rc);
+    }
+}
+
+void ring_persistence::close()
+{
+    if (!handle_)
+        return;
+
+    int rc = per_->pclose(handle_);
+    handle_ = nullptr;
+    MQTTClient_freeRingPersistence(&per_);
+
+    if (rc != MQTTASYNC_SUCCESS)
+        throw persistence_exception(rc);
+}
+
+void ring_persistence::clear()
+{
+    void* h = handle();
+
+    int rc = per_->pclear(h);
+    if (rc != MQTTASYNC_SUCCESS)
+        throw persistence_exception(rc);
+}
+
+bool ring_persistence::contains_key(const string& key)
+{
+    void* h = handle();
+    return per_->pcontainskey(h, const_cast<char*>(key.c_str())) == MQTTASYNC_SUCCESS;
+}
+
+string_collection ring_persistence::keys() const
+{
+    void* h = handle();
+    char** keys = nullptr;
+    int nkeys = 0;
+
+    int rc = per_->pkeys(h, &keys, &nkeys);
+    if (rc != MQTTASYNC_SUCCESS)
+        throw persistence_exception(rc);
+
+    string_collection coll;
+    for (int i = 0; i < nkeys; ++i) {
+        coll.push_back(string(keys[i]));
+        MQTTAsync_free(keys[i]);
+    }
+    if (keys)
+        MQTTAsync_free(keys);
+    return coll;
+}
+
+void ring_persistence::put(const string& key, const std::vector<string_view>& bufs)
+{
+    void* h = handle();
+    std::vector<char*> buffers;
+    std::vector<int> buflens;
+
+    for (const auto& buf : bufs) {
+        buffers.push_back(const_cast<char*>(buf.data()));
+        buflens.push_back(int(buf.size()));
+    }
+
+    int rc = per_->pput(
+        h, const_cast<char*>(key.c_str()), int(bufs.size()), buffers.data(), buflens.data()
+    );
+    if (rc != MQTTASYNC_SUCCESS)
+        throw persistence_exception(rc);
+}
+
+string ring_persistence::get(const string& key) const
+{
+    void* h = handle();
+    char* buffer = nullptr;
+    int buflen = 0;
+
+    int rc = per_->pget(h, const_cast<char*>(key.c_str()), &buffer, &buflen);
+    if (rc != MQTTASYNC_SUCCESS)
+        throw persistence_exception(rc);
+
+    string data(buffer, size_t(buflen));
+    MQTTAsync_free(buffer);
+    return data;
+}
+
+void ring_persistence::remove(const string& key)
+{
+    void* h = handle();
+
+    int rc = per_->premove(h, const_cast<char*>(key.c_str()));
+    if (rc != MQTTASYNC_SUCCESS)
+        throw persistence_exception(rc);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// end namespace mqtt
+}  // namespace mqtt
@@ -341,5 +341,12 @@ void ssl_options::set_alpn_protos(const std::vector<string>& protos)
     }
 }
 
+ssl_options::cache_stats ssl_options::get_cache_stats()
+{
+    cache_stats stats;
+    MQTTAsync_getSSLCacheStats(&stats);
+    return stats;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 }  // namespace mqtt
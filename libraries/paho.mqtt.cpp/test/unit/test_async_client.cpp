@@ -22,6 +22,14 @@
  *******************************************************************************/
 #define UNIT_TESTS
 
+#include <functional>
+#include <future>
+#include <thread>
+
+#if !defined(_WIN32)
+    #include <poll.h>
+#endif
+
 #include "catch2_version.h"
 #include "mock_action_listener.h"
 #include "mock_callback.h"
@@ -106,6 +114,14 @@ TEST_CASE("async_client user constructor 3 string args", "[client]")
     REQUIRE(CLIENT_ID == cli.get_client_id());
 }
 
+TEST_CASE("async_client user constructor log persistence", "[client]")
+{
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID, log_persistence{"persist-log"}};
+
+    REQUIRE(GOOD_SERVER_URI == cli.get_server_uri());
+    REQUIRE(CLIENT_ID == cli.get_client_id());
+}
+
 TEST_CASE("async_client user constructor 3 args", "[client]")
 {
     mock_persistence cp;
@@ -616,6 +632,425 @@ TEST_CASE("async_client publish 7 args", "[client]")
     REQUIRE(!cli.is_connected());
 }
 
+TEST_CASE("async_client publish many", "[client]")
+{
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID};
+
+    token_ptr conn_tok{cli.connect()};
+    REQUIRE(conn_tok);
+    conn_tok->wait();
+    REQUIRE(cli.is_connected());
+
+    REQUIRE(cli.publish_many({}).empty());
+
+    std::vector<const_message_ptr> msgs{
+        message::create(TOPIC, PAYLOAD, 1, false), message::create(TOPIC, PAYLOAD, 1, false),
+        message::create(TOPIC, PAYLOAD, 0, false)
+    };
+
+    auto toks = cli.publish_many(msgs);
+    REQUIRE(msgs.size() == toks.size());
+
+    for (size_t i = 0; i < toks.size(); ++i) {
+        REQUIRE(toks[i]->get_message() == msgs[i]);
+        REQUIRE(toks[i]->wait_for(TIMEOUT));
+        REQUIRE(MQTTASYNC_SUCCESS == toks[i]->get_return_code());
+    }
+    REQUIRE(toks[0]->get_message_id() > 0);
+    REQUIRE(toks[1]->get_message_id() > 0);
+    REQUIRE(toks[0]->get_message_id() != toks[1]->get_message_id());
+
+    // A bad topic is refused, and the messages after it are not attempted
+    msgs[1] = message::create("bad\xff", PAYLOAD, 1, false);
+
+    toks = cli.publish_many(msgs);
+    REQUIRE(msgs.size() == toks.size());
+
+    REQUIRE(toks[0]->wait_for(TIMEOUT));
+    REQUIRE(MQTTASYNC_SUCCESS == toks[0]->get_return_code());
+    REQUIRE(toks[1]->is_complete());
+    REQUIRE(MQTTASYNC_BAD_UTF8_STRING == toks[1]->get_return_code());
+    REQUIRE(toks[2]->is_complete());
+    REQUIRE(MQTTASYNC_BAD_UTF8_STRING == toks[2]->get_return_code());
+    REQUIRE_THROWS_AS(toks[2]->wait(), mqtt::exception);
+
+    token_ptr disconn_tok{cli.disconnect()};
+    REQUIRE(disconn_tok);
+    disconn_tok->wait();
+}
+
+TEST_CASE("async_client publish many failure", "[client]")
+{
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID};
+    REQUIRE(!cli.is_connected());
+
+    std::vector<const_message_ptr> msgs{
+        message::create(TOPIC, PAYLOAD), message::create(TOPIC, PAYLOAD)
+    };
+
+    auto toks = cli.publish_many(msgs);
+    REQUIRE(msgs.size() == toks.size());
+
+    for (const auto& tok : toks) {
+        REQUIRE(tok->is_complete());
+        REQUIRE(MQTTASYNC_DISCONNECTED == tok->get_return_code());
+    }
+    REQUIRE(cli.get_pending_delivery_tokens().empty());
+}
+
+//----------------------------------------------------------------------
+// Test async_client::get_inflight_window() and get_rtt_estimate()
+//----------------------------------------------------------------------
+
+TEST_CASE("async_client inflight window", "[client]")
+{
+    const int MAX_INFLIGHT = 20;
+
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID};
+    REQUIRE(!cli.is_connected());
+
+    auto opts = connect_options_builder()
+                    .max_inflight(MAX_INFLIGHT)
+                    .inflight_target_rtt(std::chrono::seconds(5))
+                    .finalize();
+
+    REQUIRE(0 == cli.get_rtt_estimate().count());
+
+    token_ptr conn_tok{cli.connect(opts)};
+    REQUIRE(conn_tok);
+    conn_tok->wait();
+    REQUIRE(cli.is_connected());
+
+    int window = cli.get_inflight_window();
+    REQUIRE(0 < window);
+    REQUIRE(window < MAX_INFLIGHT);
+
+    message_ptr msg{message::create(TOPIC, PAYLOAD, 1, false)};
+    for (int i = 0; i < 3; ++i) {
+        delivery_token_ptr token_pub{cli.publish(msg)};
+        REQUIRE(token_pub);
+        token_pub->wait_for(TIMEOUT);
+    }
+
+    REQUIRE(window <= cli.get_inflight_window());
+    REQUIRE(cli.get_inflight_window() <= MAX_INFLIGHT);
+    REQUIRE(0 < cli.get_rtt_estimate().count());
+
+    token_ptr disconn_tok{cli.disconnect()};
+    REQUIRE(disconn_tok);
+    disconn_tok->wait();
+    REQUIRE(!cli.is_connected());
+}
+
+//----------------------------------------------------------------------
+// Test the byte limit of the offline buffer
+//----------------------------------------------------------------------
+
+TEST_CASE("async_client buffer byte limit", "[client]")
+{
+    const size_t MSG_BYTES = PAYLOAD.size() + TOPIC.size() + 1;
+    const int N = 4;
+
+    SECTION("refuse newest")
+    {
+        auto opts = create_options_builder()
+                        .send_while_disconnected(true, true)
+                        .max_buffered_bytes(N * MSG_BYTES)
+                        .finalize();
+        async_client cli{GOOD_SERVER_URI, CLIENT_ID, opts};
+
+        for (int i = 0; i < N; ++i) cli.publish(TOPIC, PAYLOAD);
+
+        int rc = 0;
+        try {
+            cli.publish(TOPIC, PAYLOAD);
+        }
+        catch (const mqtt::exception& ex) {
+            rc = ex.get_return_code();
+        }
+        REQUIRE(MQTTASYNC_MAX_BUFFERED_MESSAGES == rc);
+
+        auto stats = cli.get_buffer_stats();
+        REQUIRE(N == stats.bufferedMessages);
+        REQUIRE(N * MSG_BYTES == stats.bufferedBytes);
+        REQUIRE(1 == stats.droppedMessages);
+        REQUIRE(MSG_BYTES == stats.droppedBytes);
+    }
+
+    SECTION("delete oldest")
+    {
+        auto opts = create_options_builder()
+                        .send_while_disconnected(true, true)
+                        .max_buffered_bytes(N * MSG_BYTES)
+                        .delete_oldest_messages()
+                        .finalize();
+        async_client cli{GOOD_SERVER_URI, CLIENT_ID, opts};
+
+        for (int i = 0; i < 3 * N; ++i) cli.publish(TOPIC, PAYLOAD);
+
+        auto stats = cli.get_buffer_stats();
+        REQUIRE(N == stats.bufferedMessages);
+        REQUIRE(N * MSG_BYTES == stats.bufferedBytes);
+        REQUIRE(2 * N == int(stats.droppedMessages));
+        REQUIRE(2 * N * MSG_BYTES == stats.droppedBytes);
+    }
+}
+
+//----------------------------------------------------------------------
+// Test that buffered messages with a coalescing key are replaced
+//----------------------------------------------------------------------
+
+TEST_CASE("async_client coalesce key", "[client]")
+{
+    auto opts = create_options_builder().send_while_disconnected(true, true).finalize();
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID, opts};
+
+    auto keyed = [](const std::string& payload) {
+        return message_ptr_builder()
+            .topic(TOPIC)
+            .payload(payload)
+            .coalesce_key("presence")
+            .finalize();
+    };
+
+    auto tok1 = cli.publish(keyed("away"));
+    auto tok2 = cli.publish(TOPIC, PAYLOAD);
+    auto tok3 = cli.publish(keyed("busy"));
+    auto tok4 = cli.publish(keyed("online"));
+
+    auto stats = cli.get_buffer_stats();
+    REQUIRE(2 == stats.bufferedMessages);
+    REQUIRE(0 == stats.droppedMessages);
+
+    // The replaced tokens are failed by the send thread, once it runs
+    cli.connect()->wait();
+
+    REQUIRE_THROWS_AS(tok1->wait_for(TIMEOUT), mqtt::exception);
+    REQUIRE(MQTTASYNC_SUPERSEDED == tok1->get_return_code());
+    REQUIRE_THROWS_AS(tok3->wait_for(TIMEOUT), mqtt::exception);
+    REQUIRE(MQTTASYNC_SUPERSEDED == tok3->get_return_code());
+    REQUIRE(tok2->wait_for(TIMEOUT));
+    REQUIRE(tok4->wait_for(TIMEOUT));
+
+    cli.disconnect()->wait();
+}
+
+// A listener of a replaced message can publish from its failure callback
+
+TEST_CASE("async_client coalesce key republish", "[client]")
+{
+    auto opts = create_options_builder().send_while_disconnected(true, true).finalize();
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID, opts};
+
+    class republisher : public iaction_listener
+    {
+        async_client& cli_;
+        std::promise<delivery_token_ptr> republished_;
+
+        void on_success(const token&) override {}
+        void on_failure(const token& tok) override {
+            if (tok.get_return_code() == MQTTASYNC_SUPERSEDED)
+                republished_.set_value(cli_.publish(TOPIC, "again"));
+        }
+
+    public:
+        republisher(async_client& cli) : cli_(cli) {}
+        std::future<delivery_token_ptr> get_future() { return republished_.get_future(); }
+    };
+
+    republisher listener{cli};
+    auto republished = listener.get_future();
+
+    auto msg = message_ptr_builder().topic(TOPIC).payload("away").coalesce_key("presence").finalize();
+    auto tok1 = cli.publish(msg, nullptr, listener);
+    auto tok2 = cli.publish(
+        message_ptr_builder().topic(TOPIC).payload("online").coalesce_key("presence").finalize()
+    );
+
+    cli.connect()->wait();
+
+    REQUIRE(std::future_status::ready == republished.wait_for(std::chrono::seconds(5)));
+    auto tok3 = republished.get();
+    REQUIRE(tok3);
+    REQUIRE(tok3->wait_for(TIMEOUT));
+    REQUIRE(tok2->wait_for(TIMEOUT));
+    REQUIRE(MQTTASYNC_SUPERSEDED == tok1->get_return_code());
+
+    cli.disconnect()->wait();
+}
+
+TEST_CASE("async_client slab info", "[client]")
+{
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID};
+
+    auto info = async_client::get_slab_info();
+    REQUIRE(std::string(info.struct_id, 4) == "MQSI");
+
+    // A structure without the eyecatcher is refused
+    MQTTAsync_slabInfo bad{};
+    REQUIRE(MQTTASYNC_BAD_STRUCTURE == MQTTAsync_getSlabInfo(&bad));
+
+    // Without the slab allocator built in, there are no classes
+    REQUIRE(info.classes >= 0);
+    REQUIRE(info.classes <= MQTTASYNC_SLAB_CLASSES);
+
+    for (int i = 0; i < info.classes; ++i) {
+        const auto& ci = info.classInfo[i];
+        REQUIRE(ci.blockSize > 0);
+        REQUIRE(ci.inUse + ci.cached <= ci.blocks);
+        if (i > 0)
+            REQUIRE(ci.blockSize > info.classInfo[i - 1].blockSize);
+    }
+}
+
+//----------------------------------------------------------------------
+// Test the I/O shards
+//----------------------------------------------------------------------
+
+TEST_CASE("async_client io shards", "[client]")
+{
+    REQUIRE_THROWS_AS(async_client::set_io_shards(0), std::invalid_argument);
+
+    async_client::set_io_shards(4);
+    {
+        async_client cli0{GOOD_SERVER_URI, CLIENT_ID + "0", create_options_builder().shard(1).finalize()};
+        async_client cli1{GOOD_SERVER_URI, CLIENT_ID + "1", create_options_builder().shard(6).finalize()};
+        async_client cli2{GOOD_SERVER_URI, CLIENT_ID + "2"};
+        async_client cli3{GOOD_SERVER_URI, CLIENT_ID + "3"};
+
+        REQUIRE(1 == cli0.get_shard());
+        REQUIRE(2 == cli1.get_shard());
+        REQUIRE(cli2.get_shard() != cli3.get_shard());
+
+        token_ptr conn_tok{cli2.connect()};
+        REQUIRE(conn_tok);
+        conn_tok->wait();
+        REQUIRE(cli2.is_connected());
+
+        delivery_token_ptr pub_tok{cli2.publish(TOPIC, PAYLOAD, 1, false)};
+        REQUIRE(pub_tok);
+        REQUIRE(pub_tok->wait_for(TIMEOUT));
+
+        cli2.disconnect()->wait();
+        REQUIRE(!cli2.is_connected());
+    }
+    async_client::set_io_shards(1);
+
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID};
+    REQUIRE(0 == cli.get_shard());
+}
+
+//----------------------------------------------------------------------
+// Test a client driven by the application's event loop
+//----------------------------------------------------------------------
+
+TEST_CASE("async_client event loop", "[client]")
+{
+    async_client thr_cli{GOOD_SERVER_URI, CLIENT_ID};
+    REQUIRE_THROWS_AS(thr_cli.run_once(), exception);
+    REQUIRE_THROWS_AS(thr_cli.get_loop_socket(), exception);
+
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID, create_options_builder().event_loop().finalize()};
+    REQUIRE_THROWS_AS(cli.get_shard(), exception);
+    REQUIRE(-1 == cli.get_loop_socket());
+
+    std::thread::id loop_id = std::this_thread::get_id(), cb_id;
+    int n_arrived = 0;
+    cli.set_message_callback([&](const_message_ptr) {
+        cb_id = std::this_thread::get_id();
+        ++n_arrived;
+    });
+
+    auto run_until = [&cli](const std::function<bool()>& done) {
+        for (int i = 0; i < 500 && !done(); ++i) cli.run_once(std::chrono::milliseconds(10));
+        return done();
+    };
+
+    token_ptr conn_tok{cli.connect()};
+    REQUIRE(run_until([&] { return conn_tok->is_complete(); }));
+    REQUIRE(cli.is_connected());
+    REQUIRE(cli.get_loop_socket() > 0);
+
+    token_ptr sub_tok{cli.subscribe(TOPIC, 1)};
+    REQUIRE(run_until([&] { return sub_tok->is_complete(); }));
+
+    delivery_token_ptr pub_tok{cli.publish(TOPIC, PAYLOAD, 1, false)};
+    REQUIRE(run_until([&] { return pub_tok->is_complete() && n_arrived > 0; }));
+    REQUIRE(1 == n_arrived);
+    REQUIRE(loop_id == cb_id);
+
+    token_ptr disc_tok{cli.disconnect()};
+    REQUIRE(run_until([&] { return disc_tok->is_complete(); }));
+    REQUIRE(!cli.is_connected());
+}
+
+//----------------------------------------------------------------------
+// Test the notification descriptor
+//----------------------------------------------------------------------
+
+#if !defined(_WIN32)
+TEST_CASE("async_client notify fd", "[client]")
+{
+    async_client plain_cli{GOOD_SERVER_URI, CLIENT_ID};
+    REQUIRE(-1 == plain_cli.get_notify_fd());
+    REQUIRE(!plain_cli.clear_notify());
+
+    async_client cli{GOOD_SERVER_URI, CLIENT_ID, create_options_builder().notify_fd().finalize()};
+    int fd = cli.get_notify_fd();
+    REQUIRE(fd >= 0);
+    REQUIRE(!cli.clear_notify());
+
+    auto readable = [fd] {
+        pollfd pfd{fd, POLLIN, 0};
+        return ::poll(&pfd, 1, TIMEOUT) == 1;
+    };
+
+    cli.start_consuming();
+    token_ptr conn_tok{cli.connect()};
+    REQUIRE(readable());
+    REQUIRE(cli.clear_notify());
+
+    auto toks = cli.try_consume_tokens();
+    REQUIRE(toks.size() == 1);
+    REQUIRE(conn_tok == toks[0]);
+    REQUIRE(conn_tok->is_complete());
+
+    token_ptr sub_tok{cli.subscribe(TOPIC, 1)};
+    toks.clear();
+    while (toks.empty() && readable()) {
+        cli.clear_notify();
+        toks = cli.try_consume_tokens();
+    }
+    REQUIRE(toks.size() == 1);
+    REQUIRE(sub_tok == toks[0]);
+
+    delivery_token_ptr pub_tok{cli.publish(TOPIC, PAYLOAD, 1, false)};
+
+    // Drain until the message and the delivery token are both in
+    std::vector<const_message_ptr> msgs;
+    std::vector<token_ptr> done;
+    while ((msgs.empty() || done.empty()) && readable()) {
+        cli.clear_notify();
+        for (auto& evt : cli.try_consume_events()) {
+            if (const auto* pmsg = evt.get_message_if())
+                msgs.push_back(*pmsg);
+        }
+        for (auto& tok : cli.try_consume_tokens()) done.push_back(tok);
+    }
+    REQUIRE(done.size() == 1);
+    REQUIRE(pub_tok == done[0]);
+    REQUIRE(msgs.size() == 1);
+    REQUIRE(PAYLOAD == msgs[0]->get_payload_str());
+
+    // Nothing more to drain
+    REQUIRE(!cli.clear_notify());
+    REQUIRE(cli.try_consume_events().empty());
+
+    cli.disconnect()->wait();
+    cli.stop_consuming();
+}
+#endif
+
 //----------------------------------------------------------------------
 // Test async_client::set_callback()
 //----------------------------------------------------------------------
@@ -1029,3 +1464,133 @@ TEST_CASE("async_client consumer queue size", "[client]")
     cli.stop_consuming();
     cli.disconnect()->wait();
 }
+
+//----------------------------------------------------------------------
+// Test the index of the persisted commands, which lets a new client
+// restore its queue without reading every command record.
+// The C client is used, to see the tokens of the restored commands.
+//----------------------------------------------------------------------
+
+// A store which counts the records read from it
+class counting_persistence : public mock_persistence
+{
+public:
+    mutable int gets{0};
+
+    std::string get(const std::string& key) const override {
+        ++gets;
+        return mock_persistence::get(key);
+    }
+};
+
+static const std::string COMMAND_INDEX_KEY{"ci-"};
+
+static MQTTAsync create_buffering_client(MQTTClient_persistence& pers)
+{
+    MQTTAsync cli = nullptr;
+    MQTTAsync_createOptions opts = MQTTAsync_createOptions_initializer;
+    opts.sendWhileDisconnected = 1;
+    opts.allowDisconnectedSendAtAnyTime = 1;
+
+    REQUIRE(
+        MQTTASYNC_SUCCESS == MQTTAsync_createWithOptions(
+                                 &cli, GOOD_SERVER_URI.c_str(), CLIENT_ID.c_str(),
+                                 MQTTCLIENT_PERSISTENCE_USER, &pers, &opts
+                             )
+    );
+    return cli;
+}
+
+static void publish_buffered(MQTTAsync cli, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        MQTTAsync_responseOptions ropts = MQTTAsync_responseOptions_initializer;
+        REQUIRE(
+            MQTTASYNC_SUCCESS == MQTTAsync_send(
+                                     cli, TOPIC.c_str(), int(PAYLOAD.size()), PAYLOAD.data(),
+                                     1, 0, &ropts
+                                 )
+        );
+    }
+}
+
+static std::vector<MQTTAsync_token> pending_tokens(MQTTAsync cli)
+{
+    MQTTAsync_token* toks = nullptr;
+    REQUIRE(MQTTASYNC_SUCCESS == MQTTAsync_getPendingTokens(cli, &toks));
+
+    std::vector<MQTTAsync_token> v;
+    for (auto p = toks; p && *p != -1; ++p) v.push_back(*p);
+    MQTTAsync_free(toks);
+    return v;
+}
+
+TEST_CASE("async_client command index", "[client]")
+{
+    const int N = 3;
+
+    counting_persistence cp;
+    MQTTClient_persistence pers{
+        static_cast<iclient_persistence*>(&cp), &mock_persistence::persistence_open,
+        &mock_persistence::persistence_close,   &mock_persistence::persistence_put,
+        &mock_persistence::persistence_get,     &mock_persistence::persistence_remove,
+        &mock_persistence::persistence_keys,    &mock_persistence::persistence_clear,
+        &mock_persistence::persistence_containskey
+    };
+
+    MQTTAsync cli = create_buffering_client(pers);
+    publish_buffered(cli, N);
+    auto toks = pending_tokens(cli);
+    REQUIRE(N == int(toks.size()));
+    MQTTAsync_destroy(&cli);
+    REQUIRE(cp.contains_key(COMMAND_INDEX_KEY));
+
+    SECTION("restored from the index")
+    {
+        cp.gets = 0;
+        cli = create_buffering_client(pers);
+        REQUIRE(toks == pending_tokens(cli));
+        // Only the index is read
+        REQUIRE(1 == cp.gets);
+    }
+
+    SECTION("stale index")
+    {
+        auto stale = cp.get(COMMAND_INDEX_KEY);
+
+        cli = create_buffering_client(pers);
+        publish_buffered(cli, N);
+        toks = pending_tokens(cli);
+        REQUIRE(2 * N == int(toks.size()));
+        MQTTAsync_destroy(&cli);
+
+        cp.put(COMMAND_INDEX_KEY, {string_view{stale}});
+        cp.gets = 0;
+        cli = create_buffering_client(pers);
+        REQUIRE(toks == pending_tokens(cli));
+        // The newer commands are read from their records
+        REQUIRE(1 + N == cp.gets);
+    }
+
+    SECTION("deleted index")
+    {
+        cp.remove(COMMAND_INDEX_KEY);
+        cp.gets = 0;
+        cli = create_buffering_client(pers);
+        REQUIRE(toks == pending_tokens(cli));
+        REQUIRE(N == cp.gets);
+    }
+
+    SECTION("truncated index")
+    {
+        auto index = cp.get(COMMAND_INDEX_KEY);
+        cp.put(COMMAND_INDEX_KEY, {string_view{index.data(), index.size() - 1}});
+        cp.gets = 0;
+        cli = create_buffering_client(pers);
+        REQUIRE(toks == pending_tokens(cli));
+        // The index is read and ignored
+        REQUIRE(1 + N == cp.gets);
+    }
+
+    MQTTAsync_destroy(&cli);
+}
@@ -102,6 +102,12 @@ TEST_CASE("connect_options default ctor", "[options]")
 
     REQUIRE(nullptr == c_struct.httpProxy);
     REQUIRE(nullptr == c_struct.httpsProxy);
+
+    REQUIRE(0 == opts.get_outbound_topic_alias_maximum());
+    REQUIRE(0 == c_struct.outboundTopicAliasMaximum);
+
+    REQUIRE(0 == opts.get_inflight_target_rtt().count());
+    REQUIRE(0 == c_struct.inflightTargetRTT);
 }
 
 // ----------------------------------------------------------------------
@@ -579,6 +585,104 @@ TEST_CASE("set_token", "[options]")
     }
 }
 
+// ----------------------------------------------------------------------
+// Test setting the outbound topic alias maximum
+// ----------------------------------------------------------------------
+
+TEST_CASE("connect_options set_outbound_topic_alias_maximum", "[options]")
+{
+    auto opts = connect_options::v5();
+    const auto& c_struct = opts.c_struct();
+
+    REQUIRE(9 <= c_struct.struct_version);
+    REQUIRE(0 == opts.get_outbound_topic_alias_maximum());
+
+    opts.set_outbound_topic_alias_maximum(32);
+    REQUIRE(32 == opts.get_outbound_topic_alias_maximum());
+    REQUIRE(32 == c_struct.outboundTopicAliasMaximum);
+
+    // Negative values turn aliases off
+    opts.set_outbound_topic_alias_maximum(-1);
+    REQUIRE(0 == opts.get_outbound_topic_alias_maximum());
+
+    // Kept through a copy
+    opts.set_outbound_topic_alias_maximum(8);
+    connect_options copts{opts};
+    REQUIRE(8 == copts.get_outbound_topic_alias_maximum());
+
+    opts = connect_options_builder::v5().outbound_topic_alias_maximum(16).finalize();
+    REQUIRE(16 == opts.get_outbound_topic_alias_maximum());
+}
+
+// ----------------------------------------------------------------------
+// Test setting the topic alias maximum advertised to the server
+// ----------------------------------------------------------------------
+
+TEST_CASE("connect_options set_topic_alias_maximum", "[options]")
+{
+    const uint32_t INTERVAL = 80000;
+
+    connect_options opts;
+    opts.set_properties(properties{property{property::SESSION_EXPIRY_INTERVAL, INTERVAL}});
+    REQUIRE(0 == opts.get_topic_alias_maximum());
+
+    opts.set_topic_alias_maximum(64);
+    REQUIRE(64 == opts.get_topic_alias_maximum());
+    REQUIRE(MQTTVERSION_5 == opts.get_mqtt_version());
+
+    // Replaces any previous value, keeping the other properties
+    opts.set_topic_alias_maximum(10);
+    REQUIRE(10 == opts.get_topic_alias_maximum());
+
+    const auto& props = opts.get_properties();
+    REQUIRE(2 == props.size());
+    REQUIRE(1 == props.count(property::TOPIC_ALIAS_MAXIMUM));
+    REQUIRE(INTERVAL == get<uint32_t>(props, property::SESSION_EXPIRY_INTERVAL));
+
+    const auto& c_struct = opts.c_struct();
+    REQUIRE(&props.c_struct() == c_struct.connectProperties);
+    REQUIRE(
+        10 == MQTTProperties_getNumericValue(
+                  c_struct.connectProperties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM
+              )
+    );
+
+    // Zero removes it
+    opts.set_topic_alias_maximum(0);
+    REQUIRE(0 == opts.get_topic_alias_maximum());
+    REQUIRE(1 == opts.get_properties().size());
+
+    opts = connect_options_builder::v5().topic_alias_maximum(32).finalize();
+    REQUIRE(32 == opts.get_topic_alias_maximum());
+}
+
+// ----------------------------------------------------------------------
+// Test setting the target round trip time of the in-flight window
+// ----------------------------------------------------------------------
+
+TEST_CASE("connect_options set_inflight_target_rtt", "[options]")
+{
+    connect_options opts;
+    const auto& c_struct = opts.c_struct();
+
+    REQUIRE(10 <= c_struct.struct_version);
+    REQUIRE(0 == opts.get_inflight_target_rtt().count());
+
+    opts.set_inflight_target_rtt(std::chrono::milliseconds(250));
+    REQUIRE(250 == opts.get_inflight_target_rtt().count());
+    REQUIRE(250 == c_struct.inflightTargetRTT);
+
+    opts.set_inflight_target_rtt(std::chrono::seconds(2));
+    REQUIRE(2000 == c_struct.inflightTargetRTT);
+
+    // Negative values keep the window fixed
+    opts.set_inflight_target_rtt(std::chrono::milliseconds(-5));
+    REQUIRE(0 == opts.get_inflight_target_rtt().count());
+
+    opts = connect_options_builder().inflight_target_rtt(std::chrono::milliseconds(40)).finalize();
+    REQUIRE(40 == opts.get_inflight_target_rtt().count());
+}
+
 // ----------------------------------------------------------------------
 // Test the builder constructors
 // ----------------------------------------------------------------------
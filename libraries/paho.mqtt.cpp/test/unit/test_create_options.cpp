@@ -42,6 +42,12 @@ TEST_CASE("create_options default ctor", "[options]")
 
     REQUIRE(opts.get_restore_messages());
     REQUIRE(opts.get_persist_qos0());
+
+    REQUIRE(0 == opts.get_coalesce_bytes());
+    REQUIRE(std::chrono::microseconds(0) == opts.get_coalesce_delay());
+
+    REQUIRE(0 == opts.get_max_buffered_bytes());
+    REQUIRE(!opts.get_spill_buffered_messages());
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -75,3 +81,115 @@ TEST_CASE("create_options_builder sets", "[options]")
     REQUIRE(opts.get_restore_messages());
     REQUIRE(opts.get_persist_qos0());
 }
+
+TEST_CASE("create_options_builder coalescing", "[options]")
+{
+    const auto opts = create_options_builder()
+                          .coalesce_bytes(16 * 1024)
+                          .coalesce_delay(std::chrono::microseconds(250))
+                          .finalize();
+
+    REQUIRE(16 * 1024 == opts.get_coalesce_bytes());
+    REQUIRE(std::chrono::microseconds(250) == opts.get_coalesce_delay());
+}
+
+TEST_CASE("create_options set coalescing", "[options]")
+{
+    mqtt::create_options opts;
+
+    opts.set_coalesce_bytes(4096);
+    opts.set_coalesce_delay(std::chrono::milliseconds(2));
+
+    REQUIRE(4096 == opts.get_coalesce_bytes());
+    REQUIRE(std::chrono::microseconds(2000) == opts.get_coalesce_delay());
+}
+
+TEST_CASE("create_options_builder buffer bytes", "[options]")
+{
+    const auto opts = create_options_builder()
+                          .max_buffered_bytes(1024 * 1024)
+                          .spill_buffered_messages()
+                          .finalize();
+
+    REQUIRE(1024 * 1024 == opts.get_max_buffered_bytes());
+    REQUIRE(opts.get_spill_buffered_messages());
+}
+
+TEST_CASE("create_options set buffer bytes", "[options]")
+{
+    mqtt::create_options opts;
+
+    opts.set_max_buffered_bytes(64 * 1024);
+    opts.set_spill_buffered_messages(true);
+
+    REQUIRE(64 * 1024 == opts.get_max_buffered_bytes());
+    REQUIRE(opts.get_spill_buffered_messages());
+
+    opts.set_spill_buffered_messages(false);
+    REQUIRE(!opts.get_spill_buffered_messages());
+}
+
+TEST_CASE("create_options shard", "[options]")
+{
+    mqtt::create_options opts;
+    REQUIRE(-1 == opts.get_shard());
+
+    opts.set_shard(3);
+    REQUIRE(3 == opts.get_shard());
+
+    const auto bopts = create_options_builder().shard(2).finalize();
+    REQUIRE(2 == bopts.get_shard());
+}
+
+TEST_CASE("create_options event loop", "[options]")
+{
+    mqtt::create_options opts;
+    REQUIRE(!opts.get_event_loop());
+
+    opts.set_event_loop(true);
+    REQUIRE(opts.get_event_loop());
+
+    const auto bopts = create_options_builder().event_loop().finalize();
+    REQUIRE(bopts.get_event_loop());
+}
+
+TEST_CASE("create_options notify fd", "[options]")
+{
+    mqtt::create_options opts;
+    REQUIRE(!opts.get_notify_fd());
+
+    opts.set_notify_fd(true);
+    REQUIRE(opts.get_notify_fd());
+
+    const auto bopts = create_options_builder().notify_fd().finalize();
+    REQUIRE(bopts.get_notify_fd());
+
+    mqtt::create_options copts{bopts};
+    REQUIRE(copts.get_notify_fd());
+}
+
+TEST_CASE("create_options log persistence", "[options]")
+{
+    log_persistence logp{"persist"};
+
+    REQUIRE("persist" == logp.get_directory());
+    REQUIRE(log_persistence::GROUP_SYNC == logp.get_sync_mode());
+
+    logp.set_sync_mode(log_persistence::ALWAYS_SYNC);
+    logp.set_sync_interval(std::chrono::milliseconds(50));
+    logp.set_segment_size(1024 * 1024);
+    logp.set_compaction_threshold(75);
+
+    const auto opts = create_options_builder().persistence(logp).finalize();
+    const auto p = std::get_if<log_persistence>(&opts.get_persistence());
+
+    REQUIRE(p);
+    REQUIRE(log_persistence::ALWAYS_SYNC == p->get_sync_mode());
+    REQUIRE(std::chrono::milliseconds(50) == p->get_sync_interval());
+    REQUIRE(1024 * 1024 == p->get_segment_size());
+    REQUIRE(75 == p->get_compaction_threshold());
+
+    const auto copts = p->c_struct();
+    REQUIRE(0 == strcmp("persist", copts.directory));
+    REQUIRE(MQTTCLIENT_LOG_SYNC_ALWAYS == copts.sync_mode);
+}
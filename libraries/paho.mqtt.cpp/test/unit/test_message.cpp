@@ -365,6 +365,60 @@ TEST_CASE("validate qos", "[message]")
     REQUIRE_NOTHROW(mqtt::message::validate_qos(0));
 }
 
+// --------------------------------------------------------------------------
+// Test the priority, and that copies keep it
+// --------------------------------------------------------------------------
+
+TEST_CASE("priority", "[message]")
+{
+    mqtt::message msg;
+    REQUIRE(mqtt::message::PRIORITY_NORMAL == msg.get_priority());
+
+    msg.set_priority(mqtt::message::PRIORITY_HIGH);
+    REQUIRE(mqtt::message::PRIORITY_HIGH == msg.get_priority());
+
+    mqtt::message copy{msg};
+    REQUIRE(mqtt::message::PRIORITY_HIGH == copy.get_priority());
+
+    mqtt::message moved{std::move(copy)};
+    REQUIRE(mqtt::message::PRIORITY_HIGH == moved.get_priority());
+
+    mqtt::message assigned;
+    assigned = msg;
+    REQUIRE(mqtt::message::PRIORITY_HIGH == assigned.get_priority());
+
+    auto built = mqtt::message_ptr_builder().priority(mqtt::message::PRIORITY_LOW).finalize();
+    REQUIRE(mqtt::message::PRIORITY_LOW == built->get_priority());
+}
+
+// --------------------------------------------------------------------------
+// Test the coalescing key, and that copies keep it
+// --------------------------------------------------------------------------
+
+TEST_CASE("coalesce key", "[message]")
+{
+    const std::string KEY{"presence"};
+
+    mqtt::message msg;
+    REQUIRE(msg.get_coalesce_key().empty());
+
+    msg.set_coalesce_key(KEY);
+    REQUIRE(KEY == msg.get_coalesce_key());
+
+    mqtt::message copy{msg};
+    REQUIRE(KEY == copy.get_coalesce_key());
+
+    mqtt::message moved{std::move(copy)};
+    REQUIRE(KEY == moved.get_coalesce_key());
+
+    mqtt::message assigned;
+    assigned = msg;
+    REQUIRE(KEY == assigned.get_coalesce_key());
+
+    auto built = mqtt::message_ptr_builder().coalesce_key(KEY).finalize();
+    REQUIRE(KEY == built->get_coalesce_key());
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
 // --------------------------------------------------------------------------
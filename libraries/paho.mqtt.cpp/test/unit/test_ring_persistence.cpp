@@ -0,0 +1,164 @@
+// test_ring_persistence.cpp
+//
+// Unit tests for the ring_persistence class in the Paho MQTT C++ library.
+//
+
+/*******************************************************************************
+ * Copyright (c) 2024 IBM Corp. and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    initial implementation
+ *******************************************************************************/
+
+#define UNIT_TESTS
+
+#include <vector>
+
+#include "catch2_version.h"
+#include "mqtt/async_client.h"
+#include "mqtt/exception.h"
+#include "mqtt/ring_persistence.h"
+
+using namespace mqtt;
+
+static const string DIR{"persist-ring"};
+static const string CLIENT_ID{"ring-client"};
+static const string SERVER_URI{"tcp://localhost:1883"};
+
+static const size_t SLOT_SIZE = 64;
+static const size_t SLOT_COUNT = 16;
+
+// Puts the concatenation of some strings to the store
+static void put(ring_persistence& per, const string& key, const std::vector<string>& strs)
+{
+    std::vector<string_view> bufs(strs.begin(), strs.end());
+    per.put(key, bufs);
+}
+
+// ----------------------------------------------------------------------
+// Options
+// ----------------------------------------------------------------------
+
+TEST_CASE("ring_persistence options", "[persistence]")
+{
+    ring_persistence per{DIR, SLOT_SIZE, SLOT_COUNT};
+
+    REQUIRE(DIR == per.get_directory());
+    REQUIRE(SLOT_SIZE == per.get_slot_size());
+    REQUIRE(SLOT_COUNT == per.get_slot_count());
+    REQUIRE(ring_persistence::GROUP_SYNC == per.get_sync_mode());
+    REQUIRE(!per.is_open());
+
+    per.set_sync_mode(ring_persistence::ALWAYS_SYNC);
+    per.set_sync_interval(std::chrono::milliseconds(50));
+
+    REQUIRE(ring_persistence::ALWAYS_SYNC == per.get_sync_mode());
+    REQUIRE(std::chrono::milliseconds(50) == per.get_sync_interval());
+
+    REQUIRE_THROWS_AS(per.keys(), persistence_exception);
+
+    per.set_slot_size(60);  // not a multiple of 8
+    REQUIRE_THROWS_AS(per.open(CLIENT_ID, SERVER_URI), persistence_exception);
+    REQUIRE(!per.is_open());
+}
+
+// ----------------------------------------------------------------------
+// Store and retrieve
+// ----------------------------------------------------------------------
+
+TEST_CASE("ring_persistence put get remove", "[persistence]")
+{
+    ring_persistence per{DIR, SLOT_SIZE, SLOT_COUNT};
+
+    per.open(CLIENT_ID, SERVER_URI);
+    REQUIRE(per.is_open());
+    per.clear();
+
+    SECTION("put and get") {
+        put(per, "k1", {"some ", "data"});
+        put(per, "k2", {string(100, 'x')});
+
+        REQUIRE(per.contains_key("k1"));
+        REQUIRE("some data" == per.get("k1"));
+        REQUIRE(string(100, 'x') == per.get("k2"));
+
+        auto keys = per.keys();
+        REQUIRE(2 == keys.size());
+
+        put(per, "k1", {"replaced"});
+        REQUIRE("replaced" == per.get("k1"));
+        REQUIRE(2 == per.keys().size());
+    }
+
+    SECTION("remove") {
+        put(per, "k1", {"data"});
+        per.remove("k1");
+
+        REQUIRE(!per.contains_key("k1"));
+        REQUIRE_THROWS_AS(per.get("k1"), persistence_exception);
+        REQUIRE_THROWS_AS(per.remove("k1"), persistence_exception);
+    }
+
+    SECTION("full") {
+        for (size_t i = 0; i < SLOT_COUNT; ++i)
+            put(per, "k" + std::to_string(i), {"data"});
+
+        REQUIRE_THROWS_AS(put(per, "another", {"data"}), persistence_exception);
+        per.remove("k0");
+        put(per, "another", {"data"});
+    }
+
+    per.clear();
+    REQUIRE(0 == per.keys().size());
+    per.close();
+    REQUIRE(!per.is_open());
+}
+
+TEST_CASE("ring_persistence reopen", "[persistence]")
+{
+    {
+        ring_persistence per{DIR, SLOT_SIZE, SLOT_COUNT};
+        per.open(CLIENT_ID, SERVER_URI);
+        per.clear();
+        put(per, "k1", {"kept"});
+        put(per, "k2", {"removed"});
+        per.remove("k2");
+    }
+
+    ring_persistence per{DIR, SLOT_SIZE, SLOT_COUNT};
+    per.open(CLIENT_ID, SERVER_URI);
+
+    auto keys = per.keys();
+    REQUIRE(1 == keys.size());
+    REQUIRE("k1" == keys[0]);
+    REQUIRE("kept" == per.get("k1"));
+
+    per.clear();
+    per.close();
+
+    // The geometry of an existing store can't be changed
+    per.set_slot_count(2 * SLOT_COUNT);
+    REQUIRE_THROWS_AS(per.open(CLIENT_ID, SERVER_URI), persistence_exception);
+}
+
+// ----------------------------------------------------------------------
+// Use with a client
+// ----------------------------------------------------------------------
+
+TEST_CASE("ring_persistence client", "[persistence]")
+{
+    ring_persistence per{DIR};
+    async_client cli{SERVER_URI, CLIENT_ID, &per};
+
+    REQUIRE(SERVER_URI == cli.get_server_uri());
+    REQUIRE(CLIENT_ID == cli.get_client_id());
+}
@@ -406,3 +406,20 @@ TEST_CASE("ssl_options test error handler", "[options]")
         std::cerr << "SSL Error: " << msg << std::endl;
     });
 }
+
+// ----------------------------------------------------------------------
+// Test that the TLS cache counters can be read and only ever go up
+// ----------------------------------------------------------------------
+
+TEST_CASE("ssl_options cache stats", "[options]")
+{
+    auto stats = mqtt::ssl_options::get_cache_stats();
+    auto again = mqtt::ssl_options::get_cache_stats();
+
+    REQUIRE(again.contextHits >= stats.contextHits);
+    REQUIRE(again.contextMisses >= stats.contextMisses);
+    REQUIRE(again.sessionHits >= stats.sessionHits);
+    REQUIRE(again.sessionMisses >= stats.sessionMisses);
+    REQUIRE(again.resumedHandshakes >= stats.resumedHandshakes);
+    REQUIRE(again.fullHandshakes >= stats.fullHandshakes);
+}
@@ -74,6 +74,28 @@ TEST_CASE("thread_queue tryget", "[thread_queue]")
     REQUIRE(n == 3);
 }
 
+TEST_CASE("thread_queue tryget all", "[thread_queue]")
+{
+    thread_queue<int> que{2};
+    std::vector<int> vals;
+
+    REQUIRE(que.try_get_all(&vals) == 0);
+    REQUIRE(vals.empty());
+
+    que.put(1);
+    que.put(2);
+    REQUIRE(!que.try_put(3));
+
+    REQUIRE(que.try_get_all(&vals) == 2);
+    REQUIRE((vals == std::vector<int>{1, 2}));
+    REQUIRE(que.empty());
+
+    // Room again, and the values are appended
+    REQUIRE(que.try_put(3));
+    REQUIRE(que.try_get_all(&vals) == 1);
+    REQUIRE((vals == std::vector<int>{1, 2, 3}));
+}
+
 TEST_CASE("thread_queue tryput", "[thread_queue]")
 {
     thread_queue<int> que{2};